@@ -0,0 +1,295 @@
+// Growth cycle simulator: runs whole cycles of the built-in profiles, and of
+// a dense profile that stresses the scheduler, through CycleSimulator on a
+// virtual clock. Prints a compact timeline of every stage change, relay
+// transition and alert, and the pump and light on-time per stage.
+//
+// --check replays each cycle second by second from the profile alone and
+// fails unless the timeline and the totals agree.
+//
+//   cycle_sim [--profile ID] [--ph X] [--timeline] [--check]
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <Preferences.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "HostShim.h"
+
+#include "LogBuffer.h"
+#include "CycleSimulator.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+const time_t CYCLE_START = 1709251200 + 13 * 3600 + 42 * 60;  // 2024-03-01 13:42 UTC
+
+struct Options {
+  const char* profile = nullptr;  // All profiles if not given
+  float ph = NAN;                  // Reading checked against each stage's range
+  bool timeline = false;           // Print every event, not just the totals
+  bool check = false;              // Exit non-zero unless the replay agrees
+};
+
+struct TimelineEntry {
+  time_t time;
+  CycleEventType type;
+  int value;
+
+  bool operator==(const TimelineEntry& other) const {
+    return time == other.time && type == other.type && value == other.value;
+  }
+};
+
+void setStage(GrowthStage& stage, const char* name, int days, int waterDuration, int waterInterval,
+              int lightHours, int lightStartHour) {
+  memset(&stage, 0, sizeof(stage));
+  strlcpy(stage.name, name, sizeof(stage.name));
+  stage.duration = days;
+  stage.waterDuration = waterDuration;
+  stage.waterInterval = waterInterval;
+  stage.lightHours = lightHours;
+  stage.lightStartHour = lightStartHour;
+  stage.phMin = 5.6f;
+  stage.phMax = 6.4f;
+}
+
+// Eight stages watering every few minutes, with light windows across
+// midnight, always on and always off
+GrowthProfile denseProfile() {
+  GrowthProfile profile;
+  memset(&profile, 0, sizeof(profile));
+  strlcpy(profile.id, "dense", sizeof(profile.id));
+  strlcpy(profile.name, "Dense", sizeof(profile.name));
+  profile.format = PROFILE_FORMAT;
+  profile.stageCount = MAX_GROWTH_STAGES;
+  setStage(profile.stages[0], "Germination", 3, 1, 7, 24, 0);
+  setStage(profile.stages[1], "Cloning", 5, 2, 9, 18, 20);
+  setStage(profile.stages[2], "Early veg", 9, 3, 11, 16, 22);
+  setStage(profile.stages[3], "Late veg", 12, 4, 13, 14, 5);
+  setStage(profile.stages[4], "Pre-flower", 6, 1, 5, 13, 23);
+  setStage(profile.stages[5], "Flower", 25, 5, 17, 12, 7);
+  setStage(profile.stages[6], "Ripening", 6, 2, 19, 11, 18);
+  setStage(profile.stages[7], "Flush", 4, 1, 23, 0, 6);
+  profile.updateStageEnds();
+  return profile;
+}
+
+// Second-by-second replay of a cycle from the profile's stage table: which
+// stage is running, whether its light window covers the hour of day, and a
+// watering every waterInterval after the previous one for waterDuration
+struct Replay {
+  std::vector<TimelineEntry> timeline;
+  SimulationResult totals;
+  uint32_t phAlerts = 0;
+};
+
+Replay replay(const GrowthProfile& profile, time_t from, time_t until, float ph) {
+  Replay replay;
+  memset(&replay.totals, 0, sizeof(replay.totals));
+  int stageIndex = -1;
+  bool lights = false;
+  bool pump = false;
+  bool watered = false;
+  time_t lastStart = 0;
+  time_t pumpOnSince = 0;
+
+  for (time_t now = from; now < until; now++) {
+    int stage = 0;
+    time_t boundary = CYCLE_START;
+    for (; stage < profile.stageCount - 1; stage++) {
+      boundary += (time_t)profile.stages[stage].duration * SECONDS_PER_DAY;
+      if (now < boundary) {
+        break;
+      }
+    }
+    const GrowthStage& current = profile.stages[stage];
+    if (stage != stageIndex) {
+      stageIndex = stage;
+      replay.timeline.push_back({now, CYCLE_EVENT_STAGE, stage});
+      replay.phAlerts += !isnan(ph) && (ph < current.phMin || ph > current.phMax);
+    }
+
+    long secondOfDay = (long)(now % SECONDS_PER_DAY);  // TZ=UTC
+    long on = current.lightStartHour * 3600L;
+    long off = on + constrain(current.lightHours, 0, 24) * 3600L;
+    bool lightsNow = off <= SECONDS_PER_DAY ? secondOfDay >= on && secondOfDay < off
+                                             : secondOfDay >= on || secondOfDay < off - SECONDS_PER_DAY;
+
+    bool pumpNow = pump;
+    if (!watered || now - lastStart >= current.waterInterval * 60L) {
+      watered = true;
+      lastStart = now;
+      replay.totals.waterings++;
+      replay.totals.stages[stage].waterings++;
+      if (!pumpNow) {
+        pumpNow = true;
+        pumpOnSince = now;
+      }
+    } else if (pumpNow && now - pumpOnSince >= current.waterDuration * 60L) {
+      pumpNow = false;
+    }
+
+    if (lightsNow != lights || now == from) {
+      replay.timeline.push_back({now, CYCLE_EVENT_LIGHTS, lightsNow});
+    }
+    if (pumpNow != pump || now == from) {
+      replay.timeline.push_back({now, CYCLE_EVENT_PUMP, pumpNow});
+    }
+    lights = lightsNow;
+    pump = pumpNow;
+    if (lights) {
+      replay.totals.lightSeconds++;
+      replay.totals.stages[stage].lightSeconds++;
+    }
+    if (pump) {
+      replay.totals.pumpSeconds++;
+      replay.totals.stages[stage].pumpSeconds++;
+    }
+  }
+  return replay;
+}
+
+void printEvent(const CycleEvent& event) {
+  time_t offset = event.time - CYCLE_START;
+  struct tm local;
+  localtime_r(&event.time, &local);
+  printf("  d%02ld %02d:%02d:%02d  %-6s ", (long)(offset / SECONDS_PER_DAY), local.tm_hour, local.tm_min,
+         local.tm_sec, CYCLE_EVENT_NAMES[event.type]);
+  if (event.type == CYCLE_EVENT_STAGE) {
+    printf("%d %s\n", event.value, event.text);
+  } else if (event.type == CYCLE_EVENT_ALERT) {
+    printf("%s\n", event.text);
+  } else {
+    printf("%s\n", event.value ? "on" : "off");
+  }
+}
+
+bool sameTotals(const char* what, uint32_t simulated, uint32_t replayed) {
+  if (simulated != replayed) {
+    printf("  check: %s %u, replay %u\n", what, simulated, replayed);
+  }
+  return simulated == replayed;
+}
+
+// Returns false if --check found a difference
+bool simulate(const GrowthProfile& profile, const Options& options) {
+  time_t until = CYCLE_START + (time_t)profile.totalDuration() * SECONDS_PER_DAY;
+  std::vector<TimelineEntry> timeline;
+  uint32_t phAlerts = 0;
+
+  printf("%s: %d stages over %d days\n", profile.name, profile.stageCount, profile.totalDuration());
+  auto started = std::chrono::steady_clock::now();
+  SimulationResult result = CycleSimulator::run(profile, CYCLE_START, CYCLE_START, until, options.ph,
+      [&](const CycleEvent& event) {
+        if (options.timeline) {
+          printEvent(event);
+        }
+        if (event.type == CYCLE_EVENT_ALERT) {
+          phAlerts += strncmp(event.text, "pH ", 3) == 0;
+        } else {
+          timeline.push_back({event.time, event.type, event.value});
+        }
+      });
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+  printf("  %-12s %9s %9s %9s\n", "stage", "pump h", "light h", "waterings");
+  for (int i = 0; i < profile.stageCount; i++) {
+    const StageTotals& stage = result.stages[i];
+    printf("  %-12s %9.1f %9.1f %9u\n", profile.stages[i].name, stage.pumpSeconds / 3600.0,
+           stage.lightSeconds / 3600.0, stage.waterings);
+  }
+  printf("  %-12s %9.1f %9.1f %9u\n", "total", result.pumpSeconds / 3600.0, result.lightSeconds / 3600.0,
+         result.waterings);
+  printf("  %u events, %u steps in %.1f ms%s\n", result.events, result.steps, ms,
+         result.truncated ? ", truncated" : "");
+
+  if (!options.check) {
+    return true;
+  }
+  Replay expected = replay(profile, CYCLE_START, until, options.ph);
+  bool ok = !result.truncated && result.until == until;
+  ok &= sameTotals("pump seconds", result.pumpSeconds, expected.totals.pumpSeconds);
+  ok &= sameTotals("light seconds", result.lightSeconds, expected.totals.lightSeconds);
+  ok &= sameTotals("waterings", result.waterings, expected.totals.waterings);
+  for (int i = 0; i < profile.stageCount; i++) {
+    ok &= sameTotals("stage pump seconds", result.stages[i].pumpSeconds, expected.totals.stages[i].pumpSeconds);
+    ok &= sameTotals("stage light seconds", result.stages[i].lightSeconds, expected.totals.stages[i].lightSeconds);
+    ok &= sameTotals("stage waterings", result.stages[i].waterings, expected.totals.stages[i].waterings);
+  }
+  ok &= sameTotals("pH alerts", phAlerts, expected.phAlerts);
+  ok &= sameTotals("timeline entries", timeline.size(), expected.timeline.size());
+  for (size_t i = 0; i < timeline.size() && i < expected.timeline.size(); i++) {
+    if (!(timeline[i] == expected.timeline[i])) {
+      printf("  check: entry %u is %s %d at %+ld s, replay has %s %d at %+ld s\n", (unsigned)i,
+             CYCLE_EVENT_NAMES[timeline[i].type], timeline[i].value, (long)(timeline[i].time - CYCLE_START),
+             CYCLE_EVENT_NAMES[expected.timeline[i].type], expected.timeline[i].value,
+             (long)(expected.timeline[i].time - CYCLE_START));
+      ok = false;
+      break;
+    }
+  }
+  printf("  check: %s\n", ok ? "timeline and totals match the replay" : "FAILED");
+  return ok;
+}
+
+Options parseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--profile" && hasValue) {
+      options.profile = argv[++i];
+    } else if (arg == "--ph" && hasValue) {
+      options.ph = atof(argv[++i]);
+    } else if (arg == "--timeline") {
+      options.timeline = true;
+    } else if (arg == "--check") {
+      options.check = true;
+    } else {
+      fprintf(stderr, "usage: cycle_sim [--profile ID] [--ph X] [--timeline] [--check]\n");
+      exit(2);
+    }
+  }
+  return options;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = parseOptions(argc, argv);
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  // The built-in profiles, as a fresh device's catalog holds them
+  SPIFFS.begin(true);
+  Preferences preferences;
+  GrowthManager growth(preferences);
+  growth.begin();
+  std::vector<std::string> ids;
+  growth.getCatalog().list(0, growth.getCatalog().count(), [&](const ProfileSummary& summary) {
+    ids.push_back(summary.id);
+  });
+  std::vector<GrowthProfile> profiles;
+  for (const std::string& id : ids) {
+    GrowthProfile profile;
+    if (growth.getProfile(id.c_str(), profile)) {
+      profiles.push_back(profile);
+    }
+  }
+  profiles.push_back(denseProfile());
+
+  bool ok = true;
+  int simulated = 0;
+  for (const GrowthProfile& profile : profiles) {
+    if (!options.profile || strcmp(options.profile, profile.id) == 0) {
+      ok &= simulate(profile, options);
+      simulated++;
+    }
+  }
+  if (simulated == 0) {
+    fprintf(stderr, "No profile %s\n", options.profile);
+    return 2;
+  }
+  return ok ? 0 : 1;
+}
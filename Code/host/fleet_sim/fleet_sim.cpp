@@ -0,0 +1,578 @@
+// Fleet simulator: N virtual controllers in one process, each with its own
+// device ID, flash and NVS, simulated sensors, and the firmware's
+// MQTTManager, command queue, relay controller, sensor statistics and level
+// forecast, all connected to the shim's in-process broker. A Home Assistant
+// stand-in switches lights on random towers and waits for the state echo.
+//
+// Reports the broker's message rate in steady state, the reconnect storm
+// after a broker restart, and end-to-end command latency: from the command
+// publish to the retained relay state arriving back at Home Assistant.
+//
+//   fleet_sim [--controllers N] [--seconds S] [--outage S] [--commands R] [--check]
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <Preferences.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "HostShim.h"
+
+#include "LogBuffer.h"
+#include "CommandQueue.h"
+#include "MQTTManager.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+// As in main.cpp
+const uint32_t SENSOR_SAMPLE_INTERVAL_MS = 1000;
+const uint32_t STATS_PUBLISH_INTERVAL_MS = 60000;
+const uint32_t NETWORK_ACTIVE_INTERVAL_MS = 100;
+
+// Pump duty cycle of the simulated schedule
+const uint32_t PUMP_PERIOD_MS = 60000;
+const uint32_t PUMP_RUN_MS = 10000;
+
+// A command without a state echo after this long is counted as lost
+const int64_t COMMAND_TIMEOUT_US = 5000000;
+
+// Lights keep their state at least this long between commands, above the
+// relay's minimum on and off time
+const int64_t COMMAND_SPACING_US = 1500000;
+
+struct Options {
+  int controllers = 50;
+  int seconds = 30;     // Steady-state measurement
+  int outage = 10;      // Broker down time
+  int commands = 20;    // Relay commands per second across the fleet
+  bool check = false;   // Exit non-zero unless every controller recovered
+};
+
+int64_t nowMicros() {
+  return esp_timer_get_time();
+}
+
+void sleepMs(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Reservoir, pH, TDS and temperature of one tower. The level drops while
+// the plants drink and is topped up at 30 %; the rest wander around a set
+// point with sensor noise.
+class SensorModel {
+private:
+  std::mt19937 _rng;
+  std::normal_distribution<float> _noise;
+  float _level;
+  float _ph;
+  float _tds;
+  float _temperature;
+
+public:
+  explicit SensorModel(uint32_t seed)
+      : _rng(seed), _noise(0.0f, 1.0f), _level(60.0f + seed % 40), _ph(6.0f), _tds(850.0f), _temperature(21.0f) {}
+
+  void read(bool pumpRunning, float values[METRIC_COUNT]) {
+    _level -= pumpRunning ? 0.02f : 0.002f;
+    if (_level < 30.0f) {
+      _level = 95.0f;
+    }
+    _ph += 0.002f * _noise(_rng) + 0.0005f * (6.0f - _ph);
+    _tds += 0.5f * _noise(_rng) + 0.01f * (850.0f - _tds);
+    _temperature += 0.01f * _noise(_rng) + 0.001f * (21.0f - _temperature);
+
+    values[METRIC_LIQUID_LEVEL] = roundf(_level + 0.3f * _noise(_rng));
+    values[METRIC_PH] = _ph + 0.02f * _noise(_rng);
+    values[METRIC_TDS] = _tds + 3.0f * _noise(_rng);
+    values[METRIC_TEMPERATURE] = _temperature + 0.05f * _noise(_rng);
+  }
+
+  float exactLevel() const {
+    return _level;
+  }
+};
+
+// One tower: the firmware's MQTT, command and relay path, driven by a
+// control task that samples the simulated sensors once a second like
+// main.cpp's loop
+class VirtualController {
+private:
+  struct RelayRoute {
+    VirtualController* controller;
+    uint8_t relay;
+  };
+
+  int _index;
+  SystemConfig _config;
+  WiFiClient _wifiClient;
+  RelayUsageRecord _usageRecord;
+  RelayController _relays;
+  MQTTManager _mqtt;
+  CommandQueue _commands;
+  SensorStats _stats;
+  LevelForecast _forecast;
+  SensorModel _sensors;
+  RelayRoute _routes[RELAY_COUNT];
+
+  static void controlTask(void* arg) {
+    static_cast<VirtualController*>(arg)->run();
+  }
+
+  // MQTT task, like main.cpp's onRelayMessage
+  static void onRelayMessage(const char* payload, unsigned int length, void* context) {
+    RelayRoute* route = static_cast<RelayRoute*>(context);
+    VirtualController* self = route->controller;
+    bool state = MQTTManager::payloadEquals(payload, length, "ON");
+    bool ignored = self->_relays.getState(route->relay) == state;
+    self->_mqtt.countCommand(ignored);
+    if (ignored) {
+      return;
+    }
+    Command command;
+    command.type = CMD_SET_RELAY;
+    command.relay = route->relay;
+    command.state = state;
+    command.receivedAt = esp_timer_get_time();
+    self->_commands.push(std::move(command));
+  }
+
+  void applyCommand(Command& command) {
+    if (command.type == CMD_SET_RELAY && _relays.getState(command.relay) != command.state &&
+        _relays.setState(command.relay, command.state)) {
+      _mqtt.publishRelayState(command.relay, command.state);
+    }
+    if (command.receivedAt) {
+      _mqtt.recordCommandLatency(command.receivedAt);
+    }
+  }
+
+  void sample(uint32_t now) {
+    bool pump = (now + _index * 997u) % PUMP_PERIOD_MS < PUMP_RUN_MS;
+    if (pump != _relays.getState(RELAY_PUMP)) {
+      _relays.setState(RELAY_PUMP, pump);
+    }
+
+    float values[METRIC_COUNT];
+    _sensors.read(_relays.getState(RELAY_PUMP), values);
+    bool statsChanged = false;
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      statsChanged |= _stats.add((TelemetryMetric)i, values[i], now) != 0;
+    }
+    if (statsChanged) {
+      publishSensorStats();
+    }
+    _forecast.add(_sensors.exactLevel(), _relays.getState(RELAY_PUMP), 10.0f, now);
+    _relays.accrue();
+
+    _mqtt.publishTelemetry(values);
+    _mqtt.publishCycleState("Vegetative", 0, 0);
+    for (int i = 0; i < RELAY_COUNT; i++) {
+      _mqtt.publishRelayState(i, _relays.getState(i));
+    }
+  }
+
+  void publishSensorStats() {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      _mqtt.publishSensorStats((TelemetryMetric)i, _stats.stats((TelemetryMetric)i));
+    }
+    _mqtt.publishLevelForecast(_forecast.result());
+  }
+
+  void run() {
+    _commands.setConsumer(xTaskGetCurrentTaskHandle());
+    uint32_t nextSample = millis();
+    uint32_t nextStats = millis() + STATS_PUBLISH_INTERVAL_MS;
+    bool replaying = false;
+    for (;;) {
+      int32_t wait = (int32_t)(nextSample - millis());
+      if (replaying && wait > (int32_t)NETWORK_ACTIVE_INTERVAL_MS) {
+        wait = NETWORK_ACTIVE_INTERVAL_MS;
+      }
+      if (wait > 0) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+      }
+
+      Command command;
+      while (_commands.pop(command)) {
+        applyCommand(command);
+      }
+
+      uint32_t now = millis();
+      if ((int32_t)(now - nextSample) >= 0) {
+        sample(now);
+        nextSample += SENSOR_SAMPLE_INTERVAL_MS;
+      }
+      if ((int32_t)(now - nextStats) >= 0) {
+        publishSensorStats();
+        nextStats += STATS_PUBLISH_INTERVAL_MS;
+      }
+      replaying = _mqtt.serviceSpool();
+    }
+  }
+
+public:
+  explicit VirtualController(int index)
+      : _index(index),
+        _config(makeConfig(index)),
+        _usageRecord(),
+        _relays(_usageRecord),
+        _mqtt(_wifiClient, _config),
+        _sensors(index * 7919u + 1) {}
+
+  static SystemConfig makeConfig(int index) {
+    SystemConfig config;
+    snprintf(config.device_id, sizeof(config.device_id), "tower-%03d", index);
+    config.mqtt_enabled = true;
+    return config;
+  }
+
+  // Runs on the main thread; the device's tasks inherit its flash and NVS
+  void start() {
+    shim::setDevice(_index + 1);
+    SPIFFS.begin(true);
+    Preferences preferences;
+    _relays.begin();
+    _relays.loadUsage(preferences);
+    for (int i = 0; i < RELAY_COUNT; i++) {
+      _routes[i] = {this, (uint8_t)i};
+      _mqtt.onMessage(_mqtt.getRelayCommandTopic(i), onRelayMessage, &_routes[i]);
+    }
+    _mqtt.begin();
+    xTaskCreate(controlTask, "control", 8192, this, 1, nullptr);
+    shim::setDevice(0);
+  }
+
+  MQTTManager& mqtt() {
+    return _mqtt;
+  }
+
+  const char* deviceId() const {
+    return _config.device_id;
+  }
+};
+
+// Percentiles of a set of latencies in microseconds
+struct LatencySummary {
+  size_t count = 0;
+  double p50 = 0, p95 = 0, p99 = 0, max = 0;
+};
+
+LatencySummary summarize(std::vector<int64_t> latencies) {
+  LatencySummary summary;
+  summary.count = latencies.size();
+  if (latencies.empty()) {
+    return summary;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto at = [&](double q) { return latencies[(size_t)(q * (latencies.size() - 1))] / 1000.0; };
+  summary.p50 = at(0.50);
+  summary.p95 = at(0.95);
+  summary.p99 = at(0.99);
+  summary.max = latencies.back() / 1000.0;
+  return summary;
+}
+
+// Home Assistant stand-in on its own thread. Toggles the lights of random
+// idle towers at a fixed rate and times the state echo. Reconnects and
+// announces itself after a broker restart, which makes every tower
+// republish discovery, as the real one does.
+class HomeAssistant {
+private:
+  struct Pending {
+    bool active = false;
+    bool state = false;
+    int64_t sentAt = 0;
+    int64_t settledAt = 0;
+  };
+
+  std::vector<std::string> _deviceIds;
+  std::vector<std::string> _commandTopics;
+  std::vector<Pending> _pending;
+  int _rate;
+  std::thread _thread;
+  std::atomic<bool> _running;
+
+  std::mutex _mutex;  // Guards the results below
+  std::vector<int64_t> _latencies;
+  uint32_t _lost = 0;
+  uint64_t _discovery = 0;
+
+  int deviceOf(const std::string& topic) const {
+    // hydroponics/tower-NNN/...
+    size_t at = topic.find("tower-");
+    return at == std::string::npos ? -1 : atoi(topic.c_str() + at + 6);
+  }
+
+  void run() {
+    shim::MqttBroker& broker = shim::MqttBroker::instance();
+    std::shared_ptr<shim::MqttSession> session;
+    std::mt19937 rng(42);
+    int64_t nextCommand = nowMicros();
+    int64_t interval = 1000000 / (_rate > 0 ? _rate : 1);
+
+    while (_running) {
+      if (!session || !broker.alive(session)) {
+        session = broker.running() ? broker.connect("home-assistant") : nullptr;
+        if (!session) {
+          sleepMs(10);
+          continue;
+        }
+        broker.subscribe(session, "hydroponics/+/lights_state");
+        broker.subscribe(session, "homeassistant/#");
+        broker.publish(session, HA_STATUS_TOPIC, (const uint8_t*)"online", 6, false);
+      }
+
+      shim::MqttMessage message;
+      while (broker.receive(session, message)) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (message.topic.compare(0, 14, "homeassistant/") == 0) {
+          _discovery++;
+          continue;
+        }
+        int device = deviceOf(message.topic);
+        if (device < 0 || device >= (int)_pending.size()) {
+          continue;
+        }
+        Pending& pending = _pending[device];
+        if (pending.active && message.payload == (pending.state ? "ON" : "OFF")) {
+          int64_t now = nowMicros();
+          _latencies.push_back(now - pending.sentAt);
+          pending.active = false;
+          pending.settledAt = now;
+        }
+      }
+
+      // After an outage, carry on at the normal rate rather than catch up
+      int64_t now = nowMicros();
+      if (now - nextCommand > 1000000) {
+        nextCommand = now;
+      }
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (Pending& pending : _pending) {
+          if (pending.active && now - pending.sentAt > COMMAND_TIMEOUT_US) {
+            pending.active = false;
+            pending.settledAt = now;
+            _lost++;
+          }
+        }
+      }
+
+      // Commands go to idle towers whose lights have settled
+      while (_rate > 0 && now >= nextCommand) {
+        nextCommand += interval;
+        int device = rng() % _pending.size();
+        std::lock_guard<std::mutex> lock(_mutex);
+        Pending& pending = _pending[device];
+        if (pending.active || now - pending.settledAt < COMMAND_SPACING_US) {
+          continue;
+        }
+        pending.active = true;
+        pending.state = !pending.state;
+        pending.sentAt = now;
+        const char* payload = pending.state ? "ON" : "OFF";
+        broker.publish(session, _commandTopics[device].c_str(), (const uint8_t*)payload, strlen(payload), false);
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  }
+
+public:
+  HomeAssistant(const std::vector<std::string>& deviceIds, int rate)
+      : _deviceIds(deviceIds), _pending(deviceIds.size()), _rate(rate), _running(false) {
+    for (const std::string& id : deviceIds) {
+      _commandTopics.push_back("hydroponics/" + id + "/lights_state/set");
+    }
+  }
+
+  void start() {
+    _running = true;
+    _thread = std::thread([this] { run(); });
+  }
+
+  // Results since the last call
+  void take(std::vector<int64_t>& latencies, uint32_t& lost, uint64_t& discovery) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    latencies.swap(_latencies);
+    _latencies.clear();
+    lost = _lost;
+    _lost = 0;
+    discovery = _discovery;
+    _discovery = 0;
+  }
+};
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--controllers" && hasValue) {
+      options.controllers = atoi(argv[++i]);
+    } else if (arg == "--seconds" && hasValue) {
+      options.seconds = atoi(argv[++i]);
+    } else if (arg == "--outage" && hasValue) {
+      options.outage = atoi(argv[++i]);
+    } else if (arg == "--commands" && hasValue) {
+      options.commands = atoi(argv[++i]);
+    } else if (arg == "--check") {
+      options.check = true;
+    } else {
+      return false;
+    }
+  }
+  return options.controllers > 0 && options.controllers < 1000 && options.seconds > 0 && options.outage >= 0;
+}
+
+int connectedCount(std::vector<std::unique_ptr<VirtualController>>& fleet) {
+  int connected = 0;
+  for (auto& controller : fleet) {
+    connected += controller->mqtt().connected() ? 1 : 0;
+  }
+  return connected;
+}
+
+uint32_t connectFailures(std::vector<std::unique_ptr<VirtualController>>& fleet) {
+  uint32_t failures = 0;
+  for (auto& controller : fleet) {
+    failures += controller->mqtt().connectFailures();
+  }
+  return failures;
+}
+
+// Wait until every controller is connected; returns the seconds taken and
+// prints the connects per second while the fleet comes up
+double waitForFleet(std::vector<std::unique_ptr<VirtualController>>& fleet, const char* label) {
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+  int64_t start = nowMicros();
+  uint64_t connects = broker.stats().connects;
+  int second = 0;
+  uint32_t peak = 0;
+  while (connectedCount(fleet) < (int)fleet.size() && nowMicros() - start < 180 * 1000000LL) {
+    sleepMs(10);
+    int elapsed = (int)((nowMicros() - start) / 1000000);
+    if (elapsed > second) {
+      uint64_t now = broker.stats().connects;
+      uint32_t perSecond = (uint32_t)(now - connects);
+      peak = std::max(peak, perSecond);
+      printf("  %s +%2ds: %3d/%zu connected, %u connects/s\n", label, elapsed, connectedCount(fleet), fleet.size(),
+             perSecond);
+      connects = now;
+      second = elapsed;
+    }
+  }
+  double seconds = (nowMicros() - start) / 1e6;
+  printf("  %s: %d/%zu connected after %.1f s, peak %u connects/s\n", label, connectedCount(fleet), fleet.size(),
+         seconds, peak);
+  return seconds;
+}
+
+LatencySummary printLatency(const char* label, const std::vector<int64_t>& latencies, uint32_t lost) {
+  LatencySummary summary = summarize(latencies);
+  printf("  %s: %zu commands, %u lost; p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n", label, summary.count,
+         lost, summary.p50, summary.p95, summary.p99, summary.max);
+  return summary;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    fprintf(stderr, "usage: %s [--controllers N] [--seconds S] [--outage S] [--commands R] [--check]\n", argv[0]);
+    return 2;
+  }
+
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+  broker.start();
+
+  printf("Fleet of %d controllers, %d s steady state, %d s broker outage, %d commands/s\n", options.controllers,
+         options.seconds, options.outage, options.commands);
+
+  // Boot: every tower connects and publishes discovery at once
+  std::vector<std::unique_ptr<VirtualController>> fleet;
+  std::vector<std::string> deviceIds;
+  for (int i = 0; i < options.controllers; i++) {
+    fleet.emplace_back(new VirtualController(i));
+    deviceIds.push_back(fleet.back()->deviceId());
+  }
+  HomeAssistant homeAssistant(deviceIds, options.commands);
+  homeAssistant.start();
+  for (auto& controller : fleet) {
+    controller->start();
+  }
+  printf("Boot\n");
+  double bootSeconds = waitForFleet(fleet, "boot");
+  bool booted = connectedCount(fleet) == options.controllers;
+
+  // Let discovery and the first retained states settle
+  sleepMs(2000);
+  std::vector<int64_t> latencies;
+  uint32_t lost;
+  uint64_t discovery;
+  homeAssistant.take(latencies, lost, discovery);
+  shim::MqttBrokerStats stats = broker.stats();
+  printf("  discovery: %llu messages, %u retained topics (%.1f KB), %.1f per controller\n",
+         (unsigned long long)discovery, stats.retained, stats.retainedBytes / 1024.0,
+         (double)stats.retained / options.controllers);
+
+  // Steady state
+  printf("Steady state\n");
+  shim::MqttBrokerStats before = broker.stats();
+  int64_t start = nowMicros();
+  sleepMs(options.seconds * 1000);
+  double elapsed = (nowMicros() - start) / 1e6;
+  shim::MqttBrokerStats after = broker.stats();
+  double inRate = (after.received - before.received) / elapsed;
+  double outRate = (after.delivered - before.delivered) / elapsed;
+  printf("  broker: %.0f msgs/s in (%.2f per controller), %.0f msgs/s delivered\n", inRate,
+         inRate / options.controllers, outRate);
+  homeAssistant.take(latencies, lost, discovery);
+  LatencySummary steady = printLatency("commands", latencies, lost);
+  uint32_t steadyLost = lost;
+
+  uint32_t firmwareAvg = 0;
+  uint32_t firmwareMax = 0;
+  uint32_t dropped = 0;
+  for (auto& controller : fleet) {
+    firmwareAvg += controller->mqtt().commandLatencyAvg() / options.controllers;
+    firmwareMax = std::max(firmwareMax, controller->mqtt().commandLatencyMax());
+    dropped += controller->mqtt().droppedCount();
+  }
+  printf("  on device, arrival to applied: avg %.2f ms, max %.2f ms; %u messages dropped from outboxes\n",
+         firmwareAvg / 1000.0, firmwareMax / 1000.0, dropped);
+
+  // Broker restart
+  printf("Broker restart\n");
+  uint32_t failuresBefore = connectFailures(fleet);
+  before = broker.stats();
+  broker.stop();
+  sleepMs(options.outage * 1000);
+  broker.start();
+  start = nowMicros();
+  double recoverySeconds = waitForFleet(fleet, "reconnect");
+  bool recovered = connectedCount(fleet) == options.controllers;
+
+  // The burst of discovery, retained state and spool replay that follows
+  sleepMs(2000);
+  after = broker.stats();
+  elapsed = (nowMicros() - start) / 1e6;
+  printf("  %u failed connection attempts during the outage, %llu messages in the %.1f s after the restart\n",
+         connectFailures(fleet) - failuresBefore, (unsigned long long)(after.received - before.received), elapsed);
+  homeAssistant.take(latencies, lost, discovery);
+  printf("  discovery: %llu messages\n", (unsigned long long)discovery);
+  printLatency("commands across the restart", latencies, lost);
+
+  printf("Summary: boot %.1f s, %.0f msgs/s, command p95 %.1f ms, reconnect %.1f s\n", bootSeconds, inRate,
+         steady.p95, recoverySeconds);
+
+  fflush(stdout);
+  bool ok = booted && recovered && steady.count > 0 && steadyLost == 0;
+  _Exit(options.check && !ok ? 1 : 0);
+}
@@ -0,0 +1,194 @@
+#pragma once
+// Arduino core on the host, enough of it to build and run the firmware's
+// header-only units natively. See HostShim.h for the test controls.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+using std::isnan;
+using std::isinf;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+enum gpio_num_t {
+  GPIO_NUM_0 = 0, GPIO_NUM_5 = 5, GPIO_NUM_13 = 13, GPIO_NUM_18 = 18, GPIO_NUM_19 = 19, GPIO_NUM_21 = 21,
+  GPIO_NUM_22 = 22, GPIO_NUM_25 = 25, GPIO_NUM_26 = 26, GPIO_NUM_27 = 27, GPIO_NUM_32 = 32, GPIO_NUM_39 = 39
+};
+
+size_t strlcpy(char* dst, const char* src, size_t size);
+size_t strlcat(char* dst, const char* src, size_t size);
+
+class String {
+private:
+  std::string _s;
+
+public:
+  String() {}
+  String(const char* s) : _s(s ? s : "") {}
+  String(const std::string& s) : _s(s) {}
+  explicit String(char c) : _s(1, c) {}
+  String(int v) : _s(std::to_string(v)) {}
+  String(unsigned v) : _s(std::to_string(v)) {}
+  String(long v) : _s(std::to_string(v)) {}
+  String(unsigned long v) : _s(std::to_string(v)) {}
+  String(float v, unsigned decimals = 2) { format(v, decimals); }
+  String(double v, unsigned decimals = 2) { format(v, decimals); }
+
+  const char* c_str() const { return _s.c_str(); }
+  size_t length() const { return _s.size(); }
+  bool isEmpty() const { return _s.empty(); }
+  bool reserve(size_t size) { _s.reserve(size); return true; }
+  char operator[](size_t i) const { return _s[i]; }
+  char charAt(size_t i) const { return _s[i]; }
+  String substring(size_t from, size_t to = std::string::npos) const {
+    return from >= _s.size() ? String() : String(_s.substr(from, to == std::string::npos ? to : to - from));
+  }
+  int indexOf(char c, size_t from = 0) const { size_t p = _s.find(c, from); return p == std::string::npos ? -1 : (int)p; }
+  int indexOf(const char* s, size_t from = 0) const { size_t p = _s.find(s, from); return p == std::string::npos ? -1 : (int)p; }
+  bool startsWith(const String& s) const { return _s.compare(0, s._s.size(), s._s) == 0; }
+  bool endsWith(const String& s) const {
+    return _s.size() >= s._s.size() && _s.compare(_s.size() - s._s.size(), s._s.size(), s._s) == 0;
+  }
+  bool equalsIgnoreCase(const String& s) const { return strcasecmp(c_str(), s.c_str()) == 0; }
+  long toInt() const { return atol(c_str()); }
+  float toFloat() const { return atof(c_str()); }
+  void toLowerCase() { for (char& c : _s) c = tolower(c); }
+  void toUpperCase() { for (char& c : _s) c = toupper(c); }
+  void trim() {
+    size_t first = _s.find_first_not_of(" \t\r\n");
+    size_t last = _s.find_last_not_of(" \t\r\n");
+    _s = first == std::string::npos ? std::string() : _s.substr(first, last - first + 1);
+  }
+  String& concat(const char* s, size_t n) { _s.append(s, n); return *this; }
+  String& operator+=(const String& s) { _s += s._s; return *this; }
+  String& operator+=(const char* s) { _s += s; return *this; }
+  String& operator+=(char c) { _s += c; return *this; }
+  friend String operator+(const String& a, const String& b) { return String(a._s + b._s); }
+  friend String operator+(const String& a, const char* b) { return String(a._s + b); }
+  friend String operator+(const char* a, const String& b) { return String(a + b._s); }
+  bool operator==(const String& s) const { return _s == s._s; }
+  bool operator==(const char* s) const { return _s == s; }
+  bool operator!=(const String& s) const { return _s != s._s; }
+  bool operator!=(const char* s) const { return _s != s; }
+  bool operator<(const String& s) const { return _s < s._s; }
+
+private:
+  void format(double v, unsigned decimals) {
+    char buffer[48];
+    snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, v);
+    _s = buffer;
+  }
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (n < size && write(buffer[n])) {
+      n++;
+    }
+    return n;
+  }
+  size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+  size_t write(const char* s, size_t size) { return write((const uint8_t*)s, size); }
+  virtual void flush() {}
+
+  // Formats into a stack buffer like the ESP32 core; longer output is cut
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0) {
+      return 0;
+    }
+    return write((const uint8_t*)buffer, (size_t)length < sizeof(buffer) ? length : sizeof(buffer) - 1);
+  }
+
+  size_t print(const String& s) { return write(s.c_str()); }
+  size_t print(const char* s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v) { return printf("%d", v); }
+  size_t print(unsigned v) { return printf("%u", v); }
+  size_t print(long v) { return printf("%ld", v); }
+  size_t print(unsigned long v) { return printf("%lu", v); }
+  size_t print(double v, int decimals = 2) { return printf("%.*f", decimals, v); }
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T& v) { return print(v) + println(); }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+};
+
+// Discards output unless echo is enabled with shim::setSerialEcho()
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  void restart() {}
+  uint32_t getFreeHeap() { return 200000; }
+  uint32_t getMinFreeHeap() { return 150000; }
+  uint32_t getMaxAllocHeap() { return 110000; }
+  uint32_t getCpuFreqMHz() { return 240; }
+};
+
+extern EspClass ESP;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+long map(long x, long inMin, long inMax, long outMin, long outMax);
+long random(long max);
+long random(long min, long max);
+uint32_t esp_random();
+void configTime(long gmtOffset, int daylightOffset, const char* server1, const char* server2 = nullptr,
+                const char* server3 = nullptr);
@@ -0,0 +1,295 @@
+#pragma once
+#include <Arduino.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "HostShim.h"
+
+// The subset of ArduinoJson 6 the host-built units use: building objects
+// and arrays of strings, numbers and booleans, and serializing them.
+// StaticJsonDocument does not touch the heap on the device, so this shim's
+// own allocations are not counted as firmware allocations.
+
+struct JsonNode {
+  enum Type { NUL, OBJECT, ARRAY, STRING, INTEGER, UNSIGNED, REAL, BOOLEAN } type = NUL;
+  std::string text;
+  long long integer = 0;
+  unsigned long long uinteger = 0;
+  double real = 0;
+  bool boolean = false;
+  std::vector<std::pair<std::string, std::unique_ptr<JsonNode>>> members;
+  std::vector<std::unique_ptr<JsonNode>> elements;
+
+  void clear() {
+    type = NUL;
+    members.clear();
+    elements.clear();
+  }
+};
+
+class JsonObject;
+class JsonArray;
+
+class JsonVariant {
+protected:
+  JsonNode* _node = nullptr;
+
+public:
+  JsonVariant() {}
+  explicit JsonVariant(JsonNode* node) : _node(node) {}
+
+  bool isNull() const { return !_node || _node->type == JsonNode::NUL; }
+
+  JsonVariant operator[](const char* key) const {
+    if (!_node) {
+      return JsonVariant();
+    }
+    shim::ShimScope scope;
+    if (_node->type != JsonNode::OBJECT) {
+      _node->clear();
+      _node->type = JsonNode::OBJECT;
+    }
+    for (auto& member : _node->members) {
+      if (member.first == key) {
+        return JsonVariant(member.second.get());
+      }
+    }
+    _node->members.emplace_back(key, std::unique_ptr<JsonNode>(new JsonNode()));
+    return JsonVariant(_node->members.back().second.get());
+  }
+  JsonVariant operator[](const String& key) const { return (*this)[key.c_str()]; }
+
+  const JsonVariant& operator=(const char* value) const { setString(value); return *this; }
+  const JsonVariant& operator=(char* value) const { setString(value); return *this; }
+  const JsonVariant& operator=(const String& value) const { setString(value.c_str()); return *this; }
+  const JsonVariant& operator=(bool value) const {
+    if (_node) {
+      _node->clear();
+      _node->type = JsonNode::BOOLEAN;
+      _node->boolean = value;
+    }
+    return *this;
+  }
+  const JsonVariant& operator=(int value) const { setInteger(value); return *this; }
+  const JsonVariant& operator=(long value) const { setInteger(value); return *this; }
+  const JsonVariant& operator=(long long value) const { setInteger(value); return *this; }
+  const JsonVariant& operator=(unsigned value) const { setUnsigned(value); return *this; }
+  const JsonVariant& operator=(unsigned long value) const { setUnsigned(value); return *this; }
+  const JsonVariant& operator=(unsigned long long value) const { setUnsigned(value); return *this; }
+  const JsonVariant& operator=(float value) const { setReal(value); return *this; }
+  const JsonVariant& operator=(double value) const { setReal(value); return *this; }
+  template <typename T>
+  bool set(const T& value) const { *this = value; return _node != nullptr; }
+
+  JsonObject createNestedObject(const char* key) const;
+  JsonArray createNestedArray(const char* key) const;
+
+  template <typename T>
+  bool add(const T& value) const {
+    if (!_node) {
+      return false;
+    }
+    shim::ShimScope scope;
+    if (_node->type != JsonNode::ARRAY) {
+      _node->clear();
+      _node->type = JsonNode::ARRAY;
+    }
+    _node->elements.emplace_back(new JsonNode());
+    JsonVariant(_node->elements.back().get()) = value;
+    return true;
+  }
+
+  size_t size() const {
+    if (!_node) return 0;
+    return _node->type == JsonNode::OBJECT ? _node->members.size() : _node->elements.size();
+  }
+
+  JsonNode* node() const { return _node; }
+
+private:
+  void setString(const char* value) const {
+    if (!_node) return;
+    shim::ShimScope scope;
+    _node->clear();
+    if (value) {
+      _node->type = JsonNode::STRING;
+      _node->text = value;
+    }
+  }
+  void setInteger(long long value) const {
+    if (!_node) return;
+    _node->clear();
+    _node->type = JsonNode::INTEGER;
+    _node->integer = value;
+  }
+  void setUnsigned(unsigned long long value) const {
+    if (!_node) return;
+    _node->clear();
+    _node->type = JsonNode::UNSIGNED;
+    _node->uinteger = value;
+  }
+  void setReal(double value) const {
+    if (!_node) return;
+    _node->clear();
+    _node->type = JsonNode::REAL;
+    _node->real = value;
+  }
+};
+
+class JsonObject : public JsonVariant {
+public:
+  JsonObject() {}
+  explicit JsonObject(JsonNode* node) : JsonVariant(node) {}
+};
+
+class JsonArray : public JsonVariant {
+public:
+  JsonArray() {}
+  explicit JsonArray(JsonNode* node) : JsonVariant(node) {}
+};
+
+inline JsonObject JsonVariant::createNestedObject(const char* key) const {
+  JsonVariant member = (*this)[key];
+  if (member.node()) {
+    member.node()->clear();
+    member.node()->type = JsonNode::OBJECT;
+  }
+  return JsonObject(member.node());
+}
+
+inline JsonArray JsonVariant::createNestedArray(const char* key) const {
+  JsonVariant member = (*this)[key];
+  if (member.node()) {
+    member.node()->clear();
+    member.node()->type = JsonNode::ARRAY;
+  }
+  return JsonArray(member.node());
+}
+
+class JsonDocument : public JsonVariant {
+private:
+  std::unique_ptr<JsonNode> _root;
+
+public:
+  JsonDocument() {
+    shim::ShimScope scope;
+    _root.reset(new JsonNode());
+    _node = _root.get();
+  }
+  JsonDocument(const JsonDocument&) = delete;
+  JsonDocument& operator=(const JsonDocument&) = delete;
+
+  void clear() {
+    shim::ShimScope scope;
+    _root->clear();
+  }
+  bool overflowed() const { return false; }
+};
+
+template <size_t N>
+class StaticJsonDocument : public JsonDocument {};
+
+// Its memory pool comes from the firmware heap, as on the device
+class DynamicJsonDocument : public JsonDocument {
+private:
+  std::unique_ptr<uint8_t[]> _pool;
+
+public:
+  explicit DynamicJsonDocument(size_t capacity) : _pool(new uint8_t[capacity]) {}
+};
+
+namespace shim {
+
+inline void jsonEscape(std::string& out, const std::string& text) {
+  out += '"';
+  for (char c : text) {
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default: out += c; break;
+    }
+  }
+  out += '"';
+}
+
+inline void jsonWrite(std::string& out, const JsonNode* node) {
+  char number[32];
+  switch (node ? node->type : JsonNode::NUL) {
+    case JsonNode::NUL: out += "null"; break;
+    case JsonNode::STRING: jsonEscape(out, node->text); break;
+    case JsonNode::BOOLEAN: out += node->boolean ? "true" : "false"; break;
+    case JsonNode::INTEGER: snprintf(number, sizeof(number), "%lld", node->integer); out += number; break;
+    case JsonNode::UNSIGNED: snprintf(number, sizeof(number), "%llu", node->uinteger); out += number; break;
+    case JsonNode::REAL:
+      if (std::isnan(node->real) || std::isinf(node->real)) {
+        out += "null";
+      } else {
+        snprintf(number, sizeof(number), "%.9g", node->real);
+        out += number;
+      }
+      break;
+    case JsonNode::OBJECT:
+      out += '{';
+      for (size_t i = 0; i < node->members.size(); i++) {
+        if (i) out += ',';
+        jsonEscape(out, node->members[i].first);
+        out += ':';
+        jsonWrite(out, node->members[i].second.get());
+      }
+      out += '}';
+      break;
+    case JsonNode::ARRAY:
+      out += '[';
+      for (size_t i = 0; i < node->elements.size(); i++) {
+        if (i) out += ',';
+        jsonWrite(out, node->elements[i].get());
+      }
+      out += ']';
+      break;
+  }
+}
+
+inline std::string jsonText(const JsonVariant& variant) {
+  ShimScope scope;
+  std::string out;
+  jsonWrite(out, variant.node());
+  return out;
+}
+
+}  // namespace shim
+
+inline size_t measureJson(const JsonVariant& variant) {
+  shim::ShimScope scope;
+  return shim::jsonText(variant).size();
+}
+
+inline size_t serializeJson(const JsonVariant& variant, char* buffer, size_t size) {
+  shim::ShimScope scope;
+  std::string text = shim::jsonText(variant);
+  if (size == 0) {
+    return 0;
+  }
+  size_t n = text.size() < size - 1 ? text.size() : size - 1;
+  memcpy(buffer, text.data(), n);
+  buffer[n] = '\0';
+  return n;
+}
+
+inline size_t serializeJson(const JsonVariant& variant, Print& out) {
+  std::string text;
+  {
+    shim::ShimScope scope;
+    text = shim::jsonText(variant);
+  }
+  return out.write((const uint8_t*)text.data(), text.size());
+}
+
+inline size_t serializeJson(const JsonVariant& variant, String& out) {
+  shim::ShimScope scope;
+  out = String(shim::jsonText(variant).c_str());
+  return out.length();
+}
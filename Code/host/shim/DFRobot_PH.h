@@ -0,0 +1,8 @@
+#pragma once
+
+class DFRobot_PH {
+public:
+  void begin() {}
+  float readPH(float, float) { return 7.0f; }
+  void calibration(float, float, char* = nullptr) {}
+};
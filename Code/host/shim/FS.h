@@ -0,0 +1,65 @@
+#pragma once
+#include <Arduino.h>
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode {
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+namespace shim {
+struct FileHandle;
+}
+
+// File on the in-memory flash of HostShim.h. Copies share one open handle,
+// like the ESP32 core's File.
+class File : public Stream {
+private:
+  std::shared_ptr<shim::FileHandle> _handle;
+
+public:
+  File() {}
+  explicit File(std::shared_ptr<shim::FileHandle> handle) : _handle(handle) {}
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+  size_t read(uint8_t* buffer, size_t size);
+  int read() override;
+  int peek() override;
+  int available() override;
+  bool seek(uint32_t position, SeekMode mode = SeekSet);
+  size_t position() const;
+  size_t size() const;
+  void close();
+  const char* name() const;
+  const char* path() const;
+  bool isDirectory() { return false; }
+  File openNextFile() { return File(); }
+  operator bool() const;
+};
+
+namespace fs {
+
+class FS {
+public:
+  File open(const char* path, const char* mode = FILE_READ, bool create = false);
+  File open(const String& path, const char* mode = FILE_READ, bool create = false) {
+    return open(path.c_str(), mode, create);
+  }
+  bool exists(const char* path);
+  bool exists(const String& path) { return exists(path.c_str()); }
+  bool remove(const char* path);
+  bool remove(const String& path) { return remove(path.c_str()); }
+  bool rename(const char* from, const char* to);
+  bool mkdir(const char*) { return true; }
+};
+
+}  // namespace fs
+
+using fs::FS;
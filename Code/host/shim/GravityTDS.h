@@ -0,0 +1,12 @@
+#pragma once
+
+class GravityTDS {
+public:
+  void setPin(int) {}
+  void setAref(float) {}
+  void setAdcRange(float) {}
+  void setTemperature(float) {}
+  void begin() {}
+  void update() {}
+  float getTdsValue() { return 0; }
+};
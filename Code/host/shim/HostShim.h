@@ -0,0 +1,97 @@
+#pragma once
+#include <Arduino.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Controls for the host shim, used by the tests and the fleet simulator.
+namespace shim {
+
+// Clocks. By default millis(), esp_timer_get_time() and the wall clock
+// follow the host. useVirtualClock() freezes them at a start time; they then
+// only move through advance(), or when a task blocks with a timeout, which
+// advances the clock by that timeout (or until an esp_timer callback wakes
+// the task). The virtual clock is meant for single-threaded tests.
+void useVirtualClock(time_t wallStart);
+bool virtualClock();
+void advance(int64_t micros);
+void stepWallClock(int64_t seconds);  // An NTP step: wall time moves, monotonic time does not
+
+// Flash and NVS. Each simulated device has its own; a thread uses device 0
+// until it calls setDevice(), and tasks it creates inherit its device.
+void setDevice(int device);
+void resetFlash(size_t totalBytes);   // Erase the file system and set the partition size
+void erasePreferences();
+
+// Network
+void setWiFiConnected(bool connected);
+
+// Serial output, off by default
+void setSerialEcho(bool echo);
+
+// Called after every write to the GPIO set or clear register with the new
+// output levels
+void setGpioListener(std::function<void(uint32_t out)> listener);
+
+// Allocation accounting. A thread counts as firmware once it is a task
+// started with xTaskCreate() or has called markFirmwareThread(); shim code
+// marks itself with ShimScope, so firmwareCode() is true only while
+// firmware code runs. A test's operator new can count on it.
+void markFirmwareThread(bool firmware = true);
+bool firmwareCode();
+
+class ShimScope {
+public:
+  ShimScope();
+  ~ShimScope();
+};
+
+// In-process MQTT broker that stands in for mosquitto. PubSubClient talks
+// to it directly; start() and stop() simulate a broker restart, which drops
+// every session. Retained messages survive a restart. Thread-safe.
+struct MqttMessage {
+  std::string topic;
+  std::string payload;
+};
+
+struct MqttSession {
+  std::string clientId;
+  bool alive = true;
+  std::vector<std::string> filters;
+  std::deque<MqttMessage> inbox;
+};
+
+struct MqttBrokerStats {
+  uint64_t received;     // Publishes accepted from clients
+  uint64_t delivered;    // Messages queued to subscribers
+  uint64_t connects;     // Connections accepted
+  uint64_t refused;      // Connection attempts while stopped
+  uint32_t sessions;     // Connected clients
+  uint32_t retained;     // Retained topics
+  uint64_t retainedBytes;
+};
+
+class MqttBroker {
+public:
+  static MqttBroker& instance();
+
+  void start();
+  void stop();
+  bool running();
+  MqttBrokerStats stats();
+  void clearRetained();
+
+  // For PubSubClient
+  std::shared_ptr<MqttSession> connect(const char* clientId);
+  void disconnect(const std::shared_ptr<MqttSession>& session);
+  bool alive(const std::shared_ptr<MqttSession>& session);
+  bool publish(const std::shared_ptr<MqttSession>& session, const char* topic, const uint8_t* payload,
+               size_t length, bool retain);
+  bool subscribe(const std::shared_ptr<MqttSession>& session, const char* filter);
+  bool receive(const std::shared_ptr<MqttSession>& session, MqttMessage& message);
+
+  static bool matches(const char* filter, const char* topic);
+};
+
+}  // namespace shim
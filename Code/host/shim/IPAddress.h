@@ -0,0 +1,21 @@
+#pragma once
+#include <Arduino.h>
+
+class IPAddress {
+private:
+  uint8_t _octets[4] = {0, 0, 0, 0};
+
+public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _octets{a, b, c, d} {}
+
+  String toString() const {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", _octets[0], _octets[1], _octets[2], _octets[3]);
+    return String(buffer);
+  }
+
+  operator uint32_t() const {
+    return _octets[0] | _octets[1] << 8 | _octets[2] << 16 | (uint32_t)_octets[3] << 24;
+  }
+};
@@ -0,0 +1,8 @@
+#pragma once
+#include <Arduino.h>
+
+// Sensor drivers are only constructed on the host, never read
+class OneWire {
+public:
+  OneWire(uint8_t) {}
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <Arduino.h>
+
+// NVS in memory. Namespaces outlive the Preferences object, so a test can
+// "reboot" by constructing its units again; shim::erasePreferences() wipes
+// them. Values are typed like NVS: a key written as bytes does not read
+// back as an integer.
+class Preferences {
+private:
+  char _namespace[16] = "";
+  bool _open = false;
+  bool _readOnly = false;
+
+  size_t put(const char* key, char type, const void* value, size_t size);
+  bool get(const char* key, char type, void* value, size_t size);
+
+public:
+  bool begin(const char* name, bool readOnly = false, const char* partition = nullptr);
+  void end();
+  bool clear();
+  bool remove(const char* key);
+  bool isKey(const char* key);
+  size_t freeEntries();
+
+  size_t putBytes(const char* key, const void* value, size_t size);
+  size_t getBytes(const char* key, void* buffer, size_t size);
+  size_t getBytesLength(const char* key);
+  size_t putString(const char* key, const char* value);
+  size_t putString(const char* key, const String& value) { return putString(key, value.c_str()); }
+  size_t getString(const char* key, char* value, size_t size);
+  String getString(const char* key, const String& defaultValue = String());
+
+  size_t putChar(const char* key, int8_t value) { return put(key, 'c', &value, sizeof(value)); }
+  size_t putUChar(const char* key, uint8_t value) { return put(key, 'C', &value, sizeof(value)); }
+  size_t putShort(const char* key, int16_t value) { return put(key, 's', &value, sizeof(value)); }
+  size_t putUShort(const char* key, uint16_t value) { return put(key, 'S', &value, sizeof(value)); }
+  size_t putInt(const char* key, int32_t value) { return put(key, 'i', &value, sizeof(value)); }
+  size_t putUInt(const char* key, uint32_t value) { return put(key, 'I', &value, sizeof(value)); }
+  size_t putLong(const char* key, int32_t value) { return put(key, 'i', &value, sizeof(value)); }
+  size_t putULong(const char* key, uint32_t value) { return put(key, 'I', &value, sizeof(value)); }
+  size_t putLong64(const char* key, int64_t value) { return put(key, 'l', &value, sizeof(value)); }
+  size_t putULong64(const char* key, uint64_t value) { return put(key, 'L', &value, sizeof(value)); }
+  size_t putFloat(const char* key, float value) { return putBytes(key, &value, sizeof(value)); }
+  size_t putDouble(const char* key, double value) { return putBytes(key, &value, sizeof(value)); }
+  size_t putBool(const char* key, bool value) { return putUChar(key, value ? 1 : 0); }
+
+  int8_t getChar(const char* key, int8_t value = 0) { get(key, 'c', &value, sizeof(value)); return value; }
+  uint8_t getUChar(const char* key, uint8_t value = 0) { get(key, 'C', &value, sizeof(value)); return value; }
+  int16_t getShort(const char* key, int16_t value = 0) { get(key, 's', &value, sizeof(value)); return value; }
+  uint16_t getUShort(const char* key, uint16_t value = 0) { get(key, 'S', &value, sizeof(value)); return value; }
+  int32_t getInt(const char* key, int32_t value = 0) { get(key, 'i', &value, sizeof(value)); return value; }
+  uint32_t getUInt(const char* key, uint32_t value = 0) { get(key, 'I', &value, sizeof(value)); return value; }
+  int32_t getLong(const char* key, int32_t value = 0) { get(key, 'i', &value, sizeof(value)); return value; }
+  uint32_t getULong(const char* key, uint32_t value = 0) { get(key, 'I', &value, sizeof(value)); return value; }
+  int64_t getLong64(const char* key, int64_t value = 0) { get(key, 'l', &value, sizeof(value)); return value; }
+  uint64_t getULong64(const char* key, uint64_t value = 0) { get(key, 'L', &value, sizeof(value)); return value; }
+  float getFloat(const char* key, float value = NAN) { get(key, 'B', &value, sizeof(value)); return value; }
+  double getDouble(const char* key, double value = NAN) { get(key, 'B', &value, sizeof(value)); return value; }
+  bool getBool(const char* key, bool value = false) { return getUChar(key, value ? 1 : 0) != 0; }
+};
@@ -0,0 +1,82 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <memory>
+#include <string>
+#include "HostShim.h"
+
+// PubSubClient's defaults: publishes that do not fit the packet buffer fail
+#define MQTT_MAX_PACKET_SIZE 256
+#define MQTT_MAX_HEADER_SIZE 5
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+// PubSubClient against shim::MqttBroker. Wills are accepted and ignored.
+class PubSubClient : public Print {
+private:
+  Client* _client = nullptr;
+  std::shared_ptr<shim::MqttSession> _session;
+  std::function<void(char*, uint8_t*, unsigned int)> _callback;
+  int _state = MQTT_DISCONNECTED;
+  uint16_t _bufferSize = MQTT_MAX_PACKET_SIZE;
+
+  // Topic and payload of the message being delivered or streamed out
+  std::string _topic;
+  std::string _payload;
+  bool _retain = false;
+
+public:
+  PubSubClient() {}
+  PubSubClient(Client& client) : _client(&client) {}
+
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setClient(Client& client) { _client = &client; return *this; }
+  PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) { _callback = callback; return *this; }
+  PubSubClient& setKeepAlive(uint16_t) { return *this; }
+  PubSubClient& setSocketTimeout(uint16_t) { return *this; }
+  bool setBufferSize(uint16_t size) { _bufferSize = size; return true; }
+  uint16_t getBufferSize() { return _bufferSize; }
+
+  bool connect(const char* id) { return connect(id, nullptr, nullptr, nullptr, 0, false, nullptr, true); }
+  bool connect(const char* id, const char* user, const char* pass) {
+    return connect(id, user, pass, nullptr, 0, false, nullptr, true);
+  }
+  bool connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos,
+               bool willRetain, const char* willMessage) {
+    return connect(id, user, pass, willTopic, willQos, willRetain, willMessage, true);
+  }
+  bool connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos,
+               bool willRetain, const char* willMessage, bool cleanSession);
+  void disconnect();
+  bool connected();
+  int state() { return _state; }
+
+  bool publish(const char* topic, const char* payload) { return publish(topic, payload, false); }
+  bool publish(const char* topic, const char* payload, bool retain) {
+    return publish(topic, (const uint8_t*)payload, payload ? strlen(payload) : 0, retain);
+  }
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length) {
+    return publish(topic, payload, length, false);
+  }
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retain);
+
+  // Streamed publish; the real client sends these without its buffer limit
+  bool beginPublish(const char* topic, unsigned int length, bool retain);
+  int endPublish();
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+
+  bool subscribe(const char* topic) { return subscribe(topic, 0); }
+  bool subscribe(const char* topic, uint8_t qos);
+  bool unsubscribe(const char*) { return connected(); }
+
+  // Delivers every queued inbound message to the callback
+  bool loop();
+};
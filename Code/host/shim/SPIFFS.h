@@ -0,0 +1,16 @@
+#pragma once
+#include "FS.h"
+
+// Flat in-memory file system. Writes stop short once the partition is
+// full, as on the device; the size is set with shim::resetFlash().
+class SPIFFSFS : public fs::FS {
+public:
+  bool begin(bool formatOnFail = false, const char* basePath = "/spiffs", uint8_t maxOpenFiles = 10,
+             const char* label = nullptr);
+  void end() {}
+  bool format();
+  size_t totalBytes();
+  size_t usedBytes();
+};
+
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,58 @@
+#pragma once
+#include <Arduino.h>
+#include "IPAddress.h"
+
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+typedef int wl_status_t;
+
+class Client : public Stream {
+public:
+  virtual int connect(const char* host, uint16_t port) = 0;
+  virtual int connect(const char* host, uint16_t port, int32_t timeout) = 0;
+  virtual uint8_t connected() = 0;
+  virtual void stop() = 0;
+  size_t write(uint8_t) override { return 1; }
+  using Print::write;
+};
+
+// Connects when WiFi is up and the shim's MQTT broker is running; the
+// traffic itself goes straight from PubSubClient to the broker
+class WiFiClient : public Client {
+private:
+  bool _connected = false;
+
+public:
+  int connect(const char* host, uint16_t port) override { return connect(host, port, 3000); }
+  int connect(const char* host, uint16_t port, int32_t timeout) override;
+  uint8_t connected() override { return _connected; }
+  void stop() override { _connected = false; }
+  void setTimeout(uint32_t) {}
+  int setNoDelay(bool) { return 0; }
+  using Print::write;
+};
+
+enum WiFiEvent_t {
+  ARDUINO_EVENT_WIFI_STA_CONNECTED,
+  ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+  ARDUINO_EVENT_WIFI_STA_GOT_IP
+};
+typedef int wifi_event_id_t;
+
+class WiFiClass {
+public:
+  wl_status_t status() { return isConnected() ? WL_CONNECTED : WL_DISCONNECTED; }
+  bool isConnected();
+  int RSSI() { return -60; }
+  IPAddress localIP() { return IPAddress(192, 168, 1, 50); }
+  void macAddress(uint8_t* mac) {
+    static const uint8_t address[6] = {0x24, 0x6f, 0x28, 0x12, 0x34, 0x56};
+    memcpy(mac, address, sizeof(address));
+  }
+  String macAddress() { return String("24:6F:28:12:34:56"); }
+  bool setSleep(bool) { return true; }
+  bool hostByName(const char*, IPAddress& address) { address = IPAddress(127, 0, 0, 1); return true; }
+  wifi_event_id_t onEvent(std::function<void(WiFiEvent_t)>, WiFiEvent_t = ARDUINO_EVENT_WIFI_STA_GOT_IP) { return 0; }
+};
+
+extern WiFiClass WiFi;
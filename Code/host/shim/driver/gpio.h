@@ -0,0 +1,25 @@
+#pragma once
+#include <Arduino.h>
+
+// Writes to the set and clear registers update `out` and are reported to
+// the listener installed with shim::setGpioListener()
+struct gpio_set_reg_t {
+  gpio_set_reg_t& operator=(uint32_t mask);
+};
+
+struct gpio_clear_reg_t {
+  gpio_clear_reg_t& operator=(uint32_t mask);
+};
+
+struct gpio_dev_t {
+  volatile uint32_t out;
+  gpio_set_reg_t out_w1ts;
+  gpio_clear_reg_t out_w1tc;
+  volatile uint32_t in;
+};
+
+extern gpio_dev_t GPIO;
+
+esp_err_t gpio_hold_en(gpio_num_t pin);
+esp_err_t gpio_hold_dis(gpio_num_t pin);
+esp_err_t gpio_sleep_sel_dis(gpio_num_t pin);
@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include <mutex>
+
+// FreeRTOS on host threads. Tasks are std::threads, one tick is one
+// millisecond. Under the virtual clock (see HostShim.h) a task that blocks
+// with a timeout advances the clock instead of sleeping.
+
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void (*TaskFunction_t)(void*);
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY 0xffffffffu
+#define pdMS_TO_TICKS(x) ((TickType_t)(x))
+#define portTICK_PERIOD_MS 1
+#define tskNO_AFFINITY 0x7fffffff
+#define portYIELD_FROM_ISR(x) (void)(x)
+
+// Critical sections nest on the same core, so the mutex is recursive
+struct portMUX_TYPE {
+  std::recursive_mutex mutex;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+
+inline void portENTER_CRITICAL(portMUX_TYPE* mux) { mux->mutex.lock(); }
+inline void portEXIT_CRITICAL(portMUX_TYPE* mux) { mux->mutex.unlock(); }
+inline void portENTER_CRITICAL_ISR(portMUX_TYPE* mux) { mux->mutex.lock(); }
+inline void portEXIT_CRITICAL_ISR(portMUX_TYPE* mux) { mux->mutex.unlock(); }
+inline void portENTER_CRITICAL_SAFE(portMUX_TYPE* mux) { mux->mutex.lock(); }
+inline void portEXIT_CRITICAL_SAFE(portMUX_TYPE* mux) { mux->mutex.unlock(); }
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char* name, uint32_t stack, void* arg, UBaseType_t priority,
+                       TaskHandle_t* handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stack, void* arg,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* woken);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
+TickType_t xTaskGetTickCount();
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks);
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks);
+BaseType_t xQueuePeek(QueueHandle_t queue, void* item, TickType_t ticks);
+BaseType_t xQueueReset(QueueHandle_t queue);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
@@ -0,0 +1,1528 @@
+// Host implementations of the Arduino, FreeRTOS and ESP-IDF calls the
+// firmware's units make. Kept free of repo headers: the units define
+// static members in their headers, so each test is a single translation
+// unit that includes them.
+#include <Arduino.h>
+#include <FS.h>
+#include <SPIFFS.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <PubSubClient.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include "HostShim.h"
+
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+
+HardwareSerial Serial;
+EspClass ESP;
+gpio_dev_t GPIO;
+SPIFFSFS SPIFFS;
+WiFiClass WiFi;
+
+namespace {
+
+// Shim state is never destroyed, so detached tasks may outlive main()
+
+thread_local bool threadFirmware = false;
+thread_local int shimDepth = 0;
+thread_local int threadDevice = 0;
+
+std::atomic<bool> serialEcho(false);
+std::atomic<bool> wifiConnected(true);
+
+std::function<void(uint32_t)>& gpioListener() {
+  static std::function<void(uint32_t)>& listener = *new std::function<void(uint32_t)>();
+  return listener;
+}
+
+// ---------------------------------------------------------------------------
+// Clocks
+
+const std::chrono::steady_clock::time_point processStart = std::chrono::steady_clock::now();
+
+std::atomic<bool> clockVirtual(false);
+std::atomic<int64_t> virtualMicros(0);
+std::atomic<int64_t> wallBaseMicros(0);    // Wall time at virtual monotonic zero
+std::atomic<int64_t> wallStepMicros(0);    // Added by stepWallClock()
+std::thread::id clockOwner;
+
+int64_t realMonotonicMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - processStart)
+      .count();
+}
+
+int64_t monotonicMicros() {
+  return clockVirtual ? virtualMicros.load() : realMonotonicMicros();
+}
+
+int64_t wallMicros() {
+  if (clockVirtual) {
+    return wallBaseMicros + virtualMicros + wallStepMicros;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + wallStepMicros;
+}
+
+bool ownsClock() {
+  return clockVirtual && std::this_thread::get_id() == clockOwner;
+}
+
+// ---------------------------------------------------------------------------
+// esp_timer
+
+struct TimerRegistry {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<esp_timer*> timers;
+  bool dispatcher = false;
+};
+
+TimerRegistry& timerRegistry() {
+  static TimerRegistry& registry = *new TimerRegistry();
+  return registry;
+}
+
+}  // namespace
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void* arg;
+  std::string name;
+  int64_t deadline;
+  uint64_t period;
+  bool active;
+};
+
+namespace {
+
+// Earliest active timer. Call with the registry locked.
+esp_timer* earliestTimer(TimerRegistry& registry) {
+  esp_timer* earliest = nullptr;
+  for (esp_timer* timer : registry.timers) {
+    if (timer->active && (!earliest || timer->deadline < earliest->deadline)) {
+      earliest = timer;
+    }
+  }
+  return earliest;
+}
+
+// Take a due timer off the schedule and return its callback. Call with the
+// registry locked.
+void takeTimer(esp_timer* timer, esp_timer_cb_t& callback, void*& arg) {
+  callback = timer->callback;
+  arg = timer->arg;
+  if (timer->period) {
+    timer->deadline += timer->period;
+  } else {
+    timer->active = false;
+  }
+}
+
+void dispatchTimers() {
+  shim::markFirmwareThread();
+  TimerRegistry& registry = timerRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  for (;;) {
+    if (clockVirtual) {
+      registry.changed.wait_for(lock, std::chrono::milliseconds(10));
+      continue;
+    }
+    esp_timer* timer = earliestTimer(registry);
+    if (!timer) {
+      registry.changed.wait(lock);
+      continue;
+    }
+    int64_t wait = timer->deadline - realMonotonicMicros();
+    if (wait > 0) {
+      registry.changed.wait_for(lock, std::chrono::microseconds(wait));
+      continue;
+    }
+    esp_timer_cb_t callback;
+    void* arg;
+    takeTimer(timer, callback, arg);
+    lock.unlock();
+    callback(arg);
+    lock.lock();
+  }
+}
+
+// Move the virtual clock towards `limit`, stopping at the first timer due
+// before it and running that timer's callback. Returns false if there is
+// nothing to move to.
+bool advanceStep(int64_t limit) {
+  TimerRegistry& registry = timerRegistry();
+  esp_timer_cb_t callback;
+  void* arg;
+  {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    esp_timer* timer = earliestTimer(registry);
+    int64_t now = virtualMicros;
+    if (!timer || timer->deadline > limit) {
+      if (limit == INT64_MAX) {
+        return false;
+      }
+      if (limit > now) {
+        virtualMicros = limit;
+      }
+      return true;
+    }
+    if (timer->deadline > now) {
+      virtualMicros = timer->deadline;
+    }
+    takeTimer(timer, callback, arg);
+  }
+  callback(arg);
+  return true;
+}
+
+// Wait with `lock` held until `ready` holds or the timeout (negative for
+// none) passes. Under the virtual clock the clock's owner moves time
+// forward instead of sleeping; other threads poll the virtual time.
+template <typename Ready>
+bool block(std::unique_lock<std::mutex>& lock, std::condition_variable& cv, Ready ready, int64_t timeoutUs) {
+  if (ready()) {
+    return true;
+  }
+  if (timeoutUs == 0) {
+    return false;
+  }
+  if (!clockVirtual) {
+    if (timeoutUs < 0) {
+      cv.wait(lock, ready);
+      return true;
+    }
+    return cv.wait_for(lock, std::chrono::microseconds(timeoutUs), ready);
+  }
+  int64_t deadline = timeoutUs < 0 ? INT64_MAX : virtualMicros + timeoutUs;
+  bool owner = ownsClock();
+  while (!ready()) {
+    if (virtualMicros >= deadline) {
+      return false;
+    }
+    bool moved = false;
+    if (owner) {
+      lock.unlock();
+      moved = advanceStep(deadline);
+      lock.lock();
+    }
+    if (!moved) {
+      cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+  }
+  return true;
+}
+
+int64_t ticksToMicros(TickType_t ticks) {
+  return ticks == portMAX_DELAY ? -1 : (int64_t)ticks * portTICK_PERIOD_MS * 1000;
+}
+
+void sleepMicros(int64_t micros) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::unique_lock<std::mutex> lock(mutex);
+  block(lock, cv, [] { return false; }, micros);
+}
+
+// ---------------------------------------------------------------------------
+// Tasks
+
+struct Task {
+  std::string name;
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint32_t notifications = 0;
+};
+
+thread_local Task* currentTask = nullptr;
+
+Task* thisTask() {
+  if (!currentTask) {
+    shim::ShimScope scope;
+    currentTask = new Task();
+    currentTask->name = "main";
+  }
+  return currentTask;
+}
+
+struct Queue {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<uint8_t> storage;
+  size_t itemSize;
+  size_t length;
+  size_t head = 0;
+  size_t count = 0;
+};
+
+struct Semaphore {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool held = false;
+};
+
+// ---------------------------------------------------------------------------
+// Flash
+
+struct FlashState {
+  std::mutex mutex;
+  std::map<std::string, std::vector<uint8_t>> files;
+  size_t totalBytes = 0x20000;
+};
+
+// One flash and one NVS per simulated device
+template <typename State>
+State& deviceState() {
+  static std::mutex& mutex = *new std::mutex();
+  static std::map<int, State*>& states = *new std::map<int, State*>();
+  shim::ShimScope scope;
+  std::lock_guard<std::mutex> lock(mutex);
+  State*& state = states[threadDevice];
+  if (!state) {
+    state = new State();
+  }
+  return *state;
+}
+
+FlashState& flash() {
+  return deviceState<FlashState>();
+}
+
+size_t flashUsed(FlashState& state) {
+  size_t used = 0;
+  for (auto& file : state.files) {
+    used += file.second.size();
+  }
+  return used;
+}
+
+// ---------------------------------------------------------------------------
+// NVS
+
+struct NvsValue {
+  char type;
+  std::vector<uint8_t> bytes;
+};
+
+struct NvsState {
+  std::mutex mutex;
+  std::map<std::string, std::map<std::string, NvsValue>> namespaces;
+};
+
+NvsState& nvs() {
+  return deviceState<NvsState>();
+}
+
+const size_t NVS_KEY_MAX = 15;
+const size_t NVS_ENTRIES = 500;
+
+// ---------------------------------------------------------------------------
+// Random numbers
+
+std::mutex randomMutex;
+std::mt19937& randomEngine() {
+  static std::mt19937& engine = *new std::mt19937(12345);
+  return engine;
+}
+
+}  // namespace
+
+// ---------------------------------------------------------------------------
+// Shim controls
+
+namespace shim {
+
+void useVirtualClock(time_t wallStart) {
+  int64_t now = realMonotonicMicros();
+  virtualMicros = now;
+  wallBaseMicros = (int64_t)wallStart * 1000000 - now;
+  wallStepMicros = 0;
+  clockOwner = std::this_thread::get_id();
+  clockVirtual = true;
+  timerRegistry().changed.notify_all();
+}
+
+bool virtualClock() {
+  return clockVirtual;
+}
+
+void advance(int64_t micros) {
+  if (!clockVirtual) {
+    return;
+  }
+  int64_t target = virtualMicros + micros;
+  while (virtualMicros < target) {
+    advanceStep(target);
+  }
+}
+
+void stepWallClock(int64_t seconds) {
+  wallStepMicros += seconds * 1000000;
+}
+
+void resetFlash(size_t totalBytes) {
+  ShimScope scope;
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.files.clear();
+  state.totalBytes = totalBytes;
+}
+
+void erasePreferences() {
+  ShimScope scope;
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.namespaces.clear();
+}
+
+void setWiFiConnected(bool connected) {
+  wifiConnected = connected;
+}
+
+void setSerialEcho(bool echo) {
+  serialEcho = echo;
+}
+
+void setGpioListener(std::function<void(uint32_t out)> listener) {
+  ShimScope scope;
+  gpioListener() = listener;
+}
+
+void setDevice(int device) {
+  threadDevice = device;
+}
+
+void markFirmwareThread(bool firmware) {
+  threadFirmware = firmware;
+}
+
+bool firmwareCode() {
+  return threadFirmware && shimDepth == 0;
+}
+
+ShimScope::ShimScope() {
+  shimDepth++;
+}
+
+ShimScope::~ShimScope() {
+  shimDepth--;
+}
+
+}  // namespace shim
+
+// ---------------------------------------------------------------------------
+// libc time, so time() and gettimeofday() follow the shim's wall clock
+
+extern "C" time_t time(time_t* result) __THROW {
+  time_t now = (time_t)(wallMicros() / 1000000);
+  if (result) {
+    *result = now;
+  }
+  return now;
+}
+
+extern "C" int gettimeofday(struct timeval* __restrict tv, void* __restrict) __THROW {
+  int64_t now = wallMicros();
+  tv->tv_sec = (time_t)(now / 1000000);
+  tv->tv_usec = (suseconds_t)(now % 1000000);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Arduino core
+
+size_t strlcpy(char* dst, const char* src, size_t size) {
+  size_t length = strlen(src);
+  if (size) {
+    size_t n = length < size - 1 ? length : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return length;
+}
+
+size_t strlcat(char* dst, const char* src, size_t size) {
+  size_t used = strnlen(dst, size);
+  if (used == size) {
+    return size + strlen(src);
+  }
+  return used + strlcpy(dst + used, src, size - used);
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  if (serialEcho) {
+    fwrite(buffer, 1, size, stdout);
+  }
+  return size;
+}
+
+unsigned long millis() {
+  return (unsigned long)(monotonicMicros() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)monotonicMicros();
+}
+
+void delay(unsigned long ms) {
+  sleepMicros((int64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  sleepMicros(us);
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin >= 32) {
+    return;
+  }
+  if (value) {
+    GPIO.out_w1ts = 1u << pin;
+  } else {
+    GPIO.out_w1tc = 1u << pin;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < 32 ? (GPIO.out >> pin) & 1 : LOW;
+}
+
+uint16_t analogRead(uint8_t) {
+  return 0;
+}
+
+void analogWrite(uint8_t, int) {}
+
+long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+long random(long max) {
+  return max > 0 ? random(0, max) : 0;
+}
+
+long random(long min, long max) {
+  if (max <= min) {
+    return min;
+  }
+  std::lock_guard<std::mutex> lock(randomMutex);
+  return min + (long)(randomEngine()() % (unsigned long)(max - min));
+}
+
+uint32_t esp_random() {
+  std::lock_guard<std::mutex> lock(randomMutex);
+  return randomEngine()();
+}
+
+void configTime(long, int, const char*, const char*, const char*) {}
+
+const char* esp_err_to_name(esp_err_t code) {
+  switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    default: return "UNKNOWN ERROR";
+  }
+}
+
+// ---------------------------------------------------------------------------
+// GPIO
+
+gpio_set_reg_t& gpio_set_reg_t::operator=(uint32_t mask) {
+  GPIO.out = GPIO.out | mask;
+  if (gpioListener()) {
+    gpioListener()(GPIO.out);
+  }
+  return *this;
+}
+
+gpio_clear_reg_t& gpio_clear_reg_t::operator=(uint32_t mask) {
+  GPIO.out = GPIO.out & ~mask;
+  if (gpioListener()) {
+    gpioListener()(GPIO.out);
+  }
+  return *this;
+}
+
+esp_err_t gpio_hold_en(gpio_num_t) { return ESP_OK; }
+esp_err_t gpio_hold_dis(gpio_num_t) { return ESP_OK; }
+esp_err_t gpio_sleep_sel_dis(gpio_num_t) { return ESP_OK; }
+
+// ---------------------------------------------------------------------------
+// FreeRTOS
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char* name, uint32_t, void* arg, UBaseType_t,
+                       TaskHandle_t* handle) {
+  shim::ShimScope scope;
+  Task* task = new Task();
+  task->name = name ? name : "";
+  int device = threadDevice;
+  std::thread([task, code, arg, device] {
+    currentTask = task;
+    threadDevice = device;
+    shim::markFirmwareThread();
+    code(arg);
+  }).detach();
+  if (handle) {
+    *handle = task;
+  }
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stack, void* arg,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t) {
+  return xTaskCreate(code, name, stack, arg, priority, handle);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return thisTask();
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+  Task* task = thisTask();
+  std::unique_lock<std::mutex> lock(task->mutex);
+  block(lock, task->cv, [task] { return task->notifications > 0; }, ticksToMicros(ticks));
+  uint32_t value = task->notifications;
+  if (value) {
+    task->notifications = clear ? 0 : value - 1;
+  }
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t handle) {
+  Task* task = (Task*)handle;
+  {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->notifications++;
+  }
+  task->cv.notify_all();
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t handle, BaseType_t* woken) {
+  xTaskNotifyGive(handle);
+  if (woken) {
+    *woken = pdTRUE;
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  sleepMicros(ticksToMicros(ticks));
+}
+
+void vTaskDelete(TaskHandle_t handle) {
+  if (!handle || handle == currentTask) {
+    pthread_exit(nullptr);
+  }
+}
+
+TickType_t xTaskGetTickCount() {
+  return (TickType_t)millis();
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  shim::ShimScope scope;
+  Queue* queue = new Queue();
+  queue->itemSize = itemSize;
+  queue->length = length;
+  queue->storage.resize((size_t)length * itemSize);
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void* item, TickType_t ticks) {
+  Queue* queue = (Queue*)handle;
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!block(lock, queue->cv, [queue] { return queue->count < queue->length; }, ticksToMicros(ticks))) {
+    return pdFALSE;
+  }
+  size_t tail = (queue->head + queue->count) % queue->length;
+  memcpy(&queue->storage[tail * queue->itemSize], item, queue->itemSize);
+  queue->count++;
+  lock.unlock();
+  queue->cv.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* item, TickType_t ticks) {
+  return xQueueSend(queue, item, ticks);
+}
+
+static BaseType_t queueTake(QueueHandle_t handle, void* item, TickType_t ticks, bool remove) {
+  Queue* queue = (Queue*)handle;
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!block(lock, queue->cv, [queue] { return queue->count > 0; }, ticksToMicros(ticks))) {
+    return pdFALSE;
+  }
+  memcpy(item, &queue->storage[queue->head * queue->itemSize], queue->itemSize);
+  if (remove) {
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    lock.unlock();
+    queue->cv.notify_all();
+  }
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks) {
+  return queueTake(queue, item, ticks, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void* item, TickType_t ticks) {
+  return queueTake(queue, item, ticks, false);
+}
+
+BaseType_t xQueueReset(QueueHandle_t handle) {
+  Queue* queue = (Queue*)handle;
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->head = 0;
+    queue->count = 0;
+  }
+  queue->cv.notify_all();
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle) {
+  Queue* queue = (Queue*)handle;
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t handle) {
+  Queue* queue = (Queue*)handle;
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->length - queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  shim::ShimScope scope;
+  return new Semaphore();
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks) {
+  Semaphore* semaphore = (Semaphore*)handle;
+  std::unique_lock<std::mutex> lock(semaphore->mutex);
+  if (!block(lock, semaphore->cv, [semaphore] { return !semaphore->held; }, ticksToMicros(ticks))) {
+    return pdFALSE;
+  }
+  semaphore->held = true;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+  Semaphore* semaphore = (Semaphore*)handle;
+  {
+    std::lock_guard<std::mutex> lock(semaphore->mutex);
+    semaphore->held = false;
+  }
+  semaphore->cv.notify_all();
+  return pdTRUE;
+}
+
+// ---------------------------------------------------------------------------
+// esp_timer
+
+int64_t esp_timer_get_time() {
+  return monotonicMicros();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+  if (!args || !args->callback || !handle) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  shim::ShimScope scope;
+  esp_timer* timer = new esp_timer();
+  timer->callback = args->callback;
+  timer->arg = args->arg;
+  timer->name = args->name ? args->name : "";
+  timer->deadline = 0;
+  timer->period = 0;
+  timer->active = false;
+  TimerRegistry& registry = timerRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.timers.push_back(timer);
+  *handle = timer;
+  return ESP_OK;
+}
+
+static esp_err_t startTimer(esp_timer_handle_t timer, uint64_t timeoutUs, uint64_t periodUs) {
+  if (!timer) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  TimerRegistry& registry = timerRegistry();
+  {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    if (timer->active) {
+      return ESP_ERR_INVALID_STATE;
+    }
+    timer->deadline = monotonicMicros() + (int64_t)timeoutUs;
+    timer->period = periodUs;
+    timer->active = true;
+    if (!registry.dispatcher && !clockVirtual) {
+      shim::ShimScope scope;
+      registry.dispatcher = true;
+      std::thread(dispatchTimers).detach();
+    }
+  }
+  registry.changed.notify_all();
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutUs) {
+  return startTimer(timer, timeoutUs, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t periodUs) {
+  return startTimer(timer, periodUs, periodUs);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  if (!timer) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  TimerRegistry& registry = timerRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  if (!timer->active) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  timer->active = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+  if (!timer) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  TimerRegistry& registry = timerRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  if (timer->active) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  registry.timers.erase(std::remove(registry.timers.begin(), registry.timers.end(), timer), registry.timers.end());
+  delete timer;
+  return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+  TimerRegistry& registry = timerRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  return timer && timer->active;
+}
+
+// ---------------------------------------------------------------------------
+// File system
+
+namespace shim {
+
+struct FileHandle {
+  std::string path;
+  size_t position = 0;
+  bool readable = false;
+  bool writable = false;
+  bool append = false;
+  bool open = true;
+};
+
+}  // namespace shim
+
+// The open file's contents, or null if it was removed. Call with the flash locked.
+static std::vector<uint8_t>* fileData(FlashState& state, const shim::FileHandle& handle) {
+  auto it = state.files.find(handle.path);
+  return it == state.files.end() ? nullptr : &it->second;
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+  if (!_handle || !_handle->open || !_handle->writable) {
+    return 0;
+  }
+  shim::ShimScope scope;
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  std::vector<uint8_t>* data = fileData(state, *_handle);
+  if (!data) {
+    return 0;
+  }
+  if (_handle->append) {
+    _handle->position = data->size();
+  }
+  size_t end = _handle->position + size;
+  if (end > data->size()) {
+    // Stop short once the partition is full
+    size_t used = flashUsed(state);
+    size_t room = used < state.totalBytes ? state.totalBytes - used : 0;
+    size_t limit = data->size() + room;
+    if (end > limit) {
+      size = limit > _handle->position ? limit - _handle->position : 0;
+      end = _handle->position + size;
+    }
+    if (end > data->size()) {
+      data->resize(end);
+    }
+  }
+  memcpy(data->data() + _handle->position, buffer, size);
+  _handle->position = end;
+  return size;
+}
+
+size_t File::read(uint8_t* buffer, size_t size) {
+  if (!_handle || !_handle->open || !_handle->readable) {
+    return 0;
+  }
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  std::vector<uint8_t>* data = fileData(state, *_handle);
+  if (!data || _handle->position >= data->size()) {
+    return 0;
+  }
+  size_t n = std::min(size, data->size() - _handle->position);
+  memcpy(buffer, data->data() + _handle->position, n);
+  _handle->position += n;
+  return n;
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek() {
+  int c = read();
+  if (c >= 0) {
+    _handle->position--;
+  }
+  return c;
+}
+
+int File::available() {
+  return (int)(size() - position());
+}
+
+bool File::seek(uint32_t position, SeekMode mode) {
+  if (!_handle || !_handle->open) {
+    return false;
+  }
+  size_t length = size();
+  int64_t target = position;
+  if (mode == SeekCur) {
+    target += _handle->position;
+  } else if (mode == SeekEnd) {
+    target = (int64_t)length - position;
+  }
+  if (target < 0 || (size_t)target > length) {
+    return false;
+  }
+  _handle->position = (size_t)target;
+  return true;
+}
+
+size_t File::position() const {
+  return _handle ? _handle->position : 0;
+}
+
+size_t File::size() const {
+  if (!_handle) {
+    return 0;
+  }
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  std::vector<uint8_t>* data = fileData(state, *_handle);
+  return data ? data->size() : 0;
+}
+
+void File::close() {
+  if (_handle) {
+    _handle->open = false;
+  }
+}
+
+const char* File::name() const {
+  if (!_handle) {
+    return "";
+  }
+  size_t slash = _handle->path.rfind('/');
+  return _handle->path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+const char* File::path() const {
+  return _handle ? _handle->path.c_str() : "";
+}
+
+File::operator bool() const {
+  return _handle && _handle->open;
+}
+
+File fs::FS::open(const char* path, const char* mode, bool create) {
+  shim::ShimScope scope;
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  bool exists = state.files.count(path) > 0;
+  std::shared_ptr<shim::FileHandle> handle = std::make_shared<shim::FileHandle>();
+  handle->path = path;
+  bool plus = strchr(mode, '+') != nullptr;
+  switch (mode[0]) {
+    case 'r':
+      if (!exists && !create) {
+        return File();
+      }
+      state.files[path];
+      handle->readable = true;
+      handle->writable = plus;
+      break;
+    case 'w':
+      state.files[path].clear();
+      handle->writable = true;
+      handle->readable = plus;
+      break;
+    case 'a':
+      handle->position = state.files[path].size();
+      handle->writable = true;
+      handle->append = true;
+      handle->readable = plus;
+      break;
+    default:
+      return File();
+  }
+  return File(handle);
+}
+
+bool fs::FS::exists(const char* path) {
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.files.count(path) > 0;
+}
+
+bool fs::FS::remove(const char* path) {
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.files.erase(path) > 0;
+}
+
+bool fs::FS::rename(const char* from, const char* to) {
+  shim::ShimScope scope;
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  auto it = state.files.find(from);
+  if (it == state.files.end()) {
+    return false;
+  }
+  std::vector<uint8_t> data;
+  data.swap(it->second);
+  state.files.erase(it);
+  state.files[to].swap(data);
+  return true;
+}
+
+bool SPIFFSFS::begin(bool, const char*, uint8_t, const char*) {
+  return true;
+}
+
+bool SPIFFSFS::format() {
+  shim::ShimScope scope;
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.files.clear();
+  return true;
+}
+
+size_t SPIFFSFS::totalBytes() {
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.totalBytes;
+}
+
+size_t SPIFFSFS::usedBytes() {
+  FlashState& state = flash();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return flashUsed(state);
+}
+
+// ---------------------------------------------------------------------------
+// Preferences
+
+bool Preferences::begin(const char* name, bool readOnly, const char*) {
+  if (!name || strlen(name) > NVS_KEY_MAX) {
+    return false;
+  }
+  shim::ShimScope scope;
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if (readOnly && !state.namespaces.count(name)) {
+    return false;
+  }
+  state.namespaces[name];
+  strlcpy(_namespace, name, sizeof(_namespace));
+  _readOnly = readOnly;
+  _open = true;
+  return true;
+}
+
+void Preferences::end() {
+  _open = false;
+}
+
+bool Preferences::clear() {
+  if (!_open || _readOnly) {
+    return false;
+  }
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.namespaces[_namespace].clear();
+  return true;
+}
+
+bool Preferences::remove(const char* key) {
+  if (!_open || _readOnly) {
+    return false;
+  }
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.namespaces[_namespace].erase(key) > 0;
+}
+
+bool Preferences::isKey(const char* key) {
+  if (!_open) {
+    return false;
+  }
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.namespaces[_namespace].count(key) > 0;
+}
+
+size_t Preferences::freeEntries() {
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  size_t used = 0;
+  for (auto& space : state.namespaces) {
+    used += space.second.size();
+  }
+  return used < NVS_ENTRIES ? NVS_ENTRIES - used : 0;
+}
+
+size_t Preferences::put(const char* key, char type, const void* value, size_t size) {
+  if (!_open || _readOnly || !key || strlen(key) > NVS_KEY_MAX) {
+    return 0;
+  }
+  shim::ShimScope scope;
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  NvsValue& entry = state.namespaces[_namespace][key];
+  entry.type = type;
+  entry.bytes.assign((const uint8_t*)value, (const uint8_t*)value + size);
+  return size;
+}
+
+bool Preferences::get(const char* key, char type, void* value, size_t size) {
+  if (!_open || !key) {
+    return false;
+  }
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  auto& space = state.namespaces[_namespace];
+  auto it = space.find(key);
+  if (it == space.end() || it->second.type != type || it->second.bytes.size() != size) {
+    return false;
+  }
+  memcpy(value, it->second.bytes.data(), size);
+  return true;
+}
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t size) {
+  return put(key, 'B', value, size);
+}
+
+size_t Preferences::getBytesLength(const char* key) {
+  if (!_open || !key) {
+    return 0;
+  }
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  auto& space = state.namespaces[_namespace];
+  auto it = space.find(key);
+  return it == space.end() || it->second.type != 'B' ? 0 : it->second.bytes.size();
+}
+
+size_t Preferences::getBytes(const char* key, void* buffer, size_t size) {
+  size_t length = getBytesLength(key);
+  if (!length || length > size) {
+    return 0;
+  }
+  return get(key, 'B', buffer, length) ? length : 0;
+}
+
+size_t Preferences::putString(const char* key, const char* value) {
+  return put(key, 'Z', value, strlen(value) + 1) ? strlen(value) : 0;
+}
+
+size_t Preferences::getString(const char* key, char* value, size_t size) {
+  if (!_open || !key) {
+    return 0;
+  }
+  NvsState& state = nvs();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  auto& space = state.namespaces[_namespace];
+  auto it = space.find(key);
+  if (it == space.end() || it->second.type != 'Z' || it->second.bytes.size() > size) {
+    return 0;
+  }
+  memcpy(value, it->second.bytes.data(), it->second.bytes.size());
+  return it->second.bytes.size();
+}
+
+String Preferences::getString(const char* key, const String& defaultValue) {
+  char buffer[4000];
+  return getString(key, buffer, sizeof(buffer)) ? String(buffer) : defaultValue;
+}
+
+// ---------------------------------------------------------------------------
+// Network
+
+bool WiFiClass::isConnected() {
+  return wifiConnected;
+}
+
+int WiFiClient::connect(const char*, uint16_t, int32_t) {
+  _connected = wifiConnected && shim::MqttBroker::instance().running();
+  return _connected;
+}
+
+namespace {
+
+struct BrokerState {
+  std::mutex mutex;
+  bool running = true;
+  std::vector<std::shared_ptr<shim::MqttSession>> sessions;
+  std::map<std::string, std::string> retained;
+  shim::MqttBrokerStats stats = {};
+};
+
+BrokerState& broker() {
+  static BrokerState& state = *new BrokerState();
+  return state;
+}
+
+}  // namespace
+
+namespace shim {
+
+MqttBroker& MqttBroker::instance() {
+  static MqttBroker& instance = *new MqttBroker();
+  return instance;
+}
+
+void MqttBroker::start() {
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.running = true;
+}
+
+void MqttBroker::stop() {
+  ShimScope scope;
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.running = false;
+  for (auto& session : state.sessions) {
+    session->alive = false;
+    session->inbox.clear();
+  }
+  state.sessions.clear();
+}
+
+bool MqttBroker::running() {
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.running;
+}
+
+MqttBrokerStats MqttBroker::stats() {
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  MqttBrokerStats stats = state.stats;
+  stats.sessions = state.sessions.size();
+  stats.retained = state.retained.size();
+  stats.retainedBytes = 0;
+  for (auto& message : state.retained) {
+    stats.retainedBytes += message.first.size() + message.second.size();
+  }
+  return stats;
+}
+
+void MqttBroker::clearRetained() {
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.retained.clear();
+}
+
+std::shared_ptr<MqttSession> MqttBroker::connect(const char* clientId) {
+  ShimScope scope;
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if (!state.running) {
+    state.stats.refused++;
+    return nullptr;
+  }
+  // A second client with the same id takes over the session
+  for (auto it = state.sessions.begin(); it != state.sessions.end();) {
+    if ((*it)->clientId == clientId) {
+      (*it)->alive = false;
+      it = state.sessions.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  std::shared_ptr<MqttSession> session = std::make_shared<MqttSession>();
+  session->clientId = clientId;
+  state.sessions.push_back(session);
+  state.stats.connects++;
+  return session;
+}
+
+void MqttBroker::disconnect(const std::shared_ptr<MqttSession>& session) {
+  ShimScope scope;
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  session->alive = false;
+  state.sessions.erase(std::remove(state.sessions.begin(), state.sessions.end(), session), state.sessions.end());
+}
+
+bool MqttBroker::alive(const std::shared_ptr<MqttSession>& session) {
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return session->alive;
+}
+
+bool MqttBroker::publish(const std::shared_ptr<MqttSession>& session, const char* topic, const uint8_t* payload,
+                         size_t length, bool retain) {
+  ShimScope scope;
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if (!session->alive) {
+    return false;
+  }
+  state.stats.received++;
+  std::string text((const char*)payload, length);
+  if (retain) {
+    if (length) {
+      state.retained[topic] = text;
+    } else {
+      state.retained.erase(topic);
+    }
+  }
+  for (auto& subscriber : state.sessions) {
+    for (auto& filter : subscriber->filters) {
+      if (matches(filter.c_str(), topic)) {
+        subscriber->inbox.push_back(MqttMessage{topic, text});
+        state.stats.delivered++;
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+bool MqttBroker::subscribe(const std::shared_ptr<MqttSession>& session, const char* filter) {
+  ShimScope scope;
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if (!session->alive) {
+    return false;
+  }
+  session->filters.push_back(filter);
+  for (auto& message : state.retained) {
+    if (matches(filter, message.first.c_str())) {
+      session->inbox.push_back(MqttMessage{message.first, message.second});
+      state.stats.delivered++;
+    }
+  }
+  return true;
+}
+
+bool MqttBroker::receive(const std::shared_ptr<MqttSession>& session, MqttMessage& message) {
+  ShimScope scope;
+  BrokerState& state = broker();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if (!session->alive || session->inbox.empty()) {
+    return false;
+  }
+  message = std::move(session->inbox.front());
+  session->inbox.pop_front();
+  return true;
+}
+
+bool MqttBroker::matches(const char* filter, const char* topic) {
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+    }
+    if (*filter == '+') {
+      while (*topic && *topic != '/') {
+        topic++;
+      }
+      filter++;
+    } else {
+      while (*filter && *filter != '/' && *filter == *topic) {
+        filter++;
+        topic++;
+      }
+      if (*filter && *filter != '/') {
+        return false;
+      }
+      if (*topic && *topic != '/') {
+        return false;
+      }
+    }
+    // Both at the end of a level
+    if (!*filter) {
+      return !*topic;
+    }
+    if (!*topic) {
+      // "a/#" also matches "a"
+      return strcmp(filter, "/#") == 0;
+    }
+    filter++;
+    topic++;
+  }
+  return !*topic;
+}
+
+}  // namespace shim
+
+bool PubSubClient::connect(const char* id, const char*, const char*, const char*, uint8_t, bool, const char*,
+                           bool) {
+  if (connected()) {
+    return true;
+  }
+  if (!_client || !_client->connect("broker", 1883)) {
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  _session = shim::MqttBroker::instance().connect(id);
+  if (!_session) {
+    _client->stop();
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  _state = MQTT_CONNECTED;
+  return true;
+}
+
+void PubSubClient::disconnect() {
+  if (_session) {
+    shim::MqttBroker::instance().disconnect(_session);
+    shim::ShimScope scope;
+    _session.reset();
+  }
+  if (_client) {
+    _client->stop();
+  }
+  _state = MQTT_DISCONNECTED;
+}
+
+bool PubSubClient::connected() {
+  if (!_session) {
+    return false;
+  }
+  if (!shim::MqttBroker::instance().alive(_session)) {
+    {
+      shim::ShimScope scope;
+      _session.reset();
+    }
+    if (_client) {
+      _client->stop();
+    }
+    _state = MQTT_CONNECTION_LOST;
+    return false;
+  }
+  return true;
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retain) {
+  if (!connected()) {
+    return false;
+  }
+  if ((size_t)_bufferSize < MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + length) {
+    return false;
+  }
+  return shim::MqttBroker::instance().publish(_session, topic, payload, length, retain);
+}
+
+bool PubSubClient::beginPublish(const char* topic, unsigned int length, bool retain) {
+  if (!connected()) {
+    return false;
+  }
+  shim::ShimScope scope;
+  _topic = topic;
+  _payload.clear();
+  _payload.reserve(length);
+  _retain = retain;
+  return true;
+}
+
+size_t PubSubClient::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t PubSubClient::write(const uint8_t* buffer, size_t size) {
+  shim::ShimScope scope;
+  _payload.append((const char*)buffer, size);
+  return size;
+}
+
+int PubSubClient::endPublish() {
+  if (!connected()) {
+    return 0;
+  }
+  return shim::MqttBroker::instance().publish(_session, _topic.c_str(), (const uint8_t*)_payload.data(),
+                                              _payload.size(), _retain)
+             ? 1
+             : 0;
+}
+
+bool PubSubClient::subscribe(const char* topic, uint8_t) {
+  if (!connected()) {
+    return false;
+  }
+  return shim::MqttBroker::instance().subscribe(_session, topic);
+}
+
+bool PubSubClient::loop() {
+  if (!connected()) {
+    return false;
+  }
+  shim::MqttMessage message;
+  while (shim::MqttBroker::instance().receive(_session, message)) {
+    // Like the real client, messages that do not fit the buffer are dropped
+    if ((size_t)_bufferSize < MQTT_MAX_HEADER_SIZE + 2 + message.topic.size() + message.payload.size()) {
+      continue;
+    }
+    if (_callback) {
+      {
+        shim::ShimScope scope;
+        _topic = message.topic;
+        _payload = message.payload;
+      }
+      _callback(&_topic[0], (uint8_t*)&_payload[0], _payload.size());
+    }
+  }
+  return true;
+}
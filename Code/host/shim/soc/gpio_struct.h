@@ -0,0 +1,2 @@
+#pragma once
+#include <driver/gpio.h>
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal checks for the host tests. A failed check is reported and the
+// test carries on; testResult() gives the exit code.
+
+static int testFailures = 0;
+
+#define CHECK(condition)                                                        \
+  do {                                                                          \
+    if (!(condition)) {                                                         \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);      \
+      testFailures++;                                                           \
+    }                                                                           \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                              \
+  do {                                                                          \
+    long long _a = (long long)(actual);                                         \
+    long long _e = (long long)(expected);                                       \
+    if (_a != _e) {                                                             \
+      printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__,        \
+             __LINE__, #actual, #expected, _a, _e);                             \
+      testFailures++;                                                           \
+    }                                                                           \
+  } while (0)
+
+#define CHECK_NEAR(actual, expected, tolerance)                                 \
+  do {                                                                          \
+    double _a = (double)(actual);                                               \
+    double _e = (double)(expected);                                             \
+    if (!(_a >= _e - (tolerance) && _a <= _e + (tolerance))) {                  \
+      printf("%s:%d: CHECK_NEAR(%s, %s) failed: %g != %g +- %g\n", __FILE__,    \
+             __LINE__, #actual, #expected, _a, _e, (double)(tolerance));        \
+      testFailures++;                                                           \
+    }                                                                           \
+  } while (0)
+
+// Exit without running static destructors, which tasks started by the
+// units under test may still be using
+static int testResult(const char* name) {
+  printf("%s: %s\n", name, testFailures ? "FAILED" : "passed");
+  fflush(stdout);
+  _Exit(testFailures ? 1 : 0);
+}
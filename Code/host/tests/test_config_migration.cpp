@@ -0,0 +1,340 @@
+// Every config layout earlier firmware stored loads into the current one:
+// the three single-blob layouts keep their fields, take defaults for the
+// rest and are replaced by the tagged per-key store, which then reloads
+// unchanged. Unknown blobs and mis-sized keys fall back to defaults, and
+// edits are committed once per burst, rewriting only the keys that changed.
+#include <Arduino.h>
+#include <Preferences.h>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "Config.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+// The stored layouts as they were declared, without their initialisers and
+// with the ESP32's 32 bit long
+
+// Original firmware
+struct ConfigV0 {
+  char device_id[32];
+  bool mqtt_enabled;
+  char mqtt_server[64];
+  int mqtt_port;
+  char mqtt_user[32];
+  char mqtt_password[32];
+  char ntp_server[64];
+  int32_t cal_dry;
+  int32_t cal_critical;
+  int32_t cal_half;
+  int32_t cal_full;
+  float ph4_adc;
+  float ph7_adc;
+  float ph10_adc;
+};
+
+// + power save
+struct ConfigV1 {
+  char device_id[32];
+  bool mqtt_enabled;
+  char mqtt_server[64];
+  int mqtt_port;
+  char mqtt_user[32];
+  char mqtt_password[32];
+  char ntp_server[64];
+  int32_t cal_dry;
+  int32_t cal_critical;
+  int32_t cal_half;
+  int32_t cal_full;
+  float ph4_adc;
+  float ph7_adc;
+  float ph10_adc;
+  bool power_save;
+};
+
+// + telemetry deadbands, heartbeat and state topic
+struct ConfigV2 {
+  char device_id[32];
+  bool mqtt_enabled;
+  char mqtt_server[64];
+  int mqtt_port;
+  char mqtt_user[32];
+  char mqtt_password[32];
+  char ntp_server[64];
+  int32_t cal_dry;
+  int32_t cal_critical;
+  int32_t cal_half;
+  int32_t cal_full;
+  float ph4_adc;
+  float ph7_adc;
+  float ph10_adc;
+  bool power_save;
+  MetricDeadband deadbands[METRIC_COUNT];
+  uint16_t heartbeat_s;
+  bool state_topic;
+};
+
+// The sensors only need to exist; ConfigManager sets their calibration
+HX710B pressureSensor(1, 2);
+PHMeter phMeter(3);
+GravityTDS tdsSensor;
+OneWire oneWire(4);
+DallasTemperature temperatureSensor(&oneWire);
+SensorReader sensors(pressureSensor, phMeter, tdsSensor, temperatureSensor);
+
+// Fields every layout has, filled the same way as the device would have
+template <typename Legacy>
+void fillCommon(Legacy& legacy) {
+  memset(&legacy, 0xa5, sizeof(legacy));  // Padding as random as flash
+  strlcpy(legacy.device_id, "greenhouse-2", sizeof(legacy.device_id));
+  legacy.mqtt_enabled = true;
+  strlcpy(legacy.mqtt_server, "10.0.0.7", sizeof(legacy.mqtt_server));
+  legacy.mqtt_port = 8883;
+  strlcpy(legacy.mqtt_user, "grower", sizeof(legacy.mqtt_user));
+  strlcpy(legacy.mqtt_password, "s3cret", sizeof(legacy.mqtt_password));
+  strlcpy(legacy.ntp_server, "ntp.lan", sizeof(legacy.ntp_server));
+  legacy.cal_dry = 812000;
+  legacy.cal_critical = 845000;
+  legacy.cal_half = 901000;
+  legacy.cal_full = 967000;
+  legacy.ph4_adc = 2030.5f;
+  legacy.ph7_adc = 1510.25f;
+  legacy.ph10_adc = 990.75f;
+}
+
+template <typename Legacy>
+void checkCommon(const SystemConfig& config, const Legacy& legacy) {
+  CHECK(strcmp(config.device_id, legacy.device_id) == 0);
+  CHECK_EQ(config.mqtt_enabled, legacy.mqtt_enabled);
+  CHECK(strcmp(config.mqtt_server, legacy.mqtt_server) == 0);
+  CHECK_EQ(config.mqtt_port, legacy.mqtt_port);
+  CHECK(strcmp(config.mqtt_user, legacy.mqtt_user) == 0);
+  CHECK(strcmp(config.mqtt_password, legacy.mqtt_password) == 0);
+  CHECK(strcmp(config.ntp_server, legacy.ntp_server) == 0);
+  CHECK_EQ(config.cal_dry, legacy.cal_dry);
+  CHECK_EQ(config.cal_critical, legacy.cal_critical);
+  CHECK_EQ(config.cal_half, legacy.cal_half);
+  CHECK_EQ(config.cal_full, legacy.cal_full);
+  CHECK(config.ph4_adc == legacy.ph4_adc);
+  CHECK(config.ph7_adc == legacy.ph7_adc);
+  CHECK(config.ph10_adc == legacy.ph10_adc);
+  CHECK_EQ(sensors.getLiquidCalibrationMin(), legacy.cal_dry);
+  CHECK(sensors.getPH7ADC() == legacy.ph7_adc);
+}
+
+// Fields from the given one on hold their defaults
+void checkDefaultsFrom(const SystemConfig& config, uint32_t firstField) {
+  SystemConfig defaults;
+  for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+    const ConfigFieldInfo& info = CONFIG_FIELDS[i];
+    if (info.field >= firstField &&
+        memcmp((const uint8_t*)&config + info.offset, (const uint8_t*)&defaults + info.offset, info.size) != 0) {
+      printf("%s is not at its default\n", info.key);
+      CHECK(false);
+    }
+  }
+}
+
+bool sameConfig(const SystemConfig& a, const SystemConfig& b) {
+  for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+    const ConfigFieldInfo& info = CONFIG_FIELDS[i];
+    const uint8_t* fieldA = (const uint8_t*)&a + info.offset;
+    const uint8_t* fieldB = (const uint8_t*)&b + info.offset;
+    bool same = info.type == FIELD_STRING ? strcmp((const char*)fieldA, (const char*)fieldB) == 0
+                                          : memcmp(fieldA, fieldB, info.size) == 0;
+    if (!same) {
+      printf("%s differs\n", info.key);
+      return false;
+    }
+  }
+  return true;
+}
+
+void storeLegacy(const void* blob, size_t size) {
+  shim::erasePreferences();
+  Preferences preferences;
+  preferences.begin("hydroponics", false);
+  CHECK_EQ(preferences.putBytes("config", blob, size), size);
+  preferences.end();
+}
+
+// The blob is gone, the tagged store is complete and reloads the same
+void checkMigrated(const SystemConfig& config) {
+  Preferences preferences;
+  preferences.begin("hydroponics", true);
+  CHECK(!preferences.isKey("config"));
+  preferences.end();
+  preferences.begin("hydro_cfg", true);
+  CHECK_EQ(preferences.getUChar("schema", 0), CONFIG_SCHEMA_VERSION);
+  for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+    CHECK(preferences.isKey(CONFIG_FIELDS[i].key));
+  }
+  preferences.end();
+
+  Preferences rebootPreferences;
+  ConfigManager rebooted(rebootPreferences, sensors);
+  rebooted.begin();
+  CHECK(sameConfig(rebooted.getConfig(), config));
+}
+
+}  // namespace
+
+int main() {
+  shim::useVirtualClock(1709251200);
+
+  // Original layout
+  {
+    ConfigV0 legacy;
+    fillCommon(legacy);
+    storeLegacy(&legacy, sizeof(legacy));
+    Preferences preferences;
+    ConfigManager manager(preferences, sensors);
+    manager.begin();
+    checkCommon(manager.getConfig(), legacy);
+    checkDefaultsFrom(manager.getConfig(), CONFIG_POWER_SAVE);
+    checkMigrated(manager.getConfig());
+  }
+
+  // With power save
+  {
+    ConfigV1 legacy;
+    fillCommon(legacy);
+    legacy.power_save = true;
+    storeLegacy(&legacy, sizeof(legacy));
+    Preferences preferences;
+    ConfigManager manager(preferences, sensors);
+    manager.begin();
+    checkCommon(manager.getConfig(), legacy);
+    CHECK(manager.getConfig().power_save);
+    checkDefaultsFrom(manager.getConfig(), CONFIG_DEADBANDS);
+    checkMigrated(manager.getConfig());
+  }
+
+  // With telemetry settings
+  {
+    ConfigV2 legacy;
+    fillCommon(legacy);
+    legacy.power_save = true;
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      legacy.deadbands[i].absolute = 0.5f * (i + 1);
+      legacy.deadbands[i].relative = 0.02f;
+    }
+    legacy.heartbeat_s = 60;
+    legacy.state_topic = true;
+    storeLegacy(&legacy, sizeof(legacy));
+    Preferences preferences;
+    ConfigManager manager(preferences, sensors);
+    manager.begin();
+    const SystemConfig& config = manager.getConfig();
+    checkCommon(config, legacy);
+    CHECK(config.power_save);
+    CHECK(memcmp(config.deadbands, legacy.deadbands, sizeof(legacy.deadbands)) == 0);
+    CHECK_EQ(config.heartbeat_s, 60);
+    CHECK(config.state_topic);
+    checkDefaultsFrom(config, CONFIG_RELAY_WATTS);
+    checkMigrated(config);
+  }
+
+  // A blob of no known layout is dropped for defaults
+  {
+    uint8_t blob[100];
+    memset(blob, 0x5a, sizeof(blob));
+    storeLegacy(blob, sizeof(blob));
+    Preferences preferences;
+    ConfigManager manager(preferences, sensors);
+    manager.begin();
+    const SystemConfig& config = manager.getConfig();
+    CHECK(strcmp(config.device_id, "tower-123456") == 0);
+    CHECK(strcmp(config.mqtt_user, "") == 0);
+    CHECK(!config.mqtt_enabled);
+    checkDefaultsFrom(config, CONFIG_NTP_SERVER);
+    checkMigrated(config);
+  }
+
+  // A tagged key of the wrong size keeps its default, the others load
+  {
+    shim::erasePreferences();
+    Preferences preferences;
+    ConfigManager manager(preferences, sensors);
+    manager.begin();
+    ConfigPatch patch;
+    patch.fields = CONFIG_MQTT_PORT | CONFIG_HEARTBEAT;
+    patch.values.mqtt_port = 8883;
+    patch.values.heartbeat_s = 30;
+    manager.applyPatch(patch);
+    manager.commit();
+
+    preferences.begin("hydro_cfg", false);
+    uint16_t shortPort = 1884;
+    preferences.putBytes("mqtt_port", &shortPort, sizeof(shortPort));
+    preferences.end();
+
+    Preferences rebootPreferences;
+    ConfigManager rebooted(rebootPreferences, sensors);
+    rebooted.begin();
+    CHECK_EQ(rebooted.getConfig().mqtt_port, 1883);
+    CHECK_EQ(rebooted.getConfig().heartbeat_s, 30);
+  }
+
+  // A burst of edits is one commit, unchanged keys are not rewritten and
+  // the commit count survives a reboot
+  {
+    shim::erasePreferences();
+    Preferences preferences;
+    ConfigManager manager(preferences, sensors);
+    manager.begin();
+    ConfigWearStats before = manager.wearStats();
+    CHECK(!manager.hasPendingChanges());
+
+    ConfigPatch patch;
+    patch.fields = CONFIG_PH4_ADC;
+    for (int i = 0; i < 5; i++) {
+      patch.values.ph4_adc = 2000.0f + i;
+      manager.applyPatch(patch);
+      CHECK_EQ(manager.commitDelay(), CONFIG_COMMIT_DELAY_MS);
+      shim::advance(500 * 1000);
+    }
+    patch.fields = CONFIG_PH7_ADC;
+    patch.values.ph7_adc = manager.getConfig().ph7_adc;
+    manager.applyPatch(patch);
+    CHECK(sensors.getPH4ADC() == 2004.0f);
+    shim::advance(CONFIG_COMMIT_DELAY_MS * 1000);
+    CHECK_EQ(manager.commitDelay(), 0);
+    manager.commit();
+    CHECK(!manager.hasPendingChanges());
+    CHECK_EQ(manager.wearStats().commits, before.commits + 1);
+    CHECK_EQ(manager.wearStats().keyWrites, before.keyWrites + 1);
+    CHECK_EQ(manager.wearStats().keysSkipped, before.keysSkipped + 1);
+
+    // Editing without a pause is committed after the maximum delay
+    patch.fields = CONFIG_CAL_DRY;
+    uint32_t waited = 0;
+    for (long value = 1; value < 100; value++) {
+      patch.values.cal_dry = value;
+      manager.applyPatch(patch);
+      if (manager.commitDelay() == 0) {
+        break;
+      }
+      shim::advance(1000 * 1000);
+      waited += 1000;
+    }
+    CHECK_EQ(waited, CONFIG_COMMIT_MAX_DELAY_MS);
+
+    // Setting a value back to what is in flash writes nothing
+    patch.values.cal_dry = 0;
+    manager.applyPatch(patch);
+    manager.commit();
+    CHECK_EQ(manager.wearStats().commits, before.commits + 1);
+
+    Preferences rebootPreferences;
+    ConfigManager rebooted(rebootPreferences, sensors);
+    rebooted.begin();
+    CHECK_EQ(rebooted.wearStats().commits, before.commits + 1);
+    CHECK(rebooted.getConfig().ph4_adc == 2004.0f);
+  }
+
+  return testResult("test_config_migration");
+}
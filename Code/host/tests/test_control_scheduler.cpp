@@ -0,0 +1,245 @@
+// Runs main.cpp's control loop on the virtual clock for a week of a
+// growth cycle and checks that every pump and lights transition lands
+// within a second of the CycleSimulator timeline, with the task waking up
+// to 200 ms late and commands waking it at random times.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <Preferences.h>
+#include <vector>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "RelayController.h"
+#include "PumpGuard.h"
+#include "GrowthManager.h"
+#include "CycleSimulator.h"
+#include "ControlScheduler.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+const time_t SIM_FROM = 1709262443;                 // 2024-03-01 03:07:23 UTC
+const time_t SIM_UNTIL = SIM_FROM + 7 * SECONDS_PER_DAY;
+const time_t CYCLE_START = SIM_FROM - 10 * SECONDS_PER_DAY;  // Seedling ends on day 4
+const uint32_t MAX_SLEEP_MS = 60000;
+const uint32_t SENSOR_SAMPLE_INTERVAL_MS = 1000;
+const uint32_t PUMP_MAX_RUN_MS = 30 * 60000;
+const int64_t MAX_WAKE_LATENCY_US = 200000;
+
+struct Transition {
+  int64_t wallMs;
+  uint8_t relay;
+  bool on;
+};
+
+Preferences preferences;
+RTC_NOINIT_ATTR RelayUsageRecord relayUsageRecord;
+RelayController relayController(relayUsageRecord);
+PumpGuard pumpGuard(relayController, RELAY_PUMP);
+GrowthManager* growthManager = nullptr;
+ControlScheduler scheduler;
+WateringState watering;
+RelayMask heldRelays = 0;
+bool cycleScheduleDirty = true;
+
+// Same steps as main.cpp, without sensors and network
+void updateRelaysBasedOnCycle() {
+  heldRelays = 0;
+  time_t now = time(nullptr);
+  const GrowthPlan& plan = growthManager->getPlan(now);
+  if (!plan.valid) {
+    return;
+  }
+  WateringState previous = watering;
+  CycleOutputs outputs =
+      GrowthManager::evaluateCycle(plan, now, relayController.getState(RELAY_PUMP), watering);
+  RelayMask cycleRelays = RELAY_BIT(RELAY_LIGHTS) | RELAY_BIT(RELAY_PUMP);
+  RelayMask wanted = (outputs.lights ? RELAY_BIT(RELAY_LIGHTS) : 0) | (outputs.pump ? RELAY_BIT(RELAY_PUMP) : 0);
+  heldRelays = relayController.apply(cycleRelays, wanted);
+  if (heldRelays & RELAY_BIT(RELAY_PUMP)) {
+    if (relayController.holdRemaining(RELAY_BIT(RELAY_PUMP)) > 0) {
+      watering = previous;
+    } else if (!relayController.getState(RELAY_PUMP)) {
+      watering.pumpOnTime = 0;
+    }
+  }
+  growthManager->setWateringState(watering);
+}
+
+void scheduleCycleEvents() {
+  scheduler.cancel(EVENT_WATERING_START);
+  scheduler.cancel(EVENT_WATERING_STOP);
+  scheduler.cancel(EVENT_LIGHTS);
+  scheduler.cancel(EVENT_STAGE_CHANGE);
+  scheduler.cancel(EVENT_RELAY_RELEASE);
+
+  uint32_t holdMs = relayController.holdRemaining(heldRelays);
+  if (holdMs > 0) {
+    scheduler.scheduleIn(EVENT_RELAY_RELEASE, holdMs);
+  }
+  time_t now = time(nullptr);
+  const GrowthPlan& plan = growthManager->getPlan(now);
+  if (!plan.valid) {
+    return;
+  }
+  bool pumpHeld = relayController.holdRemaining(heldRelays & RELAY_BIT(RELAY_PUMP)) > 0;
+  if (!pumpHeld && relayController.getState(RELAY_PUMP) && plan.pumpStopTime > 0) {
+    scheduler.scheduleAtWallTime(EVENT_WATERING_STOP, plan.pumpStopTime + 1);
+  }
+  if (!pumpHeld && plan.nextWateringStart > 0) {
+    scheduler.scheduleAtWallTime(EVENT_WATERING_START, plan.nextWateringStart);
+  }
+  scheduler.scheduleAtWallTime(EVENT_LIGHTS, plan.nextLightTransition(now));
+  if (plan.stageEnd > 0) {
+    scheduler.scheduleAtWallTime(EVENT_STAGE_CHANGE, plan.stageEnd);
+  }
+}
+
+void armPumpDeadline() {
+  int64_t stopAtUs = 0;
+  time_t now = time(nullptr);
+  const GrowthPlan& plan = growthManager->getPlan(now);
+  if (plan.valid && plan.pumpStopTime > 0) {
+    int64_t delayMs = (int64_t)plan.pumpStopTime * 1000 - ControlScheduler::wallMillis();
+    stopAtUs = esp_timer_get_time() + delayMs * 1000;
+  }
+  pumpGuard.update(stopAtUs, PUMP_MAX_RUN_MS);
+}
+
+void handleEvent(ControlEvent event) {
+  switch (event) {
+    case EVENT_SENSOR_SAMPLE:
+      relayController.accrue();
+      scheduler.scheduleIn(EVENT_SENSOR_SAMPLE, SENSOR_SAMPLE_INTERVAL_MS);
+      break;
+    case EVENT_WATERING_START:
+    case EVENT_WATERING_STOP:
+    case EVENT_LIGHTS:
+    case EVENT_STAGE_CHANGE:
+    case EVENT_RELAY_RELEASE:
+      cycleScheduleDirty = true;
+      break;
+    default:
+      break;
+  }
+}
+
+}  // namespace
+
+int main() {
+  shim::useVirtualClock(SIM_FROM);
+  srand(29);
+
+  SPIFFS.begin(true);
+  relayController.begin();
+  pumpGuard.begin();
+  growthManager = new GrowthManager(preferences);
+  growthManager->begin();
+  CHECK(growthManager->startGrowthCycle("tomatoes", CYCLE_START));
+  GrowthProfile profile;
+  CHECK(growthManager->getProfile("tomatoes", profile));
+
+  // Relay pin edges as the hardware sees them
+  std::vector<Transition> observed;
+  uint32_t lastOut = GPIO.out;
+  shim::setGpioListener([&](uint32_t out) {
+    const uint8_t relays[] = {RELAY_PUMP, RELAY_LIGHTS};
+    for (uint8_t relay : relays) {
+      uint32_t bit = 1u << relayController.getPin(relay);
+      if ((out ^ lastOut) & bit) {
+        observed.push_back(Transition{ControlScheduler::wallMillis(), relay, (out & bit) != 0});
+      }
+    }
+    lastOut = out;
+  });
+
+  scheduler.begin();
+  scheduler.scheduleIn(EVENT_SENSOR_SAMPLE, 0);
+  int64_t nextCommand = ControlScheduler::nowMillis() + rand() % 1800000;
+  uint32_t commands = 0;
+  uint32_t wakeups = 0;
+
+  while (time(nullptr) < SIM_UNTIL) {
+    // A command from the web server or MQTT marks the cycle dirty
+    if (ControlScheduler::nowMillis() >= nextCommand) {
+      cycleScheduleDirty = true;
+      commands++;
+      nextCommand = ControlScheduler::nowMillis() + rand() % 1800000;
+    }
+
+    ControlEvent event;
+    int64_t now = ControlScheduler::nowMillis();
+    while (scheduler.popDue(now, event)) {
+      handleEvent(event);
+    }
+    if (cycleScheduleDirty) {
+      cycleScheduleDirty = false;
+      updateRelaysBasedOnCycle();
+      scheduleCycleEvents();
+      armPumpDeadline();
+    }
+
+    // Commands arrive by notification, before the next deadline
+    if (nextCommand < scheduler.nextDeadline()) {
+      scheduler.schedule(EVENT_NETWORK, nextCommand);
+    }
+    scheduler.wait(MAX_SLEEP_MS);
+    scheduler.cancel(EVENT_NETWORK);
+    wakeups++;
+
+    // The task runs late by up to MAX_WAKE_LATENCY_US; the pump guard's
+    // timer fires on time meanwhile
+    shim::advance(rand() % MAX_WAKE_LATENCY_US);
+  }
+
+  // The timeline the simulator expects, as transitions from all relays off
+  std::vector<Transition> expected;
+  bool states[RELAY_COUNT] = {};
+  SimulationResult result =
+      CycleSimulator::run(profile, CYCLE_START, SIM_FROM, SIM_UNTIL, NAN, [&](const CycleEvent& event) {
+        if (event.type != CYCLE_EVENT_PUMP && event.type != CYCLE_EVENT_LIGHTS) {
+          return;
+        }
+        uint8_t relay = event.type == CYCLE_EVENT_PUMP ? RELAY_PUMP : RELAY_LIGHTS;
+        if (states[relay] != (event.value != 0)) {
+          states[relay] = event.value != 0;
+          expected.push_back(Transition{(int64_t)event.time * 1000, relay, states[relay]});
+        }
+      });
+  CHECK(!result.truncated);
+  CHECK(result.waterings > 100);
+
+  // Match relay by relay, in order
+  int64_t maxJitterMs = 0;
+  size_t matched = 0;
+  for (uint8_t relay : {RELAY_PUMP, RELAY_LIGHTS}) {
+    std::vector<Transition> want, got;
+    for (const Transition& t : expected) {
+      if (t.relay == relay && t.wallMs < (int64_t)SIM_UNTIL * 1000 - 1000) want.push_back(t);
+    }
+    for (const Transition& t : observed) {
+      if (t.relay == relay && t.wallMs < (int64_t)SIM_UNTIL * 1000 - 1000) got.push_back(t);
+    }
+    CHECK_EQ(got.size(), want.size());
+    for (size_t i = 0; i < want.size() && i < got.size(); i++) {
+      CHECK_EQ(got[i].on, want[i].on);
+      int64_t jitter = got[i].wallMs - want[i].wallMs;
+      if (jitter < -1000 || jitter > 1000) {
+        printf("relay %u transition %zu to %s: %+lld ms\n", relay, i, want[i].on ? "on" : "off", (long long)jitter);
+      }
+      CHECK(jitter >= -1000 && jitter <= 1000);
+      maxJitterMs = std::max(maxJitterMs, jitter < 0 ? -jitter : jitter);
+      matched++;
+    }
+  }
+
+  PumpShutoffStats stats = pumpGuard.getStats();
+  printf("%zu transitions over 7 days, %u wakeups, %u commands, max jitter %lld ms, "
+         "pump stops: %u by timer, %u by loop\n",
+         matched, wakeups, commands, (long long)maxJitterMs, stats.timerStops, stats.loopStops);
+  CHECK(matched > 200);
+  CHECK_EQ(stats.loopStops, 0);
+  return testResult("test_control_scheduler");
+}
@@ -0,0 +1,163 @@
+// Checks GrowthManager's compiled plan against a naive per-minute
+// computation over full growth cycles: the stage, its boundaries, the
+// light window and the next light transition, and that the plan is only
+// recompiled at stage boundaries and light transitions.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <Preferences.h>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "GrowthManager.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+const time_t CYCLE_START = 1709251200 + 13 * 3600 + 42 * 60;  // 2024-03-01 13:42 UTC
+
+// Stage index and its [start, end) from a linear scan of the durations;
+// end is 0 for the open-ended last stage
+int naiveStage(const GrowthProfile& profile, time_t cycleStart, time_t now, time_t& start, time_t& end) {
+  time_t boundary = cycleStart;
+  for (int i = 0; i < profile.stageCount; i++) {
+    time_t next = boundary + (time_t)profile.stages[i].duration * SECONDS_PER_DAY;
+    if (now < next || i == profile.stageCount - 1) {
+      start = boundary;
+      end = i == profile.stageCount - 1 ? 0 : next;
+      return i;
+    }
+    boundary = next;
+  }
+  return -1;
+}
+
+// Whether the lights are on, from the hour of day alone
+bool naiveLights(const GrowthStage& stage, time_t now) {
+  int hours = constrain(stage.lightHours, 0, 24);
+  long secondOfDay = (long)(now % SECONDS_PER_DAY);  // TZ=UTC
+  long on = stage.lightStartHour * 3600L;
+  long off = on + hours * 3600L;
+  if (off <= SECONDS_PER_DAY) {
+    return secondOfDay >= on && secondOfDay < off;
+  }
+  return secondOfDay >= on || secondOfDay < off - SECONDS_PER_DAY;
+}
+
+void setStage(GrowthStage& stage, const char* name, int days, int lightHours, int lightStartHour) {
+  memset(&stage, 0, sizeof(stage));
+  strlcpy(stage.name, name, sizeof(stage.name));
+  stage.duration = days;
+  stage.waterDuration = 5;
+  stage.waterInterval = 60;
+  stage.lightHours = lightHours;
+  stage.lightStartHour = lightStartHour;
+  stage.phMin = 5.5f;
+  stage.phMax = 6.5f;
+}
+
+// Walk a cycle minute by minute and compare every plan field the control
+// loop uses with the naive computation
+void checkCycle(GrowthManager& growth, const char* profileId) {
+  GrowthProfile profile;
+  CHECK(growth.getProfile(profileId, profile));
+  CHECK(growth.startGrowthCycle(profileId, CYCLE_START));
+
+  time_t until = CYCLE_START + (time_t)(profile.totalDuration() + 2) * SECONDS_PER_DAY;
+  uint32_t minutes = 0;
+  uint32_t mismatches = 0;
+  uint32_t compiles = 0;
+  time_t validFrom = -1;
+  time_t validUntil = -1;
+
+  for (time_t now = CYCLE_START; now < until; now += 60, minutes++) {
+    const GrowthPlan& plan = growth.getPlan(now);
+    if (plan.validFrom != validFrom || plan.validUntil != validUntil) {
+      compiles++;
+      validFrom = plan.validFrom;
+      validUntil = plan.validUntil;
+    }
+
+    time_t stageStart = -1;
+    time_t stageEnd = -1;
+    int stage = naiveStage(profile, CYCLE_START, now, stageStart, stageEnd);
+    CHECK(stage >= 0);
+    if (stage < 0) {
+      return;
+    }
+    bool lights = naiveLights(profile.stages[stage], now);
+    bool ok = plan.valid && plan.stageIndex == stage && plan.stageStart == stageStart &&
+              plan.stageEnd == stageEnd && strcmp(plan.stageName, profile.stages[stage].name) == 0 &&
+              plan.lightsOnAt(now) == lights && plan.validFrom <= now && now < plan.validUntil;
+
+    // The next transition, found by stepping forward a minute at a time
+    // from every 37th minute
+    if (ok && minutes % 37 == 0) {
+      time_t transition = plan.nextLightTransition(now);
+      time_t scan = now + 60;
+      while (scan < now + 2 * SECONDS_PER_DAY && naiveLights(plan.stage, scan) == lights) {
+        scan += 60;
+      }
+      bool constant = plan.stage.lightHours <= 0 || plan.stage.lightHours >= 24;
+      ok = constant ? transition > now : transition == scan;
+    }
+
+    if (!ok) {
+      if (mismatches < 5) {
+        printf("%s: mismatch at minute %u: stage %d/%d, lights %d/%d\n", profileId, minutes, plan.stageIndex,
+               stage, plan.lightsOnAt(now), lights);
+      }
+      mismatches++;
+    }
+  }
+
+  // Two light transitions a day plus the stage boundaries, nothing more
+  uint32_t days = profile.totalDuration() + 2;
+  printf("%s: %u minutes, %u plan compiles\n", profileId, minutes, compiles);
+  CHECK_EQ(mismatches, 0);
+  CHECK(compiles <= 2 * days + profile.stageCount + 1);
+}
+
+}  // namespace
+
+int main() {
+  shim::useVirtualClock(CYCLE_START);
+  SPIFFS.begin(true);
+  Preferences preferences;
+  GrowthManager growth(preferences);
+  growth.begin();
+
+  // The built-in profiles
+  checkCycle(growth, "tomatoes");
+  checkCycle(growth, "peppers");
+  checkCycle(growth, "lettuce");
+
+  // Every stage slot in use, light windows across midnight, always on and
+  // always off
+  GrowthProfile profile;
+  memset(&profile, 0, sizeof(profile));
+  strlcpy(profile.id, "edge", sizeof(profile.id));
+  strlcpy(profile.name, "Edge cases", sizeof(profile.name));
+  profile.stageCount = MAX_GROWTH_STAGES;
+  setStage(profile.stages[0], "Germination", 3, 0, 6);
+  setStage(profile.stages[1], "Clone", 1, 24, 0);
+  setStage(profile.stages[2], "Night", 5, 10, 20);
+  setStage(profile.stages[3], "Late", 2, 6, 23);
+  setStage(profile.stages[4], "Veg", 9, 18, 4);
+  setStage(profile.stages[5], "Preflower", 1, 12, 12);
+  setStage(profile.stages[6], "Flower", 11, 12, 0);
+  setStage(profile.stages[7], "Flush", 4, 8, 16);
+  CHECK(growth.addProfile(&profile));
+  checkCycle(growth, "edge");
+
+  // A single open-ended stage
+  memset(&profile, 0, sizeof(profile));
+  strlcpy(profile.id, "single", sizeof(profile.id));
+  profile.stageCount = 1;
+  setStage(profile.stages[0], "Always", 5, 16, 5);
+  CHECK(growth.addProfile(&profile));
+  checkCycle(growth, "single");
+
+  return testResult("test_growth_plan");
+}
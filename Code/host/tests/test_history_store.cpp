@@ -0,0 +1,312 @@
+// HistoryStore on SPIFFS: the ring file is sized to the flash left next to
+// the web UI and the files created after it, the history survives a reboot,
+// and queries downsample a week of readings to the same points as a plain
+// Largest-Triangle-Three-Buckets over the records. The JSON comes out the
+// same whatever the chunk size. Prints the query rate over a week.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "HistoryStore.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+const uint32_t START = 1709251200;  // 2024-03-01 00:00 UTC
+const size_t WEB_UI_BYTES = 86 * 1024;
+const uint32_t WEEK = HISTORY_CAPACITY;
+
+void writeFile(const char* path, size_t size) {
+  File file = SPIFFS.open(path, FILE_WRITE);
+  std::vector<uint8_t> data(size, 'x');
+  CHECK_EQ(file.write(data.data(), data.size()), size);
+  file.close();
+}
+
+size_t fileSize(const char* path) {
+  File file = SPIFFS.open(path, FILE_READ);
+  size_t size = file ? file.size() : 0;
+  file.close();
+  return size;
+}
+
+// Readings of minute i: pH swinging with the lights and stepping down on
+// doses, TDS creeping up as water is used, a drifting temperature and a
+// level that drops between refills. The level sensor drops out now and then.
+void readings(uint32_t i, float values[METRIC_COUNT]) {
+  float day = (i % 1440) / 1440.0f;
+  values[METRIC_LIQUID_LEVEL] = (i % 2880) % 997 == 500 ? NAN : 90.0f - (i % 2880) * 0.02f;
+  values[METRIC_PH] = 6.0f + 0.2f * sinf(2 * (float)M_PI * day) - 0.15f * ((i / 180) % 3 == 0) + (esp_random() % 21) / 1000.0f;
+  values[METRIC_TDS] = 800.0f + (i % 2880) * 0.05f + esp_random() % 5;
+  values[METRIC_TEMPERATURE] = 21.0f + 1.5f * sinf(2 * (float)M_PI * (day - 0.3f)) + (esp_random() % 11) / 100.0f;
+}
+
+// One reading per minute from minute first up to, not including, last.
+// A record is stored when the next interval begins.
+void fill(HistoryStore& store, uint32_t first, uint32_t last, std::vector<HistoryRecord>* stored) {
+  float values[METRIC_COUNT];
+  for (uint32_t i = first; i < last; i++) {
+    readings(i, values);
+    store.add(values, START + i * HISTORY_INTERVAL_S);
+    if (stored) {
+      HistoryRecord record;
+      record.time = START + i * HISTORY_INTERVAL_S;
+      for (int m = 0; m < METRIC_COUNT; m++) {
+        record.values[m] = isnan(values[m]) ? HISTORY_NO_VALUE : (int16_t)roundf(values[m] * HISTORY_SCALE[m]);
+      }
+      stored->push_back(record);
+    }
+  }
+}
+
+// Plain LTTB over gap-free records, with the store's bucket boundaries and
+// float arithmetic: times relative to the first record, buckets of the
+// inner records, the next bucket's average as the third vertex and the
+// last record after the last bucket
+std::vector<HistoryPoint> referenceLttb(const std::vector<HistoryRecord>& records, int metric, uint32_t maxPoints) {
+  std::vector<HistoryPoint> out;
+  if (records.size() <= maxPoints) {
+    for (const HistoryRecord& record : records) {
+      out.push_back({record.time, record.values[metric]});
+    }
+    return out;
+  }
+  float scale = HISTORY_SCALE[metric];
+  uint32_t buckets = maxPoints - 2;
+  uint32_t inner = records.size() - 2;
+  uint32_t base = records.front().time;
+  std::vector<float> averageT(buckets, 0);
+  std::vector<float> averageY(buckets, 0);
+  std::vector<uint32_t> counts(buckets, 0);
+  for (uint32_t k = 1; k <= inner; k++) {
+    uint32_t b = (uint64_t)(k - 1) * buckets / inner;
+    averageT[b] += (float)(records[k].time - base);
+    averageY[b] += records[k].values[metric] / scale;
+    counts[b]++;
+  }
+  for (uint32_t b = 0; b < buckets; b++) {
+    averageT[b] /= counts[b];
+    averageY[b] /= counts[b];
+  }
+
+  out.push_back({records.front().time, records.front().values[metric]});
+  float aT = 0;
+  float aY = records.front().values[metric] / scale;
+  uint32_t k = 1;
+  for (uint32_t b = 0; b < buckets; b++) {
+    float cT = b + 1 < buckets ? averageT[b + 1] : (float)(records.back().time - base);
+    float cY = b + 1 < buckets ? averageY[b + 1] : records.back().values[metric] / scale;
+    float bestArea = -1;
+    uint32_t best = k;
+    for (; k <= inner && (uint64_t)(k - 1) * buckets / inner == b; k++) {
+      float t = (float)(records[k].time - base);
+      float y = records[k].values[metric] / scale;
+      float area = fabsf((aT - cT) * (y - aY) - (aT - t) * (cY - aY));
+      if (area > bestArea) {
+        bestArea = area;
+        best = k;
+      }
+    }
+    out.push_back({records[best].time, records[best].values[metric]});
+    aT = (float)(records[best].time - base);
+    aY = records[best].values[metric] / scale;
+  }
+  out.push_back({records.back().time, records.back().values[metric]});
+  return out;
+}
+
+bool samePoints(const HistoryQuery& query, const std::vector<HistoryPoint>& expected) {
+  if (query.size() != expected.size()) {
+    printf("  %u points, reference %u\n", query.size(), (unsigned)expected.size());
+    return false;
+  }
+  for (uint16_t i = 0; i < query.size(); i++) {
+    if (query.point(i).time != expected[i].time || query.point(i).value != expected[i].value) {
+      printf("  point %u is %u, reference %u\n", i, query.point(i).time, expected[i].time);
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string json(HistoryQuery& query, size_t chunk) {
+  std::string text;
+  std::vector<char> buffer(chunk);
+  size_t length;
+  while ((length = query.write(buffer.data(), buffer.size())) > 0) {
+    CHECK(length <= chunk);
+    text.append(buffer.data(), length);
+  }
+  return text;
+}
+
+}  // namespace
+
+int main() {
+  SPIFFS.begin(true);
+
+  // Next to the web UI on the 128 KB partition of min_spiffs.csv there is
+  // room for under three hours, and the reserve stays free for the spool
+  // and the catalog
+  {
+    writeFile("/index.html", WEB_UI_BYTES);
+    HistoryStore store;
+    store.begin();
+    size_t size = fileSize(HISTORY_FILE_PATH);
+    uint32_t capacity = (size - 12) / sizeof(HistoryRecord);
+    printf("128 KB partition: history file holds %u records\n", capacity);
+    CHECK(capacity >= HISTORY_MIN_CAPACITY && capacity < 4 * 60);
+    CHECK(SPIFFS.totalBytes() - SPIFFS.usedBytes() >= HISTORY_FLASH_RESERVE);
+
+    // The ring keeps the newest flushed records across a reboot; what was
+    // still in RAM is lost
+    std::vector<HistoryRecord> stored;
+    fill(store, 0, 600, &stored);
+    uint32_t flushed = 599 - 599 % HISTORY_FLUSH_RECORDS;
+    HistoryStore rebooted;
+    rebooted.begin();
+    CHECK_EQ(fileSize(HISTORY_FILE_PATH), size);
+    CHECK_EQ(rebooted.size(), capacity);
+    HistoryQuery query(HISTORY_MAX_POINTS);
+    CHECK(rebooted.query(METRIC_TDS, 0, UINT32_MAX, query));
+    CHECK_EQ(query.records(), capacity);
+    bool intact = query.size() == capacity;
+    for (uint16_t i = 0; intact && i < query.size(); i++) {
+      const HistoryRecord& expected = stored[flushed - capacity + i];
+      intact = query.point(i).time == expected.time && query.point(i).value == expected.values[METRIC_TDS];
+    }
+    CHECK(intact);
+  }
+
+  // Without room for an hour the history stays in RAM
+  shim::resetFlash(0x20000);
+  {
+    writeFile("/index.html", 0x20000 - HISTORY_FLASH_RESERVE - 30 * sizeof(HistoryRecord));
+    HistoryStore store;
+    store.begin();
+    CHECK_EQ(fileSize(HISTORY_FILE_PATH), 0);
+    fill(store, 0, 100, nullptr);
+    CHECK_EQ(store.size(), HISTORY_RAM_CAPACITY);
+    HistoryQuery query(HISTORY_MAX_POINTS);
+    CHECK(store.query(METRIC_PH, 0, UINT32_MAX, query));
+    CHECK_EQ(query.size(), HISTORY_RAM_CAPACITY);
+    CHECK_EQ(query.point(HISTORY_RAM_CAPACITY - 1).time, START + 98 * HISTORY_INTERVAL_S);
+  }
+
+  // On a larger file system, e.g. a custom partition table with 2 MB of
+  // SPIFFS, a week fits. A file of an earlier layout is replaced.
+  shim::resetFlash(0x200000);
+  writeFile("/index.html", WEB_UI_BYTES);
+  {
+    File file = SPIFFS.open(HISTORY_FILE_PATH, FILE_WRITE);
+    const uint32_t header[2] = {0x48535431, 100 << 16};  // "HST1", 100 records
+    file.write((const uint8_t*)header, sizeof(header));
+    HistoryRecord record;
+    memset(&record, 0, sizeof(record));
+    for (int i = 0; i < 100; i++) {
+      file.write((const uint8_t*)&record, sizeof(record));
+    }
+    file.close();
+  }
+  std::vector<HistoryRecord> week;
+  {
+    HistoryStore store;
+    store.begin();
+    CHECK_EQ(fileSize(HISTORY_FILE_PATH), 12 + WEEK * sizeof(HistoryRecord));
+    CHECK_EQ(store.size(), 0);
+    std::vector<HistoryRecord> all;
+    fill(store, 0, WEEK + 200, &all);
+    uint32_t finished = WEEK + 199;
+    uint32_t flushed = finished - finished % HISTORY_FLUSH_RECORDS;
+    week.assign(all.begin() + flushed - WEEK, all.begin() + flushed);
+  }
+  HistoryStore store;
+  store.begin();
+  CHECK_EQ(store.size(), WEEK);
+
+  // Every metric and budget picks the reference's points; the level's
+  // dropouts are skipped instead
+  {
+    std::vector<uint32_t> budgets = {3, 10, 300, 800, HISTORY_MAX_POINTS};
+    bool same = true;
+    for (int metric = METRIC_PH; metric < METRIC_COUNT; metric++) {
+      for (uint32_t budget : budgets) {
+        HistoryQuery query(budget);
+        CHECK(store.query((TelemetryMetric)metric, 0, UINT32_MAX, query));
+        CHECK_EQ(query.records(), WEEK);
+        same = same && samePoints(query, referenceLttb(week, metric, budget));
+      }
+    }
+    CHECK(same);
+
+    HistoryQuery level(800);
+    CHECK(store.query(METRIC_LIQUID_LEVEL, 0, UINT32_MAX, level));
+    CHECK(level.size() <= 800 && level.size() > 700);
+    bool increasing = true;
+    for (uint16_t i = 0; i < level.size(); i++) {
+      increasing = increasing && level.point(i).value != HISTORY_NO_VALUE &&
+                   (i == 0 || level.point(i).time > level.point(i - 1).time);
+    }
+    CHECK(increasing);
+  }
+
+  // A range inside the week is cut at record boundaries
+  {
+    uint32_t from = week[1000].time + 1;
+    uint32_t to = week[1500].time;
+    HistoryQuery query(HISTORY_MAX_POINTS);
+    CHECK(store.query(METRIC_TDS, from, to, query));
+    CHECK_EQ(query.records(), 500);
+    CHECK_EQ(query.point(0).time, week[1001].time);
+    CHECK_EQ(query.point(query.size() - 1).time, to);
+  }
+
+  // The JSON is the same whatever the chunk size, down to one point per chunk
+  {
+    HistoryQuery whole(300);
+    CHECK(store.query(METRIC_PH, 0, UINT32_MAX, whole));
+    std::string expected = json(whole, 65536);
+    CHECK(whole.done());
+    CHECK(expected.find("{\"metric\":\"ph_value\",\"interval_s\":60,\"records\":10080,\"data\":[[") == 0);
+    CHECK(expected.compare(expected.size() - 2, 2, "]}") == 0);
+    size_t pairs = 0;
+    for (char c : expected) {
+      pairs += c == '[';
+    }
+    CHECK_EQ(pairs, 1 + whole.size());
+    for (size_t chunk : {80, 97, 1436}) {
+      HistoryQuery query(300);
+      CHECK(store.query(METRIC_PH, 0, UINT32_MAX, query));
+      CHECK(json(query, chunk) == expected);
+    }
+    HistoryQuery small(300);
+    CHECK(store.query(METRIC_PH, 0, UINT32_MAX, small));
+    char tiny[8];
+    CHECK_EQ(small.write(tiny, sizeof(tiny)), 0);
+    CHECK(!small.done());
+  }
+
+  // Query rate over the week
+  {
+    for (uint32_t budget : {300u, 800u, (uint32_t)HISTORY_MAX_POINTS}) {
+      const int RUNS = 20;
+      HistoryQuery query(budget);
+      auto started = std::chrono::steady_clock::now();
+      for (int run = 0; run < RUNS; run++) {
+        store.query(METRIC_PH, 0, UINT32_MAX, query);
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count() / RUNS;
+      printf("%u records to %u points: %.2f ms, %.1f M records/s, %.2f M points/s\n", WEEK, query.size(),
+             seconds * 1000, WEEK / seconds / 1e6, query.size() / seconds / 1e6);
+    }
+  }
+
+  return testResult("test_history_store");
+}
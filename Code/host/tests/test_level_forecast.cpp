@@ -0,0 +1,184 @@
+// LevelForecast against a brute-force weighted least-squares fit over every
+// sample it took, through a week of a draining reservoir with watering
+// cycles, probe noise and refills. Readings while the tower drains back are
+// left out, a refill starts the estimate over, and the time to the critical
+// level follows the consumption rate.
+#include <Arduino.h>
+#include <math.h>
+#include <vector>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "LevelForecast.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+const int64_t MINUTE_MS = 60000;
+const int64_t HOUR_MS = 60 * MINUTE_MS;
+
+struct Sample {
+  int64_t at;
+  float level;
+};
+
+// Slope in percent per hour and level at the newest sample, weighting each
+// sample by exp(-age / tau) and solving the normal equations directly
+bool referenceFit(const std::vector<Sample>& samples, double& slope, double& level) {
+  if (samples.size() < 3) {
+    return false;
+  }
+  int64_t newest = samples.back().at;
+  double s0 = 0, st = 0, stt = 0, sy = 0, sty = 0;
+  for (const Sample& sample : samples) {
+    double t = (sample.at - newest) / 3600000.0;
+    double w = exp(t / LEVEL_FORECAST_TAU_H);
+    s0 += w;
+    st += w * t;
+    stt += w * t * t;
+    sy += w * sample.level;
+    sty += w * t * sample.level;
+  }
+  double det = s0 * stt - st * st;
+  slope = (s0 * sty - st * sy) / det;
+  level = (sy - slope * st) / s0;
+  return true;
+}
+
+}  // namespace
+
+int main() {
+  const float CRITICAL = 20.0f;
+
+  // A week at 0.8 %/h with a pump run of 5 minutes every hour, which
+  // disturbs the level while the tower fills and drains back, and a refill
+  // to 90 % every two days. Checked against the reference at every sample
+  // the forecast takes.
+  {
+    LevelForecast forecast;
+    std::vector<Sample> taken;
+    float reservoir = 90.0f;
+    uint32_t mismatches = 0;
+    uint32_t validChecks = 0;
+    uint32_t pumpSamples = 0;
+    uint32_t refills = 0;
+    uint32_t starts = 0;
+    double worstSlope = 0;
+    for (int64_t now = HOUR_MS; now < 7 * 24 * HOUR_MS; now += 1000) {
+      if (now % (48 * HOUR_MS) == 0) {
+        reservoir = 90.0f;
+        refills++;
+      }
+      reservoir -= 0.8f / 3600;
+      bool pump = now % HOUR_MS < 5 * MINUTE_MS;
+      int64_t sincePump = now % HOUR_MS - 5 * MINUTE_MS;
+      float drawn = 0;
+      if (pump) {
+        drawn = 6.0f;
+      } else if (sincePump < (int64_t)LEVEL_SETTLE_MS) {
+        drawn = 6.0f * (1 - sincePump / (float)LEVEL_SETTLE_MS);
+      }
+      float reading = roundf(reservoir - drawn + (esp_random() % 3) - 1.0f);
+
+      uint32_t before = forecast.result().samples;
+      forecast.add(reading, pump, CRITICAL, now);
+      LevelForecastResult result = forecast.result();
+      if (result.samples == before) {
+        continue;
+      }
+      // The settle time runs from the last reading with the pump on
+      pumpSamples += pump || sincePump + 1000 < (int64_t)LEVEL_SETTLE_MS;
+      if (result.samples == 1) {
+        taken.clear();
+        starts++;
+      }
+      CHECK(taken.empty() || now - taken.back().at >= (int64_t)LEVEL_SAMPLE_INTERVAL_MS);
+      taken.push_back({now, reading});
+      CHECK_EQ(result.samples, taken.size());
+
+      bool spansEnough = now - taken.front().at >= LEVEL_MIN_SPAN_H * HOUR_MS;
+      double slope;
+      double level;
+      if (result.valid != (spansEnough && referenceFit(taken, slope, level))) {
+        mismatches++;
+        continue;
+      }
+      if (!result.valid) {
+        continue;
+      }
+      validChecks++;
+      double error = fabs(-result.ratePerHour - slope);
+      worstSlope = error > worstSlope ? error : worstSlope;
+      mismatches += error > 1e-4 || fabs(result.level - level) > 1e-3;
+      if (slope < 0) {
+        double hours = level > CRITICAL ? (level - CRITICAL) / -slope : 0;
+        mismatches += fabs(result.hoursToCritical - hours) > 1e-3 * hours + 1e-3;
+      } else {
+        mismatches += !isnan(result.hoursToCritical);
+      }
+    }
+    printf("%u forecasts checked, worst rate error %.2g %%/h, %u refills\n", validChecks, worstSlope, refills);
+    CHECK_EQ(mismatches, 0);
+    CHECK(validChecks > 1000);
+    CHECK_EQ(pumpSamples, 0);
+    CHECK_EQ(starts, refills + 1);
+
+    // Noise and watering aside, the rate is the real consumption
+    LevelForecastResult result = forecast.result();
+    CHECK(result.valid);
+    CHECK_NEAR(result.ratePerHour, 0.8, 0.05);
+  }
+
+  // A refill starts over: nothing is reported until the new history spans
+  // LEVEL_MIN_SPAN_H, and the old rate does not linger
+  {
+    LevelForecast forecast;
+    int64_t now = HOUR_MS;
+    for (int i = 0; i < 360; i++, now += LEVEL_SAMPLE_INTERVAL_MS) {
+      forecast.add(60.0f - 4.0f * i * LEVEL_SAMPLE_INTERVAL_MS / HOUR_MS, false, CRITICAL, now);
+    }
+    CHECK_NEAR(forecast.result().ratePerHour, 4.0, 1e-3);
+    CHECK_NEAR(forecast.result().hoursToCritical, (forecast.result().level - CRITICAL) / 4.0, 1e-3);
+
+    float start = 85.0f;
+    int64_t refilled = now;
+    for (int i = 0; now - refilled < LEVEL_MIN_SPAN_H * HOUR_MS; i++, now += LEVEL_SAMPLE_INTERVAL_MS) {
+      forecast.add(start - 1.0f * i * LEVEL_SAMPLE_INTERVAL_MS / HOUR_MS, false, CRITICAL, now);
+      CHECK(!forecast.result().valid);
+      CHECK_EQ(forecast.result().samples, (uint32_t)i + 1);
+    }
+    for (int i = 0; i < 60; i++, now += LEVEL_SAMPLE_INTERVAL_MS) {
+      forecast.add(start - 1.0f * (now - refilled) / HOUR_MS, false, CRITICAL, now);
+    }
+    CHECK(forecast.result().valid);
+    CHECK_NEAR(forecast.result().ratePerHour, 1.0, 1e-3);
+  }
+
+  // A level that is not dropping has no time to critical, nor has a
+  // reservoir without a calibrated critical level; one below it has none left
+  {
+    LevelForecast rising;
+    LevelForecast uncalibrated;
+    LevelForecast low;
+    for (int64_t now = HOUR_MS; now < 3 * HOUR_MS; now += LEVEL_SAMPLE_INTERVAL_MS) {
+      rising.add(50.0f + (now - HOUR_MS) / (float)HOUR_MS, false, CRITICAL, now);
+      uncalibrated.add(50.0f - (now - HOUR_MS) / (float)HOUR_MS, false, NAN, now);
+      low.add(15.0f - (now - HOUR_MS) / (float)HOUR_MS, false, CRITICAL, now);
+    }
+    CHECK(rising.result().valid && isnan(rising.result().hoursToCritical));
+    CHECK(rising.result().ratePerHour < 0);
+    CHECK(uncalibrated.result().valid && isnan(uncalibrated.result().hoursToCritical));
+    CHECK_EQ(low.result().hoursToCritical, 0);
+  }
+
+  // Unreadable levels are skipped
+  {
+    LevelForecast forecast;
+    forecast.add(NAN, false, CRITICAL, HOUR_MS);
+    CHECK_EQ(forecast.result().samples, 0);
+  }
+
+  return testResult("test_level_forecast");
+}
@@ -0,0 +1,232 @@
+// 24 hour heap soak of the MQTT path. Telemetry, relay states, cycle state,
+// usage, statistics, forecasts and alerts are published on the control
+// loop's schedule while relay commands come in and the broker restarts
+// every six hours. After two hours of warm-up, firmware code on the control
+// and MQTT tasks must not allocate at all.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "MQTTManager.h"
+
+LogBuffer hydroLog;
+
+// Heap calls made by firmware code. Everything the shim does on the
+// firmware's behalf is excluded, see shim::ShimScope.
+static std::atomic<uint64_t> firmwareAllocations(0);
+static std::atomic<uint64_t> firmwareBytes(0);
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void __libc_free(void* pointer);
+
+void* malloc(size_t size) {
+  if (shim::firmwareCode()) {
+    firmwareAllocations++;
+    firmwareBytes += size;
+  }
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  if (shim::firmwareCode()) {
+    firmwareAllocations++;
+    firmwareBytes += count * size;
+  }
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+  if (shim::firmwareCode()) {
+    firmwareAllocations++;
+    firmwareBytes += size;
+  }
+  return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer) {
+  __libc_free(pointer);
+}
+}
+
+namespace {
+
+const time_t SOAK_START = 1709251200;  // 2024-03-01 00:00 UTC
+const uint32_t WARMUP_S = 2 * 3600;
+const uint32_t SOAK_S = 24 * 3600;
+const uint32_t RESTART_EVERY_S = 6 * 3600;
+const uint32_t RESTART_DOWN_S = 90;
+
+std::atomic<uint32_t> commandsHandled(0);
+
+void onRelayCommand(const char*, unsigned int, void*) {
+  commandsHandled++;
+}
+
+// Give the MQTT task real time to catch up with the virtual clock: wait
+// until the broker has taken everything the control task queued. Returns
+// the broker's count, which also includes what the task sent on its own.
+uint64_t drain(uint64_t target) {
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+  for (int spins = 0; broker.stats().received < target && spins < 2000; spins++) {
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  uint64_t received = broker.stats().received;
+  return received > target ? received : target;
+}
+
+struct Soak {
+  MQTTManager& mqtt;
+  std::shared_ptr<shim::MqttSession> commander;
+  uint64_t queued = 0;
+  uint32_t restarts = 0;
+  bool pumpOn = false;
+  float ph = 6.0f;
+
+  explicit Soak(MQTTManager& manager) : mqtt(manager) {}
+
+  void count(bool published) {
+    queued += published ? 1 : 0;
+  }
+
+  // One second of the control loop at second t of the run
+  void second(uint32_t t) {
+    shim::MqttBroker& broker = shim::MqttBroker::instance();
+    uint32_t sentBefore = mqtt.sentCount();
+    uint32_t statesBefore = mqtt.statesPublished();
+
+    // Broker restarts; the commander reconnects with it
+    uint32_t phase = t % RESTART_EVERY_S;
+    if (phase == RESTART_EVERY_S - RESTART_DOWN_S) {
+      broker.stop();
+      restarts++;
+    } else if (phase == 0 && !broker.running()) {
+      broker.start();
+      commander = broker.connect("commander");
+    }
+
+    // Readings with noise inside the deadband and a slow pH drift
+    ph += (t % 600 < 300 ? 0.0005f : -0.0005f);
+    float values[METRIC_COUNT] = {60.0f - (t % 3600) / 360.0f, ph + (esp_random() % 5) / 1000.0f,
+                                  800.0f + esp_random() % 3, 21.5f};
+    mqtt.publishTelemetry(values);
+
+    // Pump five minutes every half hour, lights on a 16 hour day
+    bool pump = t % 1800 < 300;
+    if (pump != pumpOn) {
+      pumpOn = pump;
+      mqtt.publishRelayState(RELAY_PUMP, pump);
+    }
+    mqtt.publishRelayState(RELAY_LIGHTS, (t / 3600) % 24 < 16);
+    queued += (mqtt.sentCount() - sentBefore) + (mqtt.statesPublished() - statesBefore);
+
+    // Periodic publishes at different offsets, as the control loop's
+    // events rarely coincide
+    if (t % 60 == 0) {
+      // The countdowns change every minute, so this always goes out
+      count(mqtt.connected());
+      mqtt.publishCycleState(t % 7200 < 3600 ? "Vegetative" : "Flowering", SOAK_START + t + 1800,
+                             SOAK_START + t + 3600);
+    }
+    if (t % 60 == 20) {
+      for (int i = 0; i < METRIC_COUNT; i++) {
+        MetricStats stats = {t, 0, values[i], 0.01f, values[i], values[i], 0.005f, 0.3f, 0};
+        count(mqtt.publishSensorStats((TelemetryMetric)i, stats));
+      }
+    }
+    if (t % 600 == 40) {
+      LevelForecastResult forecast = {true, values[METRIC_LIQUID_LEVEL], 2.5f, 14.2f, t};
+      count(mqtt.publishLevelForecast(forecast));
+      RelayUsage usage = {(uint64_t)t * 250, t / 1800, 300000};
+      count(mqtt.publishRelayUsage(RELAY_PUMP, usage, 24));
+    }
+    if (t % 3600 == 1800) {
+      count(mqtt.publishAlert("pH out of range"));
+    }
+
+    // A relay command from Home Assistant every ten minutes
+    if (t % 600 == 300 && broker.running() && commander) {
+      broker.publish(commander, mqtt.getRelayCommandTopic(RELAY_LIGHTS), (const uint8_t*)"ON", 2, false);
+    }
+
+    bool replaying = mqtt.serviceSpool();
+    shim::advance(1000000);
+
+    // Spool replay and reconnects queue messages of their own, so only
+    // wait while the count is exact
+    if (mqtt.connected() && !replaying) {
+      queued = drain(queued);
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      queued = broker.stats().received;
+    }
+  }
+};
+
+}  // namespace
+
+int main() {
+  shim::useVirtualClock(SOAK_START);
+  shim::markFirmwareThread();
+  SPIFFS.begin(true);
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+
+  WiFiClient wifiClient;
+  SystemConfig config;
+  strlcpy(config.device_id, "soak", sizeof(config.device_id));
+  config.mqtt_enabled = true;
+  config.heartbeat_s = 300;
+  MQTTManager mqtt(wifiClient, config);
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    mqtt.onMessage(mqtt.getRelayCommandTopic(i), onRelayCommand);
+  }
+  mqtt.begin();
+
+  Soak soak(mqtt);
+  soak.commander = broker.connect("commander");
+
+  // Warm-up: first connect, discovery and one broker restart. The soak
+  // then starts an hour after it, so its last restart is an hour before
+  // the end.
+  const uint32_t SOAK_FROM = RESTART_EVERY_S + 3600;
+  for (uint32_t t = SOAK_FROM - WARMUP_S; t < SOAK_FROM; t++) {
+    soak.second(t);
+  }
+  CHECK(mqtt.connected());
+  uint32_t warmupRestarts = soak.restarts;
+  uint64_t warmupAllocations = firmwareAllocations;
+
+  firmwareAllocations = 0;
+  firmwareBytes = 0;
+  uint64_t receivedBefore = broker.stats().received;
+  uint32_t commandsBefore = commandsHandled;
+  uint32_t reconnectsBefore = mqtt.reconnectCount();
+
+  for (uint32_t t = SOAK_FROM; t < SOAK_FROM + SOAK_S; t++) {
+    soak.second(t);
+  }
+
+  uint64_t allocations = firmwareAllocations;
+  uint64_t bytes = firmwareBytes;
+  uint64_t messages = broker.stats().received - receivedBefore;
+  uint32_t commands = commandsHandled - commandsBefore;
+  printf("warm-up: %llu firmware allocations over %u restart(s)\n", (unsigned long long)warmupAllocations,
+         warmupRestarts);
+  printf("24 h: %llu messages, %u commands, %u reconnects, %u dropped, %llu firmware allocations (%llu bytes)\n",
+         (unsigned long long)messages, commands, mqtt.reconnectCount() - reconnectsBefore, mqtt.droppedCount(),
+         (unsigned long long)allocations, (unsigned long long)bytes);
+
+  CHECK_EQ(allocations, 0);
+  CHECK(messages > 1000);
+  CHECK(commands >= 100);
+  CHECK(mqtt.reconnectCount() - reconnectsBefore >= 4);
+  CHECK_EQ(mqtt.droppedCount(), 0);
+  return testResult("test_mqtt_allocations");
+}
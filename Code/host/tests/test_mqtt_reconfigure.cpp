@@ -0,0 +1,121 @@
+// Reconfigures the MQTT client between a short device ID and the longest
+// one whose topics fit while the control task keeps publishing. Every message must arrive on a
+// complete topic of one of the IDs, and relay commands must reach their
+// handler on the new ID's topic afterwards.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "MQTTManager.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+const char* const DEVICE_IDS[] = {"a", "greenhouse-tower-b-north-07"};
+
+std::atomic<uint32_t> commandsHandled(0);
+
+void onPumpCommand(const char*, unsigned int, void*) {
+  commandsHandled++;
+}
+
+bool waitFor(MQTTManager& mqtt, bool connected, uint32_t timeoutMs) {
+  uint32_t start = millis();
+  while (mqtt.connected() != connected) {
+    if (millis() - start > timeoutMs) {
+      return false;
+    }
+    delay(1);
+  }
+  return true;
+}
+
+}  // namespace
+
+int main() {
+  shim::markFirmwareThread();
+  CHECK(MQTTManager::deviceIdFits(DEVICE_IDS[1]));
+  CHECK(!MQTTManager::deviceIdFits("greenhouse-tower-b-north-07x"));
+
+  SPIFFS.begin(true);
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+  std::shared_ptr<shim::MqttSession> observer = broker.connect("observer");
+  broker.subscribe(observer, "hydroponics/#");
+
+  WiFiClient wifiClient;
+  SystemConfig config;
+  strlcpy(config.device_id, DEVICE_IDS[0], sizeof(config.device_id));
+  config.mqtt_enabled = true;
+  config.heartbeat_s = 0;
+  MQTTManager mqtt(wifiClient, config);
+  mqtt.onMessage(mqtt.getRelayCommandTopic(RELAY_PUMP), onPumpCommand);
+  mqtt.begin();
+  CHECK(waitFor(mqtt, true, 5000));
+
+  // Publish continuously while the device ID flips back and forth
+  float values[METRIC_COUNT] = {50, 6.0f, 500, 20};
+  const int RECONFIGURES = 41;
+  for (int round = 1; round <= RECONFIGURES; round++) {
+    strlcpy(config.device_id, DEVICE_IDS[round % 2], sizeof(config.device_id));
+    mqtt.reconfigure(config);
+    uint32_t until = millis() + 20;
+    while ((int32_t)(until - millis()) > 0) {
+      values[METRIC_PH] += 0.1f;
+      mqtt.publishTelemetry(values);
+      mqtt.publishRelayState(RELAY_LIGHTS, round % 2);
+      delay(1);
+    }
+  }
+  CHECK(waitFor(mqtt, true, 5000));
+
+  // Commands on the final, longest ID's topic reach the handler
+  const char* finalId = DEVICE_IDS[RECONFIGURES % 2];
+  char commandTopic[64];
+  snprintf(commandTopic, sizeof(commandTopic), "hydroponics/%s/pump_state/set", finalId);
+  CHECK(strcmp(mqtt.getRelayCommandTopic(RELAY_PUMP), commandTopic) == 0);
+  broker.publish(observer, commandTopic, (const uint8_t*)"ON", 2, false);
+  uint32_t start = millis();
+  while (commandsHandled == 0 && millis() - start < 2000) {
+    delay(1);
+  }
+  CHECK_EQ(commandsHandled, 1);
+
+  // Every topic seen is one of the two IDs' own topics
+  std::set<std::string> valid;
+  for (const char* id : DEVICE_IDS) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      valid.insert(std::string("hydroponics/") + id + "/" + METRIC_NAMES[i]);
+    }
+    for (int i = 0; i < RELAY_COUNT; i++) {
+      valid.insert(std::string("hydroponics/") + id + "/" + RELAY_TOPIC_NAMES[i]);
+      valid.insert(std::string("hydroponics/") + id + "/" + RELAY_TOPIC_NAMES[i] + "/set");
+    }
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      valid.insert(std::string("hydroponics/") + id + "/" + METRIC_NAMES[i] + "_stats");
+    }
+    valid.insert(std::string("hydroponics/") + id + "/availability");
+    valid.insert(std::string("hydroponics/") + id + "/backlog");
+  }
+  shim::MqttMessage message;
+  uint32_t received = 0;
+  uint32_t invalid = 0;
+  while (broker.receive(observer, message)) {
+    received++;
+    if (!valid.count(message.topic)) {
+      if (invalid++ < 5) {
+        printf("unexpected topic %s\n", message.topic.c_str());
+      }
+    }
+  }
+  printf("%u messages over %d reconfigures, %u reconnects\n", received, RECONFIGURES, mqtt.reconnectCount());
+  CHECK(received > 0);
+  CHECK_EQ(invalid, 0);
+  CHECK(mqtt.reconnectCount() >= 1);
+  return testResult("test_mqtt_reconfigure");
+}
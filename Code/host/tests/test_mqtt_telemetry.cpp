@@ -0,0 +1,96 @@
+// Telemetry deadband filter of MQTTManager: the first reading after boot
+// and after every connect goes out, changes inside the deadband are held
+// back and the heartbeat republishes unchanged values. The manager is
+// built on memory left over from an earlier one, as a heap allocation may be.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <new>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "MQTTManager.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+bool waitConnected(MQTTManager& mqtt) {
+  uint32_t start = millis();
+  while (!mqtt.connected() && millis() - start < 5000) {
+    delay(1);
+  }
+  return mqtt.connected();
+}
+
+// Let the MQTT task drain the outbox
+void settle() {
+  delay(100);
+}
+
+}  // namespace
+
+int main() {
+  SPIFFS.begin(true);
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+  broker.stop();
+
+  WiFiClient wifiClient;
+  SystemConfig config;
+  strlcpy(config.device_id, "t1", sizeof(config.device_id));
+  config.mqtt_enabled = true;
+  config.heartbeat_s = 0;
+
+  // An earlier manager leaves its filter state behind in the memory
+  alignas(MQTTManager) static uint8_t storage[sizeof(MQTTManager)];
+  float values[METRIC_COUNT] = {50, 6.0f, 500, 20};
+  new (storage) MQTTManager(wifiClient, config);
+  reinterpret_cast<MQTTManager*>(storage)->publishTelemetry(values);
+
+  MQTTManager& mqtt = *new (storage) MQTTManager(wifiClient, config);
+  mqtt.begin();
+
+  // Offline, the first reading passes the filter and is spooled
+  mqtt.publishTelemetry(values);
+  CHECK(!mqtt.connected());
+  CHECK_EQ(mqtt.spooledCount(), 1);
+
+  broker.start();
+  std::shared_ptr<shim::MqttSession> observer = broker.connect("observer");
+  broker.subscribe(observer, "hydroponics/t1/ph_value");
+  CHECK(waitConnected(mqtt));
+
+  // Everything goes out again after the connect
+  mqtt.publishTelemetry(values);
+  CHECK_EQ(mqtt.sentCount(), METRIC_COUNT);
+
+  // Inside the pH deadband of 0.05: held back
+  values[METRIC_PH] = 6.02f;
+  mqtt.publishTelemetry(values);
+  CHECK_EQ(mqtt.sentCount(), METRIC_COUNT);
+  CHECK_EQ(mqtt.suppressedCount(), METRIC_COUNT);
+
+  // Outside it: only pH goes out
+  values[METRIC_PH] = 6.2f;
+  mqtt.publishTelemetry(values);
+  CHECK_EQ(mqtt.sentCount(), METRIC_COUNT + 1);
+
+  // The heartbeat republishes unchanged values
+  config.heartbeat_s = 1;
+  delay(1100);
+  mqtt.publishTelemetry(values);
+  CHECK_EQ(mqtt.sentCount(), 2 * METRIC_COUNT + 1);
+
+  settle();
+  shim::MqttMessage message;
+  const char* expected[] = {"6.00", "6.20", "6.20"};
+  size_t received = 0;
+  while (broker.receive(observer, message)) {
+    if (received < 3) {
+      CHECK(message.payload == expected[received]);
+    }
+    received++;
+  }
+  CHECK_EQ(received, 3);
+  return testResult("test_mqtt_telemetry");
+}
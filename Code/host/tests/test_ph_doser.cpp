@@ -0,0 +1,237 @@
+// PHDoser against a simulated reservoir: a buffered nutrient solution whose
+// pH moves with the acid and base the relays actually let through, mixes in
+// over a minute and drifts up as plants take up nitrate. The doser must
+// bring a high reservoir into range without overshooting, hold it there,
+// deliver exactly the doses it reports, and stay under its hourly cap when
+// the reservoir does not respond.
+#include <Arduino.h>
+#include <Preferences.h>
+#include <math.h>
+#include <vector>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "PHDoser.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+// Stirred tank with a linear buffer around the operating point
+struct Reservoir {
+  float litres = 40;
+  float bufferMmolPerLitre = 0.5f;  // Acid or base per litre that moves the pH by one
+  float mmolPerMl = 1.0f;           // Strength of the pH up and down solutions
+  float mixSeconds = 60;            // Time constant of mixing a dose in
+  float driftPerHour = 0.02f;       // Nitrate uptake raises the pH
+  float noise = 0.02f;              // Probe noise, peak
+
+  float ph = 7.0f;
+  float unmixedMmol = 0;            // Base positive, acid negative
+
+  void step(float seconds, float upMl, float downMl) {
+    unmixedMmol += (upMl - downMl) * mmolPerMl;
+    float mixed = unmixedMmol * (1 - expf(-seconds / mixSeconds));
+    unmixedMmol -= mixed;
+    ph += mixed / (bufferMmolPerLitre * litres) + driftPerHour * seconds / 3600;
+  }
+
+  float probe() {
+    return ph + noise * ((esp_random() % 2001) / 1000.0f - 1);
+  }
+};
+
+struct Run {
+  std::vector<float> ph;            // Mixed pH, per second
+  std::vector<float> downMl;        // Delivered, per second
+  std::vector<float> upMl;
+  float reportedMl[DOSE_DIRECTION_COUNT] = {0, 0};
+  uint32_t capEpisodes = 0;
+  uint32_t samplesAbove = 0;        // Readings above the stage's range
+};
+
+float deliveredMl(RelayController& relays, uint8_t relay, const PHDosingConfig& config) {
+  relays.accrue();
+  RelayUsage usage[RELAY_COUNT];
+  relays.getUsage(usage);
+  return usage[relay].onMs * config.pumpMlPerS / 1000.0f;
+}
+
+// One sensor sample per second, as the control loop takes them
+Run simulate(PHDoser& doser, RelayController& relays, Reservoir& reservoir, const GrowthStage& stage,
+             const PHDosingConfig& config, uint32_t seconds) {
+  Run run;
+  float upBefore = deliveredMl(relays, RELAY_PH_UP, config);
+  float downBefore = deliveredMl(relays, RELAY_PH_DOWN, config);
+  for (uint32_t t = 0; t < seconds; t++) {
+    float reading = reservoir.probe();
+    run.samplesAbove += reading > stage.phMax;
+    DoseResult result = doser.update(reading, &stage, config, esp_timer_get_time() / 1000);
+    if (result == DOSE_STARTED) {
+      DoserStatus status = doser.getStatus();
+      bool up = relays.getState(RELAY_PH_UP);
+      run.reportedMl[up ? DOSE_UP : DOSE_DOWN] += status.lastDoseMl;
+    } else if (result == DOSE_CAP_REACHED) {
+      run.capEpisodes++;
+    }
+
+    // The pulse ends on its timer somewhere inside this second
+    shim::advance(1000000);
+    float up = deliveredMl(relays, RELAY_PH_UP, config);
+    float down = deliveredMl(relays, RELAY_PH_DOWN, config);
+    reservoir.step(1, up - upBefore, down - downBefore);
+    run.upMl.push_back(up - upBefore);
+    run.downMl.push_back(down - downBefore);
+    run.ph.push_back(reservoir.ph);
+    upBefore = up;
+    downBefore = down;
+  }
+  return run;
+}
+
+float total(const std::vector<float>& values) {
+  float sum = 0;
+  for (float value : values) {
+    sum += value;
+  }
+  return sum;
+}
+
+// Most delivered within any window of the given length
+float maxWindow(const std::vector<float>& perSecond, size_t window) {
+  float sum = 0;
+  float most = 0;
+  for (size_t i = 0; i < perSecond.size(); i++) {
+    sum += perSecond[i];
+    if (i >= window) {
+      sum -= perSecond[i - window];
+    }
+    most = sum > most ? sum : most;
+  }
+  return most;
+}
+
+GrowthStage growingStage() {
+  GrowthStage stage;
+  memset(&stage, 0, sizeof(stage));
+  strlcpy(stage.name, "Growing", sizeof(stage.name));
+  stage.duration = 35;
+  stage.phMin = 5.8f;
+  stage.phMax = 6.2f;
+  return stage;
+}
+
+}  // namespace
+
+int main() {
+  shim::useVirtualClock(1709251200);
+  Preferences preferences;
+  RelayUsageRecord usageRecord;
+  memset(&usageRecord, 0, sizeof(usageRecord));
+  RelayController relays(usageRecord);
+  relays.begin();
+  relays.loadUsage(preferences);
+
+  const GrowthStage stage = growingStage();
+  PHDosingConfig config = {true, 1.0f, 2.0f, 300, 20.0f};
+
+  // A reservoir topped up with hard water: pH 7.0 comes down into range
+  // with down doses only, then is held there against the drift. The range
+  // is the deadband, so it settles just inside the top of it.
+  {
+    PHDoser doser(relays);
+    doser.begin();
+    Reservoir reservoir;
+    Run run = simulate(doser, relays, reservoir, stage, config, 8 * 3600);
+
+    size_t inRange = 0;
+    while (inRange < run.ph.size() && run.ph[inRange] > stage.phMax) {
+      inRange++;
+    }
+    CHECK(inRange < 3 * 3600);
+    float lowest = stage.phMax;
+    float highest = stage.phMin;
+    for (size_t i = inRange; i < run.ph.size(); i++) {
+      lowest = fminf(lowest, run.ph[i]);
+      highest = fmaxf(highest, run.ph[i]);
+    }
+    printf("pH 7.00 in range after %u min, then %.2f to %.2f; %.1f ml down in %u doses\n",
+           (unsigned)(inRange / 60), lowest, highest, total(run.downMl), doser.getStatus().doses[DOSE_DOWN]);
+    CHECK(lowest >= stage.phMin);
+    CHECK(highest <= stage.phMax + 0.05f);
+    CHECK(run.ph.back() >= stage.phMin && run.ph.back() <= stage.phMax);
+    CHECK_EQ(doser.getStatus().doses[DOSE_UP], 0);
+
+    // The relays let through exactly what the doser reported, and never more
+    // than the cap within any hour
+    CHECK_NEAR(total(run.downMl), run.reportedMl[DOSE_DOWN], 0.01);
+    CHECK(maxWindow(run.downMl, 60 * 60) <= config.maxMlPerHour + 0.01f);
+  }
+
+  // Probe noise at the edge of the range is not dosed on
+  {
+    PHDoser doser(relays);
+    doser.begin();
+    Reservoir reservoir;
+    reservoir.ph = stage.phMax - 0.016f;
+    reservoir.driftPerHour = 0;
+    reservoir.noise = 0.02f;
+    Run run = simulate(doser, relays, reservoir, stage, config, 3600);
+    CHECK(run.samplesAbove > 200);
+    CHECK_EQ(doser.getStatus().doses[DOSE_DOWN] + doser.getStatus().doses[DOSE_UP], 0);
+  }
+
+  // A reservoir that barely responds, e.g. a clogged dosing line: the
+  // doser keeps to its hourly cap and reports reaching it once per episode
+  {
+    PHDoser doser(relays);
+    doser.begin();
+    Reservoir reservoir;
+    reservoir.ph = 5.0f;
+    reservoir.bufferMmolPerLitre = 50;
+    Run run = simulate(doser, relays, reservoir, stage, config, 3 * 3600);
+    float dosed = total(run.upMl);
+    printf("unresponsive reservoir: %.1f ml up over 3 h, at most %.1f ml in an hour, %u cap episodes\n", dosed,
+           maxWindow(run.upMl, 60 * 60), run.capEpisodes);
+    CHECK(maxWindow(run.upMl, 60 * 60) <= config.maxMlPerHour + 0.01f);
+    CHECK(dosed >= 2 * config.maxMlPerHour);
+    CHECK(dosed <= 3 * config.maxMlPerHour + 0.01f);
+    CHECK(run.capEpisodes >= 2);
+    CHECK_EQ(total(run.downMl), 0);
+    CHECK_NEAR(dosed, run.reportedMl[DOSE_UP], 0.01);
+  }
+
+  // Without a mixing pause small doses follow each other closely; once the
+  // last PH_DOSE_LOG_SIZE of them are all within the hour, dosing waits
+  {
+    PHDoser doser(relays);
+    doser.begin();
+    PHDosingConfig rapid = {true, 1.0f, 0.2f, 0, 20.0f};
+    Reservoir reservoir;
+    reservoir.ph = 5.0f;
+    reservoir.bufferMmolPerLitre = 50;
+    Run run = simulate(doser, relays, reservoir, stage, rapid, 2 * 3600);
+    std::vector<float> pulses;
+    for (float ml : run.upMl) {
+      pulses.push_back(ml > 0);
+    }
+    CHECK_EQ(maxWindow(pulses, 60 * 60), PH_DOSE_LOG_SIZE);
+    CHECK(maxWindow(run.upMl, 60 * 60) <= rapid.maxMlPerHour + 0.01f);
+    CHECK_NEAR(total(run.upMl), run.reportedMl[DOSE_UP], 0.01);
+  }
+
+  // Nothing is dosed into a reservoir below its critical level
+  {
+    PHDoser doser(relays);
+    doser.begin();
+    relays.setLiquidOk(false);
+    Reservoir reservoir;
+    Run run = simulate(doser, relays, reservoir, stage, config, 600);
+    CHECK_EQ(total(run.downMl), 0);
+    CHECK_EQ(doser.getStatus().state, DOSER_HELD);
+    relays.setLiquidOk(true);
+  }
+
+  return testResult("test_ph_doser");
+}
@@ -0,0 +1,170 @@
+// Profile catalog next to the web UI on the default SPIFFS partition: it
+// holds as many profiles as the free flash has room for, up to
+// CATALOG_MAX_CAPACITY on a larger one, refuses new ones once flash runs
+// short without leaving a broken record behind, and everything it accepted
+// reads back the same after a reboot.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <vector>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "ProfileCatalog.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+// The web UI's files, as on the device
+const size_t WEB_UI_BYTES = 86 * 1024;
+
+void writeFile(const char* path, size_t size) {
+  File file = SPIFFS.open(path, FILE_WRITE);
+  std::vector<uint8_t> data(size, 'x');
+  CHECK_EQ(file.write(data.data(), data.size()), size);
+  file.close();
+}
+
+GrowthProfile makeProfile(int n) {
+  GrowthProfile profile;
+  memset(&profile, 0, sizeof(profile));
+  snprintf(profile.id, sizeof(profile.id), "profile-%d", n);
+  snprintf(profile.name, sizeof(profile.name), "Profile %d", n);
+  profile.format = PROFILE_FORMAT;
+  profile.stageCount = 1 + n % MAX_GROWTH_STAGES;
+  for (int i = 0; i < profile.stageCount; i++) {
+    GrowthStage& stage = profile.stages[i];
+    snprintf(stage.name, sizeof(stage.name), "Stage %d", i);
+    stage.duration = 7 + n + i;
+    stage.waterDuration = 5;
+    stage.waterInterval = 60 + n;
+    stage.lightHours = 12 + i % 6;
+    stage.lightStartHour = 6;
+    stage.phMin = 5.5f;
+    stage.phMax = 6.5f;
+  }
+  profile.updateStageEnds();
+  return profile;
+}
+
+bool sameProfile(const GrowthProfile& a, const GrowthProfile& b) {
+  return strcmp(a.id, b.id) == 0 && strcmp(a.name, b.name) == 0 && a.stageCount == b.stageCount &&
+         memcmp(a.stages, b.stages, a.stageCount * sizeof(GrowthStage)) == 0 &&
+         a.totalDuration() == b.totalDuration();
+}
+
+// Every profile in [0, count) except the removed one reads back intact, and
+// nothing else is listed
+void checkContents(ProfileCatalog& catalog, int count, int removed) {
+  int expected = 0;
+  for (int n = 0; n < count; n++) {
+    GrowthProfile stored;
+    bool found = catalog.get(makeProfile(n).id, stored);
+    if (n == removed) {
+      CHECK(!found);
+      continue;
+    }
+    expected++;
+    if (!found || !sameProfile(stored, makeProfile(n))) {
+      printf("profile %d did not read back\n", n);
+      CHECK(false);
+    }
+  }
+  CHECK_EQ(catalog.count(), expected);
+  int listed = catalog.list(0, 1000, [&](const ProfileSummary& summary) {
+    CHECK_EQ(summary.format, PROFILE_FORMAT);
+    CHECK(summary.stageCount >= 1 && summary.stageCount <= MAX_GROWTH_STAGES);
+  });
+  CHECK_EQ(listed, expected);
+}
+
+}  // namespace
+
+int main() {
+  SPIFFS.begin(true);
+  writeFile("/index.html", WEB_UI_BYTES);
+
+  // The catalog fills the flash next to the web UI and leaves the reserve
+  // free
+  int capacity;
+  {
+    ProfileCatalog catalog;
+    CHECK(catalog.begin());
+    capacity = catalog.capacity();
+    CHECK(capacity > 32 && capacity < CATALOG_MAX_CAPACITY);
+    for (int n = 0; n < capacity; n++) {
+      CHECK(catalog.save(makeProfile(n)));
+    }
+    CHECK(!catalog.save(makeProfile(capacity)));
+    CHECK(SPIFFS.totalBytes() - SPIFFS.usedBytes() >= CATALOG_FLASH_RESERVE);
+    CHECK(SPIFFS.totalBytes() - SPIFFS.usedBytes() < CATALOG_FLASH_RESERVE + CATALOG_RECORD_SIZE);
+    printf("128 KB partition: %d profiles take %u bytes\n", capacity, (unsigned)(capacity * CATALOG_RECORD_SIZE));
+
+    // A freed slot is reused and overwrites stay in place
+    CHECK(catalog.remove(makeProfile(5).id));
+    GrowthProfile replacement = makeProfile(capacity);
+    CHECK(catalog.save(replacement));
+    CHECK(catalog.remove(replacement.id));
+    GrowthProfile renamed = makeProfile(7);
+    strlcpy(renamed.name, "Renamed", sizeof(renamed.name));
+    CHECK(catalog.save(renamed));
+    CHECK(catalog.save(makeProfile(7)));
+  }
+  {
+    ProfileCatalog rebooted;
+    CHECK(rebooted.begin());
+    CHECK_EQ(rebooted.capacity(), capacity);
+    checkContents(rebooted, capacity, 5);
+  }
+
+  // With flash nearly full, new profiles are refused before the file grows
+  // and the ones already stored are untouched
+  shim::resetFlash(0x20000);
+  const int ROOM = 3;
+  writeFile("/index.html", 0x20000 - CATALOG_FLASH_RESERVE - ROOM * CATALOG_RECORD_SIZE - CATALOG_RECORD_SIZE / 2);
+  {
+    ProfileCatalog catalog;
+    CHECK(catalog.begin());
+    int saved = 0;
+    while (saved < CATALOG_MAX_CAPACITY && catalog.save(makeProfile(saved))) {
+      saved++;
+    }
+    CHECK_EQ(saved, ROOM);
+    File file = SPIFFS.open(CATALOG_FILE_PATH, FILE_READ);
+    CHECK_EQ(file.size(), ROOM * CATALOG_RECORD_SIZE);
+    file.close();
+
+    // Overwrites need no new space
+    CHECK(catalog.save(makeProfile(1)));
+    CHECK(!catalog.save(makeProfile(ROOM)));
+    checkContents(catalog, ROOM, -1);
+  }
+  {
+    ProfileCatalog rebooted;
+    CHECK(rebooted.begin());
+    checkContents(rebooted, ROOM, -1);
+  }
+
+  // On a larger file system it holds hundreds
+  shim::resetFlash(0x200000);
+  writeFile("/index.html", WEB_UI_BYTES);
+  {
+    ProfileCatalog catalog;
+    CHECK(catalog.begin());
+    CHECK_EQ(catalog.capacity(), CATALOG_MAX_CAPACITY);
+    for (int n = 0; n < CATALOG_MAX_CAPACITY; n++) {
+      CHECK(catalog.save(makeProfile(n)));
+    }
+    CHECK(!catalog.save(makeProfile(CATALOG_MAX_CAPACITY)));
+    printf("2 MB partition: %d profiles take %u bytes\n", CATALOG_MAX_CAPACITY,
+           (unsigned)(CATALOG_MAX_CAPACITY * CATALOG_RECORD_SIZE));
+  }
+  {
+    ProfileCatalog rebooted;
+    CHECK(rebooted.begin());
+    checkContents(rebooted, CATALOG_MAX_CAPACITY, -1);
+  }
+
+  return testResult("test_profile_catalog");
+}
@@ -0,0 +1,248 @@
+// SensorStats against a brute-force reference: the rolling median and MAD
+// equal a sort of the window, the Welford mean and deviation a two-pass
+// computation, and every sensor condition is raised at the sample that
+// completes it. Statistics go out over MQTT as complete JSON or not at all.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "MQTTManager.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+float sortedMiddle(std::vector<float> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+// Index of the sample at which add() first reported the condition, -1 if never
+int raisedAt(SensorStats& stats, TelemetryMetric metric, const std::vector<float>& values, uint32_t& now,
+             uint8_t condition) {
+  int raised = -1;
+  for (size_t i = 0; i < values.size(); i++) {
+    now += 1000;
+    if ((stats.add(metric, values[i], now) & condition) && raised < 0) {
+      raised = i;
+    }
+  }
+  return raised;
+}
+
+// pH around 6 with probe noise, single-sample glitches and dropouts
+float noisyPh(uint32_t i) {
+  uint32_t r = esp_random();
+  if (r % 97 == 0) {
+    return NAN;
+  }
+  if (r % 89 == 0) {
+    return 9.0f;
+  }
+  return 6.0f + 0.1f * sinf(i / 500.0f) + ((r >> 8) % 1001) / 10000.0f - 0.05f;
+}
+
+bool waitConnected(MQTTManager& mqtt) {
+  uint32_t start = millis();
+  while (!mqtt.connected() && millis() - start < 5000) {
+    delay(1);
+  }
+  return mqtt.connected();
+}
+
+}  // namespace
+
+int main() {
+  // Median, MAD and z against a sort of the last STATS_WINDOW accepted
+  // samples; mean and deviation against two passes in double
+  {
+    SensorStats stats;
+    std::vector<float> accepted;
+    uint32_t mismatches = 0;
+    uint32_t previous = 0;
+    const uint32_t SAMPLES = 200000;
+    for (uint32_t i = 0; i < SAMPLES; i++) {
+      float value = noisyPh(i);
+      stats.add(METRIC_PH, value, i * 1000);
+      MetricStats now = stats.stats(METRIC_PH);
+      if (now.samples == previous) {
+        continue;
+      }
+      previous = now.samples;
+      accepted.push_back(value);
+
+      size_t from = accepted.size() > STATS_WINDOW ? accepted.size() - STATS_WINDOW : 0;
+      std::vector<float> window(accepted.begin() + from, accepted.end());
+      float median = sortedMiddle(window);
+      std::vector<float> deviations;
+      for (float sample : window) {
+        deviations.push_back(fabsf(sample - median));
+      }
+      float mad = sortedMiddle(deviations);
+      float z = 0.6745f * (value - median) / (mad > 0.01f ? mad : 0.01f);
+      mismatches += now.median != median || now.mad != mad || now.z != z;
+    }
+    CHECK_EQ(mismatches, 0);
+
+    double sum = 0;
+    for (float value : accepted) {
+      sum += value;
+    }
+    double mean = sum / accepted.size();
+    double squares = 0;
+    for (float value : accepted) {
+      squares += (value - mean) * (value - mean);
+    }
+    MetricStats final = stats.stats(METRIC_PH);
+    CHECK_EQ(final.samples, accepted.size());
+    CHECK_EQ(final.samples + final.rejected, SAMPLES);
+    CHECK_NEAR(final.mean, mean, 1e-5);
+    CHECK_NEAR(final.stddev, sqrt(squares / (accepted.size() - 1)), 1e-5);
+    printf("%u samples, %u rejected\n", final.samples, final.rejected);
+  }
+
+  // The median is only trusted for alerts from STATS_MIN_SAMPLES on
+  {
+    SensorStats stats;
+    for (int i = 0; i < STATS_MIN_SAMPLES - 1; i++) {
+      stats.add(METRIC_TDS, 800.0f + i, i * 1000);
+      CHECK(isnan(stats.robustValue(METRIC_TDS)));
+    }
+    stats.add(METRIC_TDS, 804.0f, 5000);
+    CHECK_EQ(stats.robustValue(METRIC_TDS), 802.0f);
+  }
+
+  // A probe that repeats itself for stuckSamples readings is stuck until it
+  // moves again
+  {
+    SensorStats stats;
+    uint32_t now = 0;
+    std::vector<float> flat(1000, 6.02f);
+    CHECK_EQ(raisedAt(stats, METRIC_PH, flat, now, SENSOR_STUCK), SENSOR_LIMITS[METRIC_PH].stuckSamples);
+    CHECK(isnan(stats.robustValue(METRIC_PH)));
+    stats.add(METRIC_PH, 6.03f, now + 1000);
+    CHECK(!stats.faulty(METRIC_PH));
+  }
+
+  // More than STATS_NAN_LIMIT unreadable samples out of 32 are a NaN storm
+  {
+    SensorStats stats;
+    uint32_t now = 0;
+    std::vector<float> good(20, 21.5f);
+    CHECK_EQ(raisedAt(stats, METRIC_TEMPERATURE, good, now, SENSOR_FAULTS), -1);
+    std::vector<float> storm(30, NAN);
+    CHECK_EQ(raisedAt(stats, METRIC_TEMPERATURE, storm, now, SENSOR_NAN_STORM), STATS_NAN_LIMIT);
+    CHECK(isnan(stats.robustValue(METRIC_TEMPERATURE)));
+  }
+
+  // Single glitches are rejected without touching the statistics; the
+  // STATS_REJECT_LIMIT-th within 32 samples is a slope fault
+  {
+    SensorStats stats;
+    uint32_t now = 0;
+    std::vector<float> readings;
+    for (int i = 0; i < 40; i++) {
+      readings.push_back(i % 10 == 5 ? 9.0f : 6.0f + (i % 2) * 0.01f);
+    }
+    CHECK_EQ(raisedAt(stats, METRIC_PH, readings, now, SENSOR_SLOPE), 25);
+    MetricStats after = stats.stats(METRIC_PH);
+    CHECK_EQ(after.rejected, 4);
+    CHECK_EQ(after.samples, 36);
+    CHECK(after.median < 6.02f);
+  }
+
+  // A step that persists is accepted as the new level at the
+  // STATS_REBASE_SAMPLES-th reading. The slope is measured from the last
+  // accepted reading, so the step is too steep over all of them.
+  {
+    SensorStats stats;
+    uint32_t now = 0;
+    std::vector<float> level(10, 6.0f);
+    raisedAt(stats, METRIC_PH, level, now, 0);
+    for (int i = 1; i <= STATS_REBASE_SAMPLES; i++) {
+      now += 1000;
+      stats.add(METRIC_PH, 9.5f, now);
+      CHECK_EQ(stats.stats(METRIC_PH).samples, i < STATS_REBASE_SAMPLES ? 10 : 11);
+    }
+  }
+
+  // Readings the sensor cannot report are a range fault
+  {
+    SensorStats stats;
+    uint32_t now = 0;
+    std::vector<float> readings = {800, 801, -5, 802, -5, -5, 803};
+    CHECK_EQ(raisedAt(stats, METRIC_TDS, readings, now, SENSOR_RANGE), 5);
+    CHECK_EQ(stats.stats(METRIC_TDS).samples, 4);
+  }
+
+  // STATS_SUSTAIN_SAMPLES outliers in a row against the rolling median are
+  // a deviation, which is not a fault
+  {
+    SensorStats stats;
+    uint32_t now = 0;
+    std::vector<float> readings;
+    for (int i = 0; i < 40; i++) {
+      readings.push_back(i % 2 ? 5.99f : 6.01f);
+    }
+    CHECK_EQ(raisedAt(stats, METRIC_PH, readings, now, SENSOR_DEVIATION), -1);
+    std::vector<float> shifted(15, 6.5f);
+    CHECK_EQ(raisedAt(stats, METRIC_PH, shifted, now, SENSOR_DEVIATION), STATS_SUSTAIN_SAMPLES - 1);
+    CHECK(!stats.faulty(METRIC_PH));
+    CHECK(!isnan(stats.robustValue(METRIC_PH)));
+  }
+
+  // Over MQTT: the widest statistics accepted samples can produce fit a
+  // message; anything wider is dropped and counted, never cut short
+  SPIFFS.begin(true);
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+  broker.start();
+  WiFiClient wifiClient;
+  SystemConfig config;
+  strlcpy(config.device_id, "st", sizeof(config.device_id));
+  config.mqtt_enabled = true;
+  MQTTManager mqtt(wifiClient, config);
+  mqtt.begin();
+  CHECK(waitConnected(mqtt));
+  std::shared_ptr<shim::MqttSession> observer = broker.connect("observer");
+  broker.subscribe(observer, "hydroponics/st/+");
+
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    const SensorLimits& limits = SENSOR_LIMITS[i];
+    float span = limits.maxValid - limits.minValid;
+    float widest = -fmaxf(fabsf(limits.minValid), fmaxf(limits.maxValid, 0.6745f * span / limits.madFloor));
+    MetricStats worst = {1000, 0, widest, widest, widest, widest, widest, widest,
+                         SENSOR_NAN_STORM | SENSOR_DEVIATION};
+    CHECK(mqtt.publishSensorStats((TelemetryMetric)i, worst));
+  }
+  MetricStats wild = {1000, 0, 1e30f, 1e30f, 1e30f, 1e30f, 1e30f, -1e30f, 0};
+  CHECK(!mqtt.publishSensorStats(METRIC_TDS, wild));
+  char tooLong[MQTT_PAYLOAD_MAX + 8];
+  memset(tooLong, 'x', sizeof(tooLong) - 1);
+  tooLong[sizeof(tooLong) - 1] = '\0';
+  CHECK(!mqtt.publishAlert(tooLong));
+  CHECK_EQ(mqtt.droppedCount(), 2);
+
+  delay(200);
+  shim::MqttMessage message;
+  int stats = 0;
+  size_t longest = 0;
+  while (broker.receive(observer, message)) {
+    // The availability topic is retained too
+    if (message.topic.find("_stats") == std::string::npos) {
+      continue;
+    }
+    CHECK(message.payload.front() == '{' && message.payload.back() == '}');
+    CHECK(message.payload.find("\"status\":\"nan_storm\"") != std::string::npos);
+    longest = std::max(longest, message.payload.size());
+    stats++;
+  }
+  CHECK_EQ(stats, METRIC_COUNT);
+  printf("widest statistics message: %u bytes\n", (unsigned)longest);
+  CHECK(longest < MQTT_PAYLOAD_MAX);
+  return testResult("test_sensor_stats");
+}
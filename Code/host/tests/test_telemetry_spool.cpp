@@ -0,0 +1,195 @@
+// Broker outages against the MQTT spool: readings taken while the broker is
+// down are replayed in order once it is back, the oldest are evicted when
+// an outage outlasts the file, flushed records survive a reboot, and the
+// file is sized to the flash left free by the web UI, down to RAM-only
+// spooling when there is no room.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <string>
+#include <vector>
+#include "HostShim.h"
+#include "TestCheck.h"
+
+#include "LogBuffer.h"
+#include "MQTTManager.h"
+
+LogBuffer hydroLog;
+
+namespace {
+
+// The web UI's files, as on the device
+const size_t WEB_UI_BYTES = 86 * 1024;
+
+void writeFile(const char* path, size_t size, uint8_t fill) {
+  File file = SPIFFS.open(path, FILE_WRITE);
+  std::vector<uint8_t> data(size, fill);
+  CHECK_EQ(file.write(data.data(), data.size()), size);
+  file.close();
+}
+
+size_t fileSize(const char* path) {
+  File file = SPIFFS.open(path, FILE_READ);
+  size_t size = file ? file.size() : 0;
+  file.close();
+  return size;
+}
+
+bool waitFor(MQTTManager& mqtt, bool connected) {
+  uint32_t start = millis();
+  while (mqtt.connected() != connected && millis() - start < 5000) {
+    delay(1);
+  }
+  return mqtt.connected() == connected;
+}
+
+// The pH value of a spooled telemetry snapshot, in hundredths
+int spooledPh(const std::string& payload) {
+  size_t at = payload.find("\"ph_value\":");
+  if (at == std::string::npos) {
+    return -1;
+  }
+  return (int)lroundf(strtof(payload.c_str() + at + 11, nullptr) * 100);
+}
+
+// Take the broker down, publish a reading for each pH value, bring it back
+// and replay the spool; returns the pH values that arrived on the backlog
+// topic
+std::vector<int> outage(MQTTManager& mqtt, int first, int readings) {
+  shim::MqttBroker& broker = shim::MqttBroker::instance();
+  broker.stop();
+  CHECK(waitFor(mqtt, false));
+  float values[METRIC_COUNT] = {50, 0, 500, 20};
+  for (int i = 0; i < readings; i++) {
+    values[METRIC_PH] = (first + i) / 100.0f;
+    mqtt.publishTelemetry(values);
+  }
+
+  // The restart dropped every session, so the observer connects afresh
+  broker.start();
+  std::shared_ptr<shim::MqttSession> observer = broker.connect("observer");
+  broker.subscribe(observer, "hydroponics/t1/backlog");
+  CHECK(waitFor(mqtt, true));
+  uint32_t start = millis();
+  while (mqtt.serviceSpool() && millis() - start < 10000) {
+    delay(1);
+  }
+  delay(200);
+
+  std::vector<int> replayed;
+  shim::MqttMessage message;
+  while (broker.receive(observer, message)) {
+    replayed.push_back(spooledPh(message.payload));
+  }
+  return replayed;
+}
+
+void checkRun(const std::vector<int>& replayed, int first, int count) {
+  CHECK_EQ(replayed.size(), (size_t)count);
+  for (size_t i = 0; i < replayed.size(); i++) {
+    if (replayed[i] != first + (int)i) {
+      printf("record %u: pH %d, expected %d\n", (unsigned)i, replayed[i], first + (int)i);
+      CHECK(false);
+      break;
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  SPIFFS.begin(true);
+  writeFile("/index.html", WEB_UI_BYTES, 'x');
+
+  // The spool file takes what is left after the web UI and the reserve, up
+  // to its maximum, all of it at creation
+  {
+    TelemetrySpool spool;
+    spool.begin();
+    CHECK_EQ(fileSize(SPOOL_FILE_PATH), 16 + SPOOL_FILE_CAPACITY * SPOOL_RECORD_SIZE);
+    CHECK(SPIFFS.totalBytes() - SPIFFS.usedBytes() >= SPOOL_FLASH_RESERVE);
+  }
+
+  WiFiClient wifiClient;
+  SystemConfig config;
+  strlcpy(config.device_id, "t1", sizeof(config.device_id));
+  config.mqtt_enabled = true;
+  config.heartbeat_s = 0;
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    config.deadbands[i].absolute = 0;
+    config.deadbands[i].relative = 0;
+  }
+  MQTTManager mqtt(wifiClient, config);
+  mqtt.begin();
+  CHECK(waitFor(mqtt, true));
+
+  // A short outage comes back complete and in order
+  checkRun(outage(mqtt, 100, 50), 100, 50);
+  CHECK_EQ(mqtt.spooledCount(), 0);
+  CHECK_EQ(mqtt.spoolEvictedCount(), 0);
+
+  // A long one keeps the newest readings: a full file plus what is still in
+  // RAM
+  const int LONG_OUTAGE = 300;
+  int kept = SPOOL_FILE_CAPACITY + LONG_OUTAGE % SPOOL_RAM_CAPACITY;
+  int evicted = LONG_OUTAGE - kept;
+  std::vector<int> replayed = outage(mqtt, 200, LONG_OUTAGE);
+  checkRun(replayed, 200 + evicted, kept);
+  CHECK_EQ(mqtt.spoolEvictedCount(), evicted);
+  printf("%d readings over a long outage, %d replayed, %d evicted\n", LONG_OUTAGE, kept, evicted);
+
+  // Records flushed to flash survive a reboot, the ones still in RAM do not
+  {
+    SPIFFS.remove(SPOOL_FILE_PATH);
+    TelemetrySpool spool;
+    spool.begin();
+    char payload[SPOOL_RECORD_SIZE];
+    for (int i = 0; i < 40; i++) {
+      snprintf(payload, sizeof(payload), "{\"n\":%d}", i);
+      spool.push(payload);
+    }
+    CHECK_EQ(spool.size(), 40);
+
+    TelemetrySpool rebooted;
+    rebooted.begin();
+    CHECK_EQ(rebooted.size(), 32);
+    CHECK(rebooted.peek(payload, sizeof(payload)));
+    CHECK(strcmp(payload, "{\"n\":0}") == 0);
+  }
+
+  // An oversized spool file left by older firmware is replaced by one that
+  // fits
+  shim::resetFlash(0x20000);
+  writeFile("/index.html", WEB_UI_BYTES, 'x');
+  writeFile(SPOOL_FILE_PATH, 40 * 1024, 0);
+  {
+    TelemetrySpool spool;
+    spool.begin();
+    CHECK_EQ(fileSize(SPOOL_FILE_PATH), 16 + SPOOL_FILE_CAPACITY * SPOOL_RECORD_SIZE);
+  }
+
+  // Without room for the minimum, the spool keeps its RAM records only
+  shim::resetFlash(0x20000);
+  writeFile("/index.html", 0x20000 - SPOOL_FLASH_RESERVE - 1024, 'x');
+  {
+    TelemetrySpool spool;
+    spool.begin();
+    CHECK(!SPIFFS.exists(SPOOL_FILE_PATH));
+    char payload[SPOOL_RECORD_SIZE];
+    for (int i = 0; i < 20; i++) {
+      snprintf(payload, sizeof(payload), "{\"n\":%d}", i);
+      spool.push(payload);
+    }
+    CHECK_EQ(spool.size(), SPOOL_RAM_CAPACITY);
+    CHECK_EQ(spool.evicted(), 20 - SPOOL_RAM_CAPACITY);
+    for (int i = 20 - SPOOL_RAM_CAPACITY; i < 20; i++) {
+      char expected[16];
+      snprintf(expected, sizeof(expected), "{\"n\":%d}", i);
+      CHECK(spool.peek(payload, sizeof(payload)));
+      CHECK(strcmp(payload, expected) == 0);
+      spool.pop();
+    }
+    CHECK(spool.empty());
+  }
+
+  return testResult("test_telemetry_spool");
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "LogBuffer.h"
+
+#define BOOT_RECORD_MAGIC 0x424f4f54  // "BOOT"
+
+// Boot stages in the order they normally complete. Everything up to
+// BOOT_CONTROL runs synchronously in setup(); the network stages complete
+// later on the control loop, in whatever order the network allows.
+enum BootStage : uint8_t {
+  BOOT_HARDWARE = 0,  // Relays driven to their off state, sensors started
+  BOOT_STORAGE,       // SPIFFS mounted
+  BOOT_CONFIG,        // Config and growth profiles loaded
+  BOOT_CONTROL,       // Control loop scheduled, relays follow the growth cycle
+  BOOT_WIFI,          // Station connected
+  BOOT_TIME,          // First SNTP sync
+  BOOT_WEB,           // Web server listening
+  BOOT_MQTT,          // First broker connection
+  BOOT_STAGE_COUNT
+};
+
+static const char* const BOOT_STAGE_NAMES[BOOT_STAGE_COUNT] = {
+  "hardware", "storage", "config", "control", "wifi", "time", "web", "mqtt"
+};
+
+// Stage completion times of one boot
+struct BootTimings {
+  uint32_t bootCount;
+  int32_t resetReason;                    // esp_reset_reason() of this boot
+  uint32_t stageMs[BOOT_STAGE_COUNT];     // Milliseconds since reset, 0 if not reached
+};
+
+// Kept in RTC memory, which survives software resets, panics and the
+// watchdog but not a power cycle. The previous boot is kept so a boot that
+// ended in a crash can still be inspected after the restart.
+struct BootRecord {
+  uint32_t magic;
+  BootTimings current;
+  BootTimings previous;
+};
+
+// Records when each boot stage completes. Control task only; readers on
+// other tasks take a copy and may see a stage appear mid-copy, which is
+// harmless for a diagnostic.
+class BootProfiler {
+private:
+  BootRecord& _record;
+
+public:
+  BootProfiler(BootRecord& record) : _record(record) {}
+
+  // Start a new boot, moving the last one to previous. Call first in setup().
+  void begin() {
+    if (_record.magic != BOOT_RECORD_MAGIC) {
+      memset(&_record, 0, sizeof(_record));
+      _record.magic = BOOT_RECORD_MAGIC;
+    } else {
+      _record.previous = _record.current;
+    }
+    uint32_t bootCount = _record.previous.bootCount + 1;
+    memset(&_record.current, 0, sizeof(_record.current));
+    _record.current.bootCount = bootCount;
+    _record.current.resetReason = esp_reset_reason();
+  }
+
+  // Record a stage as complete. Later calls for the same stage are ignored.
+  void mark(BootStage stage) {
+    if (_record.current.stageMs[stage]) {
+      return;
+    }
+    uint32_t now = esp_timer_get_time() / 1000;
+    _record.current.stageMs[stage] = now ? now : 1;
+    LOG_INFO(LOG_SYSTEM, "Boot stage %s complete at %u ms", BOOT_STAGE_NAMES[stage], _record.current.stageMs[stage]);
+  }
+
+  bool reached(BootStage stage) const {
+    return _record.current.stageMs[stage] != 0;
+  }
+
+  const BootTimings& current() const {
+    return _record.current;
+  }
+
+  const BootTimings& previous() const {
+    return _record.previous;
+  }
+};
@@ -0,0 +1,110 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include <memory>
+#include "Config.h"
+#include "GrowthManager.h"
+
+// Number of commands that can be waiting for the control task
+#define COMMAND_QUEUE_SIZE 16
+
+// Kinds of state mutation the control task performs on behalf of other tasks
+enum CommandType : uint8_t {
+  CMD_SET_RELAY,          // relay, state
+  CMD_TOGGLE_RELAY,       // relay
+  CMD_START_CYCLE,        // profileId, startTime
+  CMD_STOP_CYCLE,
+  CMD_SAVE_PROFILE,       // profile
+  CMD_DELETE_PROFILE,     // profileId
+  CMD_UPDATE_CONFIG       // config
+};
+
+// Called on the control task once a command has been applied
+typedef std::function<void(bool success, const char* message)> CommandCallback;
+
+struct Command {
+  CommandType type = CMD_STOP_CYCLE;
+  uint8_t relay = 0;
+  bool state = false;
+  char profileId[32] = "";
+  unsigned long startTime = 0;
+  int64_t receivedAt = 0;   // esp_timer time the request arrived, 0 if not tracked
+  std::unique_ptr<GrowthProfile> profile;
+  std::unique_ptr<ConfigPatch> config;
+  CommandCallback done;
+};
+
+// Bounded lock-free multi-producer single-consumer queue. Producers (web
+// handlers on async_tcp, the MQTT callback) claim a slot with a CAS on the
+// enqueue position; the single consumer (the control loop) drains in order.
+// Each cell carries a sequence number that tells producers and the consumer
+// whether it is free, full, or still being written.
+template <typename T, size_t Capacity>
+class MpscQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  Cell _cells[Capacity];
+  std::atomic<size_t> _enqueuePos;
+  size_t _dequeuePos = 0;
+  TaskHandle_t _consumer = nullptr;
+
+public:
+  MpscQueue() : _enqueuePos(0) {
+    for (size_t i = 0; i < Capacity; i++) {
+      _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Task to wake whenever a command is pushed
+  void setConsumer(TaskHandle_t consumer) {
+    _consumer = consumer;
+  }
+
+  // Returns false without blocking if the queue is full
+  bool push(T&& item) {
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &_cells[pos & (Capacity - 1)];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0) {
+        if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(item);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    if (_consumer) {
+      xTaskNotifyGive(_consumer);
+    }
+    return true;
+  }
+
+  // Consumer side only. Returns false if nothing is ready.
+  bool pop(T& item) {
+    Cell* cell = &_cells[_dequeuePos & (Capacity - 1)];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    if ((intptr_t)sequence - (intptr_t)(_dequeuePos + 1) < 0) {
+      return false;
+    }
+    item = std::move(cell->data);
+    cell->data = T();
+    cell->sequence.store(_dequeuePos + Capacity, std::memory_order_release);
+    _dequeuePos++;
+    return true;
+  }
+};
+
+typedef MpscQueue<Command, COMMAND_QUEUE_SIZE> CommandQueue;
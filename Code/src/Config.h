@@ -1,8 +1,41 @@
 #pragma once
 #include <Arduino.h>
+#include <stddef.h>
 #include <Preferences.h>
 #include <WiFi.h>
 #include "SensorReader.h"
+#include "RelayController.h"
+#include "LogBuffer.h"
+
+// Telemetry values published over MQTT
+enum TelemetryMetric : uint8_t {
+  METRIC_LIQUID_LEVEL = 0,
+  METRIC_PH,
+  METRIC_TDS,
+  METRIC_TEMPERATURE,
+  METRIC_COUNT
+};
+
+// Topic suffix and JSON key of each metric
+static const char* const METRIC_NAMES[METRIC_COUNT] = {
+  "liquid_level", "ph_value", "tds_value", "temperature_value"
+};
+
+// A reading is only republished once it moves by more than both the absolute
+// band and the relative band (a fraction of the last published value)
+struct MetricDeadband {
+  float absolute;
+  float relative;
+};
+
+// Closed-loop pH correction, see PHDoser
+struct PHDosingConfig {
+  bool enabled;
+  float pumpMlPerS;    // Flow rate of the pH up/down pumps
+  float doseMl;        // Dose for an error of PH_DOSE_FULL_ERROR or more from the target
+  uint16_t mixS;       // Wait after a dose before the reading is trusted again
+  float maxMlPerHour;  // Cap per direction over the last hour
+};
 
 struct SystemConfig {
   char device_id[32] = "tower1";
@@ -13,23 +46,179 @@ struct SystemConfig {
   char mqtt_password[32] = "password";
   char ntp_server[64] = "pool.ntp.org";
   
-  // Liquid level calibration
-  long cal_dry = 0;      // Sensor not submerged
-  long cal_critical = 0; // Pump safe level
-  long cal_half = 0;     // 50% full
-  long cal_full = 0;     // 100% full
+  // Liquid level calibration. Declared long by earlier firmware, which is
+  // 32 bits on the ESP32; fixed width keeps the layout the same elsewhere.
+  int32_t cal_dry = 0;      // Sensor not submerged
+  int32_t cal_critical = 0; // Pump safe level
+  int32_t cal_half = 0;     // 50% full
+  int32_t cal_full = 0;     // 100% full
   
   // pH calibration
   float ph4_adc = 0; // ADC reading at pH 4
   float ph7_adc = 0; // ADC reading at pH 7
   float ph10_adc = 0; // ADC reading at pH 10
+
+  // Power management
+  bool power_save = false; // Light sleep and CPU frequency scaling when idle
+
+  // Telemetry publishing
+  MetricDeadband deadbands[METRIC_COUNT] = {
+    {1.0f, 0.0f},   // Liquid level, percent
+    {0.05f, 0.0f},  // pH
+    {5.0f, 0.01f},  // TDS, ppm
+    {0.2f, 0.0f}    // Temperature, C
+  };
+  uint16_t heartbeat_s = 300;  // Republish unchanged values after this long, 0 to disable
+  bool state_topic = false;    // Publish all metrics as one JSON message on <device>/state
+
+  // Rated power of each relay's load in watts, for energy estimates; 0 if unknown
+  uint16_t relay_watts[RELAY_COUNT] = {0, 0, 0, 0};
+
+  // pH dosing, off until the pump flow rate has been measured
+  PHDosingConfig ph_dosing = {false, 1.0f, 2.0f, 300, 20.0f};
+
+  // Longest the pump may run at a time, cycle or manual, in minutes
+  uint16_t pump_max_run_min = 60;
+};
+
+// Fields of SystemConfig that a ConfigPatch can carry
+enum ConfigField : uint32_t {
+  CONFIG_DEVICE_ID     = 1u << 0,
+  CONFIG_MQTT_ENABLED  = 1u << 1,
+  CONFIG_MQTT_SERVER   = 1u << 2,
+  CONFIG_MQTT_PORT     = 1u << 3,
+  CONFIG_MQTT_USER     = 1u << 4,
+  CONFIG_MQTT_PASSWORD = 1u << 5,
+  CONFIG_NTP_SERVER    = 1u << 6,
+  CONFIG_CAL_DRY       = 1u << 7,
+  CONFIG_CAL_CRITICAL  = 1u << 8,
+  CONFIG_CAL_HALF      = 1u << 9,
+  CONFIG_CAL_FULL      = 1u << 10,
+  CONFIG_PH4_ADC       = 1u << 11,
+  CONFIG_PH7_ADC       = 1u << 12,
+  CONFIG_PH10_ADC      = 1u << 13,
+  CONFIG_POWER_SAVE    = 1u << 14,
+  CONFIG_DEADBANDS     = 1u << 15,
+  CONFIG_HEARTBEAT     = 1u << 16,
+  CONFIG_STATE_TOPIC   = 1u << 17,
+  CONFIG_RELAY_WATTS   = 1u << 18,
+  CONFIG_PH_DOSING     = 1u << 19,
+  CONFIG_PUMP_MAX_RUN  = 1u << 20
+};
+
+// Partial update of SystemConfig, only the fields flagged in 'fields' are applied
+struct ConfigPatch {
+  uint32_t fields = 0;
+  SystemConfig values;
+
+  void applyTo(SystemConfig& config) const {
+    if (fields & CONFIG_DEVICE_ID) strlcpy(config.device_id, values.device_id, sizeof(config.device_id));
+    if (fields & CONFIG_MQTT_ENABLED) config.mqtt_enabled = values.mqtt_enabled;
+    if (fields & CONFIG_MQTT_SERVER) strlcpy(config.mqtt_server, values.mqtt_server, sizeof(config.mqtt_server));
+    if (fields & CONFIG_MQTT_PORT) config.mqtt_port = values.mqtt_port;
+    if (fields & CONFIG_MQTT_USER) strlcpy(config.mqtt_user, values.mqtt_user, sizeof(config.mqtt_user));
+    if (fields & CONFIG_MQTT_PASSWORD) strlcpy(config.mqtt_password, values.mqtt_password, sizeof(config.mqtt_password));
+    if (fields & CONFIG_NTP_SERVER) strlcpy(config.ntp_server, values.ntp_server, sizeof(config.ntp_server));
+    if (fields & CONFIG_CAL_DRY) config.cal_dry = values.cal_dry;
+    if (fields & CONFIG_CAL_CRITICAL) config.cal_critical = values.cal_critical;
+    if (fields & CONFIG_CAL_HALF) config.cal_half = values.cal_half;
+    if (fields & CONFIG_CAL_FULL) config.cal_full = values.cal_full;
+    if (fields & CONFIG_PH4_ADC) config.ph4_adc = values.ph4_adc;
+    if (fields & CONFIG_PH7_ADC) config.ph7_adc = values.ph7_adc;
+    if (fields & CONFIG_PH10_ADC) config.ph10_adc = values.ph10_adc;
+    if (fields & CONFIG_POWER_SAVE) config.power_save = values.power_save;
+    if (fields & CONFIG_DEADBANDS) memcpy(config.deadbands, values.deadbands, sizeof(config.deadbands));
+    if (fields & CONFIG_HEARTBEAT) config.heartbeat_s = values.heartbeat_s;
+    if (fields & CONFIG_STATE_TOPIC) config.state_topic = values.state_topic;
+    if (fields & CONFIG_RELAY_WATTS) memcpy(config.relay_watts, values.relay_watts, sizeof(config.relay_watts));
+    if (fields & CONFIG_PH_DOSING) config.ph_dosing = values.ph_dosing;
+    if (fields & CONFIG_PUMP_MAX_RUN) config.pump_max_run_min = values.pump_max_run_min;
+  }
 };
 
+// Current layout of the stored config. Bump when a field changes meaning or
+// type and add a step to ConfigManager::migrate(); new fields need neither.
+#define CONFIG_SCHEMA_VERSION 1
+
+// Edits are written to flash once no further change has arrived for this
+// long, or at the latest this long after the first unsaved change
+#define CONFIG_COMMIT_DELAY_MS 2000
+#define CONFIG_COMMIT_MAX_DELAY_MS 10000
+
+// How a field is stored in NVS
+enum ConfigFieldType : uint8_t {
+  FIELD_STRING,   // Null-terminated char array, stored with putString
+  FIELD_RAW       // Anything else, stored with putBytes and only loaded if the size matches
+};
+
+// One tagged entry of the stored config: the NVS key a field lives under
+struct ConfigFieldInfo {
+  uint32_t field;         // ConfigField bit
+  const char* key;        // NVS key, at most 15 characters
+  ConfigFieldType type;
+  size_t offset;
+  size_t size;
+};
+
+#define CONFIG_FIELD(bit, key, type, member) \
+  {bit, key, type, offsetof(SystemConfig, member), sizeof(((SystemConfig*)nullptr)->member)}
+
+static const ConfigFieldInfo CONFIG_FIELDS[] = {
+  CONFIG_FIELD(CONFIG_DEVICE_ID, "device_id", FIELD_STRING, device_id),
+  CONFIG_FIELD(CONFIG_MQTT_ENABLED, "mqtt_enabled", FIELD_RAW, mqtt_enabled),
+  CONFIG_FIELD(CONFIG_MQTT_SERVER, "mqtt_server", FIELD_STRING, mqtt_server),
+  CONFIG_FIELD(CONFIG_MQTT_PORT, "mqtt_port", FIELD_RAW, mqtt_port),
+  CONFIG_FIELD(CONFIG_MQTT_USER, "mqtt_user", FIELD_STRING, mqtt_user),
+  CONFIG_FIELD(CONFIG_MQTT_PASSWORD, "mqtt_password", FIELD_STRING, mqtt_password),
+  CONFIG_FIELD(CONFIG_NTP_SERVER, "ntp_server", FIELD_STRING, ntp_server),
+  CONFIG_FIELD(CONFIG_CAL_DRY, "cal_dry", FIELD_RAW, cal_dry),
+  CONFIG_FIELD(CONFIG_CAL_CRITICAL, "cal_critical", FIELD_RAW, cal_critical),
+  CONFIG_FIELD(CONFIG_CAL_HALF, "cal_half", FIELD_RAW, cal_half),
+  CONFIG_FIELD(CONFIG_CAL_FULL, "cal_full", FIELD_RAW, cal_full),
+  CONFIG_FIELD(CONFIG_PH4_ADC, "ph4_adc", FIELD_RAW, ph4_adc),
+  CONFIG_FIELD(CONFIG_PH7_ADC, "ph7_adc", FIELD_RAW, ph7_adc),
+  CONFIG_FIELD(CONFIG_PH10_ADC, "ph10_adc", FIELD_RAW, ph10_adc),
+  CONFIG_FIELD(CONFIG_POWER_SAVE, "power_save", FIELD_RAW, power_save),
+  CONFIG_FIELD(CONFIG_DEADBANDS, "deadbands", FIELD_RAW, deadbands),
+  CONFIG_FIELD(CONFIG_HEARTBEAT, "heartbeat_s", FIELD_RAW, heartbeat_s),
+  CONFIG_FIELD(CONFIG_STATE_TOPIC, "state_topic", FIELD_RAW, state_topic),
+  CONFIG_FIELD(CONFIG_RELAY_WATTS, "relay_watts", FIELD_RAW, relay_watts),
+  CONFIG_FIELD(CONFIG_PH_DOSING, "ph_dosing", FIELD_RAW, ph_dosing),
+  CONFIG_FIELD(CONFIG_PUMP_MAX_RUN, "pump_max_run", FIELD_RAW, pump_max_run_min)
+};
+
+#define CONFIG_FIELD_COUNT (sizeof(CONFIG_FIELDS) / sizeof(CONFIG_FIELDS[0]))
+
+// Sizes of the single-blob layouts stored under "hydroponics/config" by
+// earlier firmware. Fields were only ever appended, so each is a prefix of
+// SystemConfig.
+static const size_t LEGACY_CONFIG_SIZES[] = {
+  offsetof(SystemConfig, power_save),   // Original layout, ending at ph10_adc
+  offsetof(SystemConfig, deadbands),    // + power_save
+  offsetof(SystemConfig, relay_watts)   // + deadbands, heartbeat_s, state_topic
+};
+
+// Flash writes made by the config store
+struct ConfigWearStats {
+  uint32_t commits;       // Commits since the store was created, persisted
+  uint32_t keyWrites;     // Keys written since boot
+  uint32_t keysSkipped;   // Dirty keys whose value turned out unchanged, since boot
+};
+
+// Persists SystemConfig in NVS with one key per field, so fields can be
+// added without invalidating what is stored and each edit only rewrites the
+// keys it touched. Changes are applied in RAM immediately and committed to
+// flash after a short quiet period; see commitDelay().
 class ConfigManager {
 private:
   Preferences& _preferences;
   SystemConfig _config;
+  SystemConfig _committed;      // What is currently in flash
   SensorReader& _sensorReader;
+  uint32_t _dirty = 0;          // ConfigField bits changed since the last commit
+  uint32_t _firstDirty = 0;     // millis() of the oldest uncommitted change
+  uint32_t _lastDirty = 0;      // millis() of the newest uncommitted change
+  ConfigWearStats _wear = {0, 0, 0};
 
 public:
   ConfigManager(Preferences& preferences, SensorReader& sensorReader) 
@@ -47,43 +236,93 @@ public:
     return _config;
   }
 
-  void saveConfig() {
-    _preferences.begin("hydroponics", false);
-    _preferences.putBytes("config", &_config, sizeof(SystemConfig));
-    _preferences.end();
-    
-    // Update sensor calibration values
+  // Apply a partial update. Calibration takes effect immediately; the
+  // flash write waits for commit().
+  void applyPatch(const ConfigPatch& patch) {
+    patch.applyTo(_config);
+    if (!patch.fields) {
+      return;
+    }
+    uint32_t now = millis();
+    if (!_dirty) {
+      _firstDirty = now;
+    }
+    _dirty |= patch.fields;
+    _lastDirty = now;
     updateSensorCalibration();
   }
 
-  void loadConfig() {
-    _preferences.begin("hydroponics", false);
+  bool hasPendingChanges() const {
+    return _dirty != 0;
+  }
 
-    // Check if config exists and is the correct size
-    if (_preferences.getBytesLength("config") != sizeof(SystemConfig)) {
-      // No config exists - initialize with defaults
-      Serial.println("No saved config found - initializing with defaults");
-
-      // Set default MQTT values
-      strlcpy(_config.mqtt_server, "mqtt.local", sizeof(_config.mqtt_server));
-      _config.mqtt_port = 1883;
-      strlcpy(_config.mqtt_user, "", sizeof(_config.mqtt_user));
-      strlcpy(_config.mqtt_password, "", sizeof(_config.mqtt_password));
-
-      // Set default device ID based on MAC address
-      uint8_t mac[6];
-      WiFi.macAddress(mac);
-      snprintf(_config.device_id, sizeof(_config.device_id),
-              "tower-%02x%02x%02x", mac[3], mac[4], mac[5]);
-
-      // Save the defaults
-      saveConfig();
-    } else {
-      // Load existing config
-      _preferences.getBytes("config", &_config, sizeof(SystemConfig));
+  // Milliseconds until pending changes should be committed
+  uint32_t commitDelay() const {
+    if (!_dirty) {
+      return 0;
+    }
+    uint32_t now = millis();
+    uint32_t quiet = now - _lastDirty;
+    uint32_t pending = now - _firstDirty;
+    if (quiet >= CONFIG_COMMIT_DELAY_MS || pending >= CONFIG_COMMIT_MAX_DELAY_MS) {
+      return 0;
     }
+    uint32_t untilQuiet = CONFIG_COMMIT_DELAY_MS - quiet;
+    uint32_t untilMax = CONFIG_COMMIT_MAX_DELAY_MS - pending;
+    return untilQuiet < untilMax ? untilQuiet : untilMax;
+  }
 
+  // Write every dirty field whose value differs from what is in flash
+  void commit() {
+    if (!_dirty) {
+      return;
+    }
+    _preferences.begin("hydro_cfg", false);
+    int written = writeFields(_dirty);
+    if (written > 0) {
+      _wear.commits++;
+      _preferences.putUInt("commits", _wear.commits);
+    }
     _preferences.end();
+    LOG_INFO(LOG_CONFIG, "Config committed, %d keys written", written);
+    _dirty = 0;
+  }
+
+  const ConfigWearStats& wearStats() const {
+    return _wear;
+  }
+
+  void loadConfig() {
+    _preferences.begin("hydro_cfg", false);
+    uint8_t version = _preferences.getUChar("schema", 0);
+    if (version > 0) {
+      readFields();
+      _wear.commits = _preferences.getUInt("commits", 0);
+      if (version < CONFIG_SCHEMA_VERSION) {
+        migrate(version);
+      }
+      _preferences.end();
+    } else {
+      _preferences.end();
+      if (!loadLegacyConfig()) {
+        // No config exists - initialize with defaults
+        LOG_INFO(LOG_CONFIG, "No saved config found - initializing with defaults");
+
+        // Set default MQTT values
+        strlcpy(_config.mqtt_server, "mqtt.local", sizeof(_config.mqtt_server));
+        _config.mqtt_port = 1883;
+        strlcpy(_config.mqtt_user, "", sizeof(_config.mqtt_user));
+        strlcpy(_config.mqtt_password, "", sizeof(_config.mqtt_password));
+
+        // Set default device ID based on MAC address
+        uint8_t mac[6];
+        WiFi.macAddress(mac);
+        snprintf(_config.device_id, sizeof(_config.device_id),
+                "tower-%02x%02x%02x", mac[3], mac[4], mac[5]);
+      }
+      writeAll();
+    }
+    _committed = _config;
     
     // Apply calibration values to sensors
     updateSensorCalibration();
@@ -95,4 +334,99 @@ private:
     _sensorReader.setLiquidCalibration(_config.cal_dry, _config.cal_full, _config.cal_critical);
     _sensorReader.setPHCalibration(_config.ph4_adc, _config.ph7_adc, _config.ph10_adc);
   }
+
+  // Load every field that has a key; missing keys keep their defaults.
+  // Preferences must be open.
+  void readFields() {
+    uint8_t* base = (uint8_t*)&_config;
+    for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+      const ConfigFieldInfo& info = CONFIG_FIELDS[i];
+      if (!_preferences.isKey(info.key)) {
+        continue;
+      }
+      if (info.type == FIELD_STRING) {
+        String value = _preferences.getString(info.key);
+        strlcpy((char*)base + info.offset, value.c_str(), info.size);
+      } else if (_preferences.getBytesLength(info.key) == info.size) {
+        _preferences.getBytes(info.key, base + info.offset, info.size);
+      } else {
+        LOG_WARN(LOG_CONFIG, "Stored %s has the wrong size, using default", info.key);
+      }
+    }
+  }
+
+  // Write the given fields where they differ from flash, or unconditionally
+  // with force. Preferences must be open.
+  int writeFields(uint32_t fields, bool force = false) {
+    const uint8_t* base = (const uint8_t*)&_config;
+    const uint8_t* stored = (const uint8_t*)&_committed;
+    int written = 0;
+    for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+      const ConfigFieldInfo& info = CONFIG_FIELDS[i];
+      if (!(fields & info.field)) {
+        continue;
+      }
+      if (!force && memcmp(base + info.offset, stored + info.offset, info.size) == 0) {
+        _wear.keysSkipped++;
+        continue;
+      }
+      if (info.type == FIELD_STRING) {
+        _preferences.putString(info.key, (const char*)base + info.offset);
+      } else {
+        _preferences.putBytes(info.key, base + info.offset, info.size);
+      }
+      memcpy((uint8_t*)&_committed + info.offset, base + info.offset, info.size);
+      written++;
+    }
+    _wear.keyWrites += written;
+    return written;
+  }
+
+  // Write a complete config in the current schema
+  void writeAll() {
+    _preferences.begin("hydro_cfg", false);
+    _preferences.clear();
+    uint32_t all = 0;
+    for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+      all |= CONFIG_FIELDS[i].field;
+    }
+    writeFields(all, true);
+    _wear.commits++;
+    _preferences.putUInt("commits", _wear.commits);
+    _preferences.putUChar("schema", CONFIG_SCHEMA_VERSION);
+    _preferences.end();
+  }
+
+  // Upgrade a tagged config written by an older schema. Steps run in order,
+  // each falling through to the next. Preferences must be open.
+  void migrate(uint8_t fromVersion) {
+    LOG_INFO(LOG_CONFIG, "Migrating config from schema %u to %u", fromVersion, CONFIG_SCHEMA_VERSION);
+    switch (fromVersion) {
+      // case 1: convert fields changed in schema 2 here
+      default:
+        break;
+    }
+    _preferences.putUChar("schema", CONFIG_SCHEMA_VERSION);
+  }
+
+  // Import the single-blob config of earlier firmware and remove it
+  bool loadLegacyConfig() {
+    _preferences.begin("hydroponics", false);
+    size_t storedSize = _preferences.getBytesLength("config");
+    bool known = false;
+    for (size_t i = 0; i < sizeof(LEGACY_CONFIG_SIZES) / sizeof(LEGACY_CONFIG_SIZES[0]); i++) {
+      known |= storedSize == LEGACY_CONFIG_SIZES[i];
+    }
+    if (known) {
+      _preferences.getBytes("config", &_config, storedSize);
+      LOG_INFO(LOG_CONFIG, "Migrating %u byte legacy config", (unsigned)storedSize);
+    } else if (storedSize > 0) {
+      LOG_WARN(LOG_CONFIG, "Unrecognised legacy config of %u bytes, using defaults", (unsigned)storedSize);
+    }
+    if (storedSize > 0) {
+      _preferences.remove("config");
+    }
+    _preferences.end();
+    return known;
+  }
 };
@@ -0,0 +1,173 @@
+#pragma once
+#include <Arduino.h>
+#include <sys/time.h>
+#include <esp_timer.h>
+
+// Events the control loop waits for
+enum ControlEvent : uint8_t {
+  EVENT_SENSOR_SAMPLE = 0,  // Read sensors, check alerts, publish telemetry
+  EVENT_WATERING_START,     // Next watering interval elapses
+  EVENT_WATERING_STOP,      // Running pump reaches its watering duration
+  EVENT_LIGHTS,             // Next lights on/off transition
+  EVENT_STAGE_CHANGE,       // Growth cycle moves to its next stage
+  EVENT_NETWORK,            // Service MQTT and other network housekeeping
+  EVENT_CONFIG_COMMIT,      // Write pending config changes to flash
+  EVENT_RELAY_RELEASE,      // A relay held by its minimum on/off time may change again
+  EVENT_USAGE_CHECKPOINT,   // Save relay usage counters to flash and publish them
+  EVENT_STATS_PUBLISH,      // Publish sensor statistics
+  EVENT_COUNT
+};
+
+// Min-heap of deadlines, one slot per ControlEvent, in monotonic milliseconds.
+// loop() sleeps on its task notification until the earliest deadline;
+// other tasks call notify() to wake it early (queued commands, new clients).
+class ControlScheduler {
+private:
+  struct Entry {
+    int64_t deadline;
+    uint8_t event;
+  };
+
+  Entry _heap[EVENT_COUNT];
+  int8_t _position[EVENT_COUNT];  // Index of each event in _heap, -1 if not scheduled
+  int _size = 0;
+  TaskHandle_t _task = nullptr;
+
+public:
+  ControlScheduler() {
+    for (int i = 0; i < EVENT_COUNT; i++) {
+      _position[i] = -1;
+    }
+  }
+
+  // Monotonic time base for all deadlines
+  static int64_t nowMillis() {
+    return esp_timer_get_time() / 1000;
+  }
+
+  // Wall-clock time in milliseconds since the epoch
+  static int64_t wallMillis() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  }
+
+  // Must be called from the task that will wait on the scheduler
+  void begin() {
+    _task = xTaskGetCurrentTaskHandle();
+  }
+
+  // Wake the waiting task early. Safe to call from any task.
+  void notify() {
+    if (_task) {
+      xTaskNotifyGive(_task);
+    }
+  }
+
+  // Schedule or move an event to an absolute monotonic deadline
+  void schedule(ControlEvent event, int64_t deadline) {
+    int index = _position[event];
+    if (index < 0) {
+      index = _size++;
+      _heap[index].event = event;
+      _position[event] = index;
+    }
+    _heap[index].deadline = deadline;
+    siftUp(index);
+    siftDown(_position[event]);
+  }
+
+  // Schedule an event a number of milliseconds from now
+  void scheduleIn(ControlEvent event, int64_t delayMillis) {
+    schedule(event, nowMillis() + delayMillis);
+  }
+
+  // Schedule an event at a wall-clock time given in epoch seconds
+  void scheduleAtWallTime(ControlEvent event, time_t when) {
+    int64_t delayMillis = (int64_t)when * 1000 - wallMillis();
+    scheduleIn(event, delayMillis > 0 ? delayMillis : 0);
+  }
+
+  void cancel(ControlEvent event) {
+    int index = _position[event];
+    if (index < 0) {
+      return;
+    }
+    _position[event] = -1;
+    _size--;
+    if (index != _size) {
+      _heap[index] = _heap[_size];
+      _position[_heap[index].event] = index;
+      siftUp(index);
+      siftDown(_position[_heap[index].event]);
+    }
+  }
+
+  bool isScheduled(ControlEvent event) const {
+    return _position[event] >= 0;
+  }
+
+  // Remove and return the earliest event if it is due
+  bool popDue(int64_t now, ControlEvent& event) {
+    if (_size == 0 || _heap[0].deadline > now) {
+      return false;
+    }
+    event = (ControlEvent)_heap[0].event;
+    cancel(event);
+    return true;
+  }
+
+  // Earliest deadline, or INT64_MAX if nothing is scheduled
+  int64_t nextDeadline() const {
+    return _size > 0 ? _heap[0].deadline : INT64_MAX;
+  }
+
+  // Block until the earliest deadline or until notify() is called
+  void wait(uint32_t maxWaitMillis) {
+    int64_t remaining = nextDeadline() - nowMillis();
+    if (remaining <= 0) {
+      return;
+    }
+    if (remaining > maxWaitMillis) {
+      remaining = maxWaitMillis;
+    }
+    // Round up so we never wake just before the deadline
+    TickType_t ticks = (remaining + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+    ulTaskNotifyTake(pdTRUE, ticks);
+  }
+
+private:
+  void swap(int a, int b) {
+    Entry tmp = _heap[a];
+    _heap[a] = _heap[b];
+    _heap[b] = tmp;
+    _position[_heap[a].event] = a;
+    _position[_heap[b].event] = b;
+  }
+
+  void siftUp(int index) {
+    while (index > 0) {
+      int parent = (index - 1) / 2;
+      if (_heap[parent].deadline <= _heap[index].deadline) {
+        break;
+      }
+      swap(index, parent);
+      index = parent;
+    }
+  }
+
+  void siftDown(int index) {
+    for (;;) {
+      int smallest = index;
+      int left = 2 * index + 1;
+      int right = left + 1;
+      if (left < _size && _heap[left].deadline < _heap[smallest].deadline) smallest = left;
+      if (right < _size && _heap[right].deadline < _heap[smallest].deadline) smallest = right;
+      if (smallest == index) {
+        break;
+      }
+      swap(index, smallest);
+      index = smallest;
+    }
+  }
+};
@@ -0,0 +1,173 @@
+#pragma once
+#include <Arduino.h>
+#include <time.h>
+#include <math.h>
+#include "GrowthManager.h"
+
+// Limits for a simulation run on the device
+#define SIM_MAX_DAYS 14          // Longest window one request may simulate
+
+// Bounds the run if a stage waters every few seconds, override with
+// -DSIM_MAX_STEPS=<steps> where a whole cycle has to fit
+#ifndef SIM_MAX_STEPS
+#define SIM_MAX_STEPS 20000
+#endif
+
+enum CycleEventType : uint8_t {
+  CYCLE_EVENT_STAGE = 0,   // value: stage index, text: stage name
+  CYCLE_EVENT_LIGHTS,      // value: new relay state
+  CYCLE_EVENT_PUMP,        // value: new relay state
+  CYCLE_EVENT_ALERT,       // text: alert message
+  CYCLE_EVENT_TYPE_COUNT
+};
+
+static const char* const CYCLE_EVENT_NAMES[CYCLE_EVENT_TYPE_COUNT] = {
+  "stage", "lights", "pump", "alert"
+};
+
+// Each stage start raises at most two alerts, of up to SIM_ALERT_TEXT_MAX - 1
+// characters
+#define SIM_ALERT_TEXT_MAX 64
+#define SIM_MAX_ALERTS (2 * MAX_GROWTH_STAGES)
+
+// One entry of the simulated timeline. text is only valid during the callback.
+struct CycleEvent {
+  time_t time;
+  CycleEventType type;
+  int value;
+  const char* text;
+};
+
+// Relay on-time within one stage of the simulated window
+struct StageTotals {
+  uint32_t pumpSeconds;
+  uint32_t lightSeconds;
+  uint32_t waterings;
+};
+
+struct SimulationResult {
+  time_t from;
+  time_t until;              // End of the simulated window, earlier than asked if truncated
+  uint32_t steps;
+  uint32_t events;
+  uint32_t pumpSeconds;
+  uint32_t lightSeconds;
+  uint32_t waterings;
+  bool truncated;            // Stopped at SIM_MAX_STEPS
+  StageTotals stages[MAX_GROWTH_STAGES];
+};
+
+// Runs a growth cycle against a virtual clock. It steps from one control
+// event to the next exactly as the control loop's scheduler does and
+// applies the same plan compilation and relay rules, so the timeline shows
+// what the device would do without touching the relays or any stored state.
+// Safe to call from any task.
+class CycleSimulator {
+public:
+  // Simulate a cycle of `profile` started at cycleStart over [from, until).
+  // Watering starts fresh at `from`, as after a reboot. A non-NaN ph is
+  // checked against each stage's range as if the probe read it all along.
+  // onEvent(const CycleEvent&) receives the timeline in order.
+  template<typename EventFn>
+  static SimulationResult run(const GrowthProfile& profile, time_t cycleStart, time_t from, time_t until,
+                              float ph, EventFn onEvent) {
+    SimulationResult result;
+    memset(&result, 0, sizeof(result));
+    result.from = from;
+
+    GrowthPlan plan;
+    WateringState watering;
+    bool lights = false;
+    bool pump = false;
+    int stageIndex = -1;
+    time_t now = from;
+
+    while (now < until) {
+      if (result.steps == SIM_MAX_STEPS) {
+        result.truncated = true;
+        break;
+      }
+      result.steps++;
+
+      GrowthManager::compilePlan(profile, cycleStart, now, watering, plan);
+      if (plan.stageIndex != stageIndex) {
+        stageIndex = plan.stageIndex;
+        emit(result, onEvent, now, CYCLE_EVENT_STAGE, stageIndex, plan.stageName);
+        checkStage(result, onEvent, now, plan, ph);
+      }
+
+      time_t lastWatering = watering.lastWateringTime;
+      CycleOutputs outputs = GrowthManager::evaluateCycle(plan, now, pump, watering);
+      if (watering.lastWateringTime != lastWatering) {
+        result.waterings++;
+        result.stages[stageIndex].waterings++;
+      }
+      if (outputs.lights != lights || result.steps == 1) {
+        emit(result, onEvent, now, CYCLE_EVENT_LIGHTS, outputs.lights, nullptr);
+      }
+      if (outputs.pump != pump || result.steps == 1) {
+        emit(result, onEvent, now, CYCLE_EVENT_PUMP, outputs.pump, nullptr);
+      }
+      lights = outputs.lights;
+      pump = outputs.pump;
+
+      // Next deadline, as scheduleCycleEvents() would set it
+      GrowthManager::updateWateringTimes(plan, watering);
+      time_t next = until;
+      if (pump && plan.pumpStopTime > 0 && plan.pumpStopTime < next) {
+        next = plan.pumpStopTime;
+      }
+      if (plan.nextWateringStart > 0 && plan.nextWateringStart < next) {
+        next = plan.nextWateringStart;
+      }
+      if (plan.nextLightTransition(now) < next) {
+        next = plan.nextLightTransition(now);
+      }
+      if (plan.stageEnd > 0 && plan.stageEnd < next) {
+        next = plan.stageEnd;
+      }
+      if (next <= now) {
+        next = now + 1;
+      }
+
+      uint32_t span = next - now;
+      if (pump) {
+        result.pumpSeconds += span;
+        result.stages[stageIndex].pumpSeconds += span;
+      }
+      if (lights) {
+        result.lightSeconds += span;
+        result.stages[stageIndex].lightSeconds += span;
+      }
+      now = next;
+    }
+
+    result.until = now;
+    return result;
+  }
+
+private:
+  template<typename EventFn>
+  static void emit(SimulationResult& result, EventFn& onEvent, time_t time, CycleEventType type,
+                   int value, const char* text) {
+    CycleEvent event = {time, type, value, text};
+    result.events++;
+    onEvent(event);
+  }
+
+  // Schedule warnings for this stage, and the pH alert the device would raise
+  template<typename EventFn>
+  static void checkStage(SimulationResult& result, EventFn& onEvent, time_t now, const GrowthPlan& plan, float ph) {
+    char alertMsg[SIM_ALERT_TEXT_MAX];
+    if (plan.stage.waterDuration >= plan.stage.waterInterval) {
+      snprintf(alertMsg, sizeof(alertMsg), "Watering interval not longer than duration in %s stage", plan.stageName);
+      emit(result, onEvent, now, CYCLE_EVENT_ALERT, 0, alertMsg);
+    }
+    if (!isnan(ph) && (ph < plan.stage.phMin || ph > plan.stage.phMax)) {
+      // Same message as checkStageAlerts()
+      snprintf(alertMsg, sizeof(alertMsg), "pH %s for %s stage!",
+               ph < plan.stage.phMin ? "too low" : "too high", plan.stageName);
+      emit(result, onEvent, now, CYCLE_EVENT_ALERT, 0, alertMsg);
+    }
+  }
+};
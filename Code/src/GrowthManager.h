@@ -2,26 +2,10 @@
 #include <Arduino.h>
 #include <Preferences.h>
 #include <time.h>
-
-// Growth Profile Stage structure
-struct GrowthStage {
-  int duration;           // Duration in days
-  int waterDuration;      // Watering duration in minutes
-  int waterInterval;      // Watering interval in minutes
-  int lightHours;         // Light hours per day
-  int lightStartHour;     // Hour of day when lights turn on (24h format)
-  float phMin;            // Minimum pH value
-  float phMax;            // Maximum pH value
-};
-
-// Growth Profile structure
-struct GrowthProfile {
-  char id[32];            // Unique identifier for the profile
-  char name[64];          // Display name for the profile
-  GrowthStage seedling;   // Seedling stage settings
-  GrowthStage growing;    // Growing stage settings
-  GrowthStage harvesting; // Harvesting stage settings
-};
+#include <limits.h>
+#include <stddef.h>
+#include "LogBuffer.h"
+#include "ProfileCatalog.h"
 
 // Active Growth Cycle structure
 struct GrowthCycle {
@@ -30,18 +14,72 @@ struct GrowthCycle {
   bool active;            // Whether the cycle is active
 };
 
-// Maximum number of profiles to store
-#define MAX_PROFILES 10
+// Profile slots used in NVS by earlier firmware, migrated to the catalog
+#define LEGACY_NVS_PROFILES 10
+
+// Watering timers of the control loop
+struct WateringState {
+  time_t lastWateringTime = 0;    // Start of the last watering, 0 before the first
+  time_t pumpOnTime = 0;          // When the pump was first seen running, 0 while it is off
+};
+
+// Relay states the growth cycle asks for
+struct CycleOutputs {
+  bool lights;
+  bool pump;
+};
+
+// Active cycle resolved against its profile: absolute stage boundaries, the
+// current stage settings and today's light window. Compiled once and reused
+// until one of its boundaries passes or the cycle, profile or clock changes.
+struct GrowthPlan {
+  bool valid = false;             // Active cycle with a known profile
+  char profileId[32] = "";
+  int stageIndex = -1;            // Index into the profile's stages
+  char stageName[STAGE_NAME_SIZE] = "None";
+  GrowthStage stage = {};         // Settings of the current stage
+  time_t cycleStart = 0;
+  int totalDuration = 0;          // Sum of stage durations in days
+  time_t stageStart = 0;
+  time_t stageEnd = 0;            // 0 if the current stage is open-ended
+  time_t lightsOn = 0;            // Current light window if lightsOn <= now < lightsOff,
+  time_t lightsOff = 0;           // otherwise the next one
+  time_t nextWateringStart = 0;   // 0 if not known yet
+  time_t pumpStopTime = 0;        // 0 if the pump is not running on a timer
+  time_t validFrom = 0;           // Plan holds for validFrom <= now < validUntil
+  time_t validUntil = 0;
+
+  bool lightsOnAt(time_t now) const {
+    return now >= lightsOn && now < lightsOff;
+  }
+
+  time_t nextLightTransition(time_t now) const {
+    return now < lightsOn ? lightsOn : lightsOff;
+  }
+};
 
 class GrowthManager {
 private:
   Preferences& _preferences;
-  GrowthProfile _profiles[MAX_PROFILES];
-  int _profileCount = 0;
+  ProfileCatalog _catalog;
   GrowthCycle _activeCycle = {"", 0, false};
+
+  // Copy of the active cycle's profile, also kept in NVS so control does
+  // not depend on the catalog. Control task only.
+  GrowthProfile _activeProfile;
+  bool _activeProfileLoaded = false;
   
   // Default profile definitions
   static const GrowthProfile DEFAULT_PROFILES[3];
+  static const char* const LEGACY_STAGE_NAMES[3];
+
+  // Compiled plan: _plan belongs to the control task, _publishedPlan is
+  // the copy other tasks read under _planLock
+  GrowthPlan _plan;
+  GrowthPlan _publishedPlan;
+  bool _planDirty = true;
+  WateringState _watering;
+  portMUX_TYPE _planLock = portMUX_INITIALIZER_UNLOCKED;
   
 public:
   GrowthManager(Preferences& preferences) : _preferences(preferences) {}
@@ -51,65 +89,39 @@ public:
     loadActiveCycle();
   }
 
-  // Get all profiles and count
-  const GrowthProfile* getProfiles() const { return _profiles; }
-  int getProfileCount() const { return _profileCount; }
+  // Profile catalog, for listings. Safe to use from any task.
+  ProfileCatalog& getCatalog() { return _catalog; }
   const GrowthCycle& getActiveCycle() const { return _activeCycle; }
 
-  // Functions for Growth Profile management
-  void saveProfiles() {
-    _preferences.begin("hydroGrowth", false);
-    
-    // Save profile count
-    _preferences.putInt("profileCount", _profileCount);
-    
-    // Save each profile
-    for (int i = 0; i < _profileCount; i++) {
-      String prefix = "profile" + String(i);
-      _preferences.putBytes(prefix.c_str(), &_profiles[i], sizeof(GrowthProfile));
-    }
-    
-    _preferences.end();
-    Serial.printf("Saved %d profiles\n", _profileCount);
+  // Copy a profile out of the catalog. Safe to call from any task.
+  bool getProfile(const char* id, GrowthProfile& profile) {
+    return _catalog.get(id, profile);
   }
 
   void loadProfiles() {
-    _preferences.begin("hydroGrowth", false);
-    
-    // Load profile count (default to 0 if not found)
-    _profileCount = _preferences.getInt("profileCount", 0);
+    if (!_catalog.begin()) {
+      return;
+    }
+    if (_catalog.count() == 0) {
+      migrateNvsProfiles();
+    }
     
     // If no profiles exist, initialize with defaults
-    if (_profileCount == 0) {
-      Serial.println("No saved profiles found - initializing with defaults");
-      
-      // Copy default profiles
+    if (_catalog.count() == 0) {
+      LOG_INFO(LOG_GROWTH, "No saved profiles found - initializing with defaults");
       for (int i = 0; i < 3; i++) { // 3 default profiles
-        if (i < MAX_PROFILES) {
-          memcpy(&_profiles[i], &DEFAULT_PROFILES[i], sizeof(GrowthProfile));
-          _profileCount++;
-        }
-      }
-      
-      // Save the initialized profiles
-      saveProfiles();
-    } else {
-      // Load existing profiles
-      for (int i = 0; i < _profileCount && i < MAX_PROFILES; i++) {
-        String prefix = "profile" + String(i);
-        _preferences.getBytes(prefix.c_str(), &_profiles[i], sizeof(GrowthProfile));
+        GrowthProfile profile = DEFAULT_PROFILES[i];
+        profile.updateStageEnds();
+        _catalog.save(profile);
       }
-      Serial.printf("Loaded %d profiles\n", _profileCount);
     }
-    
-    _preferences.end();
   }
 
   void saveActiveCycle() {
     _preferences.begin("hydroGrowth", false);
     _preferences.putBytes("activeCycle", &_activeCycle, sizeof(GrowthCycle));
     _preferences.end();
-    Serial.println("Saved active cycle");
+    LOG_INFO(LOG_GROWTH, "Saved active cycle");
   }
 
   void loadActiveCycle() {
@@ -118,148 +130,103 @@ public:
     // Check if active cycle exists
     if (_preferences.getBytesLength("activeCycle") == sizeof(GrowthCycle)) {
       _preferences.getBytes("activeCycle", &_activeCycle, sizeof(GrowthCycle));
-      Serial.println("Loaded active cycle");
+      LOG_INFO(LOG_GROWTH, "Loaded active cycle");
       
-      // Validate the loaded cycle
-      bool validCycle = false;
-      for (int i = 0; i < _profileCount; i++) {
-        if (strcmp(_activeCycle.profileId, _profiles[i].id) == 0) {
-          validCycle = true;
-          break;
+      // Load the cycle's profile, from NVS or else from the catalog
+      if (_activeCycle.active) {
+        _activeProfileLoaded = readProfile("activeProfile", _activeProfile) &&
+                               strcmp(_activeProfile.id, _activeCycle.profileId) == 0;
+        if (!_activeProfileLoaded && _catalog.get(_activeCycle.profileId, _activeProfile)) {
+          _activeProfileLoaded = true;
+          _preferences.putBytes("activeProfile", &_activeProfile, _activeProfile.storedSize());
         }
       }
       
-      if (!validCycle && _activeCycle.active) {
-        Serial.println("Warning: Active cycle references non-existent profile, disabling");
+      if (!_activeProfileLoaded && _activeCycle.active) {
+        LOG_WARN(LOG_GROWTH, "Active cycle references non-existent profile, disabling");
         _activeCycle.active = false;
-        saveActiveCycle();
+        _preferences.putBytes("activeCycle", &_activeCycle, sizeof(GrowthCycle));
       }
     } else {
       // Initialize a new inactive cycle
       strlcpy(_activeCycle.profileId, "", sizeof(_activeCycle.profileId));
       _activeCycle.startTime = 0;
       _activeCycle.active = false;
-      Serial.println("No active cycle found");
+      LOG_INFO(LOG_GROWTH, "No active cycle found");
     }
     
     _preferences.end();
   }
 
-  // Find a profile by ID
-  GrowthProfile* findProfileById(const char* id) {
-    for (int i = 0; i < _profileCount; i++) {
-      if (strcmp(_profiles[i].id, id) == 0) {
-        return &_profiles[i];
-      }
+  // Compiled plan for the active cycle, recompiled when it expires (stage
+  // boundary or lights transition) or after invalidatePlan(). Control task only.
+  const GrowthPlan& getPlan(time_t currentTime) {
+    if (_planDirty || currentTime < _plan.validFrom || currentTime >= _plan.validUntil) {
+      compilePlan(currentTime);
     }
-    return nullptr;
+    return _plan;
   }
 
-  // Get current growth stage based on active cycle
-  String getCurrentGrowthStage(unsigned long currentTime) {
-    if (!_activeCycle.active) {
-      return "None";
-    }
-    
-    // Find the profile
-    GrowthProfile* profile = findProfileById(_activeCycle.profileId);
-    if (!profile) {
-      return "Invalid";
-    }
-    
-    // Calculate elapsed days
-    unsigned long elapsedDays = (currentTime - _activeCycle.startTime) / (24 * 60 * 60);
-    
-    // Determine current stage - harvesting stage continues indefinitely
-    if (elapsedDays < profile->seedling.duration) {
-      return "Seedling";
-    } else if (elapsedDays < (profile->seedling.duration + profile->growing.duration)) {
-      return "Growing";
-    } else {
-      // Harvesting stage continues until cycle is stopped or changed
-      return "Harvesting";
-    }
+  // Copy of the most recently compiled plan, safe to call from any task
+  GrowthPlan getPlanSnapshot() {
+    GrowthPlan snapshot;
+    portENTER_CRITICAL(&_planLock);
+    snapshot = _publishedPlan;
+    portEXIT_CRITICAL(&_planLock);
+    return snapshot;
   }
 
-  // Get current growth stage settings
-  GrowthStage* getCurrentStageSettings() {
-    if (!_activeCycle.active) {
-      return nullptr;
-    }
-    
-    // Find the profile
-    GrowthProfile* profile = findProfileById(_activeCycle.profileId);
-    if (!profile) {
-      return nullptr;
-    }
-    
-    // Calculate elapsed days
-    unsigned long currentTime = time(nullptr);
-    unsigned long elapsedDays = (currentTime - _activeCycle.startTime) / (24 * 60 * 60);
-    
-    // Determine current stage and return appropriate settings
-    // Harvesting stage continues indefinitely
-    if (elapsedDays < profile->seedling.duration) {
-      return &profile->seedling;
-    } else if (elapsedDays < (profile->seedling.duration + profile->growing.duration)) {
-      return &profile->growing;
-    } else {
-      // Harvesting stage continues until cycle is stopped or changed
-      return &profile->harvesting;
+  // Force a recompile, e.g. after the wall clock has been stepped
+  void invalidatePlan() {
+    _planDirty = true;
+  }
+
+  // Record the watering timers so the plan can report the next pump transitions
+  void setWateringState(const WateringState& watering) {
+    if (watering.lastWateringTime == _watering.lastWateringTime && watering.pumpOnTime == _watering.pumpOnTime) {
+      return;
     }
+    _watering = watering;
+    updateWateringTimes(_plan, _watering);
+    publishPlan();
   }
 
-  // Add a new profile
+  // Add a new profile, or replace the one with the same ID
   bool addProfile(GrowthProfile* newProfile) {
-    if (_profileCount >= MAX_PROFILES) {
+    newProfile->format = PROFILE_FORMAT;
+    newProfile->updateStageEnds();
+    if (!_catalog.save(*newProfile)) {
       return false;
     }
-    
-    // Check if ID exists
-    for (int i = 0; i < _profileCount; i++) {
-      if (strcmp(_profiles[i].id, newProfile->id) == 0) {
-        // Update existing profile
-        memcpy(&_profiles[i], newProfile, sizeof(GrowthProfile));
-        saveProfiles();
-        return true;
-      }
+    if (_activeCycle.active && strcmp(_activeCycle.profileId, newProfile->id) == 0) {
+      setActiveProfile(*newProfile);
     }
-    
-    // Add new profile
-    memcpy(&_profiles[_profileCount], newProfile, sizeof(GrowthProfile));
-    _profileCount++;
-    saveProfiles();
     return true;
   }
 
   // Update a profile
   bool updateProfile(const char* id, GrowthProfile* updatedProfile) {
-    // Find and update the profile
-    for (int i = 0; i < _profileCount; i++) {
-      if (strcmp(_profiles[i].id, id) == 0) {
-        // Copy content but preserve the original ID
-        strlcpy(updatedProfile->id, id, sizeof(updatedProfile->id));
-        memcpy(&_profiles[i], updatedProfile, sizeof(GrowthProfile));
-        saveProfiles();
-        return true;
-      }
+    if (!_catalog.contains(id)) {
+      return false;
     }
-    
-    return false;
+    // Copy content but preserve the original ID
+    strlcpy(updatedProfile->id, id, sizeof(updatedProfile->id));
+    return addProfile(updatedProfile);
+  }
+
+  // Remove a profile. Fails for the profile of the active cycle.
+  bool deleteProfile(const char* id) {
+    if (_activeCycle.active && strcmp(_activeCycle.profileId, id) == 0) {
+      return false;
+    }
+    return _catalog.remove(id);
   }
 
   // Start a growth cycle
   bool startGrowthCycle(const char* profileId, unsigned long startTime) {
     // Find the profile
-    bool profileFound = false;
-    for (int i = 0; i < _profileCount; i++) {
-      if (strcmp(_profiles[i].id, profileId) == 0) {
-        profileFound = true;
-        break;
-      }
-    }
-    
-    if (!profileFound) {
+    GrowthProfile profile;
+    if (!_catalog.get(profileId, profile)) {
       return false;
     }
     
@@ -270,6 +237,7 @@ public:
     
     // Save to persistent storage
     saveActiveCycle();
+    setActiveProfile(profile);
     return true;
   }
 
@@ -277,7 +245,223 @@ public:
   void stopGrowthCycle() {
     _activeCycle.active = false;
     saveActiveCycle();
+    _planDirty = true;
   }
+
+  // Resolve a cycle of `profile` started at cycleStart into the plan that
+  // holds at currentTime. No device state is touched, so the cycle
+  // simulator compiles its plans with this too.
+  static void compilePlan(const GrowthProfile& profile, time_t cycleStart, time_t currentTime,
+                          const WateringState& watering, GrowthPlan& plan) {
+    plan = GrowthPlan();
+    plan.valid = true;
+    strlcpy(plan.profileId, profile.id, sizeof(plan.profileId));
+    plan.cycleStart = cycleStart;
+    plan.totalDuration = profile.totalDuration();
+
+    // Stage boundaries come from the profile's prefix sums; the last
+    // stage continues until the cycle is stopped
+    int index = profile.stageAt(currentTime - cycleStart);
+    plan.stageIndex = index;
+    plan.stageStart = cycleStart + (index > 0 ? (time_t)profile.stageEndDays[index - 1] * SECONDS_PER_DAY : 0);
+    plan.stageEnd = index < profile.stageCount - 1 ? cycleStart + (time_t)profile.stageEndDays[index] * SECONDS_PER_DAY : 0;
+    plan.stage = profile.stages[index];
+    strlcpy(plan.stageName, plan.stage.name, sizeof(plan.stageName));
+
+    computeLightWindow(currentTime, plan.stage, plan.lightsOn, plan.lightsOff);
+    updateWateringTimes(plan, watering);
+
+    // Recompile at the previous or next stage boundary or lights transition
+    plan.validFrom = plan.lightsOnAt(currentTime) ? plan.lightsOn : plan.lightsOff - SECONDS_PER_DAY;
+    if (plan.validFrom < plan.stageStart && plan.stageStart <= currentTime) {
+      plan.validFrom = plan.stageStart;
+    }
+    plan.validUntil = plan.nextLightTransition(currentTime);
+    if (plan.stageEnd > 0 && plan.stageEnd < plan.validUntil) {
+      plan.validUntil = plan.stageEnd;
+    }
+  }
+
+  static void updateWateringTimes(GrowthPlan& plan, const WateringState& watering) {
+    if (!plan.valid) {
+      return;
+    }
+    plan.nextWateringStart = watering.lastWateringTime > 0 ? watering.lastWateringTime + plan.stage.waterInterval * 60 : 0;
+    plan.pumpStopTime = watering.pumpOnTime > 0 ? watering.pumpOnTime + plan.stage.waterDuration * 60 : 0;
+  }
+
+  // Relay states the plan asks for at `now`, given whether the pump is
+  // running, and advance the watering timers. The first call after boot
+  // (no watering yet) starts a watering right away. Shared by the control
+  // loop and the cycle simulator so both follow the same rules.
+  static CycleOutputs evaluateCycle(const GrowthPlan& plan, time_t now, bool pumpOn, WateringState& watering) {
+    CycleOutputs outputs;
+    outputs.lights = plan.lightsOnAt(now);
+    outputs.pump = pumpOn;
+
+    // Start a watering when none has run yet or the interval has passed
+    time_t wateringInterval = (time_t)plan.stage.waterInterval * 60;
+    if (watering.lastWateringTime == 0 || now - watering.lastWateringTime >= wateringInterval) {
+      outputs.pump = true;
+      watering.lastWateringTime = now;
+    }
+
+    // Time the pump from when it was first seen running
+    if (!outputs.pump) {
+      watering.pumpOnTime = 0;
+    } else if (watering.pumpOnTime == 0) {
+      watering.pumpOnTime = now;
+    } else if (now - watering.pumpOnTime >= (time_t)plan.stage.waterDuration * 60) {
+      outputs.pump = false;
+      watering.pumpOnTime = 0;
+    }
+    return outputs;
+  }
+
+private:
+  // Pin a profile as the one the control loop runs on
+  void setActiveProfile(const GrowthProfile& profile) {
+    _activeProfile = profile;
+    _activeProfileLoaded = true;
+    _preferences.begin("hydroGrowth", false);
+    _preferences.putBytes("activeProfile", &_activeProfile, _activeProfile.storedSize());
+    _preferences.end();
+    _planDirty = true;
+  }
+
+  // Move profiles stored in NVS by earlier firmware into the catalog
+  void migrateNvsProfiles() {
+    _preferences.begin("hydroGrowth", false);
+    
+    // Slot index, or profileCount with packed slots profile0..profileN-1
+    uint8_t slots[LEGACY_NVS_PROFILES];
+    int count;
+    size_t indexSize = _preferences.getBytesLength("slots");
+    if (indexSize > 0 && indexSize <= LEGACY_NVS_PROFILES) {
+      count = _preferences.getBytes("slots", slots, indexSize);
+    } else {
+      count = _preferences.getInt("profileCount", 0);
+      if (count > LEGACY_NVS_PROFILES) {
+        count = LEGACY_NVS_PROFILES;
+      }
+      for (int i = 0; i < count; i++) {
+        slots[i] = i;
+      }
+    }
+    
+    int migrated = 0;
+    for (int i = 0; i < count; i++) {
+      GrowthProfile profile;
+      if (readProfile(slotKey(slots[i]).c_str(), profile) && _catalog.save(profile)) {
+        migrated++;
+      } else {
+        LOG_WARN(LOG_GROWTH, "Discarding unreadable profile in slot %d", slots[i]);
+      }
+    }
+    
+    if (count > 0) {
+      for (int slot = 0; slot < LEGACY_NVS_PROFILES; slot++) {
+        _preferences.remove(slotKey(slot).c_str());
+      }
+      _preferences.remove("slots");
+      _preferences.remove("profileCount");
+      LOG_INFO(LOG_GROWTH, "Moved %d profiles from NVS to the catalog", migrated);
+    }
+    _preferences.end();
+  }
+
+  // Read a profile blob from NVS, converting the three-stage layout.
+  // Returns false if it is missing or corrupt. Preferences must be open.
+  bool readProfile(const char* key, GrowthProfile& profile) {
+    size_t size = _preferences.getBytesLength(key);
+    memset(&profile, 0, sizeof(profile));
+
+    if (size == sizeof(LegacyGrowthProfile)) {
+      LegacyGrowthProfile legacy;
+      _preferences.getBytes(key, &legacy, sizeof(legacy));
+      strlcpy(profile.id, legacy.id, sizeof(profile.id));
+      strlcpy(profile.name, legacy.name, sizeof(profile.name));
+      profile.format = PROFILE_FORMAT;
+      profile.stageCount = 3;
+      for (int i = 0; i < 3; i++) {
+        const LegacyGrowthStage& from = legacy.stages[i];
+        GrowthStage& to = profile.stages[i];
+        strlcpy(to.name, LEGACY_STAGE_NAMES[i], sizeof(to.name));
+        to.duration = from.duration;
+        to.waterDuration = from.waterDuration;
+        to.waterInterval = from.waterInterval;
+        to.lightHours = from.lightHours;
+        to.lightStartHour = from.lightStartHour;
+        to.phMin = from.phMin;
+        to.phMax = from.phMax;
+      }
+      profile.updateStageEnds();
+      LOG_INFO(LOG_GROWTH, "Migrated three-stage profile %s", profile.id);
+      return true;
+    }
+
+    if (size <= offsetof(GrowthProfile, stages) || size > offsetof(GrowthProfile, stageEndDays)) {
+      return false;
+    }
+    _preferences.getBytes(key, &profile, size);
+    if (profile.format != PROFILE_FORMAT || profile.stageCount == 0 ||
+        profile.stageCount > MAX_GROWTH_STAGES || size != profile.storedSize()) {
+      return false;
+    }
+    profile.id[sizeof(profile.id) - 1] = '\0';
+    profile.name[sizeof(profile.name) - 1] = '\0';
+    profile.updateStageEnds();
+    return true;
+  }
+
+  static String slotKey(int slot) {
+    return "profile" + String(slot);
+  }
+
+  void compilePlan(time_t currentTime) {
+    GrowthPlan plan;
+    if (_activeCycle.active && _activeProfileLoaded) {
+      compilePlan(_activeProfile, _activeCycle.startTime, currentTime, _watering, plan);
+    } else {
+      plan.validFrom = 0;
+      plan.validUntil = LONG_MAX;
+      if (_activeCycle.active) {
+        strlcpy(plan.stageName, "Invalid", sizeof(plan.stageName));
+      }
+    }
+
+    _plan = plan;
+    _planDirty = false;
+    publishPlan();
+  }
+
+  // Light window containing currentTime, or the next one if the lights are off
+  static void computeLightWindow(time_t currentTime, const GrowthStage& stage, time_t& lightsOn, time_t& lightsOff) {
+    struct tm timeinfo;
+    localtime_r(&currentTime, &timeinfo);
+    time_t midnight = currentTime - (timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60 + timeinfo.tm_sec);
+    int lightHours = constrain(stage.lightHours, 0, 24);
+
+    lightsOn = midnight + stage.lightStartHour * 3600;
+    if (lightsOn > currentTime) {
+      lightsOn -= SECONDS_PER_DAY;
+    }
+    lightsOff = lightsOn + lightHours * 3600;
+    if (currentTime >= lightsOff) {
+      lightsOn += SECONDS_PER_DAY;
+      lightsOff += SECONDS_PER_DAY;
+    }
+  }
+
+  void publishPlan() {
+    portENTER_CRITICAL(&_planLock);
+    _publishedPlan = _plan;
+    portEXIT_CRITICAL(&_planLock);
+  }
+};
+
+const char* const GrowthManager::LEGACY_STAGE_NAMES[3] = {
+  "Seedling", "Growing", "Harvesting"
 };
 
 // Initialize default profiles
@@ -285,22 +469,34 @@ const GrowthProfile GrowthManager::DEFAULT_PROFILES[3] = {
   {
     "tomatoes",
     "Tomatoes",
-    {14, 5, 60, 8, 6, 5.5, 6.5},   // Seedling - 6AM light start
-    {35, 5, 30, 12, 6, 5.8, 6.2},  // Growing - 6AM light start
-    {21, 5, 45, 10, 6, 6.0, 6.5}   // Harvesting - 6AM light start
+    PROFILE_FORMAT,
+    3,
+    {
+      {"Seedling", 14, 5, 60, 8, 6, 5.5, 6.5},    // 6AM light start
+      {"Growing", 35, 5, 30, 12, 6, 5.8, 6.2},
+      {"Harvesting", 21, 5, 45, 10, 6, 6.0, 6.5}
+    }
   },
   {
     "peppers",
     "Peppers",
-    {14, 5, 120, 10, 6, 5.5, 6.5}, // Seedling - 6AM light start
-    {30, 5, 45, 14, 6, 5.8, 6.3},  // Growing - 6AM light start
-    {14, 5, 60, 12, 6, 5.8, 6.5}   // Harvesting - 6AM light start
+    PROFILE_FORMAT,
+    3,
+    {
+      {"Seedling", 14, 5, 120, 10, 6, 5.5, 6.5},  // 6AM light start
+      {"Growing", 30, 5, 45, 14, 6, 5.8, 6.3},
+      {"Harvesting", 14, 5, 60, 12, 6, 5.8, 6.5}
+    }
   },
   {
     "lettuce",
     "Lettuce",
-    {7, 5, 90, 10, 6, 5.6, 6.2},   // Seedling - 6AM light start
-    {21, 5, 40, 12, 6, 5.6, 6.2},  // Growing - 6AM light start
-    {7, 5, 30, 12, 6, 5.8, 6.0}    // Harvesting - 6AM light start
+    PROFILE_FORMAT,
+    3,
+    {
+      {"Seedling", 7, 5, 90, 10, 6, 5.6, 6.2},    // 6AM light start
+      {"Growing", 21, 5, 40, 12, 6, 5.6, 6.2},
+      {"Harvesting", 7, 5, 30, 12, 6, 5.8, 6.0}
+    }
   }
 };
@@ -0,0 +1,574 @@
+#pragma once
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <math.h>
+#include <memory>
+#include <new>
+#include "Config.h"
+#include "LogBuffer.h"
+
+// One record per interval holds the mean of the readings taken in it
+#define HISTORY_INTERVAL_S 60
+
+// Most records kept, a week at 12 bytes each. The ring file is sized at
+// creation to what the partition has room for, up to this; below the
+// minimum the history stays in RAM.
+#define HISTORY_CAPACITY (7 * 24 * 60)
+#define HISTORY_MIN_CAPACITY 60
+
+// Flash left free when the file is sized: room for the MQTT spool (16 KB),
+// some 30 growth profiles (14 KB) and SPIFFS garbage collection
+#define HISTORY_FLASH_RESERVE (40 * 1024)
+
+// Records held in RAM before they are written to flash; a reboot loses at
+// most HISTORY_FLUSH_RECORDS intervals
+#define HISTORY_RAM_CAPACITY 16
+#define HISTORY_FLUSH_RECORDS 10
+
+// Most points one query returns, 8 bytes each in the result and 10 more
+// per bucket while it is downsampled; and records read from flash at a time
+#define HISTORY_MAX_POINTS 1000
+#define HISTORY_READ_CHUNK 32
+
+#define HISTORY_FILE_PATH "/history.bin"
+#define HISTORY_MAGIC 0x48535432  // "HST2"
+
+// Stored value of a metric without readings in the interval
+#define HISTORY_NO_VALUE INT16_MIN
+
+// Fixed-point scale and decimals in query output of each metric
+static const float HISTORY_SCALE[METRIC_COUNT] = {10.0f, 100.0f, 1.0f, 100.0f};
+static const uint8_t HISTORY_DECIMALS[METRIC_COUNT] = {1, 2, 0, 2};
+
+struct HistoryRecord {
+  uint32_t time;                       // Start of the interval, Unix time
+  int16_t values[METRIC_COUNT];        // Mean times HISTORY_SCALE, or HISTORY_NO_VALUE
+};
+
+struct HistoryPoint {
+  uint32_t time;
+  int16_t value;                       // Times HISTORY_SCALE
+};
+
+// Points of one query, filled by HistoryStore::query() and then written out
+// as JSON a piece at a time, so a chunked response never holds more than
+// one chunk of text
+class HistoryQuery {
+private:
+  friend class HistoryStore;
+
+  std::unique_ptr<HistoryPoint[]> _points;
+  uint16_t _capacity;
+  uint16_t _count = 0;
+  TelemetryMetric _metric = METRIC_LIQUID_LEVEL;
+  uint32_t _records = 0;
+  int32_t _next = -1;   // Point written next; -1 is the opening, _count the closing
+  bool _done = false;
+
+  void add(uint32_t time, int16_t value) {
+    if (_count < _capacity) {
+      _points[_count++] = {time, value};
+    }
+  }
+
+public:
+  // At most maxPoints points, clamped to 3..HISTORY_MAX_POINTS. Check ok()
+  // for the allocation.
+  explicit HistoryQuery(uint16_t maxPoints) {
+    _capacity = constrain(maxPoints, 3, HISTORY_MAX_POINTS);
+    _points.reset(new (std::nothrow) HistoryPoint[_capacity]);
+  }
+
+  bool ok() const {
+    return _points != nullptr;
+  }
+
+  uint16_t size() const {
+    return _count;
+  }
+
+  const HistoryPoint& point(uint16_t index) const {
+    return _points[index];
+  }
+
+  float value(uint16_t index) const {
+    return _points[index].value / HISTORY_SCALE[_metric];
+  }
+
+  // Records in the queried range
+  uint32_t records() const {
+    return _records;
+  }
+
+  // Write as many whole pieces of the JSON as fit in size bytes. Returns
+  // the bytes written, 0 once everything has been.
+  size_t write(char* buffer, size_t size) {
+    size_t length = 0;
+    char piece[96];
+    while (!_done) {
+      int n;
+      if (_next < 0) {
+        n = snprintf(piece, sizeof(piece), "{\"metric\":\"%s\",\"interval_s\":%d,\"records\":%lu,\"data\":[",
+                     METRIC_NAMES[_metric], HISTORY_INTERVAL_S, (unsigned long)_records);
+      } else if (_next < _count) {
+        n = snprintf(piece, sizeof(piece), "%s[%lu,%.*f]", _next ? "," : "", (unsigned long)_points[_next].time,
+                     HISTORY_DECIMALS[_metric], value(_next));
+      } else {
+        n = snprintf(piece, sizeof(piece), "]}");
+      }
+      if (length + n > size) {
+        break;
+      }
+      memcpy(buffer + length, piece, n);
+      length += n;
+      if (_next == _count) {
+        _done = true;
+      } else {
+        _next++;
+      }
+    }
+    return length;
+  }
+
+  bool done() const {
+    return _done;
+  }
+};
+
+// Telemetry history in a fixed-size ring file on SPIFFS, in the layout of
+// TelemetrySpool. Queries downsample a time range to a point budget with
+// Largest-Triangle-Three-Buckets while reading the file, so the result
+// size depends on the budget rather than the range. add() runs on the
+// control task and never waits for a query; query() may run on any task.
+class HistoryStore {
+private:
+  struct FileHeader {
+    uint32_t magic;
+    uint16_t head;    // Index of the oldest record in the file
+    uint16_t count;   // Records in the file
+    uint16_t capacity;// Records the file has room for
+    uint16_t reserved;
+  };
+
+  // Interval being averaged, control task only
+  uint32_t _slot = 0;
+  float _sums[METRIC_COUNT];
+  uint16_t _counts[METRIC_COUNT];
+  HistoryRecord _pending;
+  bool _hasPending = false;
+
+  // Guarded by _lock
+  HistoryRecord _ram[HISTORY_RAM_CAPACITY];
+  int _ramHead = 0;
+  int _ramCount = 0;
+  FileHeader _header = {HISTORY_MAGIC, 0, 0, 0, 0};
+  bool _fileOk = false;
+  SemaphoreHandle_t _lock = nullptr;
+
+  // Reads records in logical order, oldest first, the file part in chunks.
+  // Call with _lock held.
+  class Reader {
+  private:
+    HistoryStore& _store;
+    File _file;
+    HistoryRecord _chunk[HISTORY_READ_CHUNK];
+    uint32_t _chunkStart = 0;
+    uint32_t _chunkCount = 0;
+
+  public:
+    Reader(HistoryStore& store) : _store(store) {
+      if (_store._fileOk && _store._header.count > 0) {
+        _file = SPIFFS.open(HISTORY_FILE_PATH, FILE_READ);
+      }
+    }
+
+    ~Reader() {
+      _file.close();
+    }
+
+    uint32_t size() const {
+      return (_file ? _store._header.count : 0) + _store._ramCount;
+    }
+
+    bool read(uint32_t index, HistoryRecord& record) {
+      uint32_t fileCount = _file ? _store._header.count : 0;
+      if (index >= fileCount) {
+        index -= fileCount;
+        if (index >= (uint32_t)_store._ramCount) {
+          return false;
+        }
+        record = _store._ram[(_store._ramHead + index) % HISTORY_RAM_CAPACITY];
+        return true;
+      }
+      if (index < _chunkStart || index >= _chunkStart + _chunkCount) {
+        // Stop the chunk at the end of the file so it is one contiguous read
+        uint32_t slot = (_store._header.head + index) % _store._header.capacity;
+        uint32_t count = fileCount - index;
+        if (count > HISTORY_READ_CHUNK) {
+          count = HISTORY_READ_CHUNK;
+        }
+        if (count > _store._header.capacity - slot) {
+          count = _store._header.capacity - slot;
+        }
+        _chunkCount = 0;
+        if (!_file.seek(recordOffset(slot)) ||
+            _file.read((uint8_t*)_chunk, count * sizeof(HistoryRecord)) != count * sizeof(HistoryRecord)) {
+          return false;
+        }
+        _chunkStart = index;
+        _chunkCount = count;
+      }
+      record = _chunk[index - _chunkStart];
+      return true;
+    }
+
+    // First record at or after the given time; records are in time order
+    uint32_t lowerBound(uint32_t time) {
+      uint32_t low = 0;
+      uint32_t high = size();
+      HistoryRecord record;
+      while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (read(mid, record) && record.time < time) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      return low;
+    }
+  };
+
+  void resetInterval(uint32_t slot) {
+    _slot = slot;
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      _sums[i] = 0;
+      _counts[i] = 0;
+    }
+  }
+
+  void finishInterval() {
+    _pending.time = _slot * HISTORY_INTERVAL_S;
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      float value = _counts[i] ? roundf(_sums[i] / _counts[i] * HISTORY_SCALE[i]) : NAN;
+      _pending.values[i] = isnan(value) ? HISTORY_NO_VALUE : (int16_t)constrain(value, -32767.0f, 32767.0f);
+    }
+    _hasPending = true;
+  }
+
+  // Move the pending record to RAM if no query holds the lock; otherwise
+  // it is retried on the next add()
+  void storePending() {
+    if (!_hasPending || xSemaphoreTake(_lock, 0) != pdTRUE) {
+      return;
+    }
+    if (_ramCount == HISTORY_RAM_CAPACITY) {
+      // Flash unavailable, fall back to evicting from RAM
+      _ramHead = (_ramHead + 1) % HISTORY_RAM_CAPACITY;
+      _ramCount--;
+    }
+    _ram[(_ramHead + _ramCount) % HISTORY_RAM_CAPACITY] = _pending;
+    _ramCount++;
+    _hasPending = false;
+    if (_ramCount >= HISTORY_FLUSH_RECORDS) {
+      flush();
+    }
+    xSemaphoreGive(_lock);
+  }
+
+  // Append all RAM records to the ring file, overwriting the oldest when
+  // full. Call with _lock held.
+  void flush() {
+    if (!_fileOk || _ramCount == 0) {
+      return;
+    }
+    File file = SPIFFS.open(HISTORY_FILE_PATH, "r+");
+    if (!file) {
+      LOG_WARN(LOG_SYSTEM, "Failed to open history file");
+      return;
+    }
+    while (_ramCount > 0) {
+      uint16_t tail = (_header.head + _header.count) % _header.capacity;
+      if (!file.seek(recordOffset(tail)) ||
+          file.write((const uint8_t*)&_ram[_ramHead], sizeof(HistoryRecord)) != sizeof(HistoryRecord)) {
+        LOG_WARN(LOG_SYSTEM, "Failed to write history file");
+        break;
+      }
+      if (_header.count == _header.capacity) {
+        _header.head = (_header.head + 1) % _header.capacity;
+      } else {
+        _header.count++;
+      }
+      _ramHead = (_ramHead + 1) % HISTORY_RAM_CAPACITY;
+      _ramCount--;
+    }
+    file.close();
+    writeHeader();
+  }
+
+  // Replace the file with a ring sized to the free space, written out in
+  // full so later writes cannot run out of room
+  bool create() {
+    SPIFFS.remove(HISTORY_FILE_PATH);
+    size_t used = SPIFFS.usedBytes();
+    size_t free = SPIFFS.totalBytes() > used ? SPIFFS.totalBytes() - used : 0;
+    size_t room = free > HISTORY_FLASH_RESERVE + sizeof(FileHeader) ? free - HISTORY_FLASH_RESERVE - sizeof(FileHeader) : 0;
+    uint32_t capacity = room / sizeof(HistoryRecord);
+    if (capacity > HISTORY_CAPACITY) {
+      capacity = HISTORY_CAPACITY;
+    }
+    _header = {HISTORY_MAGIC, 0, 0, (uint16_t)capacity, 0};
+    if (capacity < HISTORY_MIN_CAPACITY) {
+      LOG_WARN(LOG_SYSTEM, "%u bytes of flash free, keeping history in RAM only", (unsigned)free);
+      return false;
+    }
+
+    File file = SPIFFS.open(HISTORY_FILE_PATH, FILE_WRITE);
+    bool ok = file && file.write((const uint8_t*)&_header, sizeof(_header)) == sizeof(_header);
+    HistoryRecord blank[HISTORY_READ_CHUNK];
+    memset(blank, 0, sizeof(blank));
+    for (uint32_t i = 0; ok && i < capacity; i += HISTORY_READ_CHUNK) {
+      size_t bytes = (capacity - i < HISTORY_READ_CHUNK ? capacity - i : HISTORY_READ_CHUNK) * sizeof(HistoryRecord);
+      ok = file.write((const uint8_t*)blank, bytes) == bytes;
+    }
+    file.close();
+    if (!ok) {
+      LOG_WARN(LOG_SYSTEM, "Failed to create history file, keeping history in RAM only");
+      SPIFFS.remove(HISTORY_FILE_PATH);
+      return false;
+    }
+    LOG_INFO(LOG_SYSTEM, "History file holds %u records", (unsigned)capacity);
+    return true;
+  }
+
+  bool writeHeader() {
+    File file = SPIFFS.open(HISTORY_FILE_PATH, "r+");
+    if (!file) {
+      LOG_WARN(LOG_SYSTEM, "Failed to open history file, keeping history in RAM only");
+      return false;
+    }
+    bool ok = file.write((const uint8_t*)&_header, sizeof(_header)) == sizeof(_header);
+    file.close();
+    return ok;
+  }
+
+  static uint32_t recordOffset(uint32_t index) {
+    return sizeof(FileHeader) + index * sizeof(HistoryRecord);
+  }
+
+public:
+  HistoryStore() {
+    resetInterval(0);
+  }
+
+  // Pick up the history of previous boots, or create the file with as
+  // many records as the partition has room for. Call after SPIFFS is
+  // mounted and before the other files that size themselves to free space.
+  void begin() {
+    _lock = xSemaphoreCreateMutex();
+    FileHeader header = {0, 0, 0, 0, 0};
+    File file = SPIFFS.open(HISTORY_FILE_PATH, FILE_READ);
+    size_t size = file ? file.size() : 0;
+    if (size >= sizeof(FileHeader)) {
+      file.read((uint8_t*)&header, sizeof(header));
+    }
+    file.close();
+
+    if (header.magic == HISTORY_MAGIC && header.capacity >= HISTORY_MIN_CAPACITY &&
+        header.capacity <= HISTORY_CAPACITY && header.head < header.capacity && header.count <= header.capacity &&
+        size == recordOffset(header.capacity)) {
+      _header = header;
+      _fileOk = true;
+    } else {
+      _fileOk = create();
+    }
+    LOG_INFO(LOG_SYSTEM, "History holds %u of %u records", _header.count, _fileOk ? _header.capacity : 0);
+  }
+
+  // Add one reading of every metric (NaN if unreadable). now is Unix time;
+  // readings before the clock is set are not recorded.
+  void add(const float values[METRIC_COUNT], time_t now) {
+    if (!_lock || now < 1000000000) {
+      return;
+    }
+    uint32_t slot = (uint32_t)now / HISTORY_INTERVAL_S;
+    if (slot != _slot) {
+      bool hasReadings = false;
+      for (int i = 0; i < METRIC_COUNT; i++) {
+        hasReadings = hasReadings || _counts[i] > 0;
+      }
+      // A clock step back leaves the file in time order by dropping the
+      // interval in progress
+      if (hasReadings && slot > _slot && !_hasPending) {
+        finishInterval();
+      }
+      resetInterval(slot);
+    }
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      if (!isnan(values[i])) {
+        _sums[i] += values[i];
+        _counts[i]++;
+      }
+    }
+    storePending();
+  }
+
+  // Fill result with the history of one metric between from and to (Unix
+  // time), downsampled to the points it has room for. Two passes over the
+  // range: the first averages each bucket, the second picks from each
+  // bucket the point forming the largest triangle with the last point
+  // picked and the next bucket's average. Memory is ten bytes per bucket.
+  // Returns false if that memory is not available or the file cannot be read.
+  bool query(TelemetryMetric metric, uint32_t from, uint32_t to, HistoryQuery& result) {
+    result._metric = metric;
+    result._records = 0;
+    result._count = 0;
+    result._next = -1;
+    result._done = false;
+    if (!_lock || !result.ok()) {
+      return result.ok();
+    }
+    uint16_t maxPoints = result._capacity;
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    Reader reader(*this);
+    uint32_t first = reader.lowerBound(from);
+    uint32_t end = to < UINT32_MAX ? reader.lowerBound(to + 1) : reader.size();
+    uint32_t records = end > first ? end - first : 0;
+    float scale = HISTORY_SCALE[metric];
+    result._records = records;
+
+    uint32_t buckets = maxPoints - 2;
+    std::unique_ptr<float[]> averages;
+    std::unique_ptr<uint16_t[]> counts;
+    if (records > maxPoints) {
+      averages.reset(new (std::nothrow) float[2 * buckets]);
+      counts.reset(new (std::nothrow) uint16_t[buckets]);
+      if (!averages || !counts) {
+        xSemaphoreGive(_lock);
+        LOG_WARN(LOG_WEB, "Not enough memory to downsample %u history records", (unsigned)records);
+        return false;
+      }
+    }
+
+    HistoryRecord record;
+
+    if (records <= maxPoints) {
+      for (uint32_t i = first; i < end && reader.read(i, record); i++) {
+        if (record.values[metric] != HISTORY_NO_VALUE) {
+          result.add(record.time, record.values[metric]);
+        }
+      }
+    } else {
+      // Times are relative to the first record, so a float keeps them to
+      // well under a second across a week
+      float* averageT = averages.get();
+      float* averageY = averageT + buckets;
+      uint32_t inner = records - 2;
+      if (!reader.read(first, record)) {
+        xSemaphoreGive(_lock);
+        LOG_WARN(LOG_WEB, "Failed to read history record %u", (unsigned)first);
+        return false;
+      }
+      uint32_t base = record.time;
+      bool hasA = record.values[metric] != HISTORY_NO_VALUE;
+      float aT = 0;
+      float aY = hasA ? record.values[metric] / scale : 0;
+      if (hasA) {
+        result.add(record.time, record.values[metric]);
+      }
+
+      // Pass 1: bucket averages
+      for (uint32_t b = 0; b < buckets; b++) {
+        averageT[b] = averageY[b] = 0;
+        counts[b] = 0;
+      }
+      for (uint32_t k = 1; k <= inner && reader.read(first + k, record); k++) {
+        if (record.values[metric] != HISTORY_NO_VALUE) {
+          uint32_t b = (uint64_t)(k - 1) * buckets / inner;
+          averageT[b] += (float)(record.time - base);
+          averageY[b] += record.values[metric] / scale;
+          counts[b]++;
+        }
+      }
+
+      // Empty buckets take the average of the next one with points, so every
+      // bucket has a third vertex; after the last bucket it is the last record
+      HistoryRecord last;
+      bool hasLast = reader.read(end - 1, last) && last.values[metric] != HISTORY_NO_VALUE;
+      float lastT = hasLast ? (float)(last.time - base) : NAN;
+      float lastY = hasLast ? last.values[metric] / scale : NAN;
+      float nextT = lastT;
+      float nextY = lastY;
+      for (uint32_t b = buckets; b-- > 0;) {
+        if (counts[b]) {
+          averageT[b] /= counts[b];
+          averageY[b] /= counts[b];
+        } else {
+          averageT[b] = nextT;
+          averageY[b] = nextY;
+        }
+        nextT = averageT[b];
+        nextY = averageY[b];
+      }
+
+      // Pass 2: the largest triangle in each bucket. k runs one past the
+      // inner records to close the last bucket.
+      uint32_t bucket = UINT32_MAX;
+      float cT = 0;
+      float cY = 0;
+      float bestArea = -1;
+      uint32_t bestTime = 0;
+      int16_t bestValue = 0;
+      float bestT = 0;
+      float bestY = 0;
+      for (uint32_t k = 1; k <= inner + 1; k++) {
+        uint32_t b = k <= inner ? (uint64_t)(k - 1) * buckets / inner : buckets;
+        if (b != bucket) {
+          if (bestArea >= 0) {
+            result.add(bestTime, bestValue);
+            aT = bestT;
+            aY = bestY;
+            hasA = true;
+          }
+          if (b == buckets) {
+            break;
+          }
+          bucket = b;
+          bestArea = -1;
+          cT = bucket + 1 < buckets ? averageT[bucket + 1] : lastT;
+          cY = bucket + 1 < buckets ? averageY[bucket + 1] : lastY;
+        }
+        if (!reader.read(first + k, record) || record.values[metric] == HISTORY_NO_VALUE) {
+          continue;
+        }
+        float t = (float)(record.time - base);
+        float y = record.values[metric] / scale;
+        // Without a previous point or a next vertex the bucket's first point is taken
+        float area = hasA ? fabsf((aT - cT) * (y - aY) - (aT - t) * (cY - aY)) : 0;
+        if (area > bestArea || (bestArea < 0 && isnan(area))) {
+          bestArea = isnan(area) ? 0 : area;
+          bestTime = record.time;
+          bestValue = record.values[metric];
+          bestT = t;
+          bestY = y;
+        }
+      }
+      if (hasLast) {
+        result.add(last.time, last.values[metric]);
+      }
+    }
+    xSemaphoreGive(_lock);
+    return true;
+  }
+
+  // Records stored, in flash and RAM
+  uint32_t size() {
+    if (!_lock) {
+      return 0;
+    }
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    uint32_t count = _header.count + _ramCount;
+    xSemaphoreGive(_lock);
+    return count;
+  }
+};
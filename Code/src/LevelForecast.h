@@ -0,0 +1,141 @@
+#pragma once
+#include <Arduino.h>
+#include <math.h>
+
+// Time constant of the exponential forgetting: samples this old weigh 1/e
+#define LEVEL_FORECAST_TAU_H 6.0
+
+// Level samples are ignored while the pump runs and for this long after,
+// while the tower drains back into the reservoir
+#define LEVEL_SETTLE_MS (10UL * 60UL * 1000UL)
+
+// The fit is only reported once it covers this much time
+#define LEVEL_MIN_SPAN_H 0.5
+
+// A rise this far above the fitted level, in percent, is a refill; the
+// estimate starts over
+#define LEVEL_REFILL_PCT 5.0f
+
+// Samples are folded in at most this often; the level moves far slower
+#define LEVEL_SAMPLE_INTERVAL_MS 10000UL
+
+struct LevelForecastResult {
+  bool valid;                // Enough history for the values below
+  float level;               // Fitted level now, percent
+  float ratePerHour;         // Consumption in percent per hour, positive while the level drops
+  float hoursToCritical;     // Until the fitted level reaches the critical level, NaN if not dropping
+  uint32_t samples;          // Samples in the fit since the last reset
+};
+
+// Online least-squares fit of reservoir level against time. The sums are
+// weighted by exponential forgetting and kept relative to the newest
+// sample, so each sample costs the same fixed work and no history is stored.
+// Control task only; result() returns a copy for other tasks.
+class LevelForecast {
+private:
+  // Weighted sums over samples i of w, w*t, w*t^2, w*y, w*t*y, where t is
+  // hours relative to the newest sample (so t <= 0)
+  double _s0 = 0;
+  double _st = 0;
+  double _stt = 0;
+  double _sy = 0;
+  double _sty = 0;
+
+  int64_t _lastSample = 0;     // ms of the newest sample in the sums, 0 if none
+  int64_t _firstSample = 0;
+  int64_t _pumpStopped = 0;    // ms when the pump was last seen running
+  uint32_t _samples = 0;
+
+  LevelForecastResult _result;
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+  void reset() {
+    _s0 = _st = _stt = _sy = _sty = 0;
+    _lastSample = 0;
+    _samples = 0;
+  }
+
+  // Fitted slope (percent per hour) and level at the newest sample
+  bool fit(double& slope, double& level) const {
+    double det = _s0 * _stt - _st * _st;
+    if (_samples < 3 || det <= 1e-9) {
+      return false;
+    }
+    slope = (_s0 * _sty - _st * _sy) / det;
+    level = (_sy - slope * _st) / _s0;
+    return true;
+  }
+
+public:
+  LevelForecast() {
+    memset(&_result, 0, sizeof(_result));
+    _result.level = _result.ratePerHour = _result.hoursToCritical = NAN;
+  }
+
+  // Add a level reading in percent (NaN if unreadable). critical is the
+  // critical level in percent, NaN if not calibrated; now is a monotonic
+  // millisecond clock.
+  void add(float level, bool pumpRunning, float critical, int64_t now) {
+    if (pumpRunning) {
+      _pumpStopped = now;
+      return;
+    }
+    if (isnan(level) || (_pumpStopped && now - _pumpStopped < (int64_t)LEVEL_SETTLE_MS) ||
+        (_lastSample && now - _lastSample < (int64_t)LEVEL_SAMPLE_INTERVAL_MS)) {
+      return;
+    }
+
+    double slope;
+    double fitted;
+    if (fit(slope, fitted)) {
+      double predicted = fitted + slope * (now - _lastSample) / 3600000.0;
+      if (level > predicted + LEVEL_REFILL_PCT) {
+        reset();
+      }
+    }
+
+    if (_lastSample) {
+      // Age every sample by dt: t -> t - dt, and weights by exp(-dt / tau)
+      double dt = (now - _lastSample) / 3600000.0;
+      double decay = exp(-dt / LEVEL_FORECAST_TAU_H);
+      _stt = decay * (_stt - 2 * dt * _st + dt * dt * _s0);
+      _sty = decay * (_sty - dt * _sy);
+      _st = decay * (_st - dt * _s0);
+      _s0 *= decay;
+      _sy *= decay;
+    } else {
+      _firstSample = now;
+    }
+    _s0 += 1;
+    _sy += level;
+    _lastSample = now;
+    _samples++;
+
+    LevelForecastResult result;
+    result.valid = false;
+    result.level = level;
+    result.ratePerHour = NAN;
+    result.hoursToCritical = NAN;
+    result.samples = _samples;
+    if ((now - _firstSample) / 3600000.0 >= LEVEL_MIN_SPAN_H && fit(slope, fitted)) {
+      result.valid = true;
+      result.level = fitted;
+      result.ratePerHour = -slope;
+      if (slope < 0 && !isnan(critical)) {
+        result.hoursToCritical = fitted > critical ? (fitted - critical) / -slope : 0;
+      }
+    }
+
+    portENTER_CRITICAL(&_lock);
+    _result = result;
+    portEXIT_CRITICAL(&_lock);
+  }
+
+  // Safe to call from any task
+  LevelForecastResult result() {
+    portENTER_CRITICAL(&_lock);
+    LevelForecastResult result = _result;
+    portEXIT_CRITICAL(&_lock);
+    return result;
+  }
+};
@@ -0,0 +1,225 @@
+#pragma once
+#include <Arduino.h>
+#include <stdarg.h>
+
+// Size of the in-memory log ring, override with -DLOG_BUFFER_SIZE=<bytes>
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 8192
+#endif
+
+// Longest single log line, longer messages are truncated
+#define LOG_LINE_MAX 192
+
+// Log levels, in increasing order of importance
+enum LogLevel : uint8_t {
+  LOG_LEVEL_DEBUG = 0,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_ACTION,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_COUNT
+};
+
+// Modules that produce log output, used for remote filtering
+enum LogModule : uint8_t {
+  LOG_SYSTEM = 0,
+  LOG_CYCLE,
+  LOG_SENSOR,
+  LOG_MQTT,
+  LOG_WEB,
+  LOG_CONFIG,
+  LOG_GROWTH,
+  LOG_MODULE_COUNT
+};
+
+#define LOG_ALL_MODULES ((1u << LOG_MODULE_COUNT) - 1)
+
+// Header stored in front of every line in the ring
+struct LogRecord {
+  uint32_t seq;           // Monotonic sequence number
+  uint32_t timestamp;     // millis() when the line was written
+  uint8_t level;          // LogLevel
+  uint8_t module;         // LogModule
+  uint16_t length;        // Length of the text that follows
+};
+
+// Read position of a single consumer in the ring
+struct LogCursor {
+  uint32_t seq = 0;
+  uint32_t offset = 0;
+};
+
+// Fixed-size ring of recent log lines. Writers never block on readers:
+// when the ring is full the oldest lines are evicted, and a reader whose
+// cursor points at an evicted line skips ahead and is told how many it lost.
+class LogBuffer {
+private:
+  uint8_t _ring[LOG_BUFFER_SIZE];
+  uint32_t _head = 0;       // Offset where the next record is written
+  uint32_t _tail = 0;       // Offset of the oldest record
+  uint32_t _used = 0;       // Bytes currently occupied
+  uint32_t _firstSeq = 0;   // Sequence number of the oldest record
+  uint32_t _nextSeq = 0;    // Sequence number of the next record
+  uint8_t _serialLevel = LOG_LEVEL_INFO;
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+public:
+  LogBuffer() = default;
+
+  void setSerialLevel(LogLevel level) { _serialLevel = level; }
+
+  void write(LogLevel level, LogModule module, const char* format, ...) __attribute__((format(printf, 4, 5))) {
+    va_list args;
+    va_start(args, format);
+    vwrite(level, module, format, args);
+    va_end(args);
+  }
+
+  void vwrite(LogLevel level, LogModule module, const char* format, va_list args) {
+    char line[LOG_LINE_MAX];
+    int length = vsnprintf(line, sizeof(line), format, args);
+    if (length < 0) {
+      return;
+    }
+    if (length >= (int)sizeof(line)) {
+      length = sizeof(line) - 1;
+    }
+    // Trailing newlines are added by the consumers
+    while (length > 0 && line[length - 1] == '\n') {
+      line[--length] = '\0';
+    }
+
+    if (level >= _serialLevel) {
+      Serial.printf("[%s] %s\n", levelName(level), line);
+    }
+
+    LogRecord record;
+    record.timestamp = millis();
+    record.level = level;
+    record.module = module;
+    record.length = length;
+
+    uint32_t needed = sizeof(LogRecord) + length;
+    portENTER_CRITICAL(&_lock);
+    while (LOG_BUFFER_SIZE - _used < needed) {
+      evictOldest();
+    }
+    record.seq = _nextSeq++;
+    copyIn(_head, &record, sizeof(record));
+    copyIn((_head + sizeof(record)) % LOG_BUFFER_SIZE, line, length);
+    _head = (_head + needed) % LOG_BUFFER_SIZE;
+    _used += needed;
+    portEXIT_CRITICAL(&_lock);
+  }
+
+  // Position a cursor at the oldest line still held in the ring
+  LogCursor oldest() {
+    LogCursor cursor;
+    portENTER_CRITICAL(&_lock);
+    cursor.seq = _firstSeq;
+    cursor.offset = _tail;
+    portEXIT_CRITICAL(&_lock);
+    return cursor;
+  }
+
+  // Read the line at the cursor and advance it. Returns false when the
+  // cursor has caught up with the writer. Lines evicted before the reader
+  // got to them are added to dropped.
+  bool read(LogCursor& cursor, LogRecord& record, char* text, size_t textSize, uint32_t& dropped) {
+    portENTER_CRITICAL(&_lock);
+    if ((int32_t)(cursor.seq - _firstSeq) < 0) {
+      dropped += _firstSeq - cursor.seq;
+      cursor.seq = _firstSeq;
+      cursor.offset = _tail;
+    }
+    if (cursor.seq == _nextSeq) {
+      portEXIT_CRITICAL(&_lock);
+      return false;
+    }
+    copyOut(&record, cursor.offset, sizeof(record));
+    size_t length = record.length < textSize - 1 ? record.length : textSize - 1;
+    copyOut(text, (cursor.offset + sizeof(record)) % LOG_BUFFER_SIZE, length);
+    text[length] = '\0';
+    cursor.offset = (cursor.offset + sizeof(record) + record.length) % LOG_BUFFER_SIZE;
+    cursor.seq = record.seq + 1;
+    portEXIT_CRITICAL(&_lock);
+    return true;
+  }
+
+  // True if there is anything past the cursor
+  bool hasPending(const LogCursor& cursor) {
+    portENTER_CRITICAL(&_lock);
+    bool pending = cursor.seq != _nextSeq;
+    portEXIT_CRITICAL(&_lock);
+    return pending;
+  }
+
+  // The names are function-local statics, so every translation unit that
+  // includes this header shares one definition
+  static const char* levelName(uint8_t level) {
+    static const char* const NAMES[LOG_LEVEL_COUNT] = {
+      "DEBUG", "INFO", "ACTION", "WARN", "ERROR"
+    };
+    return level < LOG_LEVEL_COUNT ? NAMES[level] : "?";
+  }
+
+  static const char* moduleName(uint8_t module) {
+    static const char* const NAMES[LOG_MODULE_COUNT] = {
+      "system", "cycle", "sensor", "mqtt", "web", "config", "growth"
+    };
+    return module < LOG_MODULE_COUNT ? NAMES[module] : "?";
+  }
+
+  // Parse a level name, returns LOG_LEVEL_COUNT if unknown
+  static LogLevel parseLevel(const char* name) {
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+      if (strcasecmp(name, levelName(i)) == 0) {
+        return (LogLevel)i;
+      }
+    }
+    return LOG_LEVEL_COUNT;
+  }
+
+  // Parse a module name, returns LOG_MODULE_COUNT if unknown
+  static LogModule parseModule(const char* name) {
+    for (int i = 0; i < LOG_MODULE_COUNT; i++) {
+      if (strcasecmp(name, moduleName(i)) == 0) {
+        return (LogModule)i;
+      }
+    }
+    return LOG_MODULE_COUNT;
+  }
+
+private:
+  void evictOldest() {
+    LogRecord oldest;
+    copyOut(&oldest, _tail, sizeof(oldest));
+    uint32_t size = sizeof(LogRecord) + oldest.length;
+    _tail = (_tail + size) % LOG_BUFFER_SIZE;
+    _used -= size;
+    _firstSeq = oldest.seq + 1;
+  }
+
+  void copyIn(uint32_t offset, const void* data, size_t length) {
+    size_t first = LOG_BUFFER_SIZE - offset;
+    if (first > length) first = length;
+    memcpy(&_ring[offset], data, first);
+    memcpy(&_ring[0], (const uint8_t*)data + first, length - first);
+  }
+
+  void copyOut(void* data, uint32_t offset, size_t length) const {
+    size_t first = LOG_BUFFER_SIZE - offset;
+    if (first > length) first = length;
+    memcpy(data, &_ring[offset], first);
+    memcpy((uint8_t*)data + first, &_ring[0], length - first);
+  }
+};
+
+// Global log instance, defined in main.cpp
+extern LogBuffer hydroLog;
+
+#define LOG_DEBUG(module, ...) hydroLog.write(LOG_LEVEL_DEBUG, module, __VA_ARGS__)
+#define LOG_INFO(module, ...) hydroLog.write(LOG_LEVEL_INFO, module, __VA_ARGS__)
+#define LOG_ACTION(module, ...) hydroLog.write(LOG_LEVEL_ACTION, module, __VA_ARGS__)
+#define LOG_WARN(module, ...) hydroLog.write(LOG_LEVEL_WARN, module, __VA_ARGS__)
+#define LOG_ERROR(module, ...) hydroLog.write(LOG_LEVEL_ERROR, module, __VA_ARGS__)
@@ -3,280 +3,1060 @@
 #include <PubSubClient.h>
 #include <WiFi.h>
 #include <ArduinoJson.h>
+#include <algorithm>
+#include <atomic>
+#include <esp_timer.h>
 #include "Config.h"
+#include "LogBuffer.h"
+#include "TelemetrySpool.h"
+#include "RelayController.h"
+#include "SensorStats.h"
+#include "LevelForecast.h"
 
-// Callback function type
-typedef std::function<void(const String& topic, const String& payload)> MqttCallback;
+// Outbound messages waiting for the MQTT task; publishes are dropped when full
+#define MQTT_OUTBOX_SIZE 16
+#define MQTT_TOPIC_MAX 64
+#define MQTT_PAYLOAD_MAX 128
 
+// Reconnect backoff, doubled after every failed attempt up to the maximum
+#define MQTT_BACKOFF_MIN_MS 1000
+#define MQTT_BACKOFF_MAX_MS 60000
+
+// Upper bound on the TCP connect to the broker
+#define MQTT_CONNECT_TIMEOUT_MS 3000
+
+// How often the connected client is polled for inbound messages and keepalive
+#define MQTT_POLL_INTERVAL_MS 50
+
+// Spooled messages replayed per call to serviceSpool(), while the outbox has
+// at least MQTT_REPLAY_HEADROOM free slots left for live traffic
+#define MQTT_REPLAY_BURST 2
+#define MQTT_REPLAY_HEADROOM 4
+
+// Window over which message rates are averaged
+#define MQTT_RATE_WINDOW_MS 10000
+
+// How often the task rechecks WiFi and the enabled flag while idle
+#define MQTT_IDLE_INTERVAL_MS 1000
+
+#define MQTT_TASK_STACK 6144
+#define MQTT_TASK_PRIORITY 1
+
+// Inbound topics that can be routed to a handler
+#define MQTT_MAX_ROUTES 8
+
+#define HA_STATUS_TOPIC "homeassistant/status"
+
+// Where a Home Assistant entity reads its state from
+enum DiscoverySource : uint8_t {
+    SOURCE_METRIC,   // Telemetry metric topic, or its field of the JSON state topic
+    SOURCE_RELAY,    // Retained relay state topic, commands on its /set topic
+    SOURCE_CYCLE,    // Field of the retained growth cycle topic
+    SOURCE_USAGE,    // Field of a relay's retained usage topic
+    SOURCE_STATS,    // Field of a metric's retained statistics topic
+    SOURCE_FORECAST  // Field of the retained level forecast topic
+};
+
+// One Home Assistant entity. Discovery configs are generated from this table.
+struct DiscoveryEntity {
+    const char* component;    // HA platform: sensor, switch
+    const char* objectId;
+    const char* name;
+    const char* unit;         // nullptr if unitless
+    const char* deviceClass;  // nullptr if none
+    const char* icon;
+    DiscoverySource source;
+    uint8_t index;            // Metric or relay number
+    const char* field;        // JSON field of the SOURCE_CYCLE, SOURCE_USAGE, SOURCE_STATS and SOURCE_FORECAST topics
+};
+
+static const DiscoveryEntity DISCOVERY_ENTITIES[] = {
+    {"sensor", "liquid_level", "Liquid Level", "%", "water", "mdi:water-percent", SOURCE_METRIC, METRIC_LIQUID_LEVEL, nullptr},
+    {"sensor", "ph_value", "pH Value", "pH", nullptr, "mdi:ph", SOURCE_METRIC, METRIC_PH, nullptr},
+    {"sensor", "tds_value", "TDS Value", "ppm", nullptr, "mdi:water", SOURCE_METRIC, METRIC_TDS, nullptr},
+    {"sensor", "temperature_value", "Water Temperature", "\u00b0C", "temperature", "mdi:thermometer", SOURCE_METRIC, METRIC_TEMPERATURE, nullptr},
+    {"switch", "pump", "Pump", nullptr, nullptr, "mdi:pump", SOURCE_RELAY, RELAY_PUMP, nullptr},
+    {"switch", "lights", "Grow Lights", nullptr, nullptr, "mdi:lightbulb", SOURCE_RELAY, RELAY_LIGHTS, nullptr},
+    {"switch", "ph_up", "pH Up Pump", nullptr, nullptr, "mdi:arrow-up-bold-circle", SOURCE_RELAY, RELAY_PH_UP, nullptr},
+    {"switch", "ph_down", "pH Down Pump", nullptr, nullptr, "mdi:arrow-down-bold-circle", SOURCE_RELAY, RELAY_PH_DOWN, nullptr},
+    {"sensor", "growth_stage", "Growth Stage", nullptr, nullptr, "mdi:sprout", SOURCE_CYCLE, 0, "stage"},
+    {"sensor", "next_watering_change", "Next Watering Change", nullptr, "timestamp", "mdi:timer-outline", SOURCE_CYCLE, 0, "next_watering_change"},
+    {"sensor", "next_light_change", "Next Light Change", nullptr, "timestamp", "mdi:timer-outline", SOURCE_CYCLE, 0, "next_light_change"},
+    {"sensor", "pump_runtime", "Pump Runtime", "s", "duration", "mdi:timer-sand", SOURCE_USAGE, RELAY_PUMP, "on_s"},
+    {"sensor", "pump_starts", "Pump Starts", nullptr, nullptr, "mdi:counter", SOURCE_USAGE, RELAY_PUMP, "switches"},
+    {"sensor", "pump_energy", "Pump Energy", "Wh", "energy", "mdi:flash", SOURCE_USAGE, RELAY_PUMP, "energy_wh"},
+    {"sensor", "lights_runtime", "Grow Lights Runtime", "s", "duration", "mdi:timer-sand", SOURCE_USAGE, RELAY_LIGHTS, "on_s"},
+    {"sensor", "lights_energy", "Grow Lights Energy", "Wh", "energy", "mdi:flash", SOURCE_USAGE, RELAY_LIGHTS, "energy_wh"},
+    {"sensor", "liquid_level_sensor", "Liquid Level Sensor", nullptr, nullptr, "mdi:alert-circle-outline", SOURCE_STATS, METRIC_LIQUID_LEVEL, "status"},
+    {"sensor", "ph_sensor", "pH Sensor", nullptr, nullptr, "mdi:alert-circle-outline", SOURCE_STATS, METRIC_PH, "status"},
+    {"sensor", "tds_sensor", "TDS Sensor", nullptr, nullptr, "mdi:alert-circle-outline", SOURCE_STATS, METRIC_TDS, "status"},
+    {"sensor", "temperature_sensor", "Water Temperature Sensor", nullptr, nullptr, "mdi:alert-circle-outline", SOURCE_STATS, METRIC_TEMPERATURE, "status"},
+    {"sensor", "water_consumption", "Water Consumption", "%/h", nullptr, "mdi:water-minus", SOURCE_FORECAST, 0, "rate_pct_h"},
+    {"sensor", "time_to_critical", "Time to Critical Level", "h", "duration", "mdi:timer-alert-outline", SOURCE_FORECAST, 0, "hours_to_critical"}
+};
+
+#define DISCOVERY_ENTITY_COUNT (sizeof(DISCOVERY_ENTITIES) / sizeof(DISCOVERY_ENTITIES[0]))
+
+// Topic suffix of each relay's state topic; commands go to <state topic>/set
+static const char* const RELAY_TOPIC_NAMES[RELAY_COUNT] = {
+    "pump_state", "lights_state", "ph_up_state", "ph_down_state"
+};
+
+// Topic suffix of each relay's retained usage counters
+static const char* const RELAY_USAGE_TOPIC_NAMES[RELAY_COUNT] = {
+    "pump_usage", "lights_usage", "ph_up_usage", "ph_down_usage"
+};
+
+// Print sink that only computes an FNV-1a hash of what is written to it
+class HashPrint : public Print {
+public:
+    uint32_t hash = 2166136261u;
+
+    size_t write(uint8_t c) override {
+        hash = (hash ^ c) * 16777619u;
+        return 1;
+    }
+    using Print::write;
+};
+
+// Handler for an inbound message. The payload is not null-terminated and is
+// only valid for the duration of the call.
+typedef void (*MqttHandler)(const char* payload, unsigned int length, void* context);
+
+// Message queued for the MQTT task
+struct MqttMessage {
+    char topic[MQTT_TOPIC_MAX];
+    char payload[MQTT_PAYLOAD_MAX];
+    bool retain;
+};
+
+// MQTT client running on its own FreeRTOS task. The task owns the
+// PubSubClient: it connects with a bounded timeout, retries with
+// exponential backoff and jitter, polls for inbound messages and drains the
+// outbound queue. Other tasks only enqueue messages and read the connected
+// flag, so a slow or unreachable broker never stalls the control loop.
 class MQTTManager {
 private:
     WiFiClient& _wifiClient;
     PubSubClient _mqttClient;
+    // Config of the control task, which owns it; the telemetry filter reads
+    // it there. The MQTT task works from its own copy, handed over by
+    // reconfigure() through _pendingConfig.
     SystemConfig& _config;
-    MqttCallback _callback;
-
-    // MQTT Topics
-    char _topic_liquid[50];
-    char _topic_ph[50];
-    char _topic_tds[50];
-    char _topic_temperature[50];
-    char _topic_pump[50];
-    char _topic_lights[50];
-    char _topic_ph_up[50];
-    char _topic_ph_down[50];
-    char _topic_alerts[50];
+    SystemConfig _taskConfig;
+    SystemConfig _pendingConfig;
+    portMUX_TYPE _configLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // Inbound dispatch table. Topics point at our own topic buffers and the
+    // hashes are recomputed whenever those are rebuilt.
+    struct Route {
+        const char* topic;
+        uint32_t hash;
+        MqttHandler handler;
+        void* context;
+    };
+    Route _routes[MQTT_MAX_ROUTES];
+    int _routeCount = 0;
+
+    TaskHandle_t _task = nullptr;
+    QueueHandle_t _outbox = nullptr;
+    std::atomic<bool> _connected;
+    std::atomic<bool> _reconfigure;
+    uint32_t _backoffMs = MQTT_BACKOFF_MIN_MS;
+    uint32_t _nextAttempt = 0;
+    std::atomic<uint32_t> _dropped;
+
+    // Telemetry filter state, control task only. _connectCount is bumped by the
+    // MQTT task on every connect so the filter republishes everything afterwards.
+    float _lastValue[METRIC_COUNT];
+    uint32_t _lastPublished[METRIC_COUNT];
+    bool _hasPublished[METRIC_COUNT];
+    uint32_t _filterConnectCount = 0;
+    std::atomic<uint32_t> _connectCount;
+    std::atomic<uint32_t> _sent;
+    std::atomic<uint32_t> _suppressed;
+
+    // Relay command and state traffic
+    std::atomic<uint32_t> _commandsReceived;
+    std::atomic<uint32_t> _commandsIgnored;
+    std::atomic<uint32_t> _statesPublished;
+
+    // Connection and throughput statistics. Counts are written by the MQTT
+    // task; rates are messages per second over the last completed window.
+    std::atomic<uint32_t> _connectFailures;
+    uint32_t _windowStart = 0;
+    uint32_t _windowOut = 0;
+    uint32_t _windowIn = 0;
+    std::atomic<float> _outRate;
+    std::atomic<float> _inRate;
+
+    // Command latency from arrival on the MQTT task to being applied by the
+    // control task, in microseconds
+    std::atomic<uint32_t> _latencyLast;
+    std::atomic<uint32_t> _latencyMax;
+    std::atomic<uint32_t> _latencyAvg;  // Exponential moving average, alpha 1/8
+
+    // Relay states last published (-1 unknown), control task only
+    int8_t _lastRelayState[RELAY_COUNT];
+    uint32_t _relayConnectCount = 0;
+
+    // Messages produced while disconnected, replayed to the backlog topic
+    // once the broker is back. Control task only.
+    TelemetrySpool _spool;
+    char _lastSpooledAlert[64] = "";
+    uint32_t _lastSpooledAlertTime = 0;
+
+    // Growth cycle state last published, control task only
+    char _lastCycleState[MQTT_PAYLOAD_MAX] = "";
+    uint32_t _cycleConnectCount = 0;
+
+    // Hash of the discovery configs last published, 0 if none yet this boot.
+    // MQTT task only; _discoveryForced is set when Home Assistant comes online.
+    uint32_t _discoveryHash = 0;
+    bool _discoveryForced = false;
+
+    // MQTT topics of one device ID; deviceIdFits() keeps them all in
+    // MQTT_TOPIC_MAX
+    struct Topics {
+        char metrics[METRIC_COUNT][MQTT_TOPIC_MAX];
+        char state[MQTT_TOPIC_MAX];
+        char backlog[MQTT_TOPIC_MAX];
+        char relays[RELAY_COUNT][MQTT_TOPIC_MAX];
+        char relayCommands[RELAY_COUNT][MQTT_TOPIC_MAX];
+        char cycle[MQTT_TOPIC_MAX];
+        char usage[RELAY_COUNT][MQTT_TOPIC_MAX];
+        char stats[METRIC_COUNT][MQTT_TOPIC_MAX];
+        char forecast[MQTT_TOPIC_MAX];
+        char availability[MQTT_TOPIC_MAX];
+        char alerts[MQTT_TOPIC_MAX];
+    };
+
+    // Live topics. The MQTT task builds new ones in _stagingTopics and
+    // copies them in under _topicLock, which publish() holds while copying
+    // a topic out; the MQTT task itself reads them without the lock.
+    Topics _topics;
+    Topics _stagingTopics;
+    portMUX_TYPE _topicLock = portMUX_INITIALIZER_UNLOCKED;
 
 public:
     MQTTManager(WiFiClient& wifiClient, SystemConfig& config) 
         : _wifiClient(wifiClient), 
           _mqttClient(wifiClient),
-          _config(config) {
+          _config(config),
+          _taskConfig(config),
+          _connected(false),
+          _reconfigure(false),
+          _dropped(0),
+          _connectCount(0),
+          _sent(0),
+          _suppressed(0),
+          _commandsReceived(0),
+          _commandsIgnored(0),
+          _statesPublished(0),
+          _connectFailures(0),
+          _outRate(0),
+          _inRate(0),
+          _latencyLast(0),
+          _latencyMax(0),
+          _latencyAvg(0) {
         
-        setupTopics();
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            _lastValue[i] = 0;
+            _lastPublished[i] = 0;
+            _hasPublished[i] = false;
+        }
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            _lastRelayState[i] = -1;
+        }
+        setupTopics(_config.device_id);
     }
 
-    void setCallback(MqttCallback callback) {
-        _callback = callback;
-        
-        // Set the PubSubClient callback
+    // Route messages on one of our topics (e.g. getTopicPump()) to a handler.
+    // Must be called before begin(); the topic is subscribed on every connect.
+    bool onMessage(const char* topic, MqttHandler handler, void* context = nullptr) {
+        if (_routeCount == MQTT_MAX_ROUTES) {
+            LOG_ERROR(LOG_MQTT, "Too many MQTT routes, ignoring %s", topic);
+            return false;
+        }
+        Route& route = _routes[_routeCount++];
+        route.topic = topic;
+        route.hash = topicHash(topic);
+        route.handler = handler;
+        route.context = context;
+        return true;
+    }
+
+    // Whether every topic under hydroponics/<device ID>/ fits MQTT_TOPIC_MAX.
+    // The longest suffixes are the statistics and relay command topics.
+    static bool deviceIdFits(const char* deviceId) {
+        size_t longest = strlen("level_forecast");
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            longest = std::max(longest, strlen(METRIC_NAMES[i]) + strlen("_stats"));
+        }
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            longest = std::max(longest, strlen(RELAY_TOPIC_NAMES[i]) + strlen("/set"));
+            longest = std::max(longest, strlen(RELAY_USAGE_TOPIC_NAMES[i]));
+        }
+        return strlen("hydroponics/") + strlen(deviceId) + 1 + longest < MQTT_TOPIC_MAX;
+    }
+
+    // Case-insensitive comparison of a payload view against a string
+    static bool payloadEquals(const char* payload, unsigned int length, const char* text) {
+        return strlen(text) == length && strncasecmp(payload, text, length) == 0;
+    }
+
+    // Set up the client and start the MQTT task
+    void begin() {
+        _taskConfig = _config;
+        setupTopics(_taskConfig.device_id);
+        _spool.begin();
+        _mqttClient.setServer(_taskConfig.mqtt_server, _taskConfig.mqtt_port);
         _mqttClient.setCallback([this](char* topic, byte* payload, unsigned int length) {
-            String message = String((char*)payload).substring(0, length);
-            Serial.printf("MQTT Message Received - Topic: %s, Payload: %s\n", topic, message.c_str());
-            
-            // Call the user's callback
-            if (this->_callback) {
-                this->_callback(String(topic), message);
-            }
+            dispatch(topic, (const char*)payload, length);
         });
+        onMessage(HA_STATUS_TOPIC, onHomeAssistantStatus, this);
+
+        _outbox = xQueueCreate(MQTT_OUTBOX_SIZE, sizeof(MqttMessage));
+        if (!_outbox) {
+            LOG_ERROR(LOG_MQTT, "Failed to create MQTT outbox");
+            return;
+        }
+        if (xTaskCreate(taskEntry, "mqtt", MQTT_TASK_STACK, this, MQTT_TASK_PRIORITY, &_task) != pdPASS) {
+            LOG_ERROR(LOG_MQTT, "Failed to start MQTT task");
+            _task = nullptr;
+        }
     }
 
-    void begin() {
-        setupTopics();
-        _mqttClient.setServer(_config.mqtt_server, _config.mqtt_port);
+    // Broker settings, device ID or the enabled flag changed. The MQTT task
+    // takes a copy of `config`, drops the current connection, rebuilds its
+    // topics and reconnects with the new settings. Control task.
+    void reconfigure(const SystemConfig& config) {
+        portENTER_CRITICAL(&_configLock);
+        _pendingConfig = config;
+        portEXIT_CRITICAL(&_configLock);
+        _reconfigure = true;
+        if (_task) {
+            xTaskNotifyGive(_task);
+        }
+    }
+
+    // Safe to call from any task
+    bool connected() {
+        return _connected;
+    }
+
+    // Number of messages dropped because the outbox was full or the payload
+    // did not fit a message
+    uint32_t droppedCount() const {
+        return _dropped;
+    }
+
+    // Queue a message for the MQTT task. Never blocks; returns false if we are
+    // not connected, the outbox is full or the payload is longer than
+    // MQTT_PAYLOAD_MAX - 1, which is never sent cut short.
+    bool publish(const char* topic, const char* payload, bool retain = false) {
+        if (!_connected || !_outbox) {
+            return false;
+        }
+        MqttMessage message;
+        if (strlcpy(message.payload, payload, sizeof(message.payload)) >= sizeof(message.payload)) {
+            _dropped++;
+            return false;
+        }
+        portENTER_CRITICAL(&_topicLock);
+        strlcpy(message.topic, topic, sizeof(message.topic));
+        portEXIT_CRITICAL(&_topicLock);
+        message.retain = retain;
+        if (xQueueSend(_outbox, &message, 0) != pdTRUE) {
+            _dropped++;
+            return false;
+        }
+        return true;
+    }
+
+    // Publish a set of sensor readings, indexed by TelemetryMetric (NaN if
+    // unavailable). A value goes out when it leaves its deadband or when the
+    // heartbeat interval has passed; everything else is counted as suppressed.
+    // With state_topic set, all metrics go out together as one JSON message.
+    // While disconnected, readings that pass the filter are spooled instead.
+    void publishTelemetry(const float values[METRIC_COUNT]) {
+        // Republish everything after a reconnect
+        uint32_t connectCount = _connectCount;
+        if (connectCount != _filterConnectCount) {
+            _filterConnectCount = connectCount;
+            for (int i = 0; i < METRIC_COUNT; i++) {
+                _hasPublished[i] = false;
+            }
+        }
+
+        uint32_t now = millis();
+        bool due[METRIC_COUNT];
+        bool anyDue = false;
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            due[i] = !isnan(values[i]) && shouldPublish(i, values[i], now);
+            anyDue |= due[i];
+        }
+
+        char payload[MQTT_PAYLOAD_MAX];
+        if (!_connected) {
+            if (anyDue) {
+                spoolTelemetry(values, now);
+            }
+            return;
+        }
+
+        if (_config.state_topic) {
+            if (!anyDue) {
+                _suppressed++;
+                return;
+            }
+            int length = snprintf(payload, sizeof(payload), "{");
+            for (int i = 0; i < METRIC_COUNT; i++) {
+                if (isnan(values[i])) {
+                    continue;
+                }
+                char value[16];
+                formatMetric(i, values[i], value, sizeof(value));
+                length += snprintf(payload + length, sizeof(payload) - length, "%s\"%s\":%s",
+                                   length > 1 ? "," : "", METRIC_NAMES[i], value);
+            }
+            snprintf(payload + length, sizeof(payload) - length, "}");
+            if (publish(_topics.state, payload)) {
+                _sent++;
+                for (int i = 0; i < METRIC_COUNT; i++) {
+                    if (!isnan(values[i])) {
+                        recordPublished(i, values[i], now);
+                    }
+                }
+            }
+            return;
+        }
+
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            if (isnan(values[i])) {
+                continue;
+            }
+            if (!due[i]) {
+                _suppressed++;
+                continue;
+            }
+            formatMetric(i, values[i], payload, sizeof(payload));
+            if (publish(_topics.metrics[i], payload)) {
+                _sent++;
+                recordPublished(i, values[i], now);
+            }
+        }
+    }
+
+    // Telemetry messages published and held back by the deadband filter
+    uint32_t sentCount() const { return _sent; }
+    uint32_t suppressedCount() const { return _suppressed; }
+
+    // Alerts raised while disconnected are spooled, repeats of the same alert
+    // only once per heartbeat interval
+    bool publishAlert(const char* message) {
+        if (message[0] == '\0') {
+            return false;
+        }
+        if (!_connected) {
+            uint32_t now = millis();
+            bool repeat = strcmp(_lastSpooledAlert, message) == 0 &&
+                          now - _lastSpooledAlertTime < _config.heartbeat_s * 1000UL;
+            if (!repeat) {
+                StaticJsonDocument<256> doc;
+                doc["ts"] = (uint32_t)time(nullptr);
+                doc["alert"] = message;
+                char payload[SPOOL_RECORD_SIZE];
+                serializeJson(doc, payload, sizeof(payload));
+                _spool.push(payload);
+                strlcpy(_lastSpooledAlert, message, sizeof(_lastSpooledAlert));
+                _lastSpooledAlertTime = now;
+            }
+            return false;
+        }
+        return publish(_topics.alerts, message);
+    }
+
+    // Flush the spool to flash while offline and replay it once connected.
+    // Called periodically by the control task; returns true while a replay
+    // is in progress so the caller can come back sooner.
+    bool serviceSpool() {
+        _spool.maintain();
+        if (!_connected || _spool.empty()) {
+            return false;
+        }
+
+        char payload[SPOOL_RECORD_SIZE];
+        int replayed = 0;
+        while (replayed < MQTT_REPLAY_BURST && uxQueueSpacesAvailable(_outbox) > MQTT_REPLAY_HEADROOM &&
+               _spool.peek(payload, sizeof(payload))) {
+            if (!publish(_topics.backlog, payload)) {
+                break;
+            }
+            _spool.pop();
+            replayed++;
+        }
+        if (replayed > 0) {
+            _spool.commit();
+            if (_spool.empty()) {
+                LOG_INFO(LOG_MQTT, "Spool replay complete");
+            }
+        }
+        return !_spool.empty();
+    }
+
+    // Messages waiting in the spool, and messages it has had to discard
+    uint32_t spooledCount() const { return _spool.size(); }
+    uint32_t spoolEvictedCount() const { return _spool.evicted(); }
+
+    // Retained relay state. Only published when it differs from what the
+    // broker already holds, so this can be called for every relay each cycle.
+    bool publishRelayState(uint8_t relay, bool state) {
+        if (!_connected || relay >= RELAY_COUNT) {
+            return false;
+        }
+        uint32_t connectCount = _connectCount;
+        if (connectCount != _relayConnectCount) {
+            _relayConnectCount = connectCount;
+            for (int i = 0; i < RELAY_COUNT; i++) {
+                _lastRelayState[i] = -1;
+            }
+        }
+        if (_lastRelayState[relay] == state) {
+            return true;
+        }
+        if (!publish(_topics.relays[relay], state ? "ON" : "OFF", true)) {
+            return false;
+        }
+        _lastRelayState[relay] = state;
+        _statesPublished++;
+        return true;
+    }
+
+    // Relay commands received, those dropped because the relay was already
+    // in the requested state, and relay states published
+    void countCommand(bool ignored) {
+        _commandsReceived++;
+        if (ignored) {
+            _commandsIgnored++;
+        }
+    }
+    // Called by the control task once a command that arrived over MQTT has been applied
+    void recordCommandLatency(int64_t receivedAt) {
+        uint32_t latency = (uint32_t)(esp_timer_get_time() - receivedAt);
+        _latencyLast = latency;
+        if (latency > _latencyMax) {
+            _latencyMax = latency;
+        }
+        uint32_t average = _latencyAvg;
+        _latencyAvg = average == 0 ? latency : average - average / 8 + latency / 8;
+    }
+
+    // Reconnects after the first connection, and failed connection attempts
+    uint32_t reconnectCount() const {
+        uint32_t connects = _connectCount;
+        return connects > 0 ? connects - 1 : 0;
+    }
+    uint32_t connectFailures() const { return _connectFailures; }
+    float outboundRate() const { return _outRate; }
+    float inboundRate() const { return _inRate; }
+    uint32_t commandLatencyLast() const { return _latencyLast; }
+    uint32_t commandLatencyAvg() const { return _latencyAvg; }
+    uint32_t commandLatencyMax() const { return _latencyMax; }
+
+    uint32_t commandsReceived() const { return _commandsReceived; }
+    uint32_t commandsIgnored() const { return _commandsIgnored; }
+    uint32_t statesPublished() const { return _statesPublished; }
+
+    // Retained growth cycle summary for the stage and countdown entities.
+    // Only published when something changed or after a reconnect; times of 0
+    // are published as null.
+    void publishCycleState(const char* stage, time_t nextWateringChange, time_t nextLightChange) {
+        if (!_connected) {
+            return;
+        }
+
+        char watering[24];
+        char lights[24];
+        formatTimestamp(nextWateringChange, watering, sizeof(watering));
+        formatTimestamp(nextLightChange, lights, sizeof(lights));
+        char payload[MQTT_PAYLOAD_MAX];
+        snprintf(payload, sizeof(payload), "{\"stage\":\"%s\",\"next_watering_change\":%s,\"next_light_change\":%s}",
+                 stage, watering, lights);
+
+        uint32_t connectCount = _connectCount;
+        if (connectCount == _cycleConnectCount && strcmp(payload, _lastCycleState) == 0) {
+            return;
+        }
+        if (publish(_topics.cycle, payload, true)) {
+            strlcpy(_lastCycleState, payload, sizeof(_lastCycleState));
+            _cycleConnectCount = connectCount;
+        }
+    }
+
+    // Retained usage counters of one relay, for maintenance tracking
+    bool publishRelayUsage(uint8_t relay, const RelayUsage& usage, uint16_t watts) {
+        if (relay >= RELAY_COUNT) {
+            return false;
+        }
+        char payload[MQTT_PAYLOAD_MAX];
+        snprintf(payload, sizeof(payload), "{\"on_s\":%lu,\"switches\":%lu,\"longest_s\":%lu,\"energy_wh\":%lu}",
+                 (unsigned long)(usage.onMs / 1000), (unsigned long)usage.switches,
+                 (unsigned long)(usage.longestRunMs / 1000), (unsigned long)RelayController::energyWh(usage, watts));
+        return publish(_topics.usage[relay], payload, true);
+    }
+
+    // Retained statistics and sensor status of one metric
+    bool publishSensorStats(TelemetryMetric metric, const MetricStats& stats) {
+        const float values[] = {stats.mean, stats.stddev, stats.ewma, stats.median, stats.mad, stats.z};
+        const char* const keys[] = {"mean", "sd", "ewma", "median", "mad", "z"};
+
+        // Accepted samples lie within the metric's SensorLimits, which keeps
+        // every value to 9 characters and the message to 120 bytes. One that
+        // does not fit anyway is dropped rather than sent as broken JSON.
+        char payload[MQTT_PAYLOAD_MAX];
+        size_t length = snprintf(payload, sizeof(payload), "{");
+        for (int i = 0; i < 6 && length < sizeof(payload); i++) {
+            // JSON has no NaN; statistics without samples are null
+            if (isnan(values[i])) {
+                length += snprintf(payload + length, sizeof(payload) - length, "\"%s\":null,", keys[i]);
+            } else {
+                length += snprintf(payload + length, sizeof(payload) - length, "\"%s\":%.3f,", keys[i], values[i]);
+            }
+        }
+        if (length < sizeof(payload)) {
+            length += snprintf(payload + length, sizeof(payload) - length, "\"status\":\"%s\"}",
+                               SensorStats::conditionName(stats.conditions));
+        }
+        if (length >= sizeof(payload)) {
+            _dropped++;
+            LOG_WARN(LOG_MQTT, "Statistics of %s do not fit a message, dropped", METRIC_NAMES[metric]);
+            return false;
+        }
+        return publish(_topics.stats[metric], payload, true);
+    }
+
+    // Retained reservoir consumption rate and time to the critical level
+    bool publishLevelForecast(const LevelForecastResult& forecast) {
+        char rate[16] = "null";
+        char hours[16] = "null";
+        if (forecast.valid) {
+            snprintf(rate, sizeof(rate), "%.2f", forecast.ratePerHour);
+            if (!isnan(forecast.hoursToCritical)) {
+                snprintf(hours, sizeof(hours), "%.1f", forecast.hoursToCritical);
+            }
+        }
+        char payload[MQTT_PAYLOAD_MAX];
+        snprintf(payload, sizeof(payload), "{\"valid\":%s,\"rate_pct_h\":%s,\"hours_to_critical\":%s}",
+                 forecast.valid ? "true" : "false", rate, hours);
+        return publish(_topics.forecast, payload, true);
+    }
+
+    const char* getRelayCommandTopic(uint8_t relay) const { return _topics.relayCommands[relay]; }
+    const char* getTopicAlerts() const { return _topics.alerts; }
+
+private:
+    // Build the topics of a device ID and make them live. MQTT task, or any
+    // task before begin().
+    void setupTopics(const char* deviceId) {
+        Topics& topics = _stagingTopics;
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            snprintf(topics.metrics[i], sizeof(topics.metrics[i]), "hydroponics/%s/%s", deviceId, METRIC_NAMES[i]);
+            snprintf(topics.stats[i], sizeof(topics.stats[i]), "hydroponics/%s/%s_stats", deviceId, METRIC_NAMES[i]);
+        }
+        snprintf(topics.state, sizeof(topics.state), "hydroponics/%s/state", deviceId);
+        snprintf(topics.backlog, sizeof(topics.backlog), "hydroponics/%s/backlog", deviceId);
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            snprintf(topics.relays[i], sizeof(topics.relays[i]), "hydroponics/%s/%s", deviceId, RELAY_TOPIC_NAMES[i]);
+            snprintf(topics.relayCommands[i], sizeof(topics.relayCommands[i]), "%s/set", topics.relays[i]);
+            snprintf(topics.usage[i], sizeof(topics.usage[i]), "hydroponics/%s/%s", deviceId, RELAY_USAGE_TOPIC_NAMES[i]);
+        }
+        snprintf(topics.cycle, sizeof(topics.cycle), "hydroponics/%s/cycle", deviceId);
+        snprintf(topics.forecast, sizeof(topics.forecast), "hydroponics/%s/level_forecast", deviceId);
+        snprintf(topics.availability, sizeof(topics.availability), "hydroponics/%s/availability", deviceId);
+        snprintf(topics.alerts, sizeof(topics.alerts), "hydroponics/%s/alerts", deviceId);
+
+        portENTER_CRITICAL(&_topicLock);
+        _topics = topics;
+        portEXIT_CRITICAL(&_topicLock);
+
+        // Routes may point at our topics, so hash them after the swap
+        for (int i = 0; i < _routeCount; i++) {
+            _routes[i].hash = topicHash(_routes[i].topic);
+        }
+    }
+
+    bool shouldPublish(int metric, float value, uint32_t now) const {
+        if (!_hasPublished[metric]) {
+            return true;
+        }
+        if (_config.heartbeat_s > 0 && now - _lastPublished[metric] >= _config.heartbeat_s * 1000UL) {
+            return true;
+        }
+        const MetricDeadband& band = _config.deadbands[metric];
+        float threshold = fmaxf(band.absolute, band.relative * fabsf(_lastValue[metric]));
+        float delta = fabsf(value - _lastValue[metric]);
+        return threshold > 0 ? delta >= threshold : delta > 0;
+    }
+
+    void recordPublished(int metric, float value, uint32_t now) {
+        _lastValue[metric] = value;
+        _lastPublished[metric] = now;
+        _hasPublished[metric] = true;
+    }
+
+    // Spool a timestamped snapshot of every available reading
+    void spoolTelemetry(const float values[METRIC_COUNT], uint32_t now) {
+        char payload[SPOOL_RECORD_SIZE];
+        int length = snprintf(payload, sizeof(payload), "{\"ts\":%lu", (unsigned long)time(nullptr));
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            if (isnan(values[i])) {
+                continue;
+            }
+            char value[16];
+            formatMetric(i, values[i], value, sizeof(value));
+            length += snprintf(payload + length, sizeof(payload) - length, ",\"%s\":%s", METRIC_NAMES[i], value);
+            recordPublished(i, values[i], now);
+        }
+        snprintf(payload + length, sizeof(payload) - length, "}");
+        _spool.push(payload);
+    }
+
+    // Liquid level is published as a whole percentage, everything else with
+    // two decimals. Formatted as scaled integers to stay off the float printf path.
+    // Magnitudes are clamped below ten million, so the text takes at most 11
+    // characters.
+    static void formatMetric(int metric, float value, char* buffer, size_t size) {
+        if (metric == METRIC_LIQUID_LEVEL) {
+            snprintf(buffer, size, "%d", (int)value);
+            return;
+        }
+        long hundredths = lroundf(constrain(value, -1e7f, 1e7f) * 100.0f);
+        unsigned long magnitude = hundredths < 0 ? 0UL - (unsigned long)hundredths : (unsigned long)hundredths;
+        if (magnitude > 999999999UL) {
+            magnitude = 999999999UL;
+        }
+        snprintf(buffer, size, "%s%lu.%02lu", hundredths < 0 ? "-" : "", magnitude / 100, magnitude % 100);
+    }
+
+    // 32-bit FNV-1a
+    static uint32_t topicHash(const char* topic) {
+        uint32_t hash = 2166136261u;
+        while (*topic) {
+            hash = (hash ^ (uint8_t)*topic++) * 16777619u;
+        }
+        return hash;
+    }
+
+    // MQTT task only
+    void updateRates() {
+        uint32_t elapsed = millis() - _windowStart;
+        if (elapsed < MQTT_RATE_WINDOW_MS) {
+            return;
+        }
+        _outRate = _windowOut * 1000.0f / elapsed;
+        _inRate = _windowIn * 1000.0f / elapsed;
+        _windowOut = 0;
+        _windowIn = 0;
+        _windowStart += elapsed;
+    }
+
+    // Runs on the MQTT task from inside PubSubClient::loop()
+    void dispatch(const char* topic, const char* payload, unsigned int length) {
+        LOG_DEBUG(LOG_MQTT, "MQTT Message Received - Topic: %s, Payload: %.*s", topic, (int)length, payload);
+        _windowIn++;
+
+        uint32_t hash = topicHash(topic);
+        for (int i = 0; i < _routeCount; i++) {
+            if (_routes[i].hash == hash && strcmp(_routes[i].topic, topic) == 0) {
+                _routes[i].handler(payload, length, _routes[i].context);
+                return;
+            }
+        }
     }
 
-    void setupTopics() {
-        // Set up MQTT topics
-        snprintf(_topic_liquid, sizeof(_topic_liquid), "hydroponics/%s/liquid_level", _config.device_id);
-        snprintf(_topic_ph, sizeof(_topic_ph), "hydroponics/%s/ph_value", _config.device_id);
-        snprintf(_topic_tds, sizeof(_topic_tds), "hydroponics/%s/tds_value", _config.device_id);
-        snprintf(_topic_temperature, sizeof(_topic_temperature), "hydroponics/%s/temperature_value", _config.device_id);
-        snprintf(_topic_pump, sizeof(_topic_pump), "hydroponics/%s/pump_state", _config.device_id);
-        snprintf(_topic_lights, sizeof(_topic_lights), "hydroponics/%s/lights_state", _config.device_id);
-        snprintf(_topic_ph_up, sizeof(_topic_ph_up), "hydroponics/%s/ph_up_state", _config.device_id);
-        snprintf(_topic_ph_down, sizeof(_topic_ph_down), "hydroponics/%s/ph_down_state", _config.device_id);
-        snprintf(_topic_alerts, sizeof(_topic_alerts), "hydroponics/%s/alerts", _config.device_id);
+    static void taskEntry(void* arg) {
+        static_cast<MQTTManager*>(arg)->run();
     }
 
+    void run() {
+        MqttMessage message;
+        for (;;) {
+            if (_reconfigure.exchange(false)) {
+                portENTER_CRITICAL(&_configLock);
+                _taskConfig = _pendingConfig;
+                portEXIT_CRITICAL(&_configLock);
+                disconnect();
+                setupTopics(_taskConfig.device_id);
+                _mqttClient.setServer(_taskConfig.mqtt_server, _taskConfig.mqtt_port);
+                _backoffMs = MQTT_BACKOFF_MIN_MS;
+                _nextAttempt = millis();
+            }
+
+            if (!_taskConfig.mqtt_enabled || !WiFi.isConnected()) {
+                disconnect();
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MQTT_IDLE_INTERVAL_MS));
+                continue;
+            }
+
+            if (!_mqttClient.connected()) {
+                if (_connected) {
+                    LOG_WARN(LOG_MQTT, "Lost connection to MQTT broker");
+                    _connected = false;
+                    _nextAttempt = millis();
+                }
+
+                int32_t wait = (int32_t)(_nextAttempt - millis());
+                if (wait > 0) {
+                    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+                    continue;
+                }
+
+                if (connect()) {
+                    _backoffMs = MQTT_BACKOFF_MIN_MS;
+                    _connectCount++;
+                    _connected = true;
+                } else {
+                    _connectFailures++;
+                    scheduleRetry();
+                }
+                continue;
+            }
+
+            _mqttClient.loop();
+            if (_discoveryForced) {
+                _discoveryForced = false;
+                publishDiscovery(true);
+            }
+            while (xQueueReceive(_outbox, &message, 0) == pdTRUE) {
+                if (_mqttClient.publish(message.topic, message.payload, message.retain)) {
+                    _windowOut++;
+                } else {
+                    LOG_WARN(LOG_MQTT, "Publish to %s failed", message.topic);
+                }
+            }
+            updateRates();
+
+            // Sleep until something is queued or the client needs polling again
+            xQueuePeek(_outbox, &message, pdMS_TO_TICKS(MQTT_POLL_INTERVAL_MS));
+        }
+    }
+
+    // Wait between half and all of the current backoff before trying again,
+    // so devices that lost the broker together do not reconnect in lockstep
+    void scheduleRetry() {
+        uint32_t delayMs = _backoffMs / 2 + esp_random() % (_backoffMs / 2 + 1);
+        _nextAttempt = millis() + delayMs;
+        _backoffMs = _backoffMs * 2 < MQTT_BACKOFF_MAX_MS ? _backoffMs * 2 : MQTT_BACKOFF_MAX_MS;
+        LOG_INFO(LOG_MQTT, "Retrying MQTT connection in %u ms", delayMs);
+    }
+
+    // MQTT task only. Returns false if the broker could not be reached.
     bool connect() {
         if (_mqttClient.connected()) {
             return true;
         }
         
-        Serial.println("Attempting MQTT connection...");
-        String clientId = "HydroponicsController-";
-        clientId += _config.device_id;
+        if (!deviceIdFits(_taskConfig.device_id)) {
+            LOG_ERROR(LOG_MQTT, "Device ID %s is too long for its MQTT topics", _taskConfig.device_id);
+            return false;
+        }
 
-        Serial.printf("Connecting to broker: %s:%d\n", _config.mqtt_server, _config.mqtt_port);
-        Serial.printf("Client ID: %s\n", clientId.c_str());
-        Serial.printf("Username: %s\n", _config.mqtt_user);
+        LOG_INFO(LOG_MQTT, "Attempting MQTT connection...");
+        char clientId[64];
+        snprintf(clientId, sizeof(clientId), "HydroponicsController-%s", _taskConfig.device_id);
 
-        bool connected = _mqttClient.connect(clientId.c_str(), _config.mqtt_user, _config.mqtt_password);
+        LOG_INFO(LOG_MQTT, "Connecting to broker: %s:%d", _taskConfig.mqtt_server, _taskConfig.mqtt_port);
+        LOG_INFO(LOG_MQTT, "Client ID: %s", clientId);
+        LOG_INFO(LOG_MQTT, "Username: %s", _taskConfig.mqtt_user);
+
+        // Open the socket ourselves so the TCP connect has a bounded timeout;
+        // PubSubClient reuses an already connected client
+        bool connected = false;
+        if (_wifiClient.connect(_taskConfig.mqtt_server, _taskConfig.mqtt_port, MQTT_CONNECT_TIMEOUT_MS)) {
+            connected = _mqttClient.connect(clientId, _taskConfig.mqtt_user, _taskConfig.mqtt_password,
+                                            _topics.availability, 1, true, "offline");
+        }
 
         if (!connected) {
             int state = _mqttClient.state();
-            Serial.print("MQTT connection failed, state=");
-            Serial.print(state);
-            Serial.print(" (");
+            const char* reason;
             switch (state) {
             case -4:
-                Serial.print("Connection timeout");
+                reason = "Connection timeout";
                 break;
             case -3:
-                Serial.print("Connection lost");
+                reason = "Connection lost";
                 break;
             case -2:
-                Serial.print("Connect failed");
+                reason = "Connect failed";
                 break;
             case -1:
-                Serial.print("Disconnected");
+                reason = "Disconnected";
                 break;
             case 1:
-                Serial.print("Bad protocol");
+                reason = "Bad protocol";
                 break;
             case 2:
-                Serial.print("Bad client ID");
+                reason = "Bad client ID";
                 break;
             case 3:
-                Serial.print("Unavailable");
+                reason = "Unavailable";
                 break;
             case 4:
-                Serial.print("Bad credentials");
+                reason = "Bad credentials";
                 break;
             case 5:
-                Serial.print("Unauthorized");
+                reason = "Unauthorized";
                 break;
             default:
-                Serial.print("Unknown error");
+                reason = "Unknown error";
             }
-            Serial.println(")");
+            LOG_WARN(LOG_MQTT, "MQTT connection failed, state=%d (%s)", state, reason);
             return false;
         }
         
-        Serial.println("Successfully connected to MQTT broker");
+        LOG_INFO(LOG_MQTT, "Successfully connected to MQTT broker");
         
-        // Subscribe to control topics
-        Serial.println("Subscribing to topics:");
-        Serial.printf("- %s\n", _topic_pump);
-        Serial.printf("- %s\n", _topic_lights);
-
-        bool pumpSub = _mqttClient.subscribe(_topic_pump, 1);
-        bool lightsSub = _mqttClient.subscribe(_topic_lights, 1);
-
-        Serial.printf("Subscription results - Pump: %s, Lights: %s\n",
-                    pumpSub ? "success" : "failed",
-                    lightsSub ? "success" : "failed");
+        // Subscribe to every routed topic
+        bool subscribed = true;
+        for (int i = 0; i < _routeCount; i++) {
+            bool ok = _mqttClient.subscribe(_routes[i].topic, 1);
+            LOG_INFO(LOG_MQTT, "Subscribing to %s: %s", _routes[i].topic, ok ? "success" : "failed");
+            subscribed &= ok;
+        }
 
-        // Publish discovery messages for Home Assistant
-        if (pumpSub && lightsSub) {
-            Serial.println("Successfully subscribed to all topics");
-            publishDiscoveryMessages();
+        if (subscribed) {
+            LOG_INFO(LOG_MQTT, "Successfully subscribed to all topics");
         }
+
+        // Home Assistant configs are retained, so they only go out again if they changed
+        _mqttClient.publish(_topics.availability, "online", true);
+        publishDiscovery(false);
         
         return connected;
     }
 
-    void loop() {
-        _mqttClient.loop();
-    }
-
-    bool connected() {
-        return _mqttClient.connected();
-    }
-    
+    // MQTT task only
     void disconnect() {
-        if (_mqttClient.connected()) {
-            Serial.println("Disconnecting from MQTT broker");
+        if (_connected || _mqttClient.connected()) {
+            LOG_INFO(LOG_MQTT, "Disconnecting from MQTT broker");
             _mqttClient.disconnect();
         }
+        _connected = false;
+        xQueueReset(_outbox);
     }
 
-    bool publish(const char* topic, const char* payload, bool retain = false) {
-        return _mqttClient.publish(topic, payload, retain);
-    }
-
-    bool publish(const char* topic, const String& payload, bool retain = false) {
-        return _mqttClient.publish(topic, payload.c_str(), retain);
-    }
-
-    // Convenience methods for publishing to specific topics
-    bool publishLiquidLevel(float level) {
-        if (!_mqttClient.connected() || isnan(level)) {
-            return false;
+    static void onHomeAssistantStatus(const char* payload, unsigned int length, void* context) {
+        if (payloadEquals(payload, length, "online")) {
+            LOG_INFO(LOG_MQTT, "Home Assistant came online, republishing discovery");
+            static_cast<MQTTManager*>(context)->_discoveryForced = true;
         }
-        return _mqttClient.publish(_topic_liquid, String((int)level).c_str());
     }
 
-    bool publishPH(float ph) {
-        if (!_mqttClient.connected() || isnan(ph)) {
-            return false;
+    // ISO 8601 UTC timestamp as a JSON string, or null
+    static void formatTimestamp(time_t when, char* buffer, size_t size) {
+        if (when <= 0) {
+            strlcpy(buffer, "null", size);
+            return;
         }
-        return _mqttClient.publish(_topic_ph, String(ph).c_str());
+        struct tm timeinfo;
+        gmtime_r(&when, &timeinfo);
+        strftime(buffer, size, "\"%Y-%m-%dT%H:%M:%SZ\"", &timeinfo);
     }
 
-    bool publishTDS(float tds) {
-        if (!_mqttClient.connected() || isnan(tds)) {
-            return false;
-        }
-        return _mqttClient.publish(_topic_tds, String(tds).c_str());
-    }
+    // Fill in the discovery config for one entity
+    void buildDiscovery(const DiscoveryEntity& entity, JsonDocument& doc, char* topic, size_t topicSize) {
+        snprintf(topic, topicSize, "homeassistant/%s/%s/%s/config", entity.component, _taskConfig.device_id, entity.objectId);
 
-    bool publishTemperature(float temp) {
-        if (!_mqttClient.connected() || isnan(temp)) {
-            return false;
-        }
-        return _mqttClient.publish(_topic_temperature, String(temp).c_str());
-    }
+        char uniqueId[64];
+        snprintf(uniqueId, sizeof(uniqueId), "%s_%s", _taskConfig.device_id, entity.objectId);
+        char valueTemplate[48] = "";
 
-    bool publishAlert(const String& message) {
-        if (!_mqttClient.connected() || message.isEmpty()) {
-            return false;
+        doc["name"] = entity.name;
+        doc["uniq_id"] = uniqueId;
+        switch (entity.source) {
+            case SOURCE_METRIC:
+                if (_taskConfig.state_topic) {
+                    snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s }}", METRIC_NAMES[entity.index]);
+                    doc["stat_t"] = _topics.state;
+                } else {
+                    doc["stat_t"] = _topics.metrics[entity.index];
+                }
+                break;
+            case SOURCE_RELAY:
+                doc["stat_t"] = _topics.relays[entity.index];
+                doc["cmd_t"] = _topics.relayCommands[entity.index];
+                break;
+            case SOURCE_CYCLE:
+                snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s }}", entity.field);
+                doc["stat_t"] = _topics.cycle;
+                break;
+            case SOURCE_USAGE:
+                snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s }}", entity.field);
+                doc["stat_t"] = _topics.usage[entity.index];
+                break;
+            case SOURCE_STATS:
+                snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s }}", entity.field);
+                doc["stat_t"] = _topics.stats[entity.index];
+                break;
+            case SOURCE_FORECAST:
+                snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s }}", entity.field);
+                doc["stat_t"] = _topics.forecast;
+                break;
         }
-        return _mqttClient.publish(_topic_alerts, message.c_str());
-    }
-
-    bool publishPumpState(bool state) {
-        if (!_mqttClient.connected()) {
-            return false;
+        if (valueTemplate[0]) {
+            doc["val_tpl"] = valueTemplate;
         }
-        return _mqttClient.publish(_topic_pump, state ? "ON" : "OFF");
-    }
-
-    bool publishLightsState(bool state) {
-        if (!_mqttClient.connected()) {
-            return false;
+        if (entity.unit) {
+            doc["unit_of_meas"] = entity.unit;
+        }
+        if (entity.deviceClass) {
+            doc["dev_cla"] = entity.deviceClass;
         }
-        return _mqttClient.publish(_topic_lights, state ? "ON" : "OFF");
+        doc["ic"] = entity.icon;
+        doc["avty_t"] = _topics.availability;
+
+        char deviceName[64];
+        snprintf(deviceName, sizeof(deviceName), "Hydroponics %s", _taskConfig.device_id);
+        JsonObject device = doc.createNestedObject("dev");
+        device.createNestedArray("ids").add(_taskConfig.device_id);
+        device["name"] = deviceName;
+        device["mf"] = "DIY";
+        device["mdl"] = "ESP32 Hydroponics Controller";
     }
 
-    const char* getTopicPump() const { return _topic_pump; }
-    const char* getTopicLights() const { return _topic_lights; }
-    const char* getTopicAlerts() const { return _topic_alerts; }
+    // Publish every entity's retained config, streamed straight into the
+    // client. Skipped if nothing changed since the last publish unless forced.
+    void publishDiscovery(bool force) {
+        StaticJsonDocument<768> doc;
+        char topic[100];
 
-private:
-    void publishDiscoveryMessages() {
-        char discoveryTopic[100];
-        StaticJsonDocument<512> doc;
-
-        // Liquid Level Sensor
-        snprintf(discoveryTopic, sizeof(discoveryTopic), "homeassistant/sensor/%s/liquid_level/config", _config.device_id);
-        doc["name"] = "Liquid Level";
-        doc["uniq_id"] = String(_config.device_id) + "_liquid_level";
-        doc["stat_t"] = _topic_liquid;
-        doc["unit_of_meas"] = "%";
-        doc["dev_cla"] = "water";
-        doc["ic"] = "mdi:water-percent";
-        _mqttClient.publish(discoveryTopic, doc.as<String>().c_str(), true);
-        doc.clear();
-
-        // pH Sensor
-        snprintf(discoveryTopic, sizeof(discoveryTopic), "homeassistant/sensor/%s/ph_value/config", _config.device_id);
-        doc["name"] = "pH Value";
-        doc["uniq_id"] = String(_config.device_id) + "_ph_value";
-        doc["stat_t"] = _topic_ph;
-        doc["unit_of_meas"] = "pH";
-        doc["ic"] = "mdi:ph";
-        _mqttClient.publish(discoveryTopic, doc.as<String>().c_str(), true);
-        doc.clear();
-
-        // TDS Sensor
-        snprintf(discoveryTopic, sizeof(discoveryTopic), "homeassistant/sensor/%s/tds_value/config", _config.device_id);
-        doc["name"] = "TDS Value";
-        doc["uniq_id"] = String(_config.device_id) + "_tds_value";
-        doc["stat_t"] = _topic_tds;
-        doc["unit_of_meas"] = "ppm";
-        doc["ic"] = "mdi:water";
-        _mqttClient.publish(discoveryTopic, doc.as<String>().c_str(), true);
-        doc.clear();
-
-        // Pump Switch
-        snprintf(discoveryTopic, sizeof(discoveryTopic), "homeassistant/switch/%s/pump/config", _config.device_id);
-        doc["name"] = "Pump";
-        doc["uniq_id"] = String(_config.device_id) + "_pump";
-        doc["stat_t"] = _topic_pump;
-        doc["cmd_t"] = _topic_pump;
-        doc["ic"] = "mdi:pump";
-        _mqttClient.publish(discoveryTopic, doc.as<String>().c_str(), true);
-        doc.clear();
-
-        // Lights Switch
-        snprintf(discoveryTopic, sizeof(discoveryTopic), "homeassistant/switch/%s/lights/config", _config.device_id);
-        doc["name"] = "Grow Lights";
-        doc["uniq_id"] = String(_config.device_id) + "_lights";
-        doc["stat_t"] = _topic_lights;
-        doc["cmd_t"] = _topic_lights;
-        doc["ic"] = "mdi:lightbulb";
-        _mqttClient.publish(discoveryTopic, doc.as<String>().c_str(), true);
-        doc.clear();
+        HashPrint hash;
+        for (size_t i = 0; i < DISCOVERY_ENTITY_COUNT; i++) {
+            doc.clear();
+            buildDiscovery(DISCOVERY_ENTITIES[i], doc, topic, sizeof(topic));
+            hash.write(topic);
+            serializeJson(doc, hash);
+        }
+        if (!force && hash.hash == _discoveryHash) {
+            LOG_DEBUG(LOG_MQTT, "Discovery unchanged, not republishing");
+            return;
+        }
+
+        bool ok = true;
+        for (size_t i = 0; i < DISCOVERY_ENTITY_COUNT && ok; i++) {
+            doc.clear();
+            buildDiscovery(DISCOVERY_ENTITIES[i], doc, topic, sizeof(topic));
+            ok = _mqttClient.beginPublish(topic, measureJson(doc), true);
+            serializeJson(doc, _mqttClient);
+            ok = _mqttClient.endPublish() && ok;
+        }
+        if (ok) {
+            _discoveryHash = hash.hash;
+            LOG_INFO(LOG_MQTT, "Published discovery for %u entities", (unsigned)DISCOVERY_ENTITY_COUNT);
+        } else {
+            LOG_WARN(LOG_MQTT, "Failed to publish discovery");
+        }
     }
 };
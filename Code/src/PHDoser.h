@@ -0,0 +1,285 @@
+#pragma once
+#include <Arduino.h>
+#include <math.h>
+#include <atomic>
+#include <esp_timer.h>
+#include "Config.h"
+#include "RelayController.h"
+#include "ProfileCatalog.h"
+#include "LogBuffer.h"
+
+// Out-of-range samples in a row, on the same side, before a dose. Keeps
+// probe noise at the edge of the range from triggering pulses.
+#define PH_DOSE_CONFIRM_SAMPLES 5
+
+// Distance from the target at which the full configured dose is given;
+// smaller errors get a proportional share of it
+#define PH_DOSE_FULL_ERROR 0.5f
+
+// Pulse length limits. Peristaltic pumps deliver unreliably below the minimum.
+#define PH_DOSE_MIN_PULSE_MS 100
+#define PH_DOSE_MAX_PULSE_MS 10000
+
+// A dose counts against the hourly cap until an hour after its pulse ended.
+// The last PH_DOSE_LOG_SIZE doses are kept; while all of them are within
+// the hour no further dose is given, so the cap holds over any hour.
+#define PH_DOSE_WINDOW_MS (60LL * 60LL * 1000LL)
+#define PH_DOSE_LOG_SIZE 32
+
+enum DoseDirection : uint8_t {
+  DOSE_UP = 0,
+  DOSE_DOWN,
+  DOSE_DIRECTION_COUNT
+};
+
+static const char* const DOSE_DIRECTION_NAMES[DOSE_DIRECTION_COUNT] = {
+  "up", "down"
+};
+
+enum DoserState : uint8_t {
+  DOSER_OFF = 0,      // Disabled, no active cycle or no pH reading
+  DOSER_IN_RANGE,
+  DOSER_CONFIRMING,   // Out of range, waiting for PH_DOSE_CONFIRM_SAMPLES
+  DOSER_DOSING,       // Pulse running
+  DOSER_MIXING,       // Waiting for the last dose to mix in
+  DOSER_CAPPED,       // Hourly cap reached for the needed direction
+  DOSER_HELD,         // Relay refused, or reservoir below its critical level
+  DOSER_STATE_COUNT
+};
+
+static const char* const DOSER_STATE_NAMES[DOSER_STATE_COUNT] = {
+  "off", "in_range", "confirming", "dosing", "mixing", "capped", "held"
+};
+
+// Outcome of one update, for the control loop
+enum DoseResult : uint8_t {
+  DOSE_NONE = 0,
+  DOSE_STARTED,
+  DOSE_CAP_REACHED    // First sample of a capped episode
+};
+
+struct DoserStatus {
+  DoserState state;
+  float target;                             // Midpoint of the stage's range, NaN when off
+  float lastDoseMl;
+  uint32_t lastPulseMs;
+  uint32_t mixingMs;                        // Until the reading is trusted again
+  float hourMl[DOSE_DIRECTION_COUNT];       // Dosed within the cap window
+  uint32_t doses[DOSE_DIRECTION_COUNT];     // Since boot
+};
+
+// Closed-loop pH correction with the pH up/down relays. Each sensor sample
+// is compared with the active stage's range; once a reading has stayed out
+// of range for PH_DOSE_CONFIRM_SAMPLES it doses towards the middle of the
+// range with a pulse proportional to the error, then waits for the dose to
+// mix in before looking again. Pulses are ended by an esp_timer one-shot,
+// so their length does not depend on when the control loop next runs.
+class PHDoser {
+private:
+  RelayController& _relays;
+  esp_timer_handle_t _timer = nullptr;
+  std::atomic<int8_t> _pulseRelay;          // Relay of the running pulse, -1 if none
+
+  uint8_t _confirmed = 0;
+  DoseDirection _confirmDirection = DOSE_UP;
+  int64_t _mixUntil = 0;
+  bool _capReported = false;
+
+  struct Dose {
+    int64_t endsAt;                         // Pulse end, ms
+    float ml;
+    DoseDirection direction;
+  };
+  Dose _log[PH_DOSE_LOG_SIZE];
+  uint8_t _logNext = 0;
+  uint8_t _logCount = 0;
+
+  DoserStatus _status;
+  portMUX_TYPE _statusLock = portMUX_INITIALIZER_UNLOCKED;
+
+  // Runs on the esp_timer task
+  static void onPulseEnd(void* arg) {
+    PHDoser* doser = (PHDoser*)arg;
+    int8_t relay = doser->_pulseRelay.exchange(-1);
+    if (relay >= 0) {
+      doser->_relays.switchOff(RELAY_BIT(relay));
+    }
+  }
+
+  void record(DoseDirection direction, float ml, int64_t endsAt) {
+    _log[_logNext] = {endsAt, ml, direction};
+    _logNext = (_logNext + 1) % PH_DOSE_LOG_SIZE;
+    if (_logCount < PH_DOSE_LOG_SIZE) {
+      _logCount++;
+    }
+  }
+
+  // Every logged dose is still within the hour, so the oldest one would be
+  // forgotten before it expires
+  bool logFull(int64_t now) const {
+    return _logCount == PH_DOSE_LOG_SIZE && _log[_logNext].endsAt > now - PH_DOSE_WINDOW_MS;
+  }
+
+  void setStatus(DoserState state, float target, int64_t now) {
+    portENTER_CRITICAL(&_statusLock);
+    _status.state = state;
+    _status.target = target;
+    _status.mixingMs = now < _mixUntil ? (uint32_t)(_mixUntil - now) : 0;
+    for (int i = 0; i < DOSE_DIRECTION_COUNT; i++) {
+      _status.hourMl[i] = dosedLastHour((DoseDirection)i, now);
+    }
+    portEXIT_CRITICAL(&_statusLock);
+  }
+
+public:
+  PHDoser(RelayController& relays) : _relays(relays), _pulseRelay(-1) {
+    memset(&_status, 0, sizeof(_status));
+    _status.target = NAN;
+  }
+
+  void begin() {
+    esp_timer_create_args_t args = {};
+    args.callback = onPulseEnd;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "ph_dose";
+    if (esp_timer_create(&args, &_timer) != ESP_OK) {
+      _timer = nullptr;
+      LOG_ERROR(LOG_SYSTEM, "Failed to create pH dosing timer, dosing disabled");
+    }
+  }
+
+  // Run once per sensor sample on the control task. stage is the active
+  // stage, or nullptr when no cycle is running; now is a monotonic
+  // millisecond clock.
+  DoseResult update(float ph, const GrowthStage* stage, const PHDosingConfig& config, int64_t now) {
+    if (!config.enabled || !stage || isnan(ph) || config.pumpMlPerS <= 0 || !_timer) {
+      stop();
+      _confirmed = 0;
+      setStatus(DOSER_OFF, NAN, now);
+      return DOSE_NONE;
+    }
+
+    float target = (stage->phMin + stage->phMax) / 2;
+    if (_pulseRelay.load() >= 0) {
+      setStatus(DOSER_DOSING, target, now);
+      return DOSE_NONE;
+    }
+    if (now < _mixUntil) {
+      setStatus(DOSER_MIXING, target, now);
+      return DOSE_NONE;
+    }
+
+    DoseDirection direction;
+    if (ph < stage->phMin) {
+      direction = DOSE_UP;
+    } else if (ph > stage->phMax) {
+      direction = DOSE_DOWN;
+    } else {
+      _confirmed = 0;
+      _capReported = false;
+      setStatus(DOSER_IN_RANGE, target, now);
+      return DOSE_NONE;
+    }
+
+    if (direction != _confirmDirection) {
+      _confirmDirection = direction;
+      _confirmed = 0;
+    }
+    if (_confirmed < PH_DOSE_CONFIRM_SAMPLES) {
+      _confirmed++;
+    }
+    if (_confirmed < PH_DOSE_CONFIRM_SAMPLES) {
+      setStatus(DOSER_CONFIRMING, target, now);
+      return DOSE_NONE;
+    }
+
+    // A concentrated dose into a nearly empty reservoir overshoots
+    if (!_relays.liquidOk()) {
+      setStatus(DOSER_HELD, target, now);
+      return DOSE_NONE;
+    }
+
+    // Proportional dose, at least the shortest reliable pulse, cut to what
+    // is left of the hourly cap
+    float error = fabsf(target - ph);
+    float ml = config.doseMl * fminf(1.0f, error / PH_DOSE_FULL_ERROR);
+    uint32_t pulseMs = (uint32_t)(ml / config.pumpMlPerS * 1000.0f);
+    pulseMs = constrain(pulseMs, (uint32_t)PH_DOSE_MIN_PULSE_MS, (uint32_t)PH_DOSE_MAX_PULSE_MS);
+    float remaining = config.maxMlPerHour - dosedLastHour(direction, now);
+    uint32_t remainingMs = remaining > 0 && !logFull(now) ? (uint32_t)(remaining / config.pumpMlPerS * 1000.0f) : 0;
+    if (pulseMs > remainingMs) {
+      if (remainingMs < PH_DOSE_MIN_PULSE_MS) {
+        setStatus(DOSER_CAPPED, target, now);
+        if (_capReported) {
+          return DOSE_NONE;
+        }
+        _capReported = true;
+        LOG_WARN(LOG_CYCLE, "pH %s dosing cap of %.1f ml/h reached", DOSE_DIRECTION_NAMES[direction],
+                 config.maxMlPerHour);
+        return DOSE_CAP_REACHED;
+      }
+      pulseMs = remainingMs;
+    }
+    ml = pulseMs * config.pumpMlPerS / 1000.0f;
+
+    // The relay is claimed before it turns on, so a stop() from here on
+    // always finds it
+    uint8_t relay = direction == DOSE_UP ? RELAY_PH_UP : RELAY_PH_DOWN;
+    _pulseRelay.store(relay);
+    if (_relays.apply(RELAY_BIT(relay), RELAY_BIT(relay)) != 0) {
+      _pulseRelay.store(-1);
+      setStatus(DOSER_HELD, target, now);
+      return DOSE_NONE;
+    }
+    if (esp_timer_start_once(_timer, (uint64_t)pulseMs * 1000) != ESP_OK) {
+      onPulseEnd(this);
+      LOG_ERROR(LOG_CYCLE, "Failed to time pH dosing pulse");
+      setStatus(DOSER_HELD, target, now);
+      return DOSE_NONE;
+    }
+
+    record(direction, ml, now + pulseMs);
+    _mixUntil = now + pulseMs + config.mixS * 1000LL;
+    _confirmed = 0;
+    _capReported = false;
+    LOG_ACTION(LOG_CYCLE, "pH %.2f, target %.2f: dosing pH %s %.1f ml (%u ms)", ph, target,
+               DOSE_DIRECTION_NAMES[direction], ml, pulseMs);
+
+    portENTER_CRITICAL(&_statusLock);
+    _status.lastDoseMl = ml;
+    _status.lastPulseMs = pulseMs;
+    _status.doses[direction]++;
+    portEXIT_CRITICAL(&_statusLock);
+    setStatus(DOSER_DOSING, target, now);
+    return DOSE_STARTED;
+  }
+
+  // End a running pulse early
+  void stop() {
+    if (_timer) {
+      esp_timer_stop(_timer);
+    }
+    onPulseEnd(this);
+  }
+
+  // Millilitres dosed in one direction within the last hour, counting a
+  // running pulse in full
+  float dosedLastHour(DoseDirection direction, int64_t now) const {
+    float total = 0;
+    for (int i = 0; i < _logCount; i++) {
+      if (_log[i].direction == direction && _log[i].endsAt > now - PH_DOSE_WINDOW_MS) {
+        total += _log[i].ml;
+      }
+    }
+    return total;
+  }
+
+  // Safe to call from any task
+  DoserStatus getStatus() {
+    portENTER_CRITICAL(&_statusLock);
+    DoserStatus status = _status;
+    portEXIT_CRITICAL(&_statusLock);
+    return status;
+  }
+};
@@ -0,0 +1,93 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_pm.h>
+#include <driver/gpio.h>
+#include "LogBuffer.h"
+
+// How long after the last web request or MQTT command the CPU is kept at full clock
+#define POWER_ACTIVE_HOLD_MS 30000
+
+// CPU clock range used by dynamic frequency scaling
+#define POWER_MAX_FREQ_MHZ 240
+#define POWER_MIN_FREQ_MHZ 80
+
+// Automatic light sleep and dynamic frequency scaling between scheduled events.
+// Once configured, ESP-IDF drops the clock and light-sleeps whenever every task
+// is blocked; the control loop blocks in ControlScheduler::wait() until its next
+// deadline, so wakeups come from that timeout, from task notifications, or from
+// WiFi at each DTIM beacon. While a client is active we hold a max-frequency
+// lock, which also keeps the chip out of light sleep.
+class PowerManager {
+private:
+  esp_pm_lock_handle_t _activeLock = nullptr;
+  bool _supported = false;
+  bool _enabled = false;
+  bool _lockHeld = false;
+  volatile uint32_t _lastActivity = 0;
+
+public:
+  // Configure power management and keep the given output pins driven during sleep
+  void begin(const uint8_t* holdPins, int holdPinCount) {
+    for (int i = 0; i < holdPinCount; i++) {
+      gpio_sleep_sel_dis((gpio_num_t)holdPins[i]);
+    }
+
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "hydro_active", &_activeLock) != ESP_OK) {
+      LOG_WARN(LOG_SYSTEM, "Power management unavailable in this build");
+      return;
+    }
+    _supported = true;
+
+    // Start out holding the lock; update() releases it when power save is on
+    esp_pm_lock_acquire(_activeLock);
+    _lockHeld = true;
+  }
+
+  // Turn power save mode on or off
+  void setEnabled(bool enabled) {
+    if (!_supported || enabled == _enabled) {
+      return;
+    }
+
+    esp_pm_config_esp32_t config;
+    config.max_freq_mhz = POWER_MAX_FREQ_MHZ;
+    config.min_freq_mhz = enabled ? POWER_MIN_FREQ_MHZ : POWER_MAX_FREQ_MHZ;
+    config.light_sleep_enable = enabled;
+
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK) {
+      LOG_WARN(LOG_SYSTEM, "Failed to configure power management: %s", esp_err_to_name(err));
+      return;
+    }
+
+    // Light sleep with WiFi connected requires modem sleep
+    WiFi.setSleep(enabled);
+    _enabled = enabled;
+    LOG_INFO(LOG_SYSTEM, "Power save %s", enabled ? "enabled" : "disabled");
+  }
+
+  bool isEnabled() const { return _enabled; }
+
+  // Record client activity (web request, MQTT command). Safe from any task.
+  void markActivity() {
+    _lastActivity = millis();
+  }
+
+  // Hold full clock while clients are active, release it otherwise.
+  // Called by the control loop before it waits.
+  void update(bool clientConnected) {
+    if (!_supported) {
+      return;
+    }
+
+    bool active = !_enabled || clientConnected || (millis() - _lastActivity < POWER_ACTIVE_HOLD_MS);
+    if (active && !_lockHeld) {
+      esp_pm_lock_acquire(_activeLock);
+      _lockHeld = true;
+    } else if (!active && _lockHeld) {
+      esp_pm_lock_release(_activeLock);
+      _lockHeld = false;
+    }
+  }
+};
@@ -0,0 +1,479 @@
+#pragma once
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <stddef.h>
+#include <time.h>
+#include <memory>
+#include <new>
+#include "LogBuffer.h"
+
+#define SECONDS_PER_DAY (24 * 60 * 60)
+
+// Most stages a profile can have, e.g. germination, cloning, veg,
+// pre-flower, flower and flush
+#define MAX_GROWTH_STAGES 8
+#define STAGE_NAME_SIZE 16
+
+// Version of the stored GrowthProfile layout
+#define PROFILE_FORMAT 2
+
+// Growth Profile Stage structure
+struct GrowthStage {
+  char name[STAGE_NAME_SIZE]; // Display name of the stage
+  int duration;           // Duration in days
+  int waterDuration;      // Watering duration in minutes
+  int waterInterval;      // Watering interval in minutes
+  int lightHours;         // Light hours per day
+  int lightStartHour;     // Hour of day when lights turn on (24h format)
+  float phMin;            // Minimum pH value
+  float phMax;            // Maximum pH value
+};
+
+// Growth Profile structure. Only the header and the stages in use are
+// stored, see storedSize().
+struct GrowthProfile {
+  char id[32];            // Unique identifier for the profile
+  char name[64];          // Display name for the profile
+  uint8_t format;         // PROFILE_FORMAT
+  uint8_t stageCount;     // Stages in use, 1 to MAX_GROWTH_STAGES
+  GrowthStage stages[MAX_GROWTH_STAGES];
+  int stageEndDays[MAX_GROWTH_STAGES];  // Prefix sums of the durations, from updateStageEnds()
+
+  void updateStageEnds() {
+    int total = 0;
+    for (int i = 0; i < stageCount; i++) {
+      total += stages[i].duration;
+      stageEndDays[i] = total;
+    }
+  }
+
+  int totalDuration() const {
+    return stageCount > 0 ? stageEndDays[stageCount - 1] : 0;
+  }
+
+  // Stage in effect the given time into the cycle. Binary search over the
+  // stage ends; the last stage continues until the cycle is stopped.
+  int stageAt(time_t elapsedSeconds) const {
+    int low = 0;
+    int high = stageCount - 1;
+    while (low < high) {
+      int mid = (low + high) / 2;
+      if (elapsedSeconds < (time_t)stageEndDays[mid] * SECONDS_PER_DAY) {
+        high = mid;
+      } else {
+        low = mid + 1;
+      }
+    }
+    return low;
+  }
+
+  size_t storedSize() const {
+    return offsetof(GrowthProfile, stages) + stageCount * sizeof(GrowthStage);
+  }
+};
+
+// Fixed three-stage layout stored by earlier firmware, converted on load
+struct LegacyGrowthStage {
+  int duration;
+  int waterDuration;
+  int waterInterval;
+  int lightHours;
+  int lightStartHour;
+  float phMin;
+  float phMax;
+};
+
+struct LegacyGrowthProfile {
+  char id[32];
+  char name[64];
+  LegacyGrowthStage stages[3];  // Seedling, growing, harvesting
+};
+
+static_assert((sizeof(LegacyGrowthProfile) - offsetof(GrowthProfile, stages)) % sizeof(GrowthStage) != 0,
+              "Legacy profile size must not match a stored GrowthProfile size");
+
+// Most profiles the catalog holds, 226 KB of records. At boot the index is
+// sized to the profiles already stored plus those the free flash has room
+// for, as the SPIFFS partition also carries the web UI, the history and the
+// MQTT spool.
+#define CATALOG_MAX_CAPACITY 512
+
+// Flash left free when the file grows by a record, for SPIFFS's own use
+// and the other files
+#define CATALOG_FLASH_RESERVE 8192
+
+// Full profiles kept in RAM for recently viewed entries
+#define CATALOG_CACHE_SIZE 4
+
+// Each profile occupies a fixed-size record so its offset follows from its
+// slot. Only storedSize() bytes of a record are written.
+#define CATALOG_RECORD_SIZE offsetof(GrowthProfile, stageEndDays)
+#define CATALOG_HEADER_SIZE offsetof(GrowthProfile, stages)
+
+#define CATALOG_FILE_PATH "/profiles.bin"
+
+// Index entry: where a profile lives in the catalog file
+struct CatalogEntry {
+  uint32_t idHash;
+  uint16_t slot;
+};
+
+// Identifying fields of a profile, read without loading its stages
+struct ProfileSummary {
+  char id[32];
+  char name[64];
+  uint8_t format;
+  uint8_t stageCount;
+};
+
+static_assert(sizeof(ProfileSummary) <= CATALOG_HEADER_SIZE &&
+              offsetof(ProfileSummary, stageCount) == offsetof(GrowthProfile, stageCount),
+              "ProfileSummary must match the start of GrowthProfile");
+
+// Growth profiles stored as fixed-size records in one SPIFFS file. RAM holds
+// only a hash index sorted by slot and a small LRU cache of full profiles;
+// listings read record headers straight from the file. A record with a
+// zero format byte is free. Safe to call from any task.
+class ProfileCatalog {
+private:
+  struct CacheLine {
+    bool valid;
+    uint32_t lastUsed;
+    GrowthProfile profile;
+  };
+
+  std::unique_ptr<CatalogEntry[]> _index;
+  int _capacity = 0;
+  int _count = 0;
+  int _fileRecords = 0;         // Records the file currently spans
+  CacheLine _cache[CATALOG_CACHE_SIZE];
+  uint32_t _useCounter = 0;
+  uint32_t _cacheHits = 0;
+  uint32_t _cacheMisses = 0;
+  SemaphoreHandle_t _lock = nullptr;
+  bool _ok = false;
+
+public:
+  // Build the index by scanning the record headers
+  bool begin() {
+    _lock = xSemaphoreCreateMutex();
+    memset(_cache, 0, sizeof(_cache));
+
+    File file = SPIFFS.open(CATALOG_FILE_PATH, FILE_READ);
+    if (!file) {
+      file = SPIFFS.open(CATALOG_FILE_PATH, FILE_WRITE);
+      if (!file) {
+        LOG_ERROR(LOG_GROWTH, "Failed to create profile catalog");
+        return false;
+      }
+    }
+
+    _fileRecords = file.size() / CATALOG_RECORD_SIZE;
+    if (_fileRecords > CATALOG_MAX_CAPACITY) {
+      LOG_WARN(LOG_GROWTH, "Profile catalog spans %d records, only the first %d are used",
+               _fileRecords, CATALOG_MAX_CAPACITY);
+      _fileRecords = CATALOG_MAX_CAPACITY;
+    }
+    size_t used = SPIFFS.usedBytes();
+    size_t free = SPIFFS.totalBytes() > used ? SPIFFS.totalBytes() - used : 0;
+    size_t room = free > CATALOG_FLASH_RESERVE ? (free - CATALOG_FLASH_RESERVE) / CATALOG_RECORD_SIZE : 0;
+    _capacity = room < (size_t)(CATALOG_MAX_CAPACITY - _fileRecords) ? _fileRecords + room : CATALOG_MAX_CAPACITY;
+    _index.reset(new (std::nothrow) CatalogEntry[_capacity > 0 ? _capacity : 1]);
+    if (!_index) {
+      file.close();
+      LOG_ERROR(LOG_GROWTH, "Not enough memory for the profile catalog index");
+      return false;
+    }
+
+    ProfileSummary summary;
+    for (int slot = 0; slot < _fileRecords; slot++) {
+      if (!readSummary(file, slot, summary)) {
+        break;
+      }
+      if (summary.format == PROFILE_FORMAT) {
+        summary.id[sizeof(summary.id) - 1] = '\0';
+        _index[_count].idHash = hashId(summary.id);
+        _index[_count].slot = slot;
+        _count++;
+      }
+    }
+    file.close();
+    _ok = true;
+    LOG_INFO(LOG_GROWTH, "Profile catalog holds %d of up to %d profiles", _count, _capacity);
+    return true;
+  }
+
+  bool ok() const {
+    return _ok;
+  }
+
+  int count() const {
+    return _count;
+  }
+
+  // Profiles the index has room for; flash may run out sooner
+  int capacity() const {
+    return _capacity;
+  }
+
+  bool contains(const char* id) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found = _ok && findEntry(id) >= 0;
+    xSemaphoreGive(_lock);
+    return found;
+  }
+
+  // Copy a profile, from the cache if it was used recently
+  bool get(const char* id, GrowthProfile& profile) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found = _ok && load(id, profile);
+    xSemaphoreGive(_lock);
+    return found;
+  }
+
+  // Call fn(const ProfileSummary&) for up to limit profiles starting at
+  // offset, in slot order. Returns the number visited.
+  template <typename Fn>
+  int list(int offset, int limit, Fn fn) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    int visited = 0;
+    File file = _ok ? SPIFFS.open(CATALOG_FILE_PATH, FILE_READ) : File();
+    if (file) {
+      ProfileSummary summary;
+      for (int i = offset; i < _count && visited < limit; i++) {
+        if (!readSummary(file, _index[i].slot, summary)) {
+          break;
+        }
+        summary.id[sizeof(summary.id) - 1] = '\0';
+        summary.name[sizeof(summary.name) - 1] = '\0';
+        fn(summary);
+        visited++;
+      }
+      file.close();
+    }
+    xSemaphoreGive(_lock);
+    return visited;
+  }
+
+  // Add a profile or overwrite the one with the same ID. Only its record
+  // is written. Returns false if the catalog is full, there is no flash
+  // left for a new record or the write fails.
+  bool save(const GrowthProfile& profile) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool saved = _ok && store(profile);
+    xSemaphoreGive(_lock);
+    return saved;
+  }
+
+  // Free a profile's record. Later index entries move up; no other record
+  // is touched.
+  bool remove(const char* id) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    int index = _ok ? findEntry(id) : -1;
+    bool removed = false;
+    if (index >= 0) {
+      uint8_t freeFormat = 0;
+      File file = SPIFFS.open(CATALOG_FILE_PATH, "r+");
+      removed = file && file.seek(recordOffset(_index[index].slot) + offsetof(GrowthProfile, format)) &&
+                file.write(&freeFormat, 1) == 1;
+      file.close();
+      if (removed) {
+        memmove(&_index[index], &_index[index + 1], (_count - index - 1) * sizeof(CatalogEntry));
+        _count--;
+        evict(id);
+      }
+    }
+    xSemaphoreGive(_lock);
+    return removed;
+  }
+
+  uint32_t cacheHits() const {
+    return _cacheHits;
+  }
+
+  uint32_t cacheMisses() const {
+    return _cacheMisses;
+  }
+
+private:
+  // FNV-1a
+  static uint32_t hashId(const char* id) {
+    uint32_t hash = 2166136261u;
+    while (*id) {
+      hash = (hash ^ (uint8_t)*id++) * 16777619u;
+    }
+    return hash;
+  }
+
+  static uint32_t recordOffset(int slot) {
+    return (uint32_t)slot * CATALOG_RECORD_SIZE;
+  }
+
+  static bool readSummary(File& file, int slot, ProfileSummary& summary) {
+    return file.seek(recordOffset(slot)) &&
+           file.read((uint8_t*)&summary, sizeof(summary)) == sizeof(summary);
+  }
+
+  // Index position of a profile. Hash matches are confirmed against the
+  // stored ID, so collisions only cost a read. Lock must be held.
+  int findEntry(const char* id) {
+    uint32_t hash = hashId(id);
+    File file;
+    for (int i = 0; i < _count; i++) {
+      if (_index[i].idHash != hash) {
+        continue;
+      }
+      if (!file) {
+        file = SPIFFS.open(CATALOG_FILE_PATH, FILE_READ);
+      }
+      ProfileSummary summary;
+      if (file && readSummary(file, _index[i].slot, summary) &&
+          strncmp(summary.id, id, sizeof(summary.id)) == 0) {
+        file.close();
+        return i;
+      }
+    }
+    file.close();
+    return -1;
+  }
+
+  CacheLine* findCached(const char* id) {
+    for (int i = 0; i < CATALOG_CACHE_SIZE; i++) {
+      if (_cache[i].valid && strcmp(_cache[i].profile.id, id) == 0) {
+        return &_cache[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Put a profile in the least recently used line
+  void cache(const GrowthProfile& profile) {
+    CacheLine* line = findCached(profile.id);
+    if (!line) {
+      line = &_cache[0];
+      for (int i = 1; i < CATALOG_CACHE_SIZE; i++) {
+        if (!_cache[i].valid || (line->valid && _cache[i].lastUsed < line->lastUsed)) {
+          line = &_cache[i];
+        }
+      }
+    }
+    line->valid = true;
+    line->lastUsed = ++_useCounter;
+    line->profile = profile;
+  }
+
+  void evict(const char* id) {
+    CacheLine* line = findCached(id);
+    if (line) {
+      line->valid = false;
+    }
+  }
+
+  // Lock must be held
+  bool load(const char* id, GrowthProfile& profile) {
+    CacheLine* line = findCached(id);
+    if (line) {
+      line->lastUsed = ++_useCounter;
+      profile = line->profile;
+      _cacheHits++;
+      return true;
+    }
+    _cacheMisses++;
+
+    int index = findEntry(id);
+    if (index < 0) {
+      return false;
+    }
+    File file = SPIFFS.open(CATALOG_FILE_PATH, FILE_READ);
+    memset(&profile, 0, sizeof(profile));
+    bool ok = file && file.seek(recordOffset(_index[index].slot)) &&
+              file.read((uint8_t*)&profile, CATALOG_HEADER_SIZE) == CATALOG_HEADER_SIZE &&
+              profile.stageCount > 0 && profile.stageCount <= MAX_GROWTH_STAGES &&
+              file.read((uint8_t*)profile.stages, profile.stageCount * sizeof(GrowthStage)) ==
+                profile.stageCount * sizeof(GrowthStage);
+    file.close();
+    if (!ok) {
+      LOG_WARN(LOG_GROWTH, "Failed to read profile %s from catalog", id);
+      return false;
+    }
+    profile.id[sizeof(profile.id) - 1] = '\0';
+    profile.name[sizeof(profile.name) - 1] = '\0';
+    profile.updateStageEnds();
+    cache(profile);
+    return true;
+  }
+
+  // Lock must be held
+  bool store(const GrowthProfile& profile) {
+    int index = findEntry(profile.id);
+    bool isNew = index < 0;
+    int slot;
+    if (isNew) {
+      if (_count >= _capacity) {
+        return false;
+      }
+      // Lowest free slot, which keeps the index sorted by slot
+      slot = 0;
+      index = 0;
+      while (index < _count && _index[index].slot == slot) {
+        index++;
+        slot++;
+      }
+    } else {
+      slot = _index[index].slot;
+    }
+
+    // A free slot lies inside the file or directly after its end
+    if (slot == _fileRecords) {
+      size_t used = SPIFFS.usedBytes();
+      size_t total = SPIFFS.totalBytes();
+      if (used > total || total - used < CATALOG_RECORD_SIZE + CATALOG_FLASH_RESERVE) {
+        LOG_WARN(LOG_GROWTH, "No flash left for profile %s", profile.id);
+        return false;
+      }
+    }
+
+    // A new record keeps a free format byte until the rest of it is written,
+    // so a write that stops short leaves a free slot, never a broken profile
+    File file = SPIFFS.open(CATALOG_FILE_PATH, "r+");
+    size_t size = profile.storedSize();
+    const size_t formatAt = offsetof(GrowthProfile, format);
+    uint8_t format = isNew ? 0 : profile.format;
+    bool written = file && file.seek(recordOffset(slot)) &&
+                   file.write((const uint8_t*)&profile, formatAt) == formatAt &&
+                   file.write(&format, 1) == 1 &&
+                   file.write((const uint8_t*)&profile + formatAt + 1, size - formatAt - 1) == size - formatAt - 1;
+    if (written && slot == _fileRecords) {
+      // Pad a new last record so the next one starts at its slot offset
+      static const uint8_t zeros[32] = {};
+      size_t padding = CATALOG_RECORD_SIZE - size;
+      while (written && padding > 0) {
+        size_t chunk = padding < sizeof(zeros) ? padding : sizeof(zeros);
+        written = file.write(zeros, chunk) == chunk;
+        padding -= chunk;
+      }
+    }
+    if (written && isNew) {
+      written = file.seek(recordOffset(slot) + formatAt) && file.write(&profile.format, 1) == 1;
+    }
+    file.close();
+    if (!written) {
+      LOG_ERROR(LOG_GROWTH, "Failed to write profile %s to catalog", profile.id);
+      return false;
+    }
+    if (slot == _fileRecords) {
+      _fileRecords++;
+    }
+
+    if (isNew) {
+      memmove(&_index[index + 1], &_index[index], (_count - index) * sizeof(CatalogEntry));
+      _index[index].idHash = hashId(profile.id);
+      _index[index].slot = slot;
+      _count++;
+    }
+    if (findCached(profile.id)) {
+      cache(profile);
+    }
+    return true;
+  }
+};
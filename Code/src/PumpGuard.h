@@ -0,0 +1,180 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+#include "RelayController.h"
+#include "LogBuffer.h"
+
+// Shutoff latency histogram. Bucket i counts stops later than the deadline
+// by less than PUMP_LATENCY_BOUNDS_US[i]; the last bucket counts the rest.
+#define PUMP_LATENCY_BUCKETS 8
+
+static const uint32_t PUMP_LATENCY_BOUNDS_US[PUMP_LATENCY_BUCKETS - 1] = {
+  100, 500, 1000, 5000, 20000, 100000, 1000000
+};
+
+static const char* const PUMP_LATENCY_LABELS[PUMP_LATENCY_BUCKETS] = {
+  "<100us", "<500us", "<1ms", "<5ms", "<20ms", "<100ms", "<1s", ">=1s"
+};
+
+struct PumpShutoffStats {
+  uint32_t histogram[PUMP_LATENCY_BUCKETS];
+  uint32_t timerStops;      // Stopped by the deadline timer
+  uint32_t loopStops;       // Still running at the deadline, stopped by the control loop
+  uint32_t failsafeTrips;   // Timer stops at the maximum run time
+  uint32_t lastUs;          // Latency of the latest stop
+  uint32_t maxUs;
+  int64_t deadlineUs;       // esp_timer time of the armed deadline, 0 if none
+};
+
+// Stops the pump from an esp_timer one-shot, so a watering ends on time
+// even if the control loop is late or hung. Every run gets a deadline: the
+// growth cycle's stop time or, if that is later or there is none (manual
+// runs), the maximum run time from the start.
+class PumpGuard {
+private:
+  RelayController& _relays;
+  uint8_t _relay;
+  esp_timer_handle_t _timer = nullptr;
+  int64_t _startedUs = 0;             // When the control loop first saw this run
+
+  // Shared with the timer callback
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+  int64_t _deadlineUs = 0;
+  bool _failsafe = false;             // The armed deadline is the maximum run time
+  PumpShutoffStats _stats;
+  std::atomic<bool> _tripped;
+
+  // Call with _lock held
+  void record(int64_t latencyUs) {
+    uint32_t latency = latencyUs <= 0 ? 0 : latencyUs > UINT32_MAX ? UINT32_MAX : (uint32_t)latencyUs;
+    int bucket = 0;
+    while (bucket < PUMP_LATENCY_BUCKETS - 1 && latency >= PUMP_LATENCY_BOUNDS_US[bucket]) {
+      bucket++;
+    }
+    _stats.histogram[bucket]++;
+    _stats.lastUs = latency;
+    if (latency > _stats.maxUs) {
+      _stats.maxUs = latency;
+    }
+  }
+
+  // Runs on the esp_timer task
+  static void onDeadline(void* arg) {
+    PumpGuard* guard = (PumpGuard*)arg;
+    int64_t now = esp_timer_get_time();
+    RelayMask stopped = guard->_relays.switchOff(RELAY_BIT(guard->_relay));
+
+    portENTER_CRITICAL(&guard->_lock);
+    bool failsafe = guard->_failsafe;
+    if (stopped && guard->_deadlineUs) {
+      guard->record(now - guard->_deadlineUs);
+      guard->_stats.timerStops++;
+      if (failsafe) {
+        guard->_stats.failsafeTrips++;
+      }
+    }
+    guard->_deadlineUs = 0;
+    portEXIT_CRITICAL(&guard->_lock);
+
+    if (stopped && failsafe) {
+      guard->_tripped = true;
+    }
+  }
+
+  void disarm() {
+    esp_timer_stop(_timer);
+    portENTER_CRITICAL(&_lock);
+    _deadlineUs = 0;
+    portEXIT_CRITICAL(&_lock);
+  }
+
+public:
+  PumpGuard(RelayController& relays, uint8_t relay) : _relays(relays), _relay(relay), _tripped(false) {
+    memset(&_stats, 0, sizeof(_stats));
+  }
+
+  void begin() {
+    esp_timer_create_args_t args = {};
+    args.callback = onDeadline;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "pump_stop";
+    if (esp_timer_create(&args, &_timer) != ESP_OK) {
+      _timer = nullptr;
+      LOG_ERROR(LOG_SYSTEM, "Failed to create pump deadline timer");
+    }
+  }
+
+  // Keep the deadline in step with the pump. Control task, after relay
+  // changes. scheduledStopUs is when the growth cycle stops this run in
+  // esp_timer time, or 0 if it does not.
+  void update(int64_t scheduledStopUs, uint32_t maxRunMs) {
+    if (!_timer) {
+      return;
+    }
+    int64_t now = esp_timer_get_time();
+    bool running = _relays.getState(_relay);
+
+    portENTER_CRITICAL(&_lock);
+    int64_t armed = _deadlineUs;
+    if (!running && armed && now >= armed) {
+      // Stopped by the loop after the deadline: the timer did not get there first
+      record(now - armed);
+      _stats.loopStops++;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (!running) {
+      if (armed) {
+        disarm();
+      }
+      return;
+    }
+
+    // Without an armed deadline the pump is on a new run; the timer clears
+    // the deadline whenever it fires
+    if (!armed) {
+      _startedUs = now;
+    }
+    int64_t deadline = _startedUs + (int64_t)maxRunMs * 1000;
+    bool failsafe = true;
+    if (scheduledStopUs > 0 && scheduledStopUs < deadline) {
+      deadline = scheduledStopUs;
+      failsafe = false;
+    }
+    if (deadline == armed) {
+      return;
+    }
+
+    // If the timer fired meanwhile, the pump is off; leave it to the next update
+    esp_timer_stop(_timer);
+    portENTER_CRITICAL(&_lock);
+    bool fired = _deadlineUs != armed;
+    if (!fired) {
+      _deadlineUs = deadline;
+      _failsafe = failsafe;
+    }
+    portEXIT_CRITICAL(&_lock);
+    if (fired) {
+      return;
+    }
+    esp_timer_start_once(_timer, deadline > now ? deadline - now : 1);
+    LOG_DEBUG(LOG_CYCLE, "Pump deadline armed in %ld ms%s", (long)((deadline - now) / 1000),
+              failsafe ? " (maximum run time)" : "");
+  }
+
+  // True once after the maximum run time stopped the pump
+  bool takeFailsafeTrip() {
+    return _tripped.exchange(false);
+  }
+
+  // Safe to call from any task
+  PumpShutoffStats getStats() {
+    portENTER_CRITICAL(&_lock);
+    PumpShutoffStats stats = _stats;
+    stats.deadlineUs = _deadlineUs;
+    portEXIT_CRITICAL(&_lock);
+    return stats;
+  }
+};
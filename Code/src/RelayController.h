@@ -1,5 +1,9 @@
 #pragma once
 #include <Arduino.h>
+#include <atomic>
+#include <Preferences.h>
+#include <soc/gpio_struct.h>
+#include "LogBuffer.h"
 
 // Relay pin definitions
 #define RELAY_PUMP_PIN 21
@@ -14,51 +18,353 @@
 #define RELAY_PH_DOWN 3
 #define RELAY_COUNT 4
 
+// Set of relays, one bit per relay number
+typedef uint32_t RelayMask;
+#define RELAY_BIT(relay) (1u << (relay))
+#define RELAY_ALL ((1u << RELAY_COUNT) - 1)
+
+// All relay pins are driven through the low output registers
+static_assert(RELAY_PUMP_PIN < 32 && RELAY_LIGHTS_PIN < 32 && RELAY_PH_UP_PIN < 32 && RELAY_PH_DOWN_PIN < 32,
+              "Relay pins must be GPIO 0-31");
+
+// Interlocks. At most one relay of each group may be on at a time.
+static const RelayMask RELAY_EXCLUSIVE_GROUPS[] = {
+    RELAY_BIT(RELAY_PH_UP) | RELAY_BIT(RELAY_PH_DOWN)   // Acid and base must never dose together
+};
+
+// Relays that may only run while the reservoir is above its critical level
+#define RELAY_NEEDS_LIQUID RELAY_BIT(RELAY_PUMP)
+
+// Minimum time a relay stays in a state before it may change again
+struct RelayTiming {
+    uint32_t minOnMs;
+    uint32_t minOffMs;
+};
+
+// Wear counters of one relay
+struct RelayUsage {
+    uint64_t onMs;          // Cumulative on-time
+    uint32_t switches;      // Off-to-on transitions
+    uint32_t longestRunMs;  // Longest single run
+};
+
+#define RELAY_USAGE_MAGIC 0x52555347  // "RUSG"
+
+// Live counters, kept in RTC memory so they survive software resets,
+// panics and the watchdog. The checksum catches a record torn by a reset
+// mid-update; after a power cycle the last NVS checkpoint is used instead.
+struct RelayUsageRecord {
+    uint32_t magic;
+    uint32_t checksum;
+    RelayUsage usage[RELAY_COUNT];
+};
+
+// How often the counters are checkpointed to NVS
+#define RELAY_USAGE_CHECKPOINT_MS (60UL * 60UL * 1000UL)
+
 class RelayController {
 private:
     struct Relay {
         uint8_t pin;
-        bool state;
+        RelayTiming timing;
     };
 
     Relay relays[RELAY_COUNT] = {
-        {RELAY_PUMP_PIN, false},    // Water Pump
-        {RELAY_LIGHTS_PIN, false},  // Grow Lights
-        {RELAY_PH_UP_PIN, false},   // pH Up
-        {RELAY_PH_DOWN_PIN, false}  // pH Down
+        {RELAY_PUMP_PIN, {5000, 10000}},    // Water Pump, protects the motor from short cycling
+        {RELAY_LIGHTS_PIN, {1000, 1000}},   // Grow Lights
+        {RELAY_PH_UP_PIN, {0, 1000}},       // pH Up, dosing pulses may be short
+        {RELAY_PH_DOWN_PIN, {0, 1000}}      // pH Down
     };
-    
+
     const char* relayNames[RELAY_COUNT] = {
         "WaterPump",
-        "GrowLights", 
+        "GrowLights",
         "PH_Up",
         "PH_Down"
     };
 
+    // Relay states, one bit per relay. Written under _lock, read from any task.
+    std::atomic<uint32_t> _states;
+
+    uint32_t _changedAt[RELAY_COUNT] = {};  // millis() of each relay's last change
+    RelayMask _changed = 0;                 // Relays changed since boot; others have no hold time
+    std::atomic<bool> _liquidOk;
+
+    // Usage accounting. The record is updated on every transition; a
+    // running relay's on-time is folded in up to _accountedAt by accrue().
+    RelayUsageRecord& _usage;
+    RelayUsage _checkpoint[RELAY_COUNT] = {};  // What NVS holds
+    uint32_t _accountedAt[RELAY_COUNT] = {};
+
+    // Guards relay transitions and the usage record. Dosing pulses are
+    // ended from esp_timer callbacks while the control task switches
+    // other relays.
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+    static uint32_t usageChecksum(const RelayUsageRecord& record) {
+        static_assert(sizeof(record.usage) % sizeof(uint32_t) == 0, "Relay usage must be whole words");
+        const uint32_t* words = (const uint32_t*)record.usage;
+        const size_t wordCount = sizeof(record.usage) / (sizeof(uint32_t));
+        uint32_t sum = RELAY_USAGE_MAGIC;
+        for (size_t i = 0; i < wordCount; i++) {
+            sum = (sum ^ words[i]) * 16777619u;
+        }
+        return sum;
+    }
+
+    // Add a running relay's on-time up to now. Call with _lock held.
+    void foldRun(uint8_t relayNum, uint32_t now) {
+        RelayUsage& usage = _usage.usage[relayNum];
+        usage.onMs += now - _accountedAt[relayNum];
+        _accountedAt[relayNum] = now;
+        uint32_t run = now - _changedAt[relayNum];
+        if (run > usage.longestRunMs) {
+            usage.longestRunMs = run;
+        }
+    }
+
+    // GPIO bits of a set of relays
+    uint32_t pinMask(RelayMask relays) const {
+        uint32_t pins = 0;
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            if (relays & RELAY_BIT(i)) {
+                pins |= 1u << this->relays[i].pin;
+            }
+        }
+        return pins;
+    }
+
+    // Milliseconds until a relay may leave its current state
+    uint32_t holdRemaining(uint8_t relayNum, RelayMask states, uint32_t now) const {
+        if (!(_changed & RELAY_BIT(relayNum))) {
+            return 0;
+        }
+        const RelayTiming& timing = relays[relayNum].timing;
+        uint32_t minimum = (states & RELAY_BIT(relayNum)) ? timing.minOnMs : timing.minOffMs;
+        uint32_t elapsed = now - _changedAt[relayNum];
+        return elapsed < minimum ? minimum - elapsed : 0;
+    }
+
+    // Drive the changed pins with one write to each set/clear register.
+    // Clearing first means exclusive relays never overlap, even briefly.
+    // Call with _lock held.
+    void write(RelayMask turnOff, RelayMask turnOn, RelayMask newStates, uint32_t now) {
+        if (turnOff) {
+            GPIO.out_w1tc = pinMask(turnOff);
+        }
+        if (turnOn) {
+            GPIO.out_w1ts = pinMask(turnOn);
+        }
+        _states.store(newStates);
+
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            if (turnOff & RELAY_BIT(i)) {
+                foldRun(i, now);
+            } else if (turnOn & RELAY_BIT(i)) {
+                _usage.usage[i].switches++;
+                _accountedAt[i] = now;
+            } else {
+                continue;
+            }
+            _changedAt[i] = now;
+        }
+        _usage.checksum = usageChecksum(_usage);
+        _changed |= turnOff | turnOn;
+    }
+
 public:
-    RelayController() = default;
+    RelayController(RelayUsageRecord& usageRecord) : _states(0), _liquidOk(true), _usage(usageRecord) {}
 
+    // Latch every relay off before the pins become outputs
     void begin() {
+        GPIO.out_w1tc = pinMask(RELAY_ALL);
         for (int i = 0; i < RELAY_COUNT; i++) {
             pinMode(relays[i].pin, OUTPUT);
-            digitalWrite(relays[i].pin, LOW);
         }
+        _states.store(0);
     }
 
-    void setState(uint8_t relayNum, bool state) {
-        if (relayNum < RELAY_COUNT) {
-            relays[relayNum].state = state;
-            digitalWrite(relays[relayNum].pin, state ? HIGH : LOW);
+    // Set the relays in `mask` to their bits in `states`, all in one
+    // register update. Changes that would break an interlock or cut short a
+    // relay's minimum on or off time are left out; the rest still apply.
+    // Returns the relays that were refused. Safe to call from any task.
+    RelayMask apply(RelayMask mask, RelayMask states) {
+        portENTER_CRITICAL(&_lock);
+        uint32_t now = millis();
+        RelayMask current = _states.load();
+        RelayMask changes = (current ^ states) & mask & RELAY_ALL;
+        RelayMask refused = 0;
+
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            if ((changes & RELAY_BIT(i)) && holdRemaining(i, current, now) > 0) {
+                refused |= RELAY_BIT(i);
+            }
+        }
+
+        RelayMask turningOn = changes & states & ~refused;
+        if (!_liquidOk) {
+            refused |= turningOn & RELAY_NEEDS_LIQUID;
         }
+
+        // A relay may only join an exclusive group that is otherwise off
+        for (RelayMask group : RELAY_EXCLUSIVE_GROUPS) {
+            RelayMask result = current ^ (changes & ~refused);
+            if (__builtin_popcount(result & group) > 1) {
+                refused |= changes & states & group;
+            }
+        }
+
+        changes &= ~refused;
+        if (changes) {
+            write(changes & current, changes & states, current ^ changes, now);
+        }
+        portEXIT_CRITICAL(&_lock);
+        return refused;
+    }
+
+    // Switch relays off at once, regardless of their minimum on time. For
+    // ending timed pulses; safe to call from any task and from esp_timer
+    // callbacks. Returns the relays that were on.
+    RelayMask switchOff(RelayMask relays) {
+        portENTER_CRITICAL(&_lock);
+        uint32_t now = millis();
+        RelayMask current = _states.load();
+        RelayMask stop = current & relays & RELAY_ALL;
+        if (stop) {
+            write(stop, 0, current & ~stop, now);
+        }
+        portEXIT_CRITICAL(&_lock);
+        return stop;
+    }
+
+    // Switch one relay. Returns false if an interlock or hold time refused it.
+    bool setState(uint8_t relayNum, bool state) {
+        if (relayNum >= RELAY_COUNT) {
+            return false;
+        }
+        return apply(RELAY_BIT(relayNum), state ? RELAY_BIT(relayNum) : 0) == 0;
+    }
+
+    // Report whether the reservoir is above its critical level. Dropping
+    // below it stops the relays that need liquid at once, regardless of
+    // their minimum on time. Returns the relays that were stopped.
+    RelayMask setLiquidOk(bool ok) {
+        _liquidOk = ok;
+        return ok ? 0 : switchOff(RELAY_NEEDS_LIQUID);
+    }
+
+    // Safe to call from any task
+    bool liquidOk() const {
+        return _liquidOk.load();
+    }
+
+    // Milliseconds until every relay in `relays` may change state again
+    uint32_t holdRemaining(RelayMask relays) const {
+        uint32_t now = millis();
+        RelayMask current = _states.load();
+        uint32_t longest = 0;
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            if (relays & RELAY_BIT(i)) {
+                uint32_t remaining = holdRemaining(i, current, now);
+                if (remaining > longest) {
+                    longest = remaining;
+                }
+            }
+        }
+        return longest;
+    }
+
+    // Restore the usage counters: from RTC memory after a software reset,
+    // otherwise from the last NVS checkpoint. Call once at boot.
+    void loadUsage(Preferences& preferences) {
+        preferences.begin("hydro_relays", true);
+        bool saved = preferences.getBytesLength("usage") == sizeof(_checkpoint) &&
+                     preferences.getBytes("usage", _checkpoint, sizeof(_checkpoint)) == sizeof(_checkpoint);
+        preferences.end();
+        if (!saved) {
+            memset(_checkpoint, 0, sizeof(_checkpoint));
+        }
+
+        if (_usage.magic == RELAY_USAGE_MAGIC && _usage.checksum == usageChecksum(_usage)) {
+            LOG_INFO(LOG_SYSTEM, "Relay usage restored from RTC memory");
+            return;
+        }
+        _usage.magic = RELAY_USAGE_MAGIC;
+        memcpy(_usage.usage, _checkpoint, sizeof(_usage.usage));
+        _usage.checksum = usageChecksum(_usage);
+        LOG_INFO(LOG_SYSTEM, saved ? "Relay usage restored from NVS" : "Relay usage counters started");
+    }
+
+    // Fold the on-time of running relays into the counters, so a reset
+    // loses at most the time since the last call
+    void accrue() {
+        uint32_t now = millis();
+        RelayMask running = _states.load();
+        if (!running) {
+            return;
+        }
+        portENTER_CRITICAL(&_lock);
+        for (int i = 0; i < RELAY_COUNT; i++) {
+            if (running & RELAY_BIT(i)) {
+                foldRun(i, now);
+            }
+        }
+        _usage.checksum = usageChecksum(_usage);
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    // Write the counters to NVS if they changed since the last checkpoint.
+    // Control task only; called every RELAY_USAGE_CHECKPOINT_MS.
+    bool saveUsage(Preferences& preferences) {
+        accrue();
+        RelayUsage usage[RELAY_COUNT];
+        getUsage(usage);
+        if (memcmp(usage, _checkpoint, sizeof(usage)) == 0) {
+            return false;
+        }
+        preferences.begin("hydro_relays", false);
+        bool ok = preferences.putBytes("usage", usage, sizeof(usage)) == sizeof(usage);
+        preferences.end();
+        if (ok) {
+            memcpy(_checkpoint, usage, sizeof(usage));
+        } else {
+            LOG_ERROR(LOG_SYSTEM, "Failed to checkpoint relay usage");
+        }
+        return ok;
     }
 
-    bool getState(uint8_t relayNum) {
+    // Copy of the usage counters, up to the last transition or accrue().
+    // Safe to call from any task.
+    void getUsage(RelayUsage usage[RELAY_COUNT]) {
+        portENTER_CRITICAL(&_lock);
+        memcpy(usage, _usage.usage, sizeof(_usage.usage));
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    // Energy estimate in watt-hours for a load of the given rating
+    static uint32_t energyWh(const RelayUsage& usage, uint16_t watts) {
+        return (uint32_t)(usage.onMs * watts / 3600000ULL);
+    }
+
+    // Snapshot of all relay states. Safe to call from any task.
+    RelayMask getStates() const {
+        return _states.load();
+    }
+
+    bool getState(uint8_t relayNum) const {
         if (relayNum < RELAY_COUNT) {
-            return relays[relayNum].state;
+            return (_states.load() & RELAY_BIT(relayNum)) != 0;
         }
         return false;
     }
 
+    uint8_t getPin(uint8_t relayNum) {
+        if (relayNum < RELAY_COUNT) {
+            return relays[relayNum].pin;
+        }
+        return 0;
+    }
+
     const char* getName(uint8_t relayNum) {
         if (relayNum < RELAY_COUNT) {
             return relayNames[relayNum];
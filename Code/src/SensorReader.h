@@ -40,6 +40,7 @@ private:
     long calibrationMin = 0;  // Sensor value when empty
     long calibrationMax = 0;  // Sensor value when full
     long calibrationCritical = 0; // Critical level value
+    bool liquidCritical = false;  // Last valid level was at or below the critical level
     
     // pH calibration values
     float ph4ADC = 0;   // ADC value at pH 4
@@ -82,6 +83,12 @@ public:
             if (calibrationMax != calibrationMin && !isnan(lastLiquidValue)) {
                 lastLiquidLevel = map(lastLiquidValue, calibrationMin, calibrationMax, 0, 100);
                 lastLiquidLevel = constrain(lastLiquidLevel, 0, 100);
+                
+                // Compared in percent so it works whichever way the raw value runs
+                if (calibrationCritical != 0) {
+                    float criticalLevel = constrain(map(calibrationCritical, calibrationMin, calibrationMax, 0, 100), 0, 100);
+                    liquidCritical = lastLiquidLevel <= criticalLevel;
+                }
             } else {
                 lastLiquidLevel = NAN;
             }
@@ -124,14 +131,36 @@ public:
     float getLiquidValue() { return lastLiquidValue; } // Get raw sensor value
     float getLiquidLevel() { return lastLiquidLevel; } // Get calculated percentage
     float getPH() { return lastPH; }
+
+    // Level in percent without rounding or clamping, NaN without calibration.
+    // Finer than getLiquidLevel(), for trend estimates.
+    float getLiquidLevelExact() {
+        if (calibrationMax == calibrationMin || isnan(lastLiquidValue)) {
+            return NAN;
+        }
+        return (lastLiquidValue - calibrationMin) * 100.0f / (calibrationMax - calibrationMin);
+    }
+
+    // Critical calibration point in percent, NaN if not calibrated
+    float getCriticalLevel() {
+        if (calibrationCritical == 0 || calibrationMax == calibrationMin) {
+            return NAN;
+        }
+        return (calibrationCritical - calibrationMin) * 100.0f / (calibrationMax - calibrationMin);
+    }
     float getTDS() { return lastTDS; }
     float getTemperature() { return lastTemperature; }
     
+    // True while the level is at or below the critical calibration point.
+    // Failed reads keep the last answer; without calibration it is never set.
+    bool isLiquidCritical() { return liquidCritical; }
+    
     // Liquid calibration methods
     void setLiquidCalibration(long minValue, long maxValue, long criticalValue) {
         calibrationMin = minValue;
         calibrationMax = maxValue;
         calibrationCritical = criticalValue;
+        liquidCritical = false;
     }
     
     long getLiquidCalibrationMin() { return calibrationMin; }
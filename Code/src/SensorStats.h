@@ -0,0 +1,248 @@
+#pragma once
+#include <Arduino.h>
+#include <math.h>
+#include <algorithm>
+#include "Config.h"
+
+// Rolling window for the median and MAD, in samples. Odd, so the median is
+// a sample.
+#define STATS_WINDOW 31
+
+// Samples needed before the median is trusted for alerts
+#define STATS_MIN_SAMPLES 5
+
+// Weight of the newest sample in the moving average
+#define STATS_EWMA_ALPHA 0.1f
+
+// A sample whose robust z-score exceeds the limit is an outlier; this many
+// outliers in a row are a sustained deviation
+#define STATS_Z_LIMIT 3.5f
+#define STATS_SUSTAIN_SAMPLES 10
+
+// Fault windows over the last 32 samples: more than STATS_NAN_LIMIT
+// unreadable samples is a NaN storm; STATS_REJECT_LIMIT or more impossible
+// readings is a range or slope fault
+#define STATS_NAN_LIMIT 16
+#define STATS_REJECT_LIMIT 3
+
+// Slope violations in a row after which the new level is accepted as real
+#define STATS_REBASE_SAMPLES 3
+
+// Sensor conditions, as bits
+enum SensorCondition : uint8_t {
+  SENSOR_STUCK     = 1 << 0,  // Identical readings for longer than plausible
+  SENSOR_NAN_STORM = 1 << 1,  // Mostly unreadable
+  SENSOR_SLOPE     = 1 << 2,  // Readings jump faster than the quantity can change
+  SENSOR_RANGE     = 1 << 3,  // Readings outside what the sensor can report
+  SENSOR_DEVIATION = 1 << 4   // Sustained outliers against the rolling median
+};
+
+#define SENSOR_FAULTS (SENSOR_STUCK | SENSOR_NAN_STORM | SENSOR_SLOPE | SENSOR_RANGE)
+#define SENSOR_CONDITION_COUNT 5
+
+static const char* const SENSOR_CONDITION_NAMES[SENSOR_CONDITION_COUNT] = {
+  "stuck", "nan_storm", "slope", "range", "deviation"
+};
+
+// What a metric can plausibly do
+struct SensorLimits {
+  float minValid;
+  float maxValid;
+  float maxSlope;         // Largest believable change per second
+  float madFloor;         // Sensor resolution; keeps z finite on a flat signal
+  uint16_t stuckSamples;  // Identical readings in a row that mean stuck, 0 to disable
+};
+
+static const SensorLimits SENSOR_LIMITS[METRIC_COUNT] = {
+  {0.0f, 100.0f, 5.0f, 0.5f, 0},       // Liquid level, whole %; steady for hours between waterings
+  {0.0f, 14.0f, 1.0f, 0.01f, 900},     // pH
+  {0.0f, 5000.0f, 200.0f, 1.0f, 900},  // TDS, ppm
+  {-10.0f, 60.0f, 0.5f, 0.0625f, 3600} // Temperature, C; DS18B20 reports -127 when absent
+};
+
+// Statistics of one metric at its latest sample
+struct MetricStats {
+  uint32_t samples;     // Accepted samples
+  uint32_t rejected;    // Unreadable or impossible samples
+  float mean;           // Welford, over all accepted samples since boot
+  float stddev;
+  float ewma;
+  float median;         // Over the rolling window
+  float mad;            // Median absolute deviation over the rolling window
+  float z;              // Robust z-score of the latest accepted sample
+  uint8_t conditions;   // SensorCondition bits
+};
+
+// Streaming statistics and fault detection for every telemetry metric, fed
+// one sample per metric per sensor read. A sample costs O(STATS_WINDOW): the
+// median and the MAD are each a selection over the 31-sample window, the
+// rest is constant. Written by the control task; stats() may be called from
+// any task.
+class SensorStats {
+private:
+  struct Tracker {
+    // Welford accumulators, in double so long runs keep their precision
+    uint32_t count = 0;
+    double mean = 0;
+    double m2 = 0;
+    float ewma = NAN;
+
+    float window[STATS_WINDOW];
+    uint8_t windowSize = 0;
+    uint8_t windowNext = 0;
+
+    float last = NAN;             // Last accepted value
+    uint32_t lastAt = 0;
+    uint16_t repeats = 0;         // Identical readings in a row
+    uint8_t slopeRun = 0;         // Slope violations in a row
+    uint8_t outlierRun = 0;
+    uint32_t nanHistory = 0;      // One bit per recent sample, newest in bit 0
+    uint32_t rejectHistory = 0;
+    uint32_t rangeHistory = 0;
+  };
+
+  Tracker _trackers[METRIC_COUNT];
+  MetricStats _stats[METRIC_COUNT];
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+  static float medianOf(float* values, int count) {
+    std::nth_element(values, values + count / 2, values + count);
+    return values[count / 2];
+  }
+
+public:
+  SensorStats() {
+    memset(_stats, 0, sizeof(_stats));
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      _stats[i].mean = _stats[i].stddev = _stats[i].ewma = NAN;
+      _stats[i].median = _stats[i].mad = NAN;
+    }
+  }
+
+  // Add a sample (NaN if unreadable). Returns the conditions that were not
+  // present at the previous sample.
+  uint8_t add(TelemetryMetric metric, float value, uint32_t now) {
+    Tracker& t = _trackers[metric];
+    const SensorLimits& limits = SENSOR_LIMITS[metric];
+    MetricStats stats = _stats[metric];
+    uint8_t before = stats.conditions;
+
+    t.nanHistory <<= 1;
+    t.rejectHistory <<= 1;
+    t.rangeHistory <<= 1;
+    bool accept = true;
+    if (isnan(value)) {
+      t.nanHistory |= 1;
+      accept = false;
+    } else if (value < limits.minValid || value > limits.maxValid) {
+      t.rangeHistory |= 1;
+      accept = false;
+    } else if (!isnan(t.last)) {
+      // Too fast a change is a glitch, unless it persists
+      uint32_t elapsed = now - t.lastAt;
+      float seconds = (elapsed > 1000 ? elapsed : 1000) / 1000.0f;
+      if (fabsf(value - t.last) / seconds > limits.maxSlope && ++t.slopeRun < STATS_REBASE_SAMPLES) {
+        t.rejectHistory |= 1;
+        accept = false;
+      }
+    }
+
+    if (accept) {
+      t.slopeRun = 0;
+      t.repeats = value == t.last ? t.repeats + 1 : 0;
+      t.last = value;
+      t.lastAt = now;
+
+      t.count++;
+      double delta = value - t.mean;
+      t.mean += delta / t.count;
+      t.m2 += delta * (value - t.mean);
+      t.ewma = isnan(t.ewma) ? value : t.ewma + STATS_EWMA_ALPHA * (value - t.ewma);
+
+      t.window[t.windowNext] = value;
+      t.windowNext = (t.windowNext + 1) % STATS_WINDOW;
+      if (t.windowSize < STATS_WINDOW) {
+        t.windowSize++;
+      }
+
+      // Two linear-time selections over a copy of the window
+      float scratch[STATS_WINDOW];
+      memcpy(scratch, t.window, t.windowSize * sizeof(float));
+      float median = medianOf(scratch, t.windowSize);
+      for (int i = 0; i < t.windowSize; i++) {
+        scratch[i] = fabsf(t.window[i] - median);
+      }
+      float mad = medianOf(scratch, t.windowSize);
+
+      // 0.6745 scales the MAD to a standard deviation for normal noise
+      float z = 0.6745f * (value - median) / (mad > limits.madFloor ? mad : limits.madFloor);
+      t.outlierRun = fabsf(z) > STATS_Z_LIMIT ? (t.outlierRun < 255 ? t.outlierRun + 1 : 255) : 0;
+
+      stats.samples = t.count;
+      stats.mean = t.mean;
+      stats.stddev = t.count > 1 ? sqrt(t.m2 / (t.count - 1)) : 0;
+      stats.ewma = t.ewma;
+      stats.median = median;
+      stats.mad = mad;
+      stats.z = z;
+    } else {
+      stats.rejected++;
+    }
+
+    uint8_t conditions = 0;
+    if (limits.stuckSamples && t.repeats >= limits.stuckSamples) {
+      conditions |= SENSOR_STUCK;
+    }
+    if (__builtin_popcount(t.nanHistory) > STATS_NAN_LIMIT) {
+      conditions |= SENSOR_NAN_STORM;
+    }
+    if (__builtin_popcount(t.rejectHistory) >= STATS_REJECT_LIMIT) {
+      conditions |= SENSOR_SLOPE;
+    }
+    if (__builtin_popcount(t.rangeHistory) >= STATS_REJECT_LIMIT) {
+      conditions |= SENSOR_RANGE;
+    }
+    if (t.outlierRun >= STATS_SUSTAIN_SAMPLES) {
+      conditions |= SENSOR_DEVIATION;
+    }
+    stats.conditions = conditions;
+
+    portENTER_CRITICAL(&_lock);
+    _stats[metric] = stats;
+    portEXIT_CRITICAL(&_lock);
+    return conditions & ~before;
+  }
+
+  // Safe to call from any task
+  MetricStats stats(TelemetryMetric metric) {
+    portENTER_CRITICAL(&_lock);
+    MetricStats stats = _stats[metric];
+    portEXIT_CRITICAL(&_lock);
+    return stats;
+  }
+
+  // Rolling median for threshold alerts, NaN while the sensor is faulty or
+  // has too few samples. Control task only.
+  float robustValue(TelemetryMetric metric) const {
+    const MetricStats& stats = _stats[metric];
+    if ((stats.conditions & SENSOR_FAULTS) || _trackers[metric].windowSize < STATS_MIN_SAMPLES) {
+      return NAN;
+    }
+    return stats.median;
+  }
+
+  // Control task only
+  bool faulty(TelemetryMetric metric) const {
+    return (_stats[metric].conditions & SENSOR_FAULTS) != 0;
+  }
+
+  // Name of the most severe condition, "ok" if none
+  static const char* conditionName(uint8_t conditions) {
+    for (int i = 0; i < SENSOR_CONDITION_COUNT; i++) {
+      if (conditions & (1 << i)) {
+        return SENSOR_CONDITION_NAMES[i];
+      }
+    }
+    return "ok";
+  }
+};
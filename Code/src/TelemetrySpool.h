@@ -0,0 +1,258 @@
+#pragma once
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "LogBuffer.h"
+
+// Records held in RAM before they are written to flash
+#define SPOOL_RAM_CAPACITY 16
+
+// Records held in the flash file; the oldest are evicted when it is full.
+// The file is sized at creation to what the partition has room for, up to
+// the maximum; below the minimum the spool stays in RAM.
+#define SPOOL_FILE_CAPACITY 128
+#define SPOOL_FILE_MIN_CAPACITY 16
+
+// Flash left free for other files and SPIFFS garbage collection when the
+// file is sized
+#define SPOOL_FLASH_RESERVE 8192
+
+// Longest spooled payload, including the terminator
+#define SPOOL_RECORD_SIZE 128
+
+// RAM records are written to flash at least this often, so a reboot loses
+// at most this much of an outage
+#define SPOOL_FLUSH_INTERVAL_MS 60000
+
+#define SPOOL_FILE_PATH "/mqtt_spool.bin"
+#define SPOOL_MAGIC 0x53505332  // "SPS2"
+
+// Bounded store-and-forward buffer for MQTT messages produced while the
+// broker is unreachable. New records collect in RAM and are flushed in
+// batches to a preallocated ring file on SPIFFS, which survives reboots.
+// Records always come out oldest first: the file holds everything older
+// than what is in RAM. Control task only.
+class TelemetrySpool {
+private:
+  struct Record {
+    uint8_t length;
+    char payload[SPOOL_RECORD_SIZE - 1];
+  };
+
+  struct FileHeader {
+    uint32_t magic;
+    uint16_t head;    // Index of the oldest record in the file
+    uint16_t count;   // Records in the file
+    uint32_t evicted; // Records lost to eviction since the file was created
+    uint16_t capacity;// Records the file has room for
+    uint16_t reserved;
+  };
+
+  Record _ram[SPOOL_RAM_CAPACITY];
+  int _ramHead = 0;
+  int _ramCount = 0;
+  uint32_t _ramSince = 0;   // millis() when the oldest unflushed record was added
+  FileHeader _header = {SPOOL_MAGIC, 0, 0, 0, 0, 0};
+  bool _fileOk = false;
+
+public:
+  // Pick up records left in flash by a previous boot, or create the file
+  // with as many records as the partition has room for
+  void begin() {
+    FileHeader header = {0, 0, 0, 0, 0, 0};
+    size_t fileSize = 0;
+    File file = SPIFFS.open(SPOOL_FILE_PATH, FILE_READ);
+    if (file) {
+      fileSize = file.size();
+      if (fileSize >= sizeof(FileHeader)) {
+        file.read((uint8_t*)&header, sizeof(header));
+      }
+    }
+    file.close();
+
+    if (header.magic == SPOOL_MAGIC && header.capacity >= SPOOL_FILE_MIN_CAPACITY &&
+        header.capacity <= SPOOL_FILE_CAPACITY && header.head < header.capacity &&
+        header.count <= header.capacity && fileSize >= recordOffset(header.capacity)) {
+      _header = header;
+      _fileOk = true;
+    } else {
+      _fileOk = create();
+    }
+
+    if (_header.count > 0) {
+      LOG_INFO(LOG_MQTT, "Spool holds %u messages from before restart", _header.count);
+    }
+  }
+
+  // Add a payload, evicting the oldest record if the spool is full
+  void push(const char* payload) {
+    if (_ramCount == SPOOL_RAM_CAPACITY) {
+      flush();
+      if (_ramCount == SPOOL_RAM_CAPACITY) {
+        // Flash unavailable, fall back to evicting from RAM
+        _ramHead = (_ramHead + 1) % SPOOL_RAM_CAPACITY;
+        _ramCount--;
+        _header.evicted++;
+      }
+    }
+    if (_ramCount == 0) {
+      _ramSince = millis();
+    }
+
+    Record& record = _ram[(_ramHead + _ramCount) % SPOOL_RAM_CAPACITY];
+    strlcpy(record.payload, payload, sizeof(record.payload));
+    record.length = strlen(record.payload);
+    _ramCount++;
+  }
+
+  // Copy the oldest payload without removing it. Returns false if empty.
+  bool peek(char* payload, size_t size) {
+    if (_header.count > 0 && _fileOk) {
+      Record record;
+      File file = SPIFFS.open(SPOOL_FILE_PATH, "r+");
+      if (!file || !file.seek(recordOffset(_header.head)) ||
+          file.read((uint8_t*)&record, sizeof(record)) != sizeof(record)) {
+        LOG_WARN(LOG_MQTT, "Spool file unreadable, discarding %u messages", _header.count);
+        file.close();
+        _header.evicted += _header.count;
+        _header.count = 0;
+        writeHeader();
+        return peek(payload, size);
+      }
+      file.close();
+      copyPayload(record, payload, size);
+      return true;
+    }
+    if (_ramCount > 0) {
+      copyPayload(_ram[_ramHead], payload, size);
+      return true;
+    }
+    return false;
+  }
+
+  // Remove the oldest record once it has been handed to the MQTT client.
+  // The file header is only rewritten by commit(), after a replay batch.
+  void pop() {
+    if (_header.count > 0) {
+      _header.head = (_header.head + 1) % _header.capacity;
+      _header.count--;
+    } else if (_ramCount > 0) {
+      _ramHead = (_ramHead + 1) % SPOOL_RAM_CAPACITY;
+      _ramCount--;
+    }
+  }
+
+  // Persist the read position after a batch of pop() calls
+  void commit() {
+    if (_fileOk) {
+      writeHeader();
+    }
+  }
+
+  // Write RAM records to flash when the flush interval has passed
+  void maintain() {
+    if (_ramCount > 0 && millis() - _ramSince >= SPOOL_FLUSH_INTERVAL_MS) {
+      flush();
+    }
+  }
+
+  bool empty() const {
+    return _ramCount == 0 && _header.count == 0;
+  }
+
+  uint32_t size() const {
+    return _ramCount + _header.count;
+  }
+
+  uint32_t evicted() const {
+    return _header.evicted;
+  }
+
+private:
+  // Append all RAM records to the ring file, overwriting the oldest when full
+  void flush() {
+    if (!_fileOk || _ramCount == 0) {
+      return;
+    }
+    File file = SPIFFS.open(SPOOL_FILE_PATH, "r+");
+    if (!file) {
+      LOG_WARN(LOG_MQTT, "Failed to open spool file");
+      return;
+    }
+    while (_ramCount > 0) {
+      uint16_t tail = (_header.head + _header.count) % _header.capacity;
+      if (!file.seek(recordOffset(tail)) ||
+          file.write((const uint8_t*)&_ram[_ramHead], sizeof(Record)) != sizeof(Record)) {
+        LOG_WARN(LOG_MQTT, "Failed to write spool file");
+        break;
+      }
+      if (_header.count == _header.capacity) {
+        _header.head = (_header.head + 1) % _header.capacity;
+        _header.evicted++;
+      } else {
+        _header.count++;
+      }
+      _ramHead = (_ramHead + 1) % SPOOL_RAM_CAPACITY;
+      _ramCount--;
+    }
+    file.close();
+    writeHeader();
+    _ramSince = millis();
+  }
+
+  // Replace the file with a ring sized to the free space, written out in
+  // full so later writes cannot run out of room
+  bool create() {
+    SPIFFS.remove(SPOOL_FILE_PATH);
+    size_t used = SPIFFS.usedBytes();
+    size_t free = SPIFFS.totalBytes() > used ? SPIFFS.totalBytes() - used : 0;
+    size_t room = free > SPOOL_FLASH_RESERVE + sizeof(FileHeader) ? free - SPOOL_FLASH_RESERVE - sizeof(FileHeader) : 0;
+    uint32_t capacity = room / sizeof(Record);
+    if (capacity > SPOOL_FILE_CAPACITY) {
+      capacity = SPOOL_FILE_CAPACITY;
+    }
+    _header = {SPOOL_MAGIC, 0, 0, 0, (uint16_t)capacity, 0};
+    if (capacity < SPOOL_FILE_MIN_CAPACITY) {
+      LOG_WARN(LOG_MQTT, "%u bytes of flash free, spooling to RAM only", (unsigned)free);
+      _header.capacity = 0;
+      return false;
+    }
+
+    File file = SPIFFS.open(SPOOL_FILE_PATH, FILE_WRITE);
+    bool ok = file && file.write((const uint8_t*)&_header, sizeof(_header)) == sizeof(_header);
+    Record blank;
+    memset(&blank, 0, sizeof(blank));
+    for (uint32_t i = 0; ok && i < capacity; i++) {
+      ok = file.write((const uint8_t*)&blank, sizeof(blank)) == sizeof(blank);
+    }
+    file.close();
+    if (!ok) {
+      LOG_WARN(LOG_MQTT, "Failed to create spool file, spooling to RAM only");
+      SPIFFS.remove(SPOOL_FILE_PATH);
+      _header.capacity = 0;
+      return false;
+    }
+    LOG_INFO(LOG_MQTT, "Spool file holds %u messages", (unsigned)capacity);
+    return true;
+  }
+
+  bool writeHeader() {
+    File file = SPIFFS.open(SPOOL_FILE_PATH, "r+");
+    if (!file) {
+      LOG_WARN(LOG_MQTT, "Failed to open spool file, spooling to RAM only");
+      return false;
+    }
+    bool ok = file.write((const uint8_t*)&_header, sizeof(_header)) == sizeof(_header);
+    file.close();
+    return ok;
+  }
+
+  static uint32_t recordOffset(uint16_t index) {
+    return sizeof(FileHeader) + (uint32_t)index * sizeof(Record);
+  }
+
+  static void copyPayload(const Record& record, char* payload, size_t size) {
+    size_t length = record.length < size - 1 ? record.length : size - 1;
+    memcpy(payload, record.payload, length);
+    payload[length] = '\0';
+  }
+};
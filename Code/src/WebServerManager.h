@@ -10,8 +10,17 @@
 #include "Config.h"
 #include "GrowthManager.h"
 #include "SensorReader.h"
+#include "SensorStats.h"
+#include "LevelForecast.h"
+#include "HistoryStore.h"
 #include "RelayController.h"
 #include "MQTTManager.h"
+#include "CommandQueue.h"
+#include "BootProfiler.h"
+#include "CycleSimulator.h"
+#include "PHDoser.h"
+#include "PumpGuard.h"
+#include "LogBuffer.h"
 
 // User structure for authentication
 struct User {
@@ -19,6 +28,30 @@ struct User {
     char password[32] = "admin";
 };
 
+// Most profiles returned by one GET /growth-profile listing
+#define PROFILE_PAGE_SIZE 25
+
+// Most timeline events returned by one simulate action; totals cover the
+// whole window regardless
+#define SIM_MAX_EVENTS 256
+#define SIM_DEFAULT_DAYS 7
+
+// Maximum number of simultaneous live log viewers
+#define MAX_LOG_CLIENTS 4
+
+// /history results held at once, up to 8 KB each; more get a 503
+#define HISTORY_MAX_QUERIES 1
+
+// Per-client state of a live log viewer
+struct LogClient {
+    uint32_t id = 0;
+    bool active = false;
+    LogCursor cursor;                       // Next line to send from hydroLog
+    uint8_t minLevel = LOG_LEVEL_INFO;      // Lowest level sent to this client
+    uint32_t moduleMask = LOG_ALL_MODULES;  // Bit per LogModule sent to this client
+    uint32_t dropped = 0;                   // Lines lost since the last notice
+};
+
 class WebServerManager {
 private:
     AsyncWebServer _server;
@@ -26,26 +59,54 @@ private:
     SystemConfig& _config;
     GrowthManager& _growthManager;
     SensorReader& _sensorReader;
+    SensorStats& _sensorStats;
+    LevelForecast& _levelForecast;
+    HistoryStore& _history;
     RelayController& _relayController;
     Preferences& _preferences;
     MQTTManager* _mqttManager;
     ConfigManager* _configManager;
+    CommandQueue& _commands;
+    BootProfiler& _bootProfiler;
+    PHDoser& _phDoser;
+    PumpGuard& _pumpGuard;
     
     User _webUser;
+
+    // Live log streaming
+    AsyncWebSocket _logSocket;
+    LogClient _logClients[MAX_LOG_CLIENTS];
+    SemaphoreHandle_t _logClientsLock;
+
+    volatile uint32_t _lastRequestMillis = 0;
+
+    // /history queries holding a result, async_tcp task only
+    uint8_t _historyQueries = 0;
     
 public:
     WebServerManager(uint16_t port, SystemConfig& config, GrowthManager& growthManager, 
-                    SensorReader& sensorReader, RelayController& relayController,
-                    Preferences& preferences, ConfigManager* configManager, 
-                    MQTTManager* mqttManager = nullptr)
+                    SensorReader& sensorReader, SensorStats& sensorStats, LevelForecast& levelForecast,
+                    HistoryStore& history, RelayController& relayController, Preferences& preferences,
+                    ConfigManager* configManager, CommandQueue& commands, BootProfiler& bootProfiler,
+                    PHDoser& phDoser, PumpGuard& pumpGuard, MQTTManager* mqttManager = nullptr)
         : _server(port),
           _config(config),
           _growthManager(growthManager),
           _sensorReader(sensorReader),
+          _sensorStats(sensorStats),
+          _levelForecast(levelForecast),
+          _history(history),
           _relayController(relayController),
           _preferences(preferences),
           _configManager(configManager),
-          _mqttManager(mqttManager) {
+          _commands(commands),
+          _bootProfiler(bootProfiler),
+          _phDoser(phDoser),
+          _pumpGuard(pumpGuard),
+          _mqttManager(mqttManager),
+          _logSocket("/logs") {
+        
+        _logClientsLock = xSemaphoreCreateMutex();
         
         // Default credentials
         strlcpy(_webUser.username, "admin", sizeof(_webUser.username));
@@ -55,9 +116,63 @@ public:
     }
     
     void begin() {
+        setupLogStream();
         setupEndpoints();
         _server.begin();
     }
+
+    // millis() of the most recent HTTP request
+    uint32_t lastRequestMillis() const {
+        return _lastRequestMillis;
+    }
+
+    bool hasLogClients() {
+        return _logSocket.count() > 0;
+    }
+
+    // Send pending log lines to connected viewers. Called from loop(); a
+    // viewer whose send queue is full is skipped and its backlog is left in
+    // the ring, so slow clients lose lines rather than stalling the logger.
+    void streamLogs() {
+        if (_logSocket.count() == 0) {
+            return;
+        }
+
+        char line[LOG_LINE_MAX + 48];
+        char text[LOG_LINE_MAX];
+        LogRecord record;
+
+        xSemaphoreTake(_logClientsLock, portMAX_DELAY);
+        for (int i = 0; i < MAX_LOG_CLIENTS; i++) {
+            LogClient& logClient = _logClients[i];
+            if (!logClient.active) {
+                continue;
+            }
+            AsyncWebSocketClient* client = _logSocket.client(logClient.id);
+            if (!client) {
+                logClient.active = false;
+                continue;
+            }
+
+            while (!client->queueIsFull() &&
+                   hydroLog.read(logClient.cursor, record, text, sizeof(text), logClient.dropped)) {
+                if (logClient.dropped > 0) {
+                    snprintf(line, sizeof(line), "-- %u lines dropped --", (unsigned)logClient.dropped);
+                    client->text(line);
+                    logClient.dropped = 0;
+                }
+                if (record.level < logClient.minLevel || !(logClient.moduleMask & (1u << record.module))) {
+                    continue;
+                }
+                snprintf(line, sizeof(line), "%lu %s %s: %s", (unsigned long)record.timestamp,
+                         LogBuffer::levelName(record.level), LogBuffer::moduleName(record.module), text);
+                client->text(line);
+            }
+        }
+        xSemaphoreGive(_logClientsLock);
+
+        _logSocket.cleanupClients(MAX_LOG_CLIENTS);
+    }
     
 private:
     void setupAuth() {
@@ -67,10 +182,295 @@ private:
         _auth.setAuthFailureMessage("Authentication failed");
     }
     
+    // Authenticate a request and record it as client activity for power management
+    bool authorize(AsyncWebServerRequest *request) {
+        _lastRequestMillis = millis();
+        return _auth.authenticate(request);
+    }
+
+    // Write a profile's stages as an array of objects. Names are copied
+    // when the profile is a temporary.
+    static void addStages(JsonArray stages, const GrowthProfile& profile, bool copyNames) {
+        for (int j = 0; j < profile.stageCount; j++) {
+            const GrowthStage& stage = profile.stages[j];
+            JsonObject stageObj = stages.createNestedObject();
+            if (copyNames) {
+                stageObj["name"] = (char*)stage.name;
+            } else {
+                stageObj["name"] = stage.name;
+            }
+            stageObj["duration"] = stage.duration;
+            stageObj["waterDuration"] = stage.waterDuration;
+            stageObj["waterInterval"] = stage.waterInterval;
+            stageObj["lightHours"] = stage.lightHours;
+            stageObj["lightStartHour"] = stage.lightStartHour;
+            stageObj["phMin"] = stage.phMin;
+            stageObj["phMax"] = stage.phMax;
+        }
+    }
+
+    // Read a profile from a request. Stages come as an array; the old fixed
+    // seedling, growing and harvesting objects are still accepted. Returns
+    // an error message, or nullptr on success.
+    static const char* parseProfile(JsonObject profileObj, const char* profileId, GrowthProfile& profile) {
+        // Copy ID and name
+        strlcpy(profile.id, profileId, sizeof(profile.id));
+        if (profileObj.containsKey("name")) {
+            strlcpy(profile.name, profileObj["name"], sizeof(profile.name));
+        } else {
+            strlcpy(profile.name, "Unnamed Profile", sizeof(profile.name));
+        }
+        
+        JsonArray stagesArr = profileObj["stages"];
+        if (!stagesArr.isNull()) {
+            for (JsonObject stageObj : stagesArr) {
+                if (profile.stageCount == MAX_GROWTH_STAGES) {
+                    return "Too many stages";
+                }
+                parseStage(stageObj, profile.stageCount, profile.stages[profile.stageCount]);
+                profile.stageCount++;
+            }
+        } else {
+            static const char* const legacyStages[] = {"seedling", "growing", "harvesting"};
+            static const char* const legacyNames[] = {"Seedling", "Growing", "Harvesting"};
+            for (int i = 0; i < 3; i++) {
+                if (profileObj.containsKey(legacyStages[i])) {
+                    GrowthStage& stage = profile.stages[profile.stageCount++];
+                    parseStage(profileObj[legacyStages[i]], i, stage);
+                    if (!profileObj[legacyStages[i]].containsKey("name")) {
+                        strlcpy(stage.name, legacyNames[i], sizeof(stage.name));
+                    }
+                }
+            }
+        }
+        if (profile.stageCount == 0) {
+            return "Profile needs at least one stage";
+        }
+        return nullptr;
+    }
+
+    // Run a growth cycle simulation and send its timeline and relay totals.
+    // Runs on the request's task: it only reads a copy of the profile.
+    static void sendSimulation(AsyncWebServerRequest *request, GrowthProfile& profile, time_t cycleStart,
+                               int fromDay, int days, float ph) {
+        profile.updateStageEnds();
+        time_t from = cycleStart + (time_t)fromDay * SECONDS_PER_DAY;
+        time_t until = from + (time_t)days * SECONDS_PER_DAY;
+        
+        // Timeline entries are [seconds since cycle start, type, value];
+        // alert texts only live during the callback and are copied, the
+        // profile's id and stage names outlive the document and are not
+        DynamicJsonDocument doc(JSON_OBJECT_SIZE(13) + JSON_ARRAY_SIZE(SIM_MAX_EVENTS) +
+                                SIM_MAX_EVENTS * JSON_ARRAY_SIZE(3) +
+                                JSON_ARRAY_SIZE(MAX_GROWTH_STAGES) + MAX_GROWTH_STAGES * JSON_OBJECT_SIZE(4) +
+                                SIM_MAX_ALERTS * JSON_STRING_SIZE(SIM_ALERT_TEXT_MAX - 1));
+        JsonArray timeline = doc.createNestedArray("timeline");
+        uint32_t added = 0;
+        SimulationResult result = CycleSimulator::run(profile, cycleStart, from, until, ph,
+            [&timeline, &added, cycleStart](const CycleEvent& event) {
+                if (added == SIM_MAX_EVENTS) {
+                    return;
+                }
+                added++;
+                JsonArray entry = timeline.createNestedArray();
+                entry.add((long)(event.time - cycleStart));
+                entry.add(CYCLE_EVENT_NAMES[event.type]);
+                if (event.type == CYCLE_EVENT_ALERT) {
+                    entry.add((char*)event.text);
+                } else if (event.type == CYCLE_EVENT_STAGE) {
+                    entry.add(event.value);
+                } else {
+                    entry.add(event.value != 0);
+                }
+            });
+        
+        doc["status"] = "ok";
+        doc["profileId"] = (const char*)profile.id;
+        doc["cycleStart"] = (long)cycleStart;
+        doc["from"] = (long)(result.from - cycleStart);
+        doc["until"] = (long)(result.until - cycleStart);
+        doc["truncated"] = result.truncated;
+        doc["events"] = result.events;
+        doc["timelineTruncated"] = result.events > added;
+        doc["waterings"] = result.waterings;
+        doc["pump_on_s"] = result.pumpSeconds;
+        doc["light_on_s"] = result.lightSeconds;
+        JsonArray stages = doc.createNestedArray("stages");
+        for (int i = 0; i < profile.stageCount; i++) {
+            JsonObject stageObj = stages.createNestedObject();
+            stageObj["name"] = (const char*)profile.stages[i].name;
+            stageObj["waterings"] = result.stages[i].waterings;
+            stageObj["pump_on_s"] = result.stages[i].pumpSeconds;
+            stageObj["light_on_s"] = result.stages[i].lightSeconds;
+        }
+        
+        if (doc.overflowed()) {
+            LOG_ERROR(LOG_WEB, "Simulation result did not fit its JSON document");
+            sendStatus(request, false, "Simulation result too large", 500);
+            return;
+        }
+
+        String json;
+        serializeJson(doc, json);
+        request->send(200, "application/json", json);
+    }
+
+    // Read one growth stage, filling in defaults for missing settings
+    static void parseStage(JsonObject stageObj, int index, GrowthStage& stage) {
+        if (stageObj.containsKey("name")) {
+            strlcpy(stage.name, stageObj["name"], sizeof(stage.name));
+        } else {
+            snprintf(stage.name, sizeof(stage.name), "Stage %d", index + 1);
+        }
+        stage.duration = stageObj["duration"] | 14;
+        stage.waterDuration = stageObj["waterDuration"] | 5;
+        stage.waterInterval = stageObj["waterInterval"] | 60;
+        stage.lightHours = stageObj["lightHours"] | 12;
+        stage.lightStartHour = stageObj["lightStartHour"] | 6;
+        stage.phMin = stageObj["phMin"] | 5.5f;
+        stage.phMax = stageObj["phMax"] | 6.5f;
+    }
+
+    // Stage times in milliseconds since reset; stages not reached are left out
+    static void addBootTimings(JsonObject obj, BootTimings timings) {
+        obj["boot"] = timings.bootCount;
+        obj["reset_reason"] = timings.resetReason;
+        JsonObject stages = obj.createNestedObject("stages_ms");
+        for (int i = 0; i < BOOT_STAGE_COUNT; i++) {
+            if (timings.stageMs[i]) {
+                stages[BOOT_STAGE_NAMES[i]] = timings.stageMs[i];
+            }
+        }
+    }
+
+    static void sendStatus(AsyncWebServerRequest *request, bool success, const char *message, int code = 200) {
+        AsyncJsonResponse *response = new AsyncJsonResponse();
+        response->setCode(code);
+        JsonObject root = response->getRoot();
+        root["status"] = success ? "ok" : "error";
+        if (message) {
+            root["message"] = message;
+        }
+        response->setLength();
+        request->send(response);
+    }
+
+    // Hand a state change to the control task. The handler returns right
+    // away; the response is sent from the command's completion callback,
+    // unless the client has gone away by then.
+    void submitCommand(AsyncWebServerRequest *request, Command& command) {
+        AsyncWebServerRequestPtr pending = request->pause();
+        command.done = [pending](bool success, const char *message) {
+            std::shared_ptr<AsyncWebServerRequest> request = pending.lock();
+            if (request) {
+                sendStatus(request.get(), success, message);
+            }
+        };
+        if (!_commands.push(std::move(command))) {
+            LOG_WARN(LOG_WEB, "Command queue full, rejecting request");
+            sendStatus(request, false, "Controller busy, try again", 503);
+        }
+    }
+
+    void logReceivedJson(JsonObject& jsonObj) {
+        char buffer[LOG_LINE_MAX];
+        serializeJson(jsonObj, buffer, sizeof(buffer));
+        LOG_DEBUG(LOG_WEB, "Received JSON: %s", buffer);
+    }
+
+    void setupLogStream() {
+        _logSocket.setFilter([this](AsyncWebServerRequest *request) {
+            return _auth.authenticate(request);
+        });
+        _logSocket.onEvent([this](AsyncWebSocket *server, AsyncWebSocketClient *client,
+                                  AwsEventType type, void *arg, uint8_t *data, size_t len) {
+            onLogSocketEvent(client, type, arg, data, len);
+        });
+        _server.addHandler(&_logSocket);
+    }
+
+    void onLogSocketEvent(AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
+        if (type == WS_EVT_CONNECT) {
+            xSemaphoreTake(_logClientsLock, portMAX_DELAY);
+            LogClient* slot = nullptr;
+            for (int i = 0; i < MAX_LOG_CLIENTS; i++) {
+                if (!_logClients[i].active) {
+                    slot = &_logClients[i];
+                    break;
+                }
+            }
+            if (slot) {
+                // New viewers start at the oldest buffered line to replay the backlog
+                *slot = LogClient();
+                slot->id = client->id();
+                slot->active = true;
+                slot->cursor = hydroLog.oldest();
+            }
+            xSemaphoreGive(_logClientsLock);
+
+            if (!slot) {
+                client->close(1013, "Too many log clients");
+                return;
+            }
+            LOG_INFO(LOG_WEB, "Log client %u connected", (unsigned)client->id());
+        } else if (type == WS_EVT_DISCONNECT) {
+            xSemaphoreTake(_logClientsLock, portMAX_DELAY);
+            for (int i = 0; i < MAX_LOG_CLIENTS; i++) {
+                if (_logClients[i].active && _logClients[i].id == client->id()) {
+                    _logClients[i].active = false;
+                }
+            }
+            xSemaphoreGive(_logClientsLock);
+        } else if (type == WS_EVT_DATA) {
+            // Filter messages are small single-frame text, e.g.
+            // {"level":"info","modules":["mqtt","cycle"]}
+            AwsFrameInfo *info = (AwsFrameInfo *)arg;
+            if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT) {
+                applyLogFilter(client->id(), (const char *)data, len);
+            }
+        }
+    }
+
+    void applyLogFilter(uint32_t clientId, const char *data, size_t len) {
+        StaticJsonDocument<256> doc;
+        if (deserializeJson(doc, data, len)) {
+            return;
+        }
+
+        uint8_t minLevel = LOG_LEVEL_DEBUG;
+        if (doc.containsKey("level")) {
+            LogLevel level = LogBuffer::parseLevel(doc["level"] | "debug");
+            if (level != LOG_LEVEL_COUNT) {
+                minLevel = level;
+            }
+        }
+
+        uint32_t moduleMask = LOG_ALL_MODULES;
+        JsonArray modules = doc["modules"];
+        if (!modules.isNull() && modules.size() > 0) {
+            moduleMask = 0;
+            for (JsonVariant module : modules) {
+                LogModule parsed = LogBuffer::parseModule(module | "");
+                if (parsed != LOG_MODULE_COUNT) {
+                    moduleMask |= 1u << parsed;
+                }
+            }
+        }
+
+        xSemaphoreTake(_logClientsLock, portMAX_DELAY);
+        for (int i = 0; i < MAX_LOG_CLIENTS; i++) {
+            if (_logClients[i].active && _logClients[i].id == clientId) {
+                _logClients[i].minLevel = minLevel;
+                _logClients[i].moduleMask = moduleMask;
+            }
+        }
+        xSemaphoreGive(_logClientsLock);
+    }
+
     void setupEndpoints() {
         // Serve HTML interface
         _server.on("/", HTTP_GET, [this](AsyncWebServerRequest *request) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             request->send(SPIFFS, "/index.html", "text/html");
@@ -83,13 +483,13 @@ private:
 
         // Configuration endpoints
         _server.on("/config", HTTP_GET, [this](AsyncWebServerRequest *request) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("GET /config - Entering");
+            LOG_DEBUG(LOG_WEB, "GET /config - Entering");
             String json;
-            StaticJsonDocument<512> doc;
+            StaticJsonDocument<1024> doc;
             doc["device_id"] = _config.device_id;
             doc["mqtt_enabled"] = _config.mqtt_enabled;
             doc["mqtt_server"] = _config.mqtt_server;
@@ -97,61 +497,122 @@ private:
             doc["mqtt_user"] = _config.mqtt_user;
             doc["mqtt_password"] = _config.mqtt_password;
             doc["ntp_server"] = _config.ntp_server;
+            doc["power_save"] = _config.power_save;
+            doc["heartbeat_s"] = _config.heartbeat_s;
+            doc["state_topic"] = _config.state_topic;
+            JsonObject deadbands = doc.createNestedObject("deadbands");
+            for (int i = 0; i < METRIC_COUNT; i++) {
+                JsonObject band = deadbands.createNestedObject(METRIC_NAMES[i]);
+                band["abs"] = _config.deadbands[i].absolute;
+                band["rel"] = _config.deadbands[i].relative;
+            }
+            JsonObject relayWatts = doc.createNestedObject("relay_watts");
+            for (int i = 0; i < RELAY_COUNT; i++) {
+                relayWatts[_relayController.getName(i)] = _config.relay_watts[i];
+            }
+            JsonObject dosing = doc.createNestedObject("ph_dosing");
+            dosing["enabled"] = _config.ph_dosing.enabled;
+            dosing["pump_ml_s"] = _config.ph_dosing.pumpMlPerS;
+            dosing["dose_ml"] = _config.ph_dosing.doseMl;
+            dosing["mix_s"] = _config.ph_dosing.mixS;
+            dosing["max_ml_h"] = _config.ph_dosing.maxMlPerHour;
+            doc["pump_max_run_min"] = _config.pump_max_run_min;
             serializeJson(doc, json);
             request->send(200, "application/json", json);
         });
 
         AsyncCallbackJsonWebHandler *configHandler = new AsyncCallbackJsonWebHandler("/config", [this](AsyncWebServerRequest *request, JsonVariant &json) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("POST /config - Entering");
+            LOG_DEBUG(LOG_WEB, "POST /config - Entering");
             JsonObject jsonObj = json.as<JsonObject>();
-            Serial.println("Received JSON:");
-            serializeJson(jsonObj, Serial);
-            Serial.println();
+            logReceivedJson(jsonObj);
 
-            bool prevMqttEnabled = _config.mqtt_enabled;
-            
-            if (jsonObj.containsKey("device_id")) strlcpy(_config.device_id, jsonObj["device_id"], sizeof(_config.device_id));
-            if (jsonObj.containsKey("mqtt_enabled")) _config.mqtt_enabled = jsonObj["mqtt_enabled"].as<bool>();
-            if (jsonObj.containsKey("mqtt_server")) strlcpy(_config.mqtt_server, jsonObj["mqtt_server"], sizeof(_config.mqtt_server));
-            if (jsonObj.containsKey("mqtt_port")) _config.mqtt_port = jsonObj["mqtt_port"];
-            if (jsonObj.containsKey("mqtt_user")) strlcpy(_config.mqtt_user, jsonObj["mqtt_user"], sizeof(_config.mqtt_user));
-            if (jsonObj.containsKey("mqtt_password")) strlcpy(_config.mqtt_password, jsonObj["mqtt_password"], sizeof(_config.mqtt_password));
-            if (jsonObj.containsKey("ntp_server")) strlcpy(_config.ntp_server, jsonObj["ntp_server"], sizeof(_config.ntp_server));
+            Command command;
+            command.type = CMD_UPDATE_CONFIG;
+            command.config.reset(new ConfigPatch());
+            ConfigPatch& patch = *command.config;
             
-            // Update the ConfigManager's internal config with our modified values
-            _configManager->getConfig() = _config;
-            
-            // Now save using the global ConfigManager instance
-            _configManager->saveConfig();
-            
-            // Handle MQTT connection state based on enabled setting
-            if (_mqttManager) {
-                if (prevMqttEnabled && !_config.mqtt_enabled) {
-                    // MQTT was enabled but now disabled - disconnect
-                    Serial.println("MQTT disabled, disconnecting...");
-                    _mqttManager->disconnect();
+            if (jsonObj.containsKey("device_id")) {
+                const char* deviceId = jsonObj["device_id"] | "";
+                if (strlen(deviceId) >= sizeof(patch.values.device_id) || !MQTTManager::deviceIdFits(deviceId)) {
+                    sendStatus(request, false, "Device ID too long for its MQTT topics", 400);
+                    return;
                 }
+                strlcpy(patch.values.device_id, deviceId, sizeof(patch.values.device_id));
+                patch.fields |= CONFIG_DEVICE_ID;
             }
-
-            AsyncJsonResponse *response = new AsyncJsonResponse();
-            JsonObject root = response->getRoot();
-            root["status"] = "ok";
-            response->setLength();
-            request->send(response);
+            if (jsonObj.containsKey("mqtt_enabled")) { patch.values.mqtt_enabled = jsonObj["mqtt_enabled"].as<bool>(); patch.fields |= CONFIG_MQTT_ENABLED; }
+            if (jsonObj.containsKey("mqtt_server")) { strlcpy(patch.values.mqtt_server, jsonObj["mqtt_server"], sizeof(patch.values.mqtt_server)); patch.fields |= CONFIG_MQTT_SERVER; }
+            if (jsonObj.containsKey("mqtt_port")) { patch.values.mqtt_port = jsonObj["mqtt_port"]; patch.fields |= CONFIG_MQTT_PORT; }
+            if (jsonObj.containsKey("mqtt_user")) { strlcpy(patch.values.mqtt_user, jsonObj["mqtt_user"], sizeof(patch.values.mqtt_user)); patch.fields |= CONFIG_MQTT_USER; }
+            if (jsonObj.containsKey("mqtt_password")) { strlcpy(patch.values.mqtt_password, jsonObj["mqtt_password"], sizeof(patch.values.mqtt_password)); patch.fields |= CONFIG_MQTT_PASSWORD; }
+            if (jsonObj.containsKey("ntp_server")) { strlcpy(patch.values.ntp_server, jsonObj["ntp_server"], sizeof(patch.values.ntp_server)); patch.fields |= CONFIG_NTP_SERVER; }
+            if (jsonObj.containsKey("power_save")) { patch.values.power_save = jsonObj["power_save"].as<bool>(); patch.fields |= CONFIG_POWER_SAVE; }
+            if (jsonObj.containsKey("heartbeat_s")) { patch.values.heartbeat_s = jsonObj["heartbeat_s"]; patch.fields |= CONFIG_HEARTBEAT; }
+            if (jsonObj.containsKey("state_topic")) { patch.values.state_topic = jsonObj["state_topic"].as<bool>(); patch.fields |= CONFIG_STATE_TOPIC; }
+            if (jsonObj.containsKey("deadbands")) {
+                // Metrics missing from the request keep their current bands
+                memcpy(patch.values.deadbands, _config.deadbands, sizeof(patch.values.deadbands));
+                JsonObject deadbands = jsonObj["deadbands"];
+                for (int i = 0; i < METRIC_COUNT; i++) {
+                    JsonObject band = deadbands[METRIC_NAMES[i]];
+                    if (band.isNull()) {
+                        continue;
+                    }
+                    patch.values.deadbands[i].absolute = band["abs"] | patch.values.deadbands[i].absolute;
+                    patch.values.deadbands[i].relative = band["rel"] | patch.values.deadbands[i].relative;
+                }
+                patch.fields |= CONFIG_DEADBANDS;
+            }
+            if (jsonObj.containsKey("relay_watts")) {
+                // Relays missing from the request keep their current rating
+                memcpy(patch.values.relay_watts, _config.relay_watts, sizeof(patch.values.relay_watts));
+                JsonObject relayWatts = jsonObj["relay_watts"];
+                for (int i = 0; i < RELAY_COUNT; i++) {
+                    patch.values.relay_watts[i] = relayWatts[_relayController.getName(i)] | patch.values.relay_watts[i];
+                }
+                patch.fields |= CONFIG_RELAY_WATTS;
+            }
+            if (jsonObj.containsKey("pump_max_run_min")) {
+                patch.values.pump_max_run_min = jsonObj["pump_max_run_min"];
+                if (patch.values.pump_max_run_min == 0) {
+                    sendStatus(request, false, "Pump maximum run time must be at least one minute", 400);
+                    return;
+                }
+                patch.fields |= CONFIG_PUMP_MAX_RUN;
+            }
+            if (jsonObj.containsKey("ph_dosing")) {
+                // Settings missing from the request keep their current value
+                PHDosingConfig& dosing = patch.values.ph_dosing;
+                dosing = _config.ph_dosing;
+                JsonObject dosingObj = jsonObj["ph_dosing"];
+                dosing.enabled = dosingObj["enabled"] | dosing.enabled;
+                dosing.pumpMlPerS = dosingObj["pump_ml_s"] | dosing.pumpMlPerS;
+                dosing.doseMl = dosingObj["dose_ml"] | dosing.doseMl;
+                dosing.mixS = dosingObj["mix_s"] | dosing.mixS;
+                dosing.maxMlPerHour = dosingObj["max_ml_h"] | dosing.maxMlPerHour;
+                if (!(dosing.pumpMlPerS > 0) || dosing.doseMl < 0 || dosing.maxMlPerHour < 0) {
+                    sendStatus(request, false, "Invalid pH dosing settings", 400);
+                    return;
+                }
+                patch.fields |= CONFIG_PH_DOSING;
+            }
+            
+            // Saving and MQTT reconnect handling happen on the control task
+            submitCommand(request, command);
         });
         _server.addHandler(configHandler);
 
         // Calibration endpoints
         _server.on("/calibration", HTTP_GET, [this](AsyncWebServerRequest *request) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("GET /calibration - Entering");
+            LOG_DEBUG(LOG_WEB, "GET /calibration - Entering");
             String json;
             StaticJsonDocument<512> doc;
             
@@ -193,48 +654,41 @@ private:
         });
 
         AsyncCallbackJsonWebHandler *calibrationHandler = new AsyncCallbackJsonWebHandler("/calibration", [this](AsyncWebServerRequest *request, JsonVariant &json) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("POST /calibration - Entering");
+            LOG_DEBUG(LOG_WEB, "POST /calibration - Entering");
             JsonObject jsonObj = json.as<JsonObject>();
-            Serial.println("Received JSON:");
-            serializeJson(jsonObj, Serial);
-            Serial.println();
+            logReceivedJson(jsonObj);
+
+            Command command;
+            command.type = CMD_UPDATE_CONFIG;
+            command.config.reset(new ConfigPatch());
+            ConfigPatch& patch = *command.config;
 
             // Handle liquid level calibration
-            if (jsonObj.containsKey("cal_dry")) _config.cal_dry = jsonObj["cal_dry"];
-            if (jsonObj.containsKey("cal_critical")) _config.cal_critical = jsonObj["cal_critical"];
-            if (jsonObj.containsKey("cal_half")) _config.cal_half = jsonObj["cal_half"];
-            if (jsonObj.containsKey("cal_full")) _config.cal_full = jsonObj["cal_full"];
+            if (jsonObj.containsKey("cal_dry")) { patch.values.cal_dry = jsonObj["cal_dry"]; patch.fields |= CONFIG_CAL_DRY; }
+            if (jsonObj.containsKey("cal_critical")) { patch.values.cal_critical = jsonObj["cal_critical"]; patch.fields |= CONFIG_CAL_CRITICAL; }
+            if (jsonObj.containsKey("cal_half")) { patch.values.cal_half = jsonObj["cal_half"]; patch.fields |= CONFIG_CAL_HALF; }
+            if (jsonObj.containsKey("cal_full")) { patch.values.cal_full = jsonObj["cal_full"]; patch.fields |= CONFIG_CAL_FULL; }
             
             // Handle pH calibration
-            if (jsonObj.containsKey("ph4_adc")) _config.ph4_adc = jsonObj["ph4_adc"];
-            if (jsonObj.containsKey("ph7_adc")) _config.ph7_adc = jsonObj["ph7_adc"];
-            if (jsonObj.containsKey("ph10_adc")) _config.ph10_adc = jsonObj["ph10_adc"];
-            
-            // Update the ConfigManager's internal config with our modified values
-            _configManager->getConfig() = _config;
+            if (jsonObj.containsKey("ph4_adc")) { patch.values.ph4_adc = jsonObj["ph4_adc"]; patch.fields |= CONFIG_PH4_ADC; }
+            if (jsonObj.containsKey("ph7_adc")) { patch.values.ph7_adc = jsonObj["ph7_adc"]; patch.fields |= CONFIG_PH7_ADC; }
+            if (jsonObj.containsKey("ph10_adc")) { patch.values.ph10_adc = jsonObj["ph10_adc"]; patch.fields |= CONFIG_PH10_ADC; }
             
-            // Now save using the global ConfigManager instance
-            _configManager->saveConfig();
-
-            AsyncJsonResponse *response = new AsyncJsonResponse();
-            JsonObject root = response->getRoot();
-            root["status"] = "ok";
-            response->setLength();
-            request->send(response);
+            submitCommand(request, command);
         });
         _server.addHandler(calibrationHandler);
 
         // User management endpoint
         _server.on("/user", HTTP_POST, [this](AsyncWebServerRequest *request) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("POST /user - Entering");
+            LOG_DEBUG(LOG_WEB, "POST /user - Entering");
             if (request->hasParam("username", true) && request->hasParam("password", true)) {
                 strlcpy(_webUser.username, request->getParam("username", true)->value().c_str(), sizeof(_webUser.username));
                 strlcpy(_webUser.password, request->getParam("password", true)->value().c_str(), sizeof(_webUser.password));
@@ -248,15 +702,106 @@ private:
             }
         });
 
+        // Boot stage timings of this boot and the previous one
+        _server.on("/boot-profile", HTTP_GET, [this](AsyncWebServerRequest *request) {
+            if (!authorize(request)) {
+                return;
+            }
+            
+            String json;
+            StaticJsonDocument<768> doc;
+            addBootTimings(doc.createNestedObject("current"), _bootProfiler.current());
+            addBootTimings(doc.createNestedObject("previous"), _bootProfiler.previous());
+            serializeJson(doc, json);
+            request->send(200, "application/json", json);
+        });
+
+        // Per-relay runtime, switch count and energy estimate
+        _server.on("/relay-usage", HTTP_GET, [this](AsyncWebServerRequest *request) {
+            if (!authorize(request)) {
+                return;
+            }
+            
+            RelayUsage usage[RELAY_COUNT];
+            _relayController.getUsage(usage);
+            String json;
+            StaticJsonDocument<JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(RELAY_COUNT) + RELAY_COUNT * JSON_OBJECT_SIZE(7)> doc;
+            JsonArray relays = doc.createNestedArray("relays");
+            for (int i = 0; i < RELAY_COUNT; i++) {
+                JsonObject relay = relays.createNestedObject();
+                relay["name"] = _relayController.getName(i);
+                relay["state"] = _relayController.getState(i);
+                relay["on_s"] = (unsigned long)(usage[i].onMs / 1000);
+                relay["switches"] = usage[i].switches;
+                relay["longest_s"] = usage[i].longestRunMs / 1000;
+                relay["watts"] = _config.relay_watts[i];
+                relay["energy_wh"] = RelayController::energyWh(usage[i], _config.relay_watts[i]);
+            }
+            serializeJson(doc, json);
+            request->send(200, "application/json", json);
+        });
+
+        // Telemetry history of one metric, downsampled to the requested
+        // number of points. ?metric=<name>&hours=1..168&points=3..1000
+        // The points are picked under the store's lock into a buffer of
+        // their own and then sent a chunk at a time; one query at a time.
+        _server.on("/history", HTTP_GET, [this](AsyncWebServerRequest *request) {
+            if (!authorize(request)) {
+                return;
+            }
+            
+            int metric = -1;
+            if (request->hasParam("metric")) {
+                const String& name = request->getParam("metric")->value();
+                for (int i = 0; i < METRIC_COUNT; i++) {
+                    if (name == METRIC_NAMES[i]) {
+                        metric = i;
+                    }
+                }
+            }
+            if (metric < 0) {
+                sendStatus(request, false, "Unknown metric", 400);
+                return;
+            }
+            int hours = request->hasParam("hours") ? request->getParam("hours")->value().toInt() : 24;
+            int points = request->hasParam("points") ? request->getParam("points")->value().toInt() : 500;
+            hours = constrain(hours, 1, HISTORY_CAPACITY * HISTORY_INTERVAL_S / 3600);
+            points = constrain(points, 3, HISTORY_MAX_POINTS);
+            if (_historyQueries >= HISTORY_MAX_QUERIES) {
+                sendStatus(request, false, "History busy, try again", 503);
+                return;
+            }
+            
+            // The deleter runs when the response is freed, also if the
+            // client went away mid-transfer
+            std::shared_ptr<HistoryQuery> query(new (std::nothrow) HistoryQuery(points), [this](HistoryQuery *done) {
+                delete done;
+                _historyQueries--;
+            });
+            _historyQueries++;
+            uint32_t to = time(nullptr);
+            if (!query || !query->ok() ||
+                !_history.query((TelemetryMetric)metric, to - hours * 3600UL, to, *query)) {
+                sendStatus(request, false, "History unavailable", 503);
+                return;
+            }
+            AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+                [query](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                    size_t length = query->write((char *)buffer, maxLen);
+                    return length || query->done() ? length : RESPONSE_TRY_AGAIN;
+                });
+            request->send(response);
+        });
+
         // Status data endpoint (replaces sensors endpoint)
         _server.on("/status", HTTP_GET, [this](AsyncWebServerRequest *request) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("GET /status - Entering");
+            LOG_DEBUG(LOG_WEB, "GET /status - Entering");
             String json;
-            StaticJsonDocument<512> doc; // Increased size for additional timing data
+            DynamicJsonDocument doc(3584); // Too large for the async task's stack
             
             // Get current values
             float liquidValue = _sensorReader.getLiquidValue();
@@ -280,6 +825,71 @@ private:
             doc["temperature_value"] = isnan(tempValue) ? "N/A" : String(tempValue);
             doc["pump_state"] = _relayController.getState(RELAY_PUMP);
             doc["lights_state"] = _relayController.getState(RELAY_LIGHTS);
+            doc["pump_interlock"] = !_relayController.liquidOk();
+            
+            // Streaming statistics and sensor health of each metric
+            JsonObject sensorStats = doc.createNestedObject("sensor_stats");
+            for (int i = 0; i < METRIC_COUNT; i++) {
+                MetricStats stats = _sensorStats.stats((TelemetryMetric)i);
+                JsonObject metric = sensorStats.createNestedObject(METRIC_NAMES[i]);
+                metric["status"] = SensorStats::conditionName(stats.conditions);
+                metric["samples"] = stats.samples;
+                metric["rejected"] = stats.rejected;
+                if (stats.samples > 0) {
+                    metric["mean"] = stats.mean;
+                    metric["stddev"] = stats.stddev;
+                    metric["ewma"] = stats.ewma;
+                    metric["median"] = stats.median;
+                    metric["mad"] = stats.mad;
+                    metric["z"] = stats.z;
+                }
+            }
+            
+            // Reservoir consumption and time to the critical level
+            LevelForecastResult forecast = _levelForecast.result();
+            JsonObject forecastInfo = doc.createNestedObject("level_forecast");
+            forecastInfo["valid"] = forecast.valid;
+            forecastInfo["samples"] = forecast.samples;
+            if (forecast.valid) {
+                forecastInfo["level"] = forecast.level;
+                forecastInfo["rate_pct_h"] = forecast.ratePerHour;
+                if (!isnan(forecast.hoursToCritical)) {
+                    forecastInfo["hours_to_critical"] = forecast.hoursToCritical;
+                }
+            }
+            
+            // Pump shutoff deadline and how late stops have been
+            PumpShutoffStats shutoff = _pumpGuard.getStats();
+            JsonObject shutoffInfo = doc.createNestedObject("pump_shutoff");
+            if (shutoff.deadlineUs) {
+                int64_t remaining = shutoff.deadlineUs - esp_timer_get_time();
+                shutoffInfo["deadline_ms"] = remaining > 0 ? (long)(remaining / 1000) : 0;
+            }
+            shutoffInfo["timer_stops"] = shutoff.timerStops;
+            shutoffInfo["loop_stops"] = shutoff.loopStops;
+            shutoffInfo["failsafe_trips"] = shutoff.failsafeTrips;
+            shutoffInfo["last_us"] = shutoff.lastUs;
+            shutoffInfo["max_us"] = shutoff.maxUs;
+            JsonObject histogram = shutoffInfo.createNestedObject("latency");
+            for (int i = 0; i < PUMP_LATENCY_BUCKETS; i++) {
+                histogram[PUMP_LATENCY_LABELS[i]] = shutoff.histogram[i];
+            }
+            
+            // pH dosing controller
+            DoserStatus dosing = _phDoser.getStatus();
+            JsonObject dosingInfo = doc.createNestedObject("ph_dosing");
+            dosingInfo["state"] = DOSER_STATE_NAMES[dosing.state];
+            if (!isnan(dosing.target)) {
+                dosingInfo["target"] = dosing.target;
+            }
+            dosingInfo["last_dose_ml"] = dosing.lastDoseMl;
+            dosingInfo["last_pulse_ms"] = dosing.lastPulseMs;
+            dosingInfo["mixing_s"] = (dosing.mixingMs + 999) / 1000;
+            for (int i = 0; i < DOSE_DIRECTION_COUNT; i++) {
+                JsonObject direction = dosingInfo.createNestedObject(DOSE_DIRECTION_NAMES[i]);
+                direction["ml_hour"] = dosing.hourMl[i];
+                direction["doses"] = dosing.doses[i];
+            }
             
             // Add WiFi status
             doc["wifi_status"] = WiFi.status() == WL_CONNECTED ? "connected" : "disconnected";
@@ -289,84 +899,64 @@ private:
             // Add MQTT status if MQTT manager is available
             if (_mqttManager) {
                 doc["mqtt_status"] = _mqttManager->connected() ? "connected" : "disconnected";
+                JsonObject mqttStats = doc.createNestedObject("mqtt_stats");
+                mqttStats["sent"] = _mqttManager->sentCount();
+                mqttStats["suppressed"] = _mqttManager->suppressedCount();
+                mqttStats["dropped"] = _mqttManager->droppedCount();
+                mqttStats["spooled"] = _mqttManager->spooledCount();
+                mqttStats["spool_evicted"] = _mqttManager->spoolEvictedCount();
+                mqttStats["commands"] = _mqttManager->commandsReceived();
+                mqttStats["commands_ignored"] = _mqttManager->commandsIgnored();
+                mqttStats["states_published"] = _mqttManager->statesPublished();
+                mqttStats["reconnects"] = _mqttManager->reconnectCount();
+                mqttStats["connect_failures"] = _mqttManager->connectFailures();
+                mqttStats["msgs_out_per_s"] = _mqttManager->outboundRate();
+                mqttStats["msgs_in_per_s"] = _mqttManager->inboundRate();
+                JsonObject latency = mqttStats.createNestedObject("command_latency_us");
+                latency["last"] = _mqttManager->commandLatencyLast();
+                latency["avg"] = _mqttManager->commandLatencyAvg();
+                latency["max"] = _mqttManager->commandLatencyMax();
             } else {
                 doc["mqtt_status"] = "disabled";
             }
             
-            // Add watering and light schedule information from GrowthManager
-            const GrowthCycle& activeCycle = _growthManager.getActiveCycle();
-            if (activeCycle.active) {
-                GrowthStage* currentStage = _growthManager.getCurrentStageSettings();
-                if (currentStage) {
-                    // Watering information
-                    JsonObject wateringInfo = doc.createNestedObject("watering_info");
-                    bool pumpState = _relayController.getState(RELAY_PUMP);
-                    
-                    // Get watering timer info from main.cpp global variables
-                    extern time_t lastWateringTime;
-                    extern time_t pumpOnTime;
-                    
-                    time_t now = time(nullptr);
-                    time_t secondsUntilNextChange = 0;
-                    
-                    if (pumpState) {
-                        // Pump is running - calculate time until it turns off
-                        if (pumpOnTime > 0) {
-                            unsigned long wateringDurationSeconds = currentStage->waterDuration * 60; // Convert minutes to seconds
-                            time_t pumpRunTime = now - pumpOnTime;
-                            secondsUntilNextChange = wateringDurationSeconds - pumpRunTime;
-                            if (secondsUntilNextChange < 0) secondsUntilNextChange = 0;
-                        }
-                    } else {
-                        // Pump is off - calculate time until next watering
-                        if (lastWateringTime > 0) {
-                            unsigned long wateringIntervalSeconds = currentStage->waterInterval * 60; // Convert minutes to seconds
-                            time_t secondsSinceLastWatering = now - lastWateringTime;
-                            secondsUntilNextChange = wateringIntervalSeconds - secondsSinceLastWatering;
-                            if (secondsUntilNextChange < 0) secondsUntilNextChange = 0;
-                        }
-                    }
-                    
-                    wateringInfo["seconds_until_next_change"] = secondsUntilNextChange;
-                    wateringInfo["interval_minutes"] = currentStage->waterInterval;
-                    wateringInfo["duration_minutes"] = currentStage->waterDuration;
-                    
-                    // Light schedule information
-                    JsonObject lightInfo = doc.createNestedObject("light_info");
-                    bool lightsState = _relayController.getState(RELAY_LIGHTS);
-                    
-                    // Calculate time until next light transition
-                    struct tm timeinfo;
-                    localtime_r(&now, &timeinfo);
-                    int currentHour = timeinfo.tm_hour;
-                    int currentMinute = timeinfo.tm_min;
-                    int currentSecond = timeinfo.tm_sec;
-                    
-                    int lightStartHour = currentStage->lightStartHour;
-                    int lightEndHour = (lightStartHour + currentStage->lightHours) % 24;
-                    
-                    int secondsUntilLightTransition = 0;
-                    if (lightsState) {
-                        // Lights are on, calculate time until they turn off
-                        if (currentHour < lightEndHour) {
-                            secondsUntilLightTransition = ((lightEndHour - currentHour) * 3600) - (currentMinute * 60) - currentSecond;
-                        } else {
-                            secondsUntilLightTransition = (((lightEndHour + 24) - currentHour) * 3600) - (currentMinute * 60) - currentSecond;
-                        }
-                    } else {
-                        // Lights are off, calculate time until they turn on
-                        if (currentHour < lightStartHour) {
-                            secondsUntilLightTransition = ((lightStartHour - currentHour) * 3600) - (currentMinute * 60) - currentSecond;
-                        } else {
-                            secondsUntilLightTransition = (((lightStartHour + 24) - currentHour) * 3600) - (currentMinute * 60) - currentSecond;
-                        }
-                    }
-                    
-                    lightInfo["seconds_until_next_change"] = secondsUntilLightTransition;
-                    lightInfo["light_hours"] = currentStage->lightHours;
-                    lightInfo["start_hour"] = currentStage->lightStartHour;
-                    lightInfo["end_hour"] = lightEndHour;
-                }
+            // Config store flash wear
+            const ConfigWearStats& wear = _configManager->wearStats();
+            JsonObject configStats = doc.createNestedObject("config_nvs");
+            configStats["commits"] = wear.commits;
+            configStats["key_writes"] = wear.keyWrites;
+            configStats["keys_skipped"] = wear.keysSkipped;
+            configStats["pending"] = _configManager->hasPendingChanges();
+            
+            // Growth profile catalog
+            ProfileCatalog& catalog = _growthManager.getCatalog();
+            JsonObject catalogStats = doc.createNestedObject("profile_catalog");
+            catalogStats["profiles"] = catalog.count();
+            catalogStats["cache_hits"] = catalog.cacheHits();
+            catalogStats["cache_misses"] = catalog.cacheMisses();
+            
+            // Add watering and light schedule information from the compiled growth plan
+            GrowthPlan plan = _growthManager.getPlanSnapshot();
+            if (plan.valid) {
+                time_t now = time(nullptr);
+                
+                // Watering information
+                JsonObject wateringInfo = doc.createNestedObject("watering_info");
+                time_t nextWateringChange = _relayController.getState(RELAY_PUMP) ? plan.pumpStopTime : plan.nextWateringStart;
+                time_t secondsUntilNextChange = nextWateringChange > now ? nextWateringChange - now : 0;
+                
+                wateringInfo["seconds_until_next_change"] = secondsUntilNextChange;
+                wateringInfo["interval_minutes"] = plan.stage.waterInterval;
+                wateringInfo["duration_minutes"] = plan.stage.waterDuration;
+                
+                // Light schedule information
+                JsonObject lightInfo = doc.createNestedObject("light_info");
+                time_t nextLightChange = plan.nextLightTransition(now);
+                
+                lightInfo["seconds_until_next_change"] = nextLightChange > now ? nextLightChange - now : 0;
+                lightInfo["light_hours"] = plan.stage.lightHours;
+                lightInfo["start_hour"] = plan.stage.lightStartHour;
+                lightInfo["end_hour"] = (plan.stage.lightStartHour + plan.stage.lightHours) % 24;
             }
             
             serializeJson(doc, json);
@@ -380,24 +970,20 @@ private:
 
         // Relay control endpoints
         AsyncCallbackJsonWebHandler *pumpHandler = new AsyncCallbackJsonWebHandler("/relay/pump", [this](AsyncWebServerRequest *request, JsonVariant &json) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("POST /relay/pump - Entering");
+            LOG_DEBUG(LOG_WEB, "POST /relay/pump - Entering");
             JsonObject jsonObj = json.as<JsonObject>();
             
             if (jsonObj.containsKey("action")) {
                 String action = jsonObj["action"];
                 if (action == "toggle") {
-                    bool newState = !_relayController.getState(RELAY_PUMP);
-                    _relayController.setState(RELAY_PUMP, newState);
-                    
-                    AsyncJsonResponse *response = new AsyncJsonResponse();
-                    JsonObject root = response->getRoot();
-                    root["status"] = "ok";
-                    response->setLength();
-                    request->send(response);
+                    Command command;
+                    command.type = CMD_TOGGLE_RELAY;
+                    command.relay = RELAY_PUMP;
+                    submitCommand(request, command);
                     return;
                 }
             }
@@ -406,24 +992,20 @@ private:
         _server.addHandler(pumpHandler);
 
         AsyncCallbackJsonWebHandler *lightsHandler = new AsyncCallbackJsonWebHandler("/relay/lights", [this](AsyncWebServerRequest *request, JsonVariant &json) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("POST /relay/lights - Entering");
+            LOG_DEBUG(LOG_WEB, "POST /relay/lights - Entering");
             JsonObject jsonObj = json.as<JsonObject>();
             
             if (jsonObj.containsKey("action")) {
                 String action = jsonObj["action"];
                 if (action == "toggle") {
-                    bool newState = !_relayController.getState(RELAY_LIGHTS);
-                    _relayController.setState(RELAY_LIGHTS, newState);
-                    
-                    AsyncJsonResponse *response = new AsyncJsonResponse();
-                    JsonObject root = response->getRoot();
-                    root["status"] = "ok";
-                    response->setLength();
-                    request->send(response);
+                    Command command;
+                    command.type = CMD_TOGGLE_RELAY;
+                    command.relay = RELAY_LIGHTS;
+                    submitCommand(request, command);
                     return;
                 }
             }
@@ -433,56 +1015,52 @@ private:
 
         // Growth Profile endpoints
         _server.on("/growth-profile", HTTP_GET, [this](AsyncWebServerRequest *request) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("GET /growth-profile - Entering");
+            LOG_DEBUG(LOG_WEB, "GET /growth-profile - Entering");
             String json;
-            StaticJsonDocument<2048> doc;
             
-            // Add profiles to response
-            JsonObject profilesObj = doc.createNestedObject("profiles");
-            const GrowthProfile* profiles = _growthManager.getProfiles();
-            int profileCount = _growthManager.getProfileCount();
-            
-            for (int i = 0; i < profileCount; i++) {
-                String profileId = profiles[i].id;
-                JsonObject profile = profilesObj.createNestedObject(profileId);
-                
-                profile["name"] = profiles[i].name;
-                
-                // Seedling stage
-                JsonObject seedling = profile.createNestedObject("seedling");
-                seedling["duration"] = profiles[i].seedling.duration;
-                seedling["waterDuration"] = profiles[i].seedling.waterDuration;
-                seedling["waterInterval"] = profiles[i].seedling.waterInterval;
-                seedling["lightHours"] = profiles[i].seedling.lightHours;
-                seedling["lightStartHour"] = profiles[i].seedling.lightStartHour;
-                seedling["phMin"] = profiles[i].seedling.phMin;
-                seedling["phMax"] = profiles[i].seedling.phMax;
-                
-                // Growing stage
-                JsonObject growing = profile.createNestedObject("growing");
-                growing["duration"] = profiles[i].growing.duration;
-                growing["waterDuration"] = profiles[i].growing.waterDuration;
-                growing["waterInterval"] = profiles[i].growing.waterInterval;
-                growing["lightHours"] = profiles[i].growing.lightHours;
-                growing["lightStartHour"] = profiles[i].growing.lightStartHour;
-                growing["phMin"] = profiles[i].growing.phMin;
-                growing["phMax"] = profiles[i].growing.phMax;
-                
-                // Harvesting stage
-                JsonObject harvesting = profile.createNestedObject("harvesting");
-                harvesting["duration"] = profiles[i].harvesting.duration;
-                harvesting["waterDuration"] = profiles[i].harvesting.waterDuration;
-                harvesting["waterInterval"] = profiles[i].harvesting.waterInterval;
-                harvesting["lightHours"] = profiles[i].harvesting.lightHours;
-                harvesting["lightStartHour"] = profiles[i].harvesting.lightStartHour;
-                harvesting["phMin"] = profiles[i].harvesting.phMin;
-                harvesting["phMax"] = profiles[i].harvesting.phMax;
+            // A single profile with its stages, served from the catalog cache
+            if (request->hasParam("id")) {
+                GrowthProfile profile;
+                if (!_growthManager.getProfile(request->getParam("id")->value().c_str(), profile)) {
+                    sendStatus(request, false, "Profile not found", 404);
+                    return;
+                }
+                DynamicJsonDocument doc(JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(3) +
+                                        JSON_ARRAY_SIZE(profile.stageCount) + profile.stageCount * JSON_OBJECT_SIZE(8) +
+                                        sizeof(profile.id) + sizeof(profile.name) + profile.stageCount * STAGE_NAME_SIZE);
+                JsonObject profileObj = doc.createNestedObject("profile");
+                profileObj["id"] = (char*)profile.id;
+                profileObj["name"] = (char*)profile.name;
+                addStages(profileObj.createNestedArray("stages"), profile, true);
+                serializeJson(doc, json);
+                request->send(200, "application/json", json);
+                return;
             }
             
+            // Otherwise one page of the catalog, read from the index and record
+            // headers without loading any stages
+            ProfileCatalog& catalog = _growthManager.getCatalog();
+            int offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+            int limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : PROFILE_PAGE_SIZE;
+            if (offset < 0) offset = 0;
+            if (limit <= 0 || limit > PROFILE_PAGE_SIZE) limit = PROFILE_PAGE_SIZE;
+            
+            DynamicJsonDocument doc(JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(limit) +
+                                    limit * (JSON_OBJECT_SIZE(2) + sizeof(ProfileSummary)) +
+                                    JSON_OBJECT_SIZE(9) + JSON_ARRAY_SIZE(MAX_GROWTH_STAGES));
+            doc["total"] = catalog.count();
+            doc["offset"] = offset;
+            JsonObject profilesObj = doc.createNestedObject("profiles");
+            catalog.list(offset, limit, [&profilesObj](const ProfileSummary& summary) {
+                JsonObject profile = profilesObj.createNestedObject((char*)summary.id);
+                profile["name"] = (char*)summary.name;
+                profile["stageCount"] = summary.stageCount;
+            });
+            
             // Add active cycle information if one exists
             const GrowthCycle& activeCycle = _growthManager.getActiveCycle();
             if (activeCycle.active) {
@@ -493,49 +1071,39 @@ private:
                 
                 // Calculate current stage and time elapsed
                 time_t now = time(nullptr);
-                String currentStage = _growthManager.getCurrentGrowthStage(now);
-                cycleObj["currentStage"] = currentStage;
+                GrowthPlan plan = _growthManager.getPlanSnapshot();
+                cycleObj["currentStage"] = plan.stageName;
+                cycleObj["currentStageIndex"] = plan.stageIndex;
                 
                 // Add elapsed and remaining days
-                GrowthProfile* profile = _growthManager.findProfileById(activeCycle.profileId);
-                if (profile) {
+                GrowthProfile profile;
+                if (_growthManager.getProfile(activeCycle.profileId, profile)) {
                     long elapsedSeconds = now - activeCycle.startTime;
                     int elapsedDays = elapsedSeconds / (24 * 60 * 60);
                     cycleObj["elapsedDays"] = elapsedDays;
                     
                     // Calculate total duration and remaining days
-                    int totalDuration = profile->seedling.duration + profile->growing.duration + profile->harvesting.duration;
+                    int totalDuration = profile.totalDuration();
                     int remainingDays = totalDuration - elapsedDays;
                     if (remainingDays < 0) remainingDays = 0;
                     cycleObj["remainingDays"] = remainingDays;
                     cycleObj["totalDuration"] = totalDuration;
                     
-                    // Add progress percentages for each stage
-                    JsonObject progress = cycleObj.createNestedObject("progress");
-                    int seedlingDuration = profile->seedling.duration;
-                    int growingDuration = profile->growing.duration;
-                    int harvestingDuration = profile->harvesting.duration;
-                    
-                    if (elapsedDays < seedlingDuration) {
-                        // In seedling stage
-                        progress["seedling"] = (elapsedDays * 100) / seedlingDuration;
-                        progress["growing"] = 0;
-                        progress["harvesting"] = 0;
-                    } else if (elapsedDays < (seedlingDuration + growingDuration)) {
-                        // In growing stage
-                        progress["seedling"] = 100;
-                        progress["growing"] = ((elapsedDays - seedlingDuration) * 100) / growingDuration;
-                        progress["harvesting"] = 0;
-                    } else if (elapsedDays < totalDuration) {
-                        // In harvesting stage
-                        progress["seedling"] = 100;
-                        progress["growing"] = 100;
-                        progress["harvesting"] = ((elapsedDays - seedlingDuration - growingDuration) * 100) / harvestingDuration;
-                    } else {
-                        // Completed
-                        progress["seedling"] = 100;
-                        progress["growing"] = 100;
-                        progress["harvesting"] = 100;
+                    // Progress percentage of each stage, in profile order
+                    JsonArray progress = cycleObj.createNestedArray("progress");
+                    int stageStartDay = 0;
+                    for (int j = 0; j < profile.stageCount; j++) {
+                        int stageDays = profile.stages[j].duration;
+                        int percent;
+                        if (elapsedDays >= profile.stageEndDays[j]) {
+                            percent = 100;
+                        } else if (elapsedDays <= stageStartDay || stageDays <= 0) {
+                            percent = 0;
+                        } else {
+                            percent = ((elapsedDays - stageStartDay) * 100) / stageDays;
+                        }
+                        progress.add(percent);
+                        stageStartDay = profile.stageEndDays[j];
                     }
                 }
             }
@@ -545,15 +1113,13 @@ private:
         });
 
         AsyncCallbackJsonWebHandler *growthProfileHandler = new AsyncCallbackJsonWebHandler("/growth-profile", [this](AsyncWebServerRequest *request, JsonVariant &json) {
-            if (!_auth.authenticate(request)) {
+            if (!authorize(request)) {
                 return;
             }
             
-            Serial.println("POST /growth-profile - Entering");
+            LOG_DEBUG(LOG_WEB, "POST /growth-profile - Entering");
             JsonObject jsonObj = json.as<JsonObject>();
-            Serial.println("Received JSON:");
-            serializeJson(jsonObj, Serial);
-            Serial.println();
+            logReceivedJson(jsonObj);
 
             // Check the action field to determine what operation to perform
             if (jsonObj.containsKey("action")) {
@@ -564,109 +1130,74 @@ private:
                     const char* profileId = jsonObj["profileId"];
                     JsonObject profileObj = jsonObj["profile"];
                     
-                    GrowthProfile newProfile;
-                    // Copy ID and name
-                    strlcpy(newProfile.id, profileId, sizeof(newProfile.id));
-                    if (profileObj.containsKey("name")) {
-                        strlcpy(newProfile.name, profileObj["name"], sizeof(newProfile.name));
-                    } else {
-                        strlcpy(newProfile.name, "Unnamed Profile", sizeof(newProfile.name));
+                    GrowthProfile newProfile = {};
+                    const char* error = parseProfile(profileObj, profileId, newProfile);
+                    if (error) {
+                        sendStatus(request, false, error);
+                        return;
                     }
                     
-                    // Copy seedling stage settings
-                    if (profileObj.containsKey("seedling")) {
-                        JsonObject seedling = profileObj["seedling"];
-                        newProfile.seedling.duration = seedling.containsKey("duration") ? seedling["duration"] : 14;
-                        newProfile.seedling.waterDuration = seedling.containsKey("waterDuration") ? seedling["waterDuration"] : 5;
-                        newProfile.seedling.waterInterval = seedling.containsKey("waterInterval") ? seedling["waterInterval"] : 60;
-                        newProfile.seedling.lightHours = seedling.containsKey("lightHours") ? seedling["lightHours"] : 8;
-                        newProfile.seedling.lightStartHour = seedling.containsKey("lightStartHour") ? seedling["lightStartHour"] : 6;
-                        newProfile.seedling.phMin = seedling.containsKey("phMin") ? seedling["phMin"] : 5.5;
-                        newProfile.seedling.phMax = seedling.containsKey("phMax") ? seedling["phMax"] : 6.5;
-                    } else {
-                        // Default seedling values
-                        newProfile.seedling = {14, 5, 60, 8, 6, 5.5, 6.5};
-                    }
+                    // Add or update the profile
+                    Command command;
+                    command.type = CMD_SAVE_PROFILE;
+                    command.profile.reset(new GrowthProfile(newProfile));
+                    submitCommand(request, command);
+                }
+                else if (action == "delete_profile" && jsonObj.containsKey("profileId")) {
+                    Command command;
+                    command.type = CMD_DELETE_PROFILE;
+                    strlcpy(command.profileId, jsonObj["profileId"], sizeof(command.profileId));
+                    submitCommand(request, command);
+                }
+                else if (action == "start_cycle" && jsonObj.containsKey("cycle")) {
+                    // Start a new growth cycle
+                    JsonObject cycleObj = jsonObj["cycle"];
                     
-                    // Copy growing stage settings
-                    if (profileObj.containsKey("growing")) {
-                        JsonObject growing = profileObj["growing"];
-                        newProfile.growing.duration = growing.containsKey("duration") ? growing["duration"] : 30;
-                        newProfile.growing.waterDuration = growing.containsKey("waterDuration") ? growing["waterDuration"] : 5;
-                        newProfile.growing.waterInterval = growing.containsKey("waterInterval") ? growing["waterInterval"] : 30;
-                        newProfile.growing.lightHours = growing.containsKey("lightHours") ? growing["lightHours"] : 12;
-                        newProfile.growing.lightStartHour = growing.containsKey("lightStartHour") ? growing["lightStartHour"] : 6;
-                        newProfile.growing.phMin = growing.containsKey("phMin") ? growing["phMin"] : 5.8;
-                        newProfile.growing.phMax = growing.containsKey("phMax") ? growing["phMax"] : 6.2;
-                    } else {
-                        // Default growing values
-                        newProfile.growing = {30, 5, 30, 12, 6, 5.8, 6.2};
+                    if (!cycleObj.containsKey("profileId")) {
+                        sendStatus(request, false, "Failed to start cycle, profile not found");
+                        return;
                     }
+
+                    Command command;
+                    command.type = CMD_START_CYCLE;
+                    strlcpy(command.profileId, cycleObj["profileId"], sizeof(command.profileId));
                     
-                    // Copy harvesting stage settings
-                    if (profileObj.containsKey("harvesting")) {
-                        JsonObject harvesting = profileObj["harvesting"];
-                        newProfile.harvesting.duration = harvesting.containsKey("duration") ? harvesting["duration"] : 14;
-                        newProfile.harvesting.waterDuration = harvesting.containsKey("waterDuration") ? harvesting["waterDuration"] : 5;
-                        newProfile.harvesting.waterInterval = harvesting.containsKey("waterInterval") ? harvesting["waterInterval"] : 45;
-                        newProfile.harvesting.lightHours = harvesting.containsKey("lightHours") ? harvesting["lightHours"] : 10;
-                        newProfile.harvesting.lightStartHour = harvesting.containsKey("lightStartHour") ? harvesting["lightStartHour"] : 6;
-                        newProfile.harvesting.phMin = harvesting.containsKey("phMin") ? harvesting["phMin"] : 6.0;
-                        newProfile.harvesting.phMax = harvesting.containsKey("phMax") ? harvesting["phMax"] : 6.5;
+                    // Get start time, default to current time if not provided
+                    if (cycleObj.containsKey("startTime")) {
+                        command.startTime = cycleObj["startTime"];
                     } else {
-                        // Default harvesting values
-                        newProfile.harvesting = {14, 5, 45, 10, 6, 6.0, 6.5};
+                        command.startTime = time(nullptr);
                     }
                     
-                    // Add or update the profile
-                    bool success = _growthManager.addProfile(&newProfile);
-                    
-                    AsyncJsonResponse *response = new AsyncJsonResponse();
-                    JsonObject root = response->getRoot();
-                    root["status"] = success ? "ok" : "error";
-                    if (!success) {
-                        root["message"] = "Failed to save profile, maximum number of profiles reached";
-                    }
-                    response->setLength();
-                    request->send(response);
+                    submitCommand(request, command);
                 }
-                else if (action == "start_cycle" && jsonObj.containsKey("cycle")) {
-                    // Start a new growth cycle
-                    JsonObject cycleObj = jsonObj["cycle"];
-                    
-                    bool success = false;
-                    if (cycleObj.containsKey("profileId")) {
-                        const char* profileId = cycleObj["profileId"];
-                        
-                        // Get start time, default to current time if not provided
-                        unsigned long startTime;
-                        if (cycleObj.containsKey("startTime")) {
-                            startTime = cycleObj["startTime"];
-                        } else {
-                            startTime = time(nullptr);
+                else if (action == "simulate") {
+                    // Dry run of a saved profile, or of an unsaved one sent
+                    // inline, for up to SIM_MAX_DAYS from the given cycle day
+                    GrowthProfile profile = {};
+                    if (jsonObj.containsKey("profile")) {
+                        const char* error = parseProfile(jsonObj["profile"], jsonObj["profileId"] | "simulation", profile);
+                        if (error) {
+                            sendStatus(request, false, error);
+                            return;
                         }
-                        
-                        success = _growthManager.startGrowthCycle(profileId, startTime);
+                    } else if (!jsonObj.containsKey("profileId") ||
+                               !_growthManager.getProfile(jsonObj["profileId"], profile)) {
+                        sendStatus(request, false, "Profile not found");
+                        return;
                     }
                     
-                    AsyncJsonResponse *response = new AsyncJsonResponse();
-                    JsonObject root = response->getRoot();
-                    root["status"] = success ? "ok" : "error";
-                    if (!success) {
-                        root["message"] = "Failed to start cycle, profile not found";
-                    }
-                    response->setLength();
-                    request->send(response);
+                    time_t cycleStart = jsonObj["startTime"] | (long)time(nullptr);
+                    int fromDay = constrain(jsonObj["fromDay"] | 0, 0, 3650);
+                    int days = constrain(jsonObj["days"] | SIM_DEFAULT_DAYS, 1, SIM_MAX_DAYS);
+                    float ph = jsonObj["ph"] | NAN;
+                    sendSimulation(request, profile, cycleStart, fromDay, days, ph);
                 }
                 else if (action == "stop_cycle") {
                     // Stop the active growth cycle
-                    _growthManager.stopGrowthCycle();
-                    
-                    AsyncJsonResponse *response = new AsyncJsonResponse();
-                    JsonObject root = response->getRoot();
-                    root["status"] = "ok";
-                    response->setLength();
-                    request->send(response);
+                    Command command;
+                    command.type = CMD_STOP_CYCLE;
+                    submitCommand(request, command);
                 }
                 else {
                     // Unknown action
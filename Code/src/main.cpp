@@ -4,32 +4,62 @@
 #include <time.h>
 #include <Preferences.h>
 
+#include "LogBuffer.h"
 #include "RelayController.h"
 #include "SensorReader.h"
+#include "SensorStats.h"
+#include "LevelForecast.h"
+#include "HistoryStore.h"
 #include "HX710B.h"
 #include "HydroAuth.h"
 #include "Config.h"
 #include "GrowthManager.h"
+#include "PHDoser.h"
+#include "PumpGuard.h"
 #include "MQTTManager.h"
+#include "CommandQueue.h"
+#include "ControlScheduler.h"
+#include "PowerManager.h"
+#include "BootProfiler.h"
 #include "WebServerManager.h"
 // todo: remove light switch, now controlled by timer and growth profile
-// todo: add ph/up, down pump control and logic
 // todo: add food pump control and logic
 // todo: better integration with home assistant
 // todo: add pins in configuration so i can switch boards
 // todo: add time zone support
  
+// In-memory log ring, streamed to web clients by WebServerManager
+LogBuffer hydroLog;
+
 // Hardware initialization
 HX710B hx710b(GPIO_NUM_26, GPIO_NUM_27); // HX710B pins
 PHMeter ph(GPIO_NUM_32);
 GravityTDS tds;
 OneWire oneWire(GPIO_NUM_22); // Temperature sensor pin
 DallasTemperature temp(&oneWire);
-RelayController relayController;
+
+// Relay usage counters, kept across software resets
+RTC_NOINIT_ATTR RelayUsageRecord relayUsageRecord;
+RelayController relayController(relayUsageRecord);
+
+// Drives the pH up/down relays from the active stage's pH range
+PHDoser phDoser(relayController);
+
+// Ends each pump run from a timer, independent of the control loop
+PumpGuard pumpGuard(relayController, RELAY_PUMP);
 
 // Create our sensor reader
 SensorReader sensorReader(hx710b, ph, tds, temp);
 
+// Rolling statistics and fault detection of every reading
+SensorStats sensorStats;
+
+// Reservoir consumption rate and time to the critical level
+LevelForecast levelForecast;
+
+// Per-minute telemetry history for the dashboard charts
+HistoryStore history;
+
 // Shared resources
 Preferences preferences;
 WiFiManager wifiManager;
@@ -42,95 +72,226 @@ GrowthManager* growthManager = nullptr;
 MQTTManager* mqttManager = nullptr;
 WebServerManager* webServerManager = nullptr;
 
+// State changes requested by the web server and MQTT, applied by loop()
+CommandQueue commandQueue;
+
 // Alert Thresholds
 const float PH_MIN = 5.5;
 const float PH_MAX = 6.5;
 const int LIQUID_ALERT_PERCENT = 20; // Alert when below 20%
 
-// Global variables for tracking timers (exposed for WebServerManager)
-time_t lastWateringTime = 0;
-time_t pumpOnTime = 0;
+// Control loop timing
+const uint32_t SENSOR_SAMPLE_INTERVAL_MS = 1000;
+const uint32_t STATS_PUBLISH_INTERVAL_MS = 60000;
+const uint32_t NETWORK_ACTIVE_INTERVAL_MS = 100;   // Log viewer attached or MQTT spool replaying
+const uint32_t NETWORK_IDLE_INTERVAL_MS = 1000;
+const uint32_t MAX_SLEEP_MS = 60000;
+const int64_t CLOCK_STEP_THRESHOLD_MS = 2000;
+
+// Deadlines for the control loop, and whether the cycle deadlines need recomputing
+ControlScheduler scheduler;
+bool cycleScheduleDirty = true;
+
+// Relays the growth cycle wanted to switch but that were held by their
+// minimum on/off time or an interlock; retried on EVENT_RELAY_RELEASE
+RelayMask heldRelays = 0;
+
+// Light sleep and frequency scaling while no client is active
+PowerManager powerManager;
+
+// Stage timings of this boot and the previous one, kept across resets
+RTC_NOINIT_ATTR BootRecord bootRecord;
+BootProfiler bootProfiler(bootRecord);
+
+// Watering timers of the growth cycle
+WateringState watering;
 
 // Function prototypes
 void initMQTT();
 void setupTimeSync();
-void checkAlerts(int levelPercent, float phValue);
+void serviceBoot();
+void checkAlerts(float levelPercent, float phValue);
 void updateRelaysBasedOnCycle();
-
+void processCommands();
+void handleEvent(ControlEvent event);
+void sampleSensors();
+void serviceNetwork();
+bool clockStepped();
+void scheduleCycleEvents();
+void checkStageAlerts(float phValue);
+void dosePH(float phValue);
+void armPumpDeadline();
+void applyCommand(Command& command);
+void onRelayMessage(const char* payload, unsigned int length, void* context);
+void publishCycleState();
+void publishRelayUsage();
+void publishSensorStats();
+
+// Boot brings up pump control first. Relays, sensors, config and the
+// control loop are ready within setup(); WiFi, SNTP, the web server and
+// MQTT are started without waiting and finish on the control loop, see
+// serviceBoot().
 void setup() {
+  bootProfiler.begin();
   Serial.begin(115200);
-  Serial.println("Starting Hydroponics System");
+  LOG_INFO(LOG_SYSTEM, "Starting Hydroponics System");
 
   pinMode(GPIO_NUM_25, OUTPUT);
   digitalWrite(GPIO_NUM_25, LOW); // Set GPIO 25 to LOW (off)
 
-  // Initialize SPIFFS
-  if (!SPIFFS.begin(true)) {
-    Serial.println("SPIFFS Mount Failed");
-    return;
-  }
-
-  // Debug SPIFFS contents
-  File root = SPIFFS.open("/");
-  File file = root.openNextFile();
-  while (file) {
-    Serial.print("FILE: ");
-    Serial.println(file.name());
-    file = root.openNextFile();
-  }
-
   // Initialize sensors and relays
   relayController.begin();
+  phDoser.begin();
+  pumpGuard.begin();
   sensorReader.begin();
 
+  // Relay outputs must keep their level through light sleep
+  uint8_t relayPins[RELAY_COUNT];
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    relayPins[i] = relayController.getPin(i);
+  }
+  powerManager.begin(relayPins, RELAY_COUNT);
+  bootProfiler.mark(BOOT_HARDWARE);
+
+  // Initialize SPIFFS. Control runs without it; only the web UI, the
+  // telemetry history and the MQTT spool need it.
+  if (SPIFFS.begin(true)) {
+    history.begin();
+    bootProfiler.mark(BOOT_STORAGE);
+  } else {
+    LOG_ERROR(LOG_SYSTEM, "SPIFFS Mount Failed");
+  }
+
   // Initialize configuration
   configManager = new ConfigManager(preferences, sensorReader);
   configManager->begin();
   systemConfig = configManager->getConfig();
 
-  // Initialize WiFi
-  wifiManager.setConfigPortalTimeout(180);
-  if (!wifiManager.autoConnect("HydroponicsAP")) {
-    Serial.println("Failed to connect, restarting");
-    ESP.restart();
-  }
-  
-  // Setup time synchronization
-  setupTimeSync();
+  // Relay usage counters from RTC memory or the last checkpoint
+  relayController.loadUsage(preferences);
 
   // Initialize growth profile manager
   growthManager = new GrowthManager(preferences);
   growthManager->begin();
+  bootProfiler.mark(BOOT_CONFIG);
+
+  // Control loop runs on this task; queued commands wake it
+  scheduler.begin();
+  commandQueue.setConsumer(xTaskGetCurrentTaskHandle());
+  scheduler.scheduleIn(EVENT_SENSOR_SAMPLE, 0);
+  scheduler.scheduleIn(EVENT_NETWORK, 0);
+  scheduler.scheduleIn(EVENT_USAGE_CHECKPOINT, RELAY_USAGE_CHECKPOINT_MS);
+  scheduler.scheduleIn(EVENT_STATS_PUBLISH, STATS_PUBLISH_INTERVAL_MS);
+  bootProfiler.mark(BOOT_CONTROL);
+
+  // Connect to WiFi in the background. Without saved credentials, or if
+  // they fail, the config portal runs alongside the control loop and is
+  // serviced by serviceNetwork().
+  wifiManager.setConfigPortalBlocking(false);
+  wifiManager.setConfigPortalTimeout(180);
+  wifiManager.autoConnect("HydroponicsAP");
+
+  // SNTP syncs on its own once the network is up
+  setupTimeSync();
 
-  // Initialize MQTT manager
+  // Initialize MQTT manager; its task waits for WiFi, and messages arrive on it
   mqttManager = new MQTTManager(espClient, systemConfig);
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    mqttManager->onMessage(mqttManager->getRelayCommandTopic(i), onRelayMessage, (void*)(uintptr_t)i);
+  }
   mqttManager->begin();
-  mqttManager->setCallback([](const String& topic, const String& payload) {
-    Serial.printf("MQTT Message: Topic: %s, Payload: %s\n", topic.c_str(), payload.c_str());
-    
-    if (topic == mqttManager->getTopicPump()) {
-      bool newState = payload.equalsIgnoreCase("ON");
-      relayController.setState(RELAY_PUMP, newState);
-      Serial.printf("Setting pump state to: %s\n", newState ? "ON" : "OFF");
-    } 
-    else if (topic == mqttManager->getTopicLights()) {
-      bool newState = payload.equalsIgnoreCase("ON");
-      relayController.setState(RELAY_LIGHTS, newState);
-      Serial.printf("Setting lights state to: %s\n", newState ? "ON" : "OFF");
-    }
-  });
 
-  // Initialize web server
+  // Web server routes; it starts listening once WiFi is connected
   webServerManager = new WebServerManager(80, systemConfig, *growthManager, 
-                                         sensorReader, relayController, preferences, configManager, mqttManager);
-  webServerManager->begin();
+                                         sensorReader, sensorStats, levelForecast, history, relayController,
+                                         preferences, configManager, commandQueue, bootProfiler, phDoser, pumpGuard, mqttManager);
 
-  Serial.println("Hydroponics System Initialized");
+  LOG_INFO(LOG_SYSTEM, "Hydroponics System Initialized, waiting for network");
 }
 
 void loop() {
-  wifiManager.process();
+  // Apply state changes queued by the web server and MQTT
+  processCommands();
+
+  // A wall-clock step (NTP sync, manual change) invalidates every wall-time deadline
+  if (clockStepped()) {
+    LOG_INFO(LOG_CYCLE, "Clock changed, rescheduling growth cycle events");
+    growthManager->invalidatePlan();
+    cycleScheduleDirty = true;
+  }
+
+  // Run everything that is due
+  ControlEvent event;
+  int64_t now = ControlScheduler::nowMillis();
+  while (scheduler.popDue(now, event)) {
+    handleEvent(event);
+  }
+
+  // Re-evaluate relays and recompute deadlines only when something changed
+  if (cycleScheduleDirty) {
+    cycleScheduleDirty = false;
+    updateRelaysBasedOnCycle();
+    scheduleCycleEvents();
+    armPumpDeadline();
+  }
+
+  // Allow light sleep only while no web client is active
+  bool webClientActive = webServerManager->hasLogClients() ||
+                         millis() - webServerManager->lastRequestMillis() < POWER_ACTIVE_HOLD_MS;
+  powerManager.update(webClientActive);
 
+  // Sleep until the earliest deadline or until another task wakes us
+  scheduler.wait(MAX_SLEEP_MS);
+}
+
+void handleEvent(ControlEvent event) {
+  switch (event) {
+    case EVENT_SENSOR_SAMPLE:
+      sampleSensors();
+      scheduler.scheduleIn(EVENT_SENSOR_SAMPLE, SENSOR_SAMPLE_INTERVAL_MS);
+      break;
+
+    case EVENT_WATERING_START:
+    case EVENT_WATERING_STOP:
+    case EVENT_LIGHTS:
+    case EVENT_STAGE_CHANGE:
+    case EVENT_RELAY_RELEASE:
+      cycleScheduleDirty = true;
+      break;
+
+    case EVENT_NETWORK:
+      serviceNetwork();
+      break;
+
+    case EVENT_USAGE_CHECKPOINT:
+      relayController.saveUsage(preferences);
+      publishRelayUsage();
+      scheduler.scheduleIn(EVENT_USAGE_CHECKPOINT, RELAY_USAGE_CHECKPOINT_MS);
+      break;
+
+    case EVENT_STATS_PUBLISH:
+      publishSensorStats();
+      scheduler.scheduleIn(EVENT_STATS_PUBLISH, STATS_PUBLISH_INTERVAL_MS);
+      break;
+
+    case EVENT_CONFIG_COMMIT: {
+      // Reschedules itself while edits keep arriving
+      uint32_t delay = configManager->commitDelay();
+      if (delay > 0) {
+        scheduler.scheduleIn(EVENT_CONFIG_COMMIT, delay);
+      } else {
+        configManager->commit();
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+// Read sensors, raise alerts and publish telemetry
+void sampleSensors() {
   // Update sensor readings
   sensorReader.updateReadings();
 
@@ -145,119 +306,400 @@ void loop() {
   int levelPercent = 0;
   if (!isnan(liquidLevel)) {
     levelPercent = (int)liquidLevel;
-    Serial.printf("Liquid Level: %.2f (%d%%), Raw Value: %.2f\n", liquidLevel, levelPercent, liquidValue);
+    LOG_DEBUG(LOG_SENSOR, "Liquid Level: %.2f (%d%%), Raw Value: %.2f", liquidLevel, levelPercent, liquidValue);
+  }
+  if (!isnan(phValue)) {
+    LOG_DEBUG(LOG_SENSOR, "pH Value: %.2f", phValue);
+  }
+  if (!isnan(tdsValue)) {
+    LOG_DEBUG(LOG_SENSOR, "TDS Value: %.2f ppm", tdsValue);
+  }
+  if (!isnan(tempValue)) {
+    LOG_DEBUG(LOG_SENSOR, "Temp Value: %.2f C", tempValue);
   }
 
-  // Check alerts
-  checkAlerts(levelPercent, phValue);
+  // Streaming statistics; report sensor faults and sustained deviations as
+  // they appear
+  float telemetry[METRIC_COUNT];
+  telemetry[METRIC_LIQUID_LEVEL] = isnan(liquidLevel) ? NAN : levelPercent;
+  telemetry[METRIC_PH] = phValue;
+  telemetry[METRIC_TDS] = tdsValue;
+  telemetry[METRIC_TEMPERATURE] = tempValue;
+  bool statsChanged = false;
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    uint8_t raised = sensorStats.add((TelemetryMetric)i, telemetry[i], millis());
+    if (!raised) {
+      continue;
+    }
+    statsChanged = true;
+    char alertMsg[64];
+    snprintf(alertMsg, sizeof(alertMsg), "Sensor %s: %s", METRIC_NAMES[i], SensorStats::conditionName(raised));
+    LOG_WARN(LOG_SENSOR, "%s", alertMsg);
+    if (systemConfig.mqtt_enabled) {
+      mqttManager->publishAlert(alertMsg);
+    }
+  }
+  if (statsChanged) {
+    publishSensorStats();
+  }
 
-  // Update relay status based on active growth cycle (if any)
-  updateRelaysBasedOnCycle();
-  
-  // MQTT handling - only if enabled
+  // Averaged into one record per minute for the charts
+  history.add(telemetry, time(nullptr));
+
+  // The fit uses the unrounded level; watering moves water into the tower
+  // and back, so those windows are left out
+  levelForecast.add(sensorStats.faulty(METRIC_LIQUID_LEVEL) ? NAN : sensorReader.getLiquidLevelExact(),
+                    relayController.getState(RELAY_PUMP), sensorReader.getCriticalLevel(),
+                    ControlScheduler::nowMillis());
+
+  // Keeps the RTC copy of the usage counters current for running relays
+  relayController.accrue();
+
+  // Pump interlock: stop it at once when the reservoir reaches its
+  // critical level, and re-run the cycle once the level has recovered
+  bool liquidOk = !sensorReader.isLiquidCritical();
+  if (liquidOk != relayController.liquidOk()) {
+    RelayMask stopped = relayController.setLiquidOk(liquidOk);
+    if (liquidOk) {
+      LOG_INFO(LOG_SENSOR, "Liquid level above critical, pump interlock released");
+    } else {
+      LOG_WARN(LOG_SENSOR, "Liquid level at or below critical, pump interlock engaged");
+    }
+    for (int i = 0; i < RELAY_COUNT; i++) {
+      if (stopped & RELAY_BIT(i)) {
+        mqttManager->publishRelayState(i, false);
+      }
+    }
+    cycleScheduleDirty = true;
+  }
+
+  // The maximum run time stopped the pump; let the cycle catch up
+  if (pumpGuard.takeFailsafeTrip()) {
+    LOG_WARN(LOG_CYCLE, "Pump stopped after its maximum run time of %u min", systemConfig.pump_max_run_min);
+    if (systemConfig.mqtt_enabled) {
+      mqttManager->publishAlert("Pump stopped by maximum run time failsafe!");
+    }
+    cycleScheduleDirty = true;
+  }
+
+  // Threshold alerts use the rolling median, so a single noisy sample does
+  // not raise them; a faulty sensor raises none
+  float robustPH = sensorStats.robustValue(METRIC_PH);
+  checkAlerts(sensorStats.robustValue(METRIC_LIQUID_LEVEL), robustPH);
+  checkStageAlerts(robustPH);
+  dosePH(sensorStats.faulty(METRIC_PH) ? NAN : phValue);
+
+  // Publish sensor data over MQTT; unchanged values are held back and
+  // readings taken while the broker is unreachable are spooled
   if (systemConfig.mqtt_enabled) {
-    if (!mqttManager->connected()) {
-      if (mqttManager->connect()) {
-        Serial.println("MQTT Connected");
+    mqttManager->publishTelemetry(telemetry);
+    publishCycleState();
+
+    // Catches state the broker has not seen yet, e.g. after a reconnect
+    for (int i = 0; i < RELAY_COUNT; i++) {
+      mqttManager->publishRelayState(i, relayController.getState(i));
+    }
+  }
+}
+
+// WiFi portal, log streaming and MQTT spool replay. Runs at a short interval
+// while a log viewer is attached or a replay is in progress. The MQTT
+// connection itself is serviced by its own task.
+void serviceNetwork() {
+  wifiManager.process();
+  serviceBoot();
+
+  // Forward buffered log lines to any live log viewers
+  webServerManager->streamLogs();
+
+  bool replaying = systemConfig.mqtt_enabled && mqttManager->serviceSpool();
+
+  bool active = webServerManager->hasLogClients() || replaying || wifiManager.getConfigPortalActive();
+  uint32_t nextService = active ? NETWORK_ACTIVE_INTERVAL_MS : NETWORK_IDLE_INTERVAL_MS;
+  scheduler.scheduleIn(EVENT_NETWORK, nextService);
+}
+
+// Finish the network boot stages as they become ready
+void serviceBoot() {
+  if (!bootProfiler.reached(BOOT_WIFI) && WiFi.isConnected()) {
+    bootProfiler.mark(BOOT_WIFI);
+
+    // Power save needs WiFi up to enable modem sleep
+    powerManager.setEnabled(systemConfig.power_save);
+
+    // The web server shares port 80 with the config portal, so it only
+    // starts once the portal is no longer needed
+    webServerManager->begin();
+    bootProfiler.mark(BOOT_WEB);
+  }
+
+  if (!bootProfiler.reached(BOOT_TIME) && time(nullptr) >= 1000000000) {
+    time_t now = time(nullptr);
+    struct tm timeinfo;
+    gmtime_r(&now, &timeinfo);
+    LOG_INFO(LOG_SYSTEM, "Current time: %d-%d-%d %d:%d:%d",
+             timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday,
+             timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+    bootProfiler.mark(BOOT_TIME);
+  }
+
+  if (!bootProfiler.reached(BOOT_MQTT) && mqttManager->connected()) {
+    bootProfiler.mark(BOOT_MQTT);
+    publishRelayUsage();
+    publishSensorStats();
+  }
+}
+
+// MQTT relay command, runs on the MQTT task. The context is the relay number.
+// Commands that would not change the relay are dropped here; applyCommand()
+// checks again in case an earlier queued command changes the picture.
+void onRelayMessage(const char* payload, unsigned int length, void* context) {
+  uint8_t relay = (uint8_t)(uintptr_t)context;
+  bool state = MQTTManager::payloadEquals(payload, length, "ON");
+  powerManager.markActivity();
+
+  bool ignored = relayController.getState(relay) == state;
+  mqttManager->countCommand(ignored);
+  if (ignored) {
+    LOG_DEBUG(LOG_MQTT, "%s already %s, ignoring command", relayController.getName(relay), state ? "ON" : "OFF");
+    return;
+  }
+  LOG_INFO(LOG_MQTT, "MQTT relay %d command: %.*s", relay, (int)length, payload);
+
+  Command command;
+  command.type = CMD_SET_RELAY;
+  command.relay = relay;
+  command.state = state;
+  command.receivedAt = esp_timer_get_time();
+  if (!commandQueue.push(std::move(command))) {
+    LOG_WARN(LOG_MQTT, "Command queue full, dropping relay %d command", relay);
+  }
+}
+
+// Stage and next watering/light transitions for Home Assistant
+void publishCycleState() {
+  time_t now = time(nullptr);
+  if (now < 1000000000) {
+    return;
+  }
+  const GrowthPlan& plan = growthManager->getPlan(now);
+  if (!plan.valid) {
+    mqttManager->publishCycleState(plan.stageName, 0, 0);
+    return;
+  }
+  time_t nextWateringChange = relayController.getState(RELAY_PUMP) ? plan.pumpStopTime : plan.nextWateringStart;
+  mqttManager->publishCycleState(plan.stageName, nextWateringChange, plan.nextLightTransition(now));
+}
+
+// Retained usage counters of every relay, for maintenance tracking
+void publishRelayUsage() {
+  if (!systemConfig.mqtt_enabled) {
+    return;
+  }
+  RelayUsage usage[RELAY_COUNT];
+  relayController.getUsage(usage);
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    mqttManager->publishRelayUsage(i, usage[i], systemConfig.relay_watts[i]);
+  }
+}
+
+// Retained statistics and sensor status of every metric, and the level forecast
+void publishSensorStats() {
+  if (!systemConfig.mqtt_enabled) {
+    return;
+  }
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    mqttManager->publishSensorStats((TelemetryMetric)i, sensorStats.stats((TelemetryMetric)i));
+  }
+  mqttManager->publishLevelForecast(levelForecast.result());
+}
+
+// Detect wall-clock steps by watching the offset between wall and monotonic time
+bool clockStepped() {
+  static int64_t lastOffset = 0;
+  int64_t offset = ControlScheduler::wallMillis() - ControlScheduler::nowMillis();
+  int64_t drift = offset - lastOffset;
+  lastOffset = offset;
+  return drift > CLOCK_STEP_THRESHOLD_MS || drift < -CLOCK_STEP_THRESHOLD_MS;
+}
+
+// Work out when the growth cycle next needs attention: watering start and
+// stop, the next lights transition and the next stage boundary.
+void scheduleCycleEvents() {
+  scheduler.cancel(EVENT_WATERING_START);
+  scheduler.cancel(EVENT_WATERING_STOP);
+  scheduler.cancel(EVENT_LIGHTS);
+  scheduler.cancel(EVENT_STAGE_CHANGE);
+  scheduler.cancel(EVENT_RELAY_RELEASE);
+
+  // Relays held by an interlock wait for the sensor sample that clears it
+  uint32_t holdMs = relayController.holdRemaining(heldRelays);
+  if (holdMs > 0) {
+    scheduler.scheduleIn(EVENT_RELAY_RELEASE, holdMs);
+  }
+
+  // Nothing to schedule; a clock step or a command will bring us back here
+  const GrowthCycle& activeCycle = growthManager->getActiveCycle();
+  time_t now = time(nullptr);
+  if (!activeCycle.active || now < 1000000000) {
+    return;
+  }
+
+  const GrowthPlan& plan = growthManager->getPlan(now);
+  if (!plan.valid) {
+    return;
+  }
+
+  // A held pump is picked up by EVENT_RELAY_RELEASE instead. The pump
+  // guard's timer stops the pump on time; the stop event follows it to
+  // update the cycle, and stops the pump itself if the timer did not.
+  bool pumpHeld = relayController.holdRemaining(heldRelays & RELAY_BIT(RELAY_PUMP)) > 0;
+  if (!pumpHeld && relayController.getState(RELAY_PUMP) && plan.pumpStopTime > 0) {
+    scheduler.scheduleAtWallTime(EVENT_WATERING_STOP, plan.pumpStopTime + 1);
+  }
+  if (!pumpHeld && plan.nextWateringStart > 0) {
+    scheduler.scheduleAtWallTime(EVENT_WATERING_START, plan.nextWateringStart);
+  }
+  scheduler.scheduleAtWallTime(EVENT_LIGHTS, plan.nextLightTransition(now));
+  if (plan.stageEnd > 0) {
+    scheduler.scheduleAtWallTime(EVENT_STAGE_CHANGE, plan.stageEnd);
+  }
+
+  LOG_DEBUG(LOG_CYCLE, "Next control event in %ld ms",
+            (long)(scheduler.nextDeadline() - ControlScheduler::nowMillis()));
+}
+
+// Drain the command queue. loop() is the only writer of relay, growth
+// cycle and config state, other tasks submit commands instead.
+void processCommands() {
+  Command command;
+  while (commandQueue.pop(command)) {
+    applyCommand(command);
+    cycleScheduleDirty = true;
+  }
+}
+
+void applyCommand(Command& command) {
+  bool success = true;
+  const char* message = nullptr;
+
+  switch (command.type) {
+    case CMD_SET_RELAY:
+      if (relayController.getState(command.relay) == command.state) {
+        break;
+      }
+      LOG_ACTION(LOG_SYSTEM, "Setting %s state to: %s", relayController.getName(command.relay),
+                 command.state ? "ON" : "OFF");
+      success = relayController.setState(command.relay, command.state);
+      if (success) {
+        mqttManager->publishRelayState(command.relay, command.state);
+      } else {
+        message = "Refused by relay interlock or minimum on/off time";
+        LOG_WARN(LOG_SYSTEM, "%s: %s", relayController.getName(command.relay), message);
+      }
+      break;
+
+    case CMD_TOGGLE_RELAY: {
+      bool newState = !relayController.getState(command.relay);
+      LOG_ACTION(LOG_SYSTEM, "Toggling %s to: %s", relayController.getName(command.relay),
+                 newState ? "ON" : "OFF");
+      success = relayController.setState(command.relay, newState);
+      if (success) {
+        mqttManager->publishRelayState(command.relay, newState);
       } else {
-        Serial.println("MQTT Connection failed");
-        delay(5000);
-        return;
+        message = "Refused by relay interlock or minimum on/off time";
+        LOG_WARN(LOG_SYSTEM, "%s: %s", relayController.getName(command.relay), message);
       }
+      break;
     }
-    
-    mqttManager->loop();
-
-        // Log values
-        if (!isnan(liquidLevel)) {
-          Serial.printf("Liquid Level: %.2f (%d%%), Raw Value: %.2f\n", liquidLevel, levelPercent, liquidValue);
-        }
-        if (!isnan(phValue)) {
-          Serial.printf("pH Value: %.2f\n", phValue);
-        }
-        if (!isnan(tdsValue)) {
-          Serial.printf("TDS Value: %.2f ppm\n", tdsValue);
-        }
-        if (!isnan(tempValue)) {
-          Serial.printf("Temp Value: %.2f C\n", tempValue);
-        }
-
-    // Publish sensor data if connected to MQTT
-    if (mqttManager->connected()) {
-      if (!isnan(liquidLevel)) {
-        mqttManager->publishLiquidLevel(levelPercent);
+
+    case CMD_START_CYCLE:
+      success = growthManager->startGrowthCycle(command.profileId, command.startTime);
+      if (!success) {
+        message = "Failed to start cycle, profile not found";
       }
+      break;
+
+    case CMD_STOP_CYCLE:
+      growthManager->stopGrowthCycle();
+      break;
 
-      if (!isnan(phValue)) {
-        mqttManager->publishPH(phValue);
+    case CMD_SAVE_PROFILE:
+      success = command.profile && growthManager->addProfile(command.profile.get());
+      if (!success) {
+        message = "Failed to save profile, catalog full or not writable";
       }
+      break;
 
-      if (!isnan(tdsValue)) {
-        mqttManager->publishTDS(tdsValue);
+    case CMD_DELETE_PROFILE:
+      success = growthManager->deleteProfile(command.profileId);
+      if (!success) {
+        message = "Failed to delete profile, not found or in use by the active cycle";
       }
+      break;
 
-      if (!isnan(tempValue)) {
-        mqttManager->publishTemperature(tempValue);
+    case CMD_UPDATE_CONFIG: {
+      if (!command.config) {
+        success = false;
+        break;
+      }
+      SystemConfig previous = systemConfig;
+      configManager->applyPatch(*command.config);
+      systemConfig = configManager->getConfig();
+
+      // Let the MQTT task reconnect (or disconnect) with the new settings.
+      // The state topic setting changes the discovery messages, so it counts too.
+      bool mqttChanged = strcmp(previous.device_id, systemConfig.device_id) != 0 ||
+                         previous.mqtt_enabled != systemConfig.mqtt_enabled ||
+                         strcmp(previous.mqtt_server, systemConfig.mqtt_server) != 0 ||
+                         previous.mqtt_port != systemConfig.mqtt_port ||
+                         strcmp(previous.mqtt_user, systemConfig.mqtt_user) != 0 ||
+                         strcmp(previous.mqtt_password, systemConfig.mqtt_password) != 0 ||
+                         previous.state_topic != systemConfig.state_topic;
+      if (mqttChanged) {
+        LOG_INFO(LOG_MQTT, "MQTT settings changed, reconnecting");
+        mqttManager->reconfigure(systemConfig);
       }
+      powerManager.setEnabled(systemConfig.power_save);
+
+      // Coalesce bursts of edits into one flash write
+      scheduler.scheduleIn(EVENT_CONFIG_COMMIT, configManager->commitDelay());
+      break;
     }
   }
 
-  // Add small delay between readings
-  delay(1000);
+  if (command.done) {
+    command.done(success, message);
+  }
+  if (command.receivedAt) {
+    mqttManager->recordCommandLatency(command.receivedAt);
+  }
 }
 
-// Setup time synchronization with NTP server
+// Start SNTP. The first sync is picked up by serviceBoot() and the clock
+// step it causes by clockStepped(), so nothing waits for it here.
 void setupTimeSync() {
-  Serial.println("Setting up time synchronization...");
+  LOG_INFO(LOG_SYSTEM, "Setting up time synchronization...");
   
   // Configure time servers and timezone
   configTime(0, 0, systemConfig.ntp_server); // UTC time, no daylight saving offset
-  
-  // Wait for time to be set (timeout after 10 seconds)
-  time_t now = time(nullptr);
-  int timeout = 10;
-  while (now < 1000000000 && timeout > 0) {
-    Serial.println("Waiting for NTP time sync...");
-    delay(1000);
-    now = time(nullptr);
-    timeout--;
-  }
-  
-  if (now < 1000000000) {
-    Serial.println("Failed to get time from NTP server!");
-  } else {
-    struct tm timeinfo;
-    gmtime_r(&now, &timeinfo);
-    Serial.print("Current time: ");
-    Serial.print(timeinfo.tm_year + 1900);
-    Serial.print("-");
-    Serial.print(timeinfo.tm_mon + 1);
-    Serial.print("-");
-    Serial.print(timeinfo.tm_mday);
-    Serial.print(" ");
-    Serial.print(timeinfo.tm_hour);
-    Serial.print(":");
-    Serial.print(timeinfo.tm_min);
-    Serial.print(":");
-    Serial.println(timeinfo.tm_sec);
-  }
 }
 
-// Check sensor values against thresholds
-void checkAlerts(int levelPercent, float phValue) {
-  String alertMsg = "";
+// Check sensor values against thresholds; NaN values are skipped
+void checkAlerts(float levelPercent, float phValue) {
+  char alertMsg[64] = "";
 
   if (levelPercent < LIQUID_ALERT_PERCENT) {
-    alertMsg += "Low water level! ";
+    strlcat(alertMsg, "Low water level! ", sizeof(alertMsg));
   }
   if (phValue < PH_MIN) {
-    alertMsg += "pH too low! ";
+    strlcat(alertMsg, "pH too low! ", sizeof(alertMsg));
   }
   if (phValue > PH_MAX) {
-    alertMsg += "pH too high! ";
+    strlcat(alertMsg, "pH too high! ", sizeof(alertMsg));
   }
 
-  if (alertMsg.length() > 0 && mqttManager->connected()) {
+  if (alertMsg[0] != '\0' && systemConfig.mqtt_enabled) {
     mqttManager->publishAlert(alertMsg);
   }
 }
@@ -266,180 +708,171 @@ void checkAlerts(int levelPercent, float phValue) {
 void updateRelaysBasedOnCycle() {
   // Debug log for tracking function calls
   static unsigned long lastExecutionTime = 0;
-  static bool firstRun = true;
   
   unsigned long currentMillis = millis();
-  Serial.printf("[DEBUG] updateRelaysBasedOnCycle called. Time since last call: %lu ms\n", 
+  LOG_DEBUG(LOG_CYCLE, "updateRelaysBasedOnCycle called. Time since last call: %lu ms", 
                 lastExecutionTime == 0 ? 0 : currentMillis - lastExecutionTime);
   lastExecutionTime = currentMillis;
+  heldRelays = 0;
   
   const GrowthCycle& activeCycle = growthManager->getActiveCycle();
   if (!activeCycle.active) {
-    Serial.println("[DEBUG] No active growth cycle");
+    LOG_DEBUG(LOG_CYCLE, "No active growth cycle");
     return;
   }
   
   // Get current time
   time_t now = time(nullptr);
   if (now < 1000000000) { // Basic sanity check for valid time (year ~2001+)
-    Serial.println("[ERROR] System time not yet synchronized");
+    LOG_ERROR(LOG_CYCLE, "System time not yet synchronized");
     return;
   }
   
-  // Get current stage settings
-  GrowthStage* currentStage = growthManager->getCurrentStageSettings();
-  if (!currentStage) {
-    Serial.println("[ERROR] Current stage settings unavailable");
+  // Stage settings and light window come from the compiled plan, which is
+  // only rebuilt when a stage boundary or lights transition has passed
+  const GrowthPlan& plan = growthManager->getPlan(now);
+  if (!plan.valid) {
+    LOG_ERROR(LOG_CYCLE, "Current stage settings unavailable");
     return;
   }
+  const GrowthStage* currentStage = &plan.stage;
   
   // Log current stage and settings
-  String currentStageName = growthManager->getCurrentGrowthStage(now);
-  Serial.printf("[INFO] Current stage: %s, Water interval: %d min, Water duration: %d min, Light hours: %d\n", 
-                currentStageName.c_str(), currentStage->waterInterval, 
+  LOG_INFO(LOG_CYCLE, "Current stage: %s, Water interval: %d min, Water duration: %d min, Light hours: %d", 
+                plan.stageName, currentStage->waterInterval, 
                 currentStage->waterDuration, currentStage->lightHours);
   
-  // Control lights based on time of day and light hours
-  struct tm timeinfo;
-  localtime_r(&now, &timeinfo);
-  int currentHour = timeinfo.tm_hour;
-  int currentMinute = timeinfo.tm_min;
-  
-  // Light control: use the light start hour from the profile
-  int lightStartHour = currentStage->lightStartHour;
-  int lightEndHour = (lightStartHour + currentStage->lightHours) % 24;
-  
-  // Determine if lights should be on based on the fixed start time
-  bool shouldLightsBeOn;
-  if (lightStartHour < lightEndHour) {
-    // Normal case (e.g., 6AM to 6PM)
-    shouldLightsBeOn = (currentHour >= lightStartHour && currentHour < lightEndHour);
-  } else {
-    // Wrap-around case (e.g., 6PM to 6AM)
-    shouldLightsBeOn = (currentHour >= lightStartHour || currentHour < lightEndHour);
-  }
-  
+  // The same rules drive the cycle simulator, see GrowthManager::evaluateCycle
   bool currentLightState = relayController.getState(RELAY_LIGHTS);
+  bool pumpCurrentState = relayController.getState(RELAY_PUMP);
+  WateringState previous = watering;
+  CycleOutputs outputs = GrowthManager::evaluateCycle(plan, now, pumpCurrentState, watering);
   
-  // Calculate time until next light transition
-  int minutesToLightTransition;
-  if (shouldLightsBeOn) {
-    // Lights should be on, calculate time until they turn off
-    if (currentHour < lightEndHour) {
-      minutesToLightTransition = (lightEndHour - currentHour) * 60 - currentMinute;
-    } else {
-      minutesToLightTransition = ((lightEndHour + 24) - currentHour) * 60 - currentMinute;
-    }
-  } else {
-    // Lights should be off, calculate time until they turn on
-    if (currentHour < lightStartHour) {
-      minutesToLightTransition = (lightStartHour - currentHour) * 60 - currentMinute;
-    } else {
-      minutesToLightTransition = ((lightStartHour + 24) - currentHour) * 60 - currentMinute;
-    }
-  }
+  // Control lights based on the plan's light window
+  long minutesToLightTransition = (long)(plan.nextLightTransition(now) - now + 59) / 60;
   
-  Serial.printf("[INFO] Light schedule: Current time: %d:%02d, Lights: %s (should be %s), Hours: %d-%d, Minutes until transition: %d\n", 
-                currentHour, currentMinute,
+  LOG_INFO(LOG_CYCLE, "Light schedule: Lights: %s (should be %s), Hours: %d+%d, Minutes until transition: %ld", 
                 currentLightState ? "ON" : "OFF", 
-                shouldLightsBeOn ? "ON" : "OFF",
-                lightStartHour, lightEndHour,
+                outputs.lights ? "ON" : "OFF",
+                currentStage->lightStartHour, currentStage->lightHours,
                 minutesToLightTransition);
   
-  if (currentLightState != shouldLightsBeOn) {
-    Serial.printf("[ACTION] Setting lights to: %s\n", shouldLightsBeOn ? "ON" : "OFF");
-    relayController.setState(RELAY_LIGHTS, shouldLightsBeOn);
-    if (mqttManager->connected()) {
-      mqttManager->publishLightsState(shouldLightsBeOn);
-    }
+  if (currentLightState != outputs.lights) {
+    LOG_ACTION(LOG_CYCLE, "Setting lights to: %s", outputs.lights ? "ON" : "OFF");
   }
   
-  // Water pump control based on interval
-  unsigned long wateringIntervalSeconds = currentStage->waterInterval * 60; // Convert minutes to seconds
-  
-  // On first run, start a watering cycle immediately
-  if (firstRun) {
-    Serial.println("[INFO] First run detected - starting initial watering cycle");
-    relayController.setState(RELAY_PUMP, true);
-    lastWateringTime = now;
-    firstRun = false;
-    
-    if (mqttManager->connected()) {
-      mqttManager->publishPumpState(true);
+  // Water pump control based on interval and duration
+  if (watering.lastWateringTime != previous.lastWateringTime) {
+    if (previous.lastWateringTime == 0) {
+      LOG_INFO(LOG_CYCLE, "First run detected - starting initial watering cycle");
+    } else {
+      LOG_ACTION(LOG_CYCLE, "Starting watering cycle. Current time: %ld, Last watering time: %ld, Difference: %ld s", 
+                   now, previous.lastWateringTime, now - previous.lastWateringTime);
     }
   } else {
-    // Log watering information
-    time_t secondsSinceLastWatering = (lastWateringTime > 0) ? now - lastWateringTime : 0;
-    time_t secondsUntilNextWatering = (lastWateringTime > 0) ? 
-                                     wateringIntervalSeconds - secondsSinceLastWatering : 0;
-    
+    long secondsUntilNextWatering = (long)(plan.nextWateringStart - now);
     if (secondsUntilNextWatering < 0) secondsUntilNextWatering = 0;
-    
-    Serial.printf("[INFO] Watering schedule: Interval: %lu s, Last watering: %ld s ago, Next watering in: %ld s\n", 
-                  wateringIntervalSeconds, 
-                  secondsSinceLastWatering,
+    LOG_INFO(LOG_CYCLE, "Watering schedule: Interval: %d s, Last watering: %ld s ago, Next watering in: %ld s", 
+                  currentStage->waterInterval * 60,
+                  (long)(now - watering.lastWateringTime),
                   secondsUntilNextWatering);
-    
-    // Check if it's time for another watering cycle
-    if (lastWateringTime > 0 && now - lastWateringTime >= wateringIntervalSeconds) {
-      Serial.printf("[ACTION] Starting watering cycle. Current time: %ld, Last watering time: %ld, Difference: %ld s\n", 
-                   now, lastWateringTime, now - lastWateringTime);
-      
-      relayController.setState(RELAY_PUMP, true);
-      lastWateringTime = now;
-      
-      if (mqttManager->connected()) {
-        mqttManager->publishPumpState(true);
-      }
-    }
   }
   
-  // Turn off pump after watering duration
-  bool pumpCurrentState = relayController.getState(RELAY_PUMP);
+  if (outputs.pump && previous.pumpOnTime == 0) {
+    LOG_INFO(LOG_CYCLE, "Pump turned on, starting duration timer");
+  } else if (outputs.pump) {
+    LOG_INFO(LOG_CYCLE, "Pump running for %ld s, will turn off in %ld s", 
+                  (long)(now - watering.pumpOnTime),
+                  (long)(watering.pumpOnTime + currentStage->waterDuration * 60 - now));
+  } else if (pumpCurrentState) {
+    LOG_ACTION(LOG_CYCLE, "Stopping watering cycle - duration completed");
+  }
   
-  if (pumpCurrentState) {
-    if (pumpOnTime == 0) {
-      Serial.println("[INFO] Pump turned on, starting duration timer");
-      pumpOnTime = now;
-    } else {
-      unsigned long wateringDurationSeconds = currentStage->waterDuration * 60; // Convert minutes to seconds
-      time_t pumpRunTime = now - pumpOnTime;
-      time_t timeRemaining = wateringDurationSeconds - pumpRunTime;
-      
-      if (timeRemaining < 0) timeRemaining = 0;
-      
-      Serial.printf("[INFO] Pump running for %ld s, will turn off in %ld s\n", 
-                    pumpRunTime, timeRemaining);
-      
-      if (pumpRunTime >= wateringDurationSeconds) {
-        Serial.println("[ACTION] Stopping watering cycle - duration completed");
-        relayController.setState(RELAY_PUMP, false);
-        pumpOnTime = 0;
-        
-        if (mqttManager->connected()) {
-          mqttManager->publishPumpState(false);
-        }
+  // Switch lights and pump together in one register update
+  RelayMask cycleRelays = RELAY_BIT(RELAY_LIGHTS) | RELAY_BIT(RELAY_PUMP);
+  RelayMask before = relayController.getStates();
+  RelayMask wanted = (outputs.lights ? RELAY_BIT(RELAY_LIGHTS) : 0) | (outputs.pump ? RELAY_BIT(RELAY_PUMP) : 0);
+  heldRelays = relayController.apply(cycleRelays, wanted);
+  if (heldRelays) {
+    LOG_WARN(LOG_CYCLE, "Relay change held back by interlock or minimum on/off time (mask 0x%x), retrying in %u ms",
+             heldRelays, relayController.holdRemaining(heldRelays));
+  }
+
+  // A pump change held by its minimum on/off time is retried from the
+  // previous timers once the hold ends, so the watering start or stop is
+  // not lost. A watering the liquid interlock refused is skipped.
+  if (heldRelays & RELAY_BIT(RELAY_PUMP)) {
+    if (relayController.holdRemaining(RELAY_BIT(RELAY_PUMP)) > 0) {
+      watering = previous;
+    } else if (!relayController.getState(RELAY_PUMP)) {
+      watering.pumpOnTime = 0;
+    }
+  }
+
+  RelayMask changed = before ^ relayController.getStates();
+  if (mqttManager->connected()) {
+    for (int i = 0; i < RELAY_COUNT; i++) {
+      if (changed & RELAY_BIT(i)) {
+        mqttManager->publishRelayState(i, relayController.getState(i));
       }
     }
-  } else {
-    if (pumpOnTime != 0) {
-      Serial.println("[INFO] Pump turned off, resetting duration timer");
-      pumpOnTime = 0;
+  }
+
+  growthManager->setWateringState(watering);
+}
+
+// pH alerts based on the current stage's optimal range
+void checkStageAlerts(float phValue) {
+  if (isnan(phValue) || !growthManager->getActiveCycle().active) {
+    return;
+  }
+
+  const GrowthPlan& plan = growthManager->getPlan(time(nullptr));
+  if (!plan.valid) {
+    return;
+  }
+  const GrowthStage* currentStage = &plan.stage;
+
+  LOG_INFO(LOG_CYCLE, "Current pH: %.2f, Target range: %.1f-%.1f",
+           phValue, currentStage->phMin, currentStage->phMax);
+
+  bool phOutOfRange = (phValue < currentStage->phMin || phValue > currentStage->phMax);
+  if (phOutOfRange && systemConfig.mqtt_enabled) {
+    char alertMsg[64];
+    snprintf(alertMsg, sizeof(alertMsg), "pH %s for %s stage!",
+             phValue < currentStage->phMin ? "too low" : "too high", plan.stageName);
+    mqttManager->publishAlert(alertMsg);
+  }
+}
+
+// Correct pH towards the middle of the current stage's range
+void dosePH(float phValue) {
+  const GrowthStage* stage = nullptr;
+  time_t now = time(nullptr);
+  if (growthManager->getActiveCycle().active && now >= 1000000000) {
+    const GrowthPlan& plan = growthManager->getPlan(now);
+    if (plan.valid) {
+      stage = &plan.stage;
     }
   }
-  
-  // pH alerts based on current stage's optimal range
-  float phValue = sensorReader.getPH();
-  if (!isnan(phValue)) {
-    Serial.printf("[INFO] Current pH: %.2f, Target range: %.1f-%.1f\n", 
-                  phValue, currentStage->phMin, currentStage->phMax);
-                  
-    bool phOutOfRange = (phValue < currentStage->phMin || phValue > currentStage->phMax);
-    if (phOutOfRange && mqttManager->connected()) {
-      String alertMsg = "pH ";
-      alertMsg += (phValue < currentStage->phMin) ? "too low" : "too high";
-      alertMsg += " for " + currentStageName + " stage!";
-      mqttManager->publishAlert(alertMsg);
+
+  DoseResult result = phDoser.update(phValue, stage, systemConfig.ph_dosing, ControlScheduler::nowMillis());
+  if (result == DOSE_CAP_REACHED && systemConfig.mqtt_enabled) {
+    mqttManager->publishAlert("pH dosing hourly cap reached!");
+  }
+}
+
+// Arm the pump guard for the current run: at the cycle's stop time, capped
+// by the maximum run time
+void armPumpDeadline() {
+  int64_t stopAtUs = 0;
+  time_t now = time(nullptr);
+  if (growthManager->getActiveCycle().active && now >= 1000000000) {
+    const GrowthPlan& plan = growthManager->getPlan(now);
+    if (plan.valid && plan.pumpStopTime > 0) {
+      int64_t delayMs = (int64_t)plan.pumpStopTime * 1000 - ControlScheduler::wallMillis();
+      stopAtUs = esp_timer_get_time() + delayMs * 1000;
     }
   }
+  pumpGuard.update(stopAtUs, systemConfig.pump_max_run_min * 60000UL);
 }